@@ -0,0 +1,223 @@
+/**
+ * bench_layout.c - Layout throughput, headless
+ * Lays out synthetic log text the way the view does, without a window or GDI: unwrapped
+ * (every line measured into the width index) and wrapped (every line broken into rows at a
+ * fixed width and added to the wrap layout). Text is measured through LayoutMeasure, once
+ * with fixed metrics, which the view uses for a fixed-pitch font, and once through an
+ * advance callback with proportional widths. Reports time per MB of UTF-16 text.
+ *
+ * The same text is then run together into one huge line and wrapped the way the view wraps
+ * it, a chunk at a time: first the rows for one screen, then the rest of the line.
+ *
+ * Builds on Windows (bench\build_bench.bat) and, since the layout code has no GDI in it,
+ * on Linux too:
+ *     cc -O2 -Isrc -o build/bench_layout bench/bench_layout.c src/slate_layout.c
+ *
+ * Usage: bench_layout [size_mb]
+ */
+
+#include "slate_layout.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <time.h>
+#endif
+
+#define BENCH_DEFAULT_MB  64
+#define BENCH_WRAP_WIDTH  800   // 100 columns of 8 px
+#define BENCH_CHAR_WIDTH  8
+#define BENCH_TAB_WIDTH   (BENCH_CHAR_WIDTH * 4)
+#define BENCH_CHUNK_UNITS 65536 // As WRAP_CHUNK_UNITS in the view
+#define BENCH_SCREEN_ROWS 60
+
+static double NowSeconds(void) {
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+    if (!freq.QuadPart) QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (double)now.QuadPart / (double)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#endif
+}
+
+// Log lines of 20 to about 300 characters with the odd tab and CJK word, CRLF terminated
+static WCHAR* MakeText(size_t units, size_t* outLen) {
+    static const char* const words[] = {
+        "request", "served", "in", "ms", "worker", "INFO", "WARN", "upstream", "timeout", "retrying",
+        "GET", "/api/v2/items", "200", "-", "cache", "miss", "\t", "user=alice", "trace-id", "0x7f3a",
+    };
+    static const WCHAR cjk[] = { 0x8ACB, 0x6C42, 0x5B8C, 0x6210 };
+    WCHAR* text = (WCHAR*)malloc((units + 512) * sizeof(WCHAR));
+    if (!text) return NULL;
+
+    size_t len = 0;
+    unsigned seed = 12345;
+    while (len < units) {
+        seed = seed * 1103515245 + 12345;
+        size_t target = 20 + (seed >> 16) % 280;
+        size_t lineStart = len;
+        while (len - lineStart < target) {
+            seed = seed * 1103515245 + 12345;
+            unsigned pick = (seed >> 16) % 64;
+            if (pick < 2) {
+                for (size_t k = 0; k < 4; k++) text[len++] = cjk[k];
+            } else {
+                const char* w = words[pick % (sizeof(words) / sizeof(words[0]))];
+                while (*w) text[len++] = (WCHAR)*w++;
+            }
+            text[len++] = L' ';
+        }
+        text[len++] = L'\r';
+        text[len++] = L'\n';
+    }
+    *outLen = len;
+    return text;
+}
+
+// Proportional widths: narrow and wide Latin letters, punctuation, and full-width CJK
+static int BenchAdvance(void* context, uint32_t codePoint) {
+    (void)context;
+    if (codePoint >= 0x2E80) return BENCH_CHAR_WIDTH * 2;
+    if (codePoint == 'i' || codePoint == 'l' || codePoint == 'j' || codePoint == '.' || codePoint == ',') return 4;
+    if (codePoint == 'm' || codePoint == 'w' || codePoint == 'M' || codePoint == 'W') return 12;
+    if (codePoint == ' ') return 5;
+    return BENCH_CHAR_WIDTH;
+}
+
+// Calls fn for each line of text without its line break; returns the line count
+typedef void (*LineFn)(const LayoutMeasure* m, const WCHAR* line, size_t len, void* state);
+
+static size_t ForEachLine(const WCHAR* text, size_t len, const LayoutMeasure* m, LineFn fn, void* state) {
+    size_t lines = 0, start = 0;
+    for (size_t i = 0; i <= len; i++) {
+        if (i < len && text[i] != L'\n') continue;
+        size_t end = i;
+        while (end > start && (text[end - 1] == L'\r' || text[end - 1] == L'\n')) end--;
+        if (i < len || end > start) {
+            fn(m, text + start, end - start, state);
+            lines++;
+        }
+        start = i + 1;
+    }
+    return lines;
+}
+
+typedef struct {
+    LineWidths widths;
+    size_t line;
+} UnwrappedState;
+
+static void MeasureLine(const LayoutMeasure* m, const WCHAR* line, size_t len, void* state) {
+    UnwrappedState* s = (UnwrappedState*)state;
+    long long width = Layout_MeasureRun(m, line, len, 0, NULL);
+    Layout_WidthsSet(&s->widths, s->line++, (width > 0x7FFFFFF0) ? 0x7FFFFFF0 : (int)width);
+}
+
+typedef struct {
+    WrapLayout layout;
+    WrapRow* rows;
+    size_t capacity;
+} WrappedState;
+
+static void BreakLine(const LayoutMeasure* m, const WCHAR* line, size_t len, void* state) {
+    WrappedState* s = (WrappedState*)state;
+    size_t count = Layout_BreakLine(m, line, len, BENCH_WRAP_WIDTH, &s->rows, &s->capacity);
+    if (count > 0) Layout_WrapSetLine(&s->layout, s->layout.count, s->rows, count);
+}
+
+static void Report(const char* mode, const char* metrics, double seconds, double mb, const char* what, size_t value) {
+    printf("%-10s %-13s %9.1f ms  %8.2f ms/MB  %s %zu\n", mode, metrics, seconds * 1000.0, seconds * 1000.0 / mb,
+           what, value);
+}
+
+static void RunMetrics(const WCHAR* text, size_t len, const LayoutMeasure* m, const char* name) {
+    double mb = (double)(len * sizeof(WCHAR)) / (1024.0 * 1024.0);
+
+    UnwrappedState unwrapped;
+    memset(&unwrapped, 0, sizeof(unwrapped));
+    double t0 = NowSeconds();
+    ForEachLine(text, len, m, MeasureLine, &unwrapped);
+    double unwrappedSeconds = NowSeconds() - t0;
+    Report("unwrapped", name, unwrappedSeconds, mb, "widest px", (size_t)Layout_WidthsMax(&unwrapped.widths));
+    Layout_WidthsClear(&unwrapped.widths);
+
+    WrappedState wrapped;
+    memset(&wrapped, 0, sizeof(wrapped));
+    t0 = NowSeconds();
+    ForEachLine(text, len, m, BreakLine, &wrapped);
+    double wrappedSeconds = NowSeconds() - t0;
+    Report("wrapped", name, wrappedSeconds, mb, "rows", Layout_WrapTotalRows(&wrapped.layout));
+    Layout_WrapClear(&wrapped.layout);
+    free(wrapped.rows);
+}
+
+// Adds rows of a line a chunk at a time until it has 'rows' of them or is done; returns the
+// offset its rows reach
+static size_t BreakChunks(const LayoutMeasure* m, const WCHAR* line, size_t len, size_t done, size_t rows,
+                          WrappedState* s) {
+    size_t have = 0;
+    Layout_WrapRows(&s->layout, 0, &have);
+    while (have < rows) {
+        BOOL lineEnds = (len - done <= BENCH_CHUNK_UNITS);
+        size_t n = lineEnds ? len - done : BENCH_CHUNK_UNITS;
+        size_t used = 0;
+        size_t count = Layout_BreakRows(m, line + done, n, done, lineEnds, BENCH_WRAP_WIDTH, &s->rows, &s->capacity, &used);
+        if (count == 0) break;
+        done += used;
+        have += count;
+        size_t tail = lineEnds ? 0 : (size_t)((double)(len - done) * (double)have / (double)done) + 1;
+        if (!Layout_WrapAddRows(&s->layout, 0, s->rows, count, tail) || lineEnds) break;
+    }
+    return done;
+}
+
+static void RunSingleLine(WCHAR* text, size_t len, const LayoutMeasure* m, const char* name) {
+    double mb = (double)(len * sizeof(WCHAR)) / (1024.0 * 1024.0);
+
+    WrappedState wrapped;
+    memset(&wrapped, 0, sizeof(wrapped));
+    Layout_WrapAppend(&wrapped.layout, 1);
+    double t0 = NowSeconds();
+    size_t done = BreakChunks(m, text, len, 0, BENCH_SCREEN_ROWS, &wrapped);
+    double firstScreen = NowSeconds() - t0;
+    BreakChunks(m, text, len, done, (size_t)-1, &wrapped);
+    double seconds = NowSeconds() - t0;
+
+    printf("%-10s %-13s %9.1f ms  %8.2f ms/MB  rows %zu, first screen %.3f ms\n", "one line", name, seconds * 1000.0,
+           seconds * 1000.0 / mb, Layout_WrapTotalRows(&wrapped.layout), firstScreen * 1000.0);
+    Layout_WrapClear(&wrapped.layout);
+    free(wrapped.rows);
+}
+
+int main(int argc, char** argv) {
+    size_t sizeMb = (argc > 1) ? (size_t)atoi(argv[1]) : BENCH_DEFAULT_MB;
+    if (sizeMb == 0) sizeMb = BENCH_DEFAULT_MB;
+
+    size_t len = 0;
+    WCHAR* text = MakeText(sizeMb * 1024 * 1024 / sizeof(WCHAR), &len);
+    if (!text) {
+        printf("Out of memory\n");
+        return 1;
+    }
+    printf("Laying out %zu MB of UTF-16 text, wrapping at %d px\n\n", sizeMb, BENCH_WRAP_WIDTH);
+
+    LayoutMeasure fixed = { NULL, NULL, BENCH_CHAR_WIDTH, BENCH_TAB_WIDTH };
+    LayoutMeasure proportional = { BenchAdvance, NULL, 0, BENCH_TAB_WIDTH };
+    RunMetrics(text, len, &fixed, "fixed");
+    RunMetrics(text, len, &proportional, "proportional");
+
+    // The same text without its line breaks
+    for (size_t i = 0; i < len; i++) {
+        if (text[i] == L'\r' || text[i] == L'\n') text[i] = L' ';
+    }
+    RunSingleLine(text, len, &fixed, "fixed");
+    RunSingleLine(text, len, &proportional, "proportional");
+
+    free(text);
+    return 0;
+}
@@ -0,0 +1,165 @@
+/**
+ * bench_save.c - Save throughput benchmark
+ * Maps a synthetic UTF-8 log, applies scattered edits plus one large paste, then times
+ * the legacy UTF-16 streaming save against Doc_WriteToHandle in each encoding. The writer
+ * is timed directly: Doc_SaveToFile would rebase the document after the first run.
+ *
+ * Usage: bench_save [size_mb]
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "slate_doc.h"
+
+#define BENCH_DEFAULT_MB  512
+#define BENCH_EDITS       2000
+#define BENCH_PASTE_CHARS (16 * 1024 * 1024)
+
+static double NowSeconds(void) {
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+    if (!freq.QuadPart) QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (double)now.QuadPart / (double)freq.QuadPart;
+}
+
+static ULONGLONG FileSizeOf(const WCHAR* path) {
+    WIN32_FILE_ATTRIBUTE_DATA attrs;
+    if (!GetFileAttributesExW(path, GetFileExInfoStandard, &attrs)) return 0;
+    return ((ULONGLONG)attrs.nFileSizeHigh << 32) | attrs.nFileSizeLow;
+}
+
+static BOOL WriteSourceFile(const WCHAR* path, size_t targetBytes) {
+    HANDLE hFile = CreateFileW(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) return FALSE;
+
+    char* block = (char*)malloc(1024 * 1024);
+    size_t used = 0, total = 0;
+    unsigned line = 0;
+    BOOL ok = (block != NULL);
+    while (ok && total < targetBytes) {
+        int n = sprintf(block + used, "2024-05-01T12:%02u:%02u.%03u INFO  worker-%02u request %u served in %u ms\r\n",
+                        (line / 60) % 60, line % 60, line % 1000, line % 16, line, (line * 7) % 500);
+        used += (size_t)n;
+        line++;
+        if (used > 1024 * 1024 - 128) {
+            DWORD written;
+            ok = WriteFile(hFile, block, (DWORD)used, &written, NULL);
+            total += used;
+            used = 0;
+        }
+    }
+    free(block);
+    CloseHandle(hFile);
+    return ok;
+}
+
+// The save path before the encoding-aware writer: UTF-16 BOM plus 4096-WCHAR chunks
+typedef struct { HANDLE hFile; BOOL ok; } LegacyCtx;
+
+static void LegacyCallback(const WCHAR* text, size_t len, void* ctx) {
+    LegacyCtx* c = (LegacyCtx*)ctx;
+    DWORD written;
+    if (c->ok && !WriteFile(c->hFile, text, (DWORD)(len * sizeof(WCHAR)), &written, NULL)) c->ok = FALSE;
+}
+
+static BOOL LegacySave(SlateDoc* doc, const WCHAR* path) {
+    HANDLE hFile = CreateFileW(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) return FALSE;
+    WCHAR bom = 0xFEFF;
+    DWORD written;
+    WriteFile(hFile, &bom, sizeof(bom), &written, NULL);
+    LegacyCtx ctx = { hFile, TRUE };
+    Doc_StreamToBuffer(doc, LegacyCallback, &ctx);
+    CloseHandle(hFile);
+    return ctx.ok;
+}
+
+static BOOL EncodedSave(SlateDoc* doc, const WCHAR* path, DocEncoding encoding, DocSaveStats* stats) {
+    HANDLE hFile = CreateFileW(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                               FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) return FALSE;
+    BOOL ok = Doc_WriteToHandle(doc, hFile, encoding, stats, NULL, NULL);
+    CloseHandle(hFile);
+    return ok;
+}
+
+static int CompareOffsets(const void* a, const void* b) {
+    size_t x = *(const size_t*)a, y = *(const size_t*)b;
+    return (x < y) ? -1 : (x > y);
+}
+
+static void Report(const char* name, double seconds, ULONGLONG outBytes, ULONGLONG docUnits) {
+    printf("%-22s %8.3f s  %10.1f MB out  %8.1f MB/s written  %8.1f Munits/s\n", name, seconds,
+           outBytes / (1024.0 * 1024.0), outBytes / (1024.0 * 1024.0) / seconds, docUnits / 1e6 / seconds);
+}
+
+int wmain(int argc, WCHAR** argv) {
+    size_t sizeMb = (argc > 1) ? (size_t)_wtoi(argv[1]) : BENCH_DEFAULT_MB;
+    if (sizeMb == 0) sizeMb = BENCH_DEFAULT_MB;
+
+    WCHAR dir[MAX_PATH], src[MAX_PATH], out[MAX_PATH];
+    GetTempPathW(MAX_PATH, dir);
+    swprintf(src, MAX_PATH, L"%sslate_bench_src.log", dir);
+    swprintf(out, MAX_PATH, L"%sslate_bench_out.log", dir);
+
+    printf("Generating %zu MB source file...\n", sizeMb);
+    if (!WriteSourceFile(src, sizeMb * 1024 * 1024)) {
+        printf("Could not write %ls\n", src);
+        return 1;
+    }
+
+    HANDLE hFile = CreateFileW(src, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    HANDLE hMap = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    void* base = hMap ? MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0) : NULL;
+    if (!base) {
+        printf("Could not map the source file\n");
+        return 1;
+    }
+    SlateDoc* doc = Doc_CreateFromMap(base, (size_t)FileSizeOf(src), hMap, base, DOC_ENCODING_UTF8, 0);
+    CloseHandle(hFile);
+
+    // Scattered small edits, then one large paste in the middle. The edits are made front to
+    // back: each one scans the line map as far as itself, so in random order every edit would
+    // rescan most of the file, and setting up a large run would take minutes.
+    static size_t editAt[BENCH_EDITS];
+    srand(42);
+    for (int i = 0; i < BENCH_EDITS; i++) editAt[i] = ((size_t)rand() * RAND_MAX + rand()) % doc->total_length;
+    qsort(editAt, BENCH_EDITS, sizeof(size_t), CompareOffsets);
+    for (int i = 0; i < BENCH_EDITS; i++) Doc_Insert(doc, editAt[i] + (size_t)i * 9, L"[edited] ", 9);
+    WCHAR* paste = (WCHAR*)malloc(BENCH_PASTE_CHARS * sizeof(WCHAR));
+    for (size_t i = 0; i < BENCH_PASTE_CHARS; i++) paste[i] = (i % 80 == 79) ? L'\n' : (WCHAR)(L'a' + i % 26);
+    Doc_Insert(doc, doc->total_length / 2, paste, BENCH_PASTE_CHARS);
+    free(paste);
+    Doc_ClearUndoStack(doc);
+
+    printf("Document: %zu units, %d edits + %d char paste\n\n", doc->total_length, BENCH_EDITS, BENCH_PASTE_CHARS);
+
+    // Warm the page cache so every run reads the mapping from memory
+    LegacySave(doc, out);
+
+    double t0 = NowSeconds();
+    BOOL ok = LegacySave(doc, out);
+    Report(ok ? "legacy UTF-16 8KB" : "legacy (FAILED)", NowSeconds() - t0, FileSizeOf(out), doc->total_length);
+
+    static const struct { DocEncoding enc; const char* name; } runs[] = {
+        { DOC_ENCODING_UTF8,     "UTF-8" },
+        { DOC_ENCODING_UTF8_BOM, "UTF-8 BOM" },
+        { DOC_ENCODING_UTF16LE,  "UTF-16 LE" },
+        { DOC_ENCODING_UTF16BE,  "UTF-16 BE" },
+    };
+    for (size_t i = 0; i < sizeof(runs) / sizeof(runs[0]); i++) {
+        DocSaveStats stats = {0};
+        t0 = NowSeconds();
+        ok = EncodedSave(doc, out, runs[i].enc, &stats);
+        double elapsed = NowSeconds() - t0;
+        Report(ok ? runs[i].name : "(FAILED)", elapsed, stats.bytesWritten, doc->total_length);
+        printf("%-22s %8.1f MB passed through from the mapping\n", "", stats.bytesPassedThrough / (1024.0 * 1024.0));
+    }
+
+    Doc_Destroy(doc);
+    DeleteFileW(out);
+    DeleteFileW(src);
+    return 0;
+}
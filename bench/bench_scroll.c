@@ -0,0 +1,185 @@
+/**
+ * bench_scroll.c - Cold-start scroll latency
+ * Maps a file (by default a synthetic log), drops it from the system cache, then pages down
+ * through it at a steady frame rate, the way a held scroll bar drag would, timing each frame:
+ * the line map scan to the next screen plus fetching its text. The view's read-ahead
+ * (Doc_PrefetchAhead) is issued after every frame. The run is made with read-ahead off,
+ * then on.
+ *
+ * Dropping the file from the cache is best effort: it only works while nothing else has
+ * the file open. A file on a network share or a freshly attached disk gives the truest
+ * cold numbers.
+ *
+ * Usage: bench_scroll [size_mb | path]
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "slate_doc.h"
+#include "slate_map.h"
+
+#define BENCH_DEFAULT_MB     1024
+#define BENCH_FRAMES         1000
+#define BENCH_FRAME_MS       16
+#define BENCH_SCREEN_LINES   60
+#define BENCH_LINES_PER_STEP 600   // Ten screens a frame: a brisk drag of the scroll thumb
+
+static double NowSeconds(void) {
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+    if (!freq.QuadPart) QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (double)now.QuadPart / (double)freq.QuadPart;
+}
+
+static BOOL WriteSourceFile(const WCHAR* path, size_t targetBytes) {
+    HANDLE hFile = CreateFileW(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) return FALSE;
+
+    char* block = (char*)malloc(1024 * 1024);
+    size_t used = 0, total = 0;
+    unsigned line = 0;
+    BOOL ok = (block != NULL);
+    while (ok && total < targetBytes) {
+        int n = sprintf(block + used, "2024-05-01T12:%02u:%02u.%03u INFO  worker-%02u request %u served in %u ms\r\n",
+                        (line / 60) % 60, line % 60, line % 1000, line % 16, line, (line * 7) % 500);
+        used += (size_t)n;
+        line++;
+        if (used > 1024 * 1024 - 128) {
+            DWORD written;
+            ok = WriteFile(hFile, block, (DWORD)used, &written, NULL);
+            total += used;
+            used = 0;
+        }
+    }
+    free(block);
+    CloseHandle(hFile);
+    return ok;
+}
+
+// An unbuffered open makes the cache manager flush and purge the file's cached pages,
+// provided no other handle or view still holds them. FALSE if the file could not be opened
+// so, when the run that follows starts warm.
+static BOOL DropFromCache(const WCHAR* path) {
+    HANDLE hFile = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+                               FILE_FLAG_NO_BUFFERING, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) return FALSE;
+    CloseHandle(hFile);
+    return TRUE;
+}
+
+// Maps the file the way the editor does: whole when it fits, otherwise through windows
+static SlateDoc* OpenDocument(const WCHAR* path) {
+    HANDLE hFile = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) return NULL;
+    LARGE_INTEGER liSize;
+    HANDLE hMap = (GetFileSizeEx(hFile, &liSize) && liSize.QuadPart > 0)
+                      ? CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+    CloseHandle(hFile);
+    if (!hMap || (ULONGLONG)liSize.QuadPart > (size_t)-1) {
+        if (hMap) CloseHandle(hMap);
+        return NULL;
+    }
+
+    size_t fileBytes = (size_t)liSize.QuadPart;
+    void* base = (fileBytes <= MAP_WHOLE_MAX_BYTES) ? MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0) : NULL;
+    size_t headBytes = (fileBytes < DOC_DETECT_BYTES) ? fileBytes : DOC_DETECT_BYTES;
+    const BYTE* head = base ? (const BYTE*)base : (const BYTE*)MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, headBytes);
+    if (!head) {
+        CloseHandle(hMap);
+        return NULL;
+    }
+
+    size_t skip = 0;
+    UINT codePage = 0;
+    DocEncoding encoding = Doc_DetectEncoding(head, fileBytes, &skip, &codePage);
+    if (!base) UnmapViewOfFile(head);
+
+    size_t units = (fileBytes - skip) / Doc_EncodingUnitSize(encoding);
+    SlateDoc* doc = base ? Doc_CreateFromMap((BYTE*)base + skip, units, hMap, base, encoding, codePage)
+                         : Doc_CreateWindowed(hMap, skip, units, encoding, codePage);
+    if (!doc) {
+        if (base) UnmapViewOfFile(base);
+        CloseHandle(hMap);
+    }
+    return doc;
+}
+
+static int CompareDoubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static BOOL RunScroll(const WCHAR* path, BOOL prefetch) {
+    Map_SetPrefetch(prefetch);
+    BOOL cold = DropFromCache(path);
+
+    double t0 = NowSeconds();
+    SlateDoc* doc = OpenDocument(path);
+    if (!doc) {
+        printf("Could not map %ls\n", path);
+        return FALSE;
+    }
+    Doc_EnsureLineForIndex(doc, BENCH_SCREEN_LINES);
+    double firstScreen = NowSeconds() - t0;
+
+    double* frames = (double*)malloc(BENCH_FRAMES * sizeof(double));
+    WCHAR* text = (WCHAR*)malloc(64 * 1024 * sizeof(WCHAR));
+    size_t count = 0;
+    double stalled = 0;
+    for (size_t top = 0; frames && text && count < BENCH_FRAMES; top += BENCH_LINES_PER_STEP) {
+        double start = NowSeconds();
+        Doc_EnsureLineForIndex(doc, top + BENCH_SCREEN_LINES);
+        if (top >= doc->line_count) break;
+
+        size_t from = Doc_GetLineOffset(doc, top);
+        size_t to = Doc_GetLineOffset(doc, top + BENCH_SCREEN_LINES);
+        size_t len = (to - from < 64 * 1024) ? to - from : 64 * 1024;
+        Doc_GetText(doc, from, len, text);
+        Doc_PrefetchAhead(doc, from, FALSE);
+
+        frames[count] = (NowSeconds() - start) * 1000.0;
+        if (frames[count] > BENCH_FRAME_MS) stalled += frames[count] - BENCH_FRAME_MS;
+        count++;
+        Sleep(BENCH_FRAME_MS);
+    }
+
+    if (count > 0) {
+        qsort(frames, count, sizeof(double), CompareDoubles);
+        printf("%-14s first screen %7.2f ms | %4zu frames  median %6.2f  p95 %7.2f  p99 %7.2f  max %7.2f ms  stalled %7.1f ms\n",
+               prefetch ? "read-ahead on" : "read-ahead off", firstScreen * 1000.0, count,
+               frames[count / 2], frames[count * 95 / 100], frames[count * 99 / 100], frames[count - 1], stalled);
+        if (!cold) printf("%-14s (the file could not be dropped from the cache: this run may be warm)\n", "");
+    }
+    free(frames);
+    free(text);
+    Doc_Destroy(doc);
+    return TRUE;
+}
+
+int wmain(int argc, WCHAR** argv) {
+    WCHAR path[MAX_PATH];
+    BOOL generated = FALSE;
+    size_t sizeMb = (argc > 1) ? (size_t)_wtoi(argv[1]) : BENCH_DEFAULT_MB;
+    if (argc > 1 && sizeMb == 0) {
+        wcsncpy_s(path, MAX_PATH, argv[1], _TRUNCATE);
+    } else {
+        if (sizeMb == 0) sizeMb = BENCH_DEFAULT_MB;
+        WCHAR dir[MAX_PATH];
+        GetTempPathW(MAX_PATH, dir);
+        swprintf(path, MAX_PATH, L"%sslate_bench_scroll.log", dir);
+        printf("Generating %zu MB source file...\n", sizeMb);
+        if (!WriteSourceFile(path, sizeMb * 1024 * 1024)) {
+            printf("Could not write %ls\n", path);
+            return 1;
+        }
+        generated = TRUE;
+    }
+
+    printf("Paging %d lines every %d ms from a cold cache\n\n", BENCH_LINES_PER_STEP, BENCH_FRAME_MS);
+    BOOL ok = RunScroll(path, FALSE) && RunScroll(path, TRUE);
+
+    if (generated) DeleteFileW(path);
+    return ok ? 0 : 1;
+}
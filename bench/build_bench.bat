@@ -0,0 +1,56 @@
+@echo off
+setlocal
+
+REM Builds the console benchmarks against the doc layer
+set ROOT_DIR=%~dp0..
+set SRC_DIR=%ROOT_DIR%\src
+set OUT_DIR=%ROOT_DIR%\build
+
+if not exist "%OUT_DIR%" mkdir "%OUT_DIR%"
+
+cl /nologo /O2 /W4 /MD /DWIN32 /DUNICODE /D_UNICODE /D_CRT_SECURE_NO_WARNINGS ^
+   /I"%SRC_DIR%" ^
+   /Fe"%OUT_DIR%\bench_save.exe" ^
+   "%~dp0bench_save.c" "%SRC_DIR%\slate_doc.c" "%SRC_DIR%\slate_index.c" "%SRC_DIR%\slate_journal.c" "%SRC_DIR%\slate_map.c" "%SRC_DIR%\slate_save.c" "%SRC_DIR%\slate_utf.c" ^
+   /link /SUBSYSTEM:CONSOLE user32.lib
+
+if %ERRORLEVEL% NEQ 0 (
+    echo Benchmark build failed!
+    exit /b %ERRORLEVEL%
+)
+
+cl /nologo /O2 /W4 /MD /DWIN32 /DUNICODE /D_UNICODE /D_CRT_SECURE_NO_WARNINGS ^
+   /I"%SRC_DIR%" ^
+   /Fe"%OUT_DIR%\bench_scroll.exe" ^
+   "%~dp0bench_scroll.c" "%SRC_DIR%\slate_doc.c" "%SRC_DIR%\slate_index.c" "%SRC_DIR%\slate_journal.c" "%SRC_DIR%\slate_map.c" "%SRC_DIR%\slate_save.c" "%SRC_DIR%\slate_utf.c" ^
+   /link /SUBSYSTEM:CONSOLE user32.lib
+
+if %ERRORLEVEL% NEQ 0 (
+    echo Benchmark build failed!
+    exit /b %ERRORLEVEL%
+)
+
+cl /nologo /O2 /W4 /MD /DWIN32 /DUNICODE /D_UNICODE /D_CRT_SECURE_NO_WARNINGS ^
+   /I"%SRC_DIR%" ^
+   /Fe"%OUT_DIR%\bench_utf.exe" ^
+   "%~dp0bench_utf.c" "%SRC_DIR%\slate_utf.c" ^
+   /link /SUBSYSTEM:CONSOLE
+
+if %ERRORLEVEL% NEQ 0 (
+    echo Benchmark build failed!
+    exit /b %ERRORLEVEL%
+)
+
+cl /nologo /O2 /W4 /MD /DWIN32 /DUNICODE /D_UNICODE /D_CRT_SECURE_NO_WARNINGS ^
+   /I"%SRC_DIR%" ^
+   /Fe"%OUT_DIR%\bench_layout.exe" ^
+   "%~dp0bench_layout.c" "%SRC_DIR%\slate_layout.c" ^
+   /link /SUBSYSTEM:CONSOLE
+
+if %ERRORLEVEL% NEQ 0 (
+    echo Benchmark build failed!
+    exit /b %ERRORLEVEL%
+)
+
+echo Benchmarks built in %OUT_DIR%
+endlocal
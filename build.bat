@@ -18,7 +18,7 @@ cl /nologo /W4 /MD /DWIN32 /D_WINDOWS /DUNICODE /D_UNICODE ^
    /D_CRT_SECURE_NO_WARNINGS ^
    /I"%SRC_DIR%" ^
    /Fe"%OUT_DIR%\%EXE_NAME%" ^
-   "%SRC_DIR%\main.c" "%SRC_DIR%\slate_doc.c" "%SRC_DIR%\slate_view.c" "%SRC_DIR%\slate.c" ^
+   "%SRC_DIR%\main.c" "%SRC_DIR%\slate_doc.c" "%SRC_DIR%\slate_follow.c" "%SRC_DIR%\slate_index.c" "%SRC_DIR%\slate_journal.c" "%SRC_DIR%\slate_layout.c" "%SRC_DIR%\slate_map.c" "%SRC_DIR%\slate_save.c" "%SRC_DIR%\slate_session.c" "%SRC_DIR%\slate_stream.c" "%SRC_DIR%\slate_utf.c" "%SRC_DIR%\slate_view.c" "%SRC_DIR%\slate.c" ^
    "%RES_DIR%\slate.res" ^
    /link /SUBSYSTEM:WINDOWS ^
          user32.lib gdi32.lib comctl32.lib comdlg32.lib shell32.lib msimg32.lib
@@ -5,11 +5,17 @@
 #define IDI_APP_ICON 101
 #define IDC_SLATE_ACCEL 103
 #define IDD_FIND_DIALOG 102
+#define IDD_REPLACE_DIALOG 104
 #define IDC_FIND_TEXT 1001
 #define IDC_FIND_FORWARD 1002
 #define IDC_FIND_BACKWARD 1003
 #define IDC_FIND_MATCHCASE 1004
 #define IDC_FIND_NEXT 1005
 #define IDC_FIND_CANCEL 1006
+#define IDC_FIND_WHOLEWORD 1007
+#define IDC_FIND_INSELECTION 1008
+#define IDC_REPLACE_TEXT 1009
+#define IDC_REPLACE_ONE 1010
+#define IDC_REPLACE_ALL 1011
 
 #endif // SLATE_RESOURCE_H
@@ -5,6 +5,10 @@
 
 #include "slate.h"
 #include "slate_doc.h"
+#include "slate_follow.h"
+#include "slate_journal.h"
+#include "slate_map.h"
+#include "slate_stream.h"
 #include "slate_view.h"
 #include "../resources/resource.h"
 
@@ -13,21 +17,30 @@ SLATE_APP g_app = {0};
 
 typedef struct {
     WCHAR pattern[256];
+    WCHAR replacement[256];
     BOOL matchCase;
     BOOL backwards;
+    BOOL wholeWord;
+    BOOL inSelection;
+    size_t rangeStart;   // Selection captured when an in-selection search starts
+    size_t rangeEnd;
     BOOL hasLast;
     size_t lastOffset;
     size_t lastLength;
 } FIND_STATE;
 
-static FIND_STATE g_findState = { L"", FALSE, FALSE, FALSE, 0, 0 };
+static FIND_STATE g_findState = { L"", L"", FALSE, FALSE, FALSE, FALSE, 0, 0, FALSE, 0, 0 };
 
-static void ShowSearchStatusMessage(HWND hwndOwner, DocSearchStatus status) {
+static void ShowSearchStatusMessage(HWND hwndOwner, DocSearchStatus status, BOOL inSelection) {
     const WCHAR* msg = NULL;
     switch (status) {
         case DOC_SEARCH_NO_PATTERN: msg = L"Enter text to search for."; break;
-        case DOC_SEARCH_REACHED_EOF: msg = L"Reached end of file without a match."; break;
-        case DOC_SEARCH_REACHED_BOF: msg = L"Reached beginning of file without a match."; break;
+        case DOC_SEARCH_REACHED_EOF:
+            msg = inSelection ? L"Reached end of selection without a match." : L"Reached end of file without a match.";
+            break;
+        case DOC_SEARCH_REACHED_BOF:
+            msg = inSelection ? L"Reached beginning of selection without a match." : L"Reached beginning of file without a match.";
+            break;
         default: break;
     }
     if (msg) {
@@ -55,7 +68,7 @@ static void RunFind(HWND hDlg) {
     GetDlgItemTextW(hDlg, IDC_FIND_TEXT, buf, _countof(buf));
     size_t len = wcslen(buf);
     if (len == 0) {
-        ShowSearchStatusMessage(hDlg, DOC_SEARCH_NO_PATTERN);
+        ShowSearchStatusMessage(hDlg, DOC_SEARCH_NO_PATTERN, FALSE);
         return;
     }
 
@@ -66,32 +79,124 @@ static void RunFind(HWND hDlg) {
 
     BOOL backwards = (IsDlgButtonChecked(hDlg, IDC_FIND_BACKWARD) == BST_CHECKED);
     BOOL matchCase = (IsDlgButtonChecked(hDlg, IDC_FIND_MATCHCASE) == BST_CHECKED);
+    BOOL wholeWord = (IsDlgButtonChecked(hDlg, IDC_FIND_WHOLEWORD) == BST_CHECKED);
+    BOOL inSelection = (IsDlgButtonChecked(hDlg, IDC_FIND_INSELECTION) == BST_CHECKED);
 
-    BOOL patternChanged = (wcscmp(g_findState.pattern, buf) != 0) || (g_findState.matchCase != matchCase) || (g_findState.backwards != backwards);
+    BOOL patternChanged = (wcscmp(g_findState.pattern, buf) != 0) || (g_findState.matchCase != matchCase) ||
+                          (g_findState.backwards != backwards) || (g_findState.wholeWord != wholeWord) ||
+                          (g_findState.inSelection != inSelection);
     if (patternChanged) {
         g_findState.hasLast = FALSE;
     }
 
+    // A fresh in-selection search captures the selection; Find Next keeps searching that range
+    // even though each match replaces the selection.
+    if (inSelection && !g_findState.hasLast) {
+        if (!View_GetSelectionRange(g_app.hEdit, &g_findState.rangeStart, &g_findState.rangeEnd)) {
+            MessageBoxW(hDlg, L"Select the text to search in first.", L"Find", MB_OK | MB_ICONINFORMATION);
+            return;
+        }
+    }
+
     // Save the current query settings
     wcsncpy(g_findState.pattern, buf, _countof(g_findState.pattern) - 1);
     g_findState.pattern[_countof(g_findState.pattern) - 1] = L'\0';
     g_findState.matchCase = matchCase;
     g_findState.backwards = backwards;
+    g_findState.wholeWord = wholeWord;
+    g_findState.inSelection = inSelection;
+
+    DocSearchOptions opts = {0};
+    opts.searchBackwards = backwards;
+    opts.caseSensitive = matchCase;
+    opts.wholeWord = wholeWord;
+    opts.hasRange = inSelection;
+    opts.rangeStart = g_findState.rangeStart;
+    opts.rangeEnd = g_findState.rangeEnd;
 
     size_t startOffset = ComputeSearchStartOffset(backwards);
-    DocSearchResult res = Doc_Search(g_app.pDoc, buf, len, startOffset, backwards, matchCase);
+    if (inSelection && !g_findState.hasLast) {
+        startOffset = backwards ? g_findState.rangeEnd : g_findState.rangeStart;
+    }
+    DocSearchResult res = Doc_Search(g_app.pDoc, buf, len, startOffset, &opts);
 
     if (res.status == DOC_SEARCH_MATCH) {
         g_findState.hasLast = TRUE;
         g_findState.lastOffset = res.match_offset;
         g_findState.lastLength = res.match_length;
+        View_SetHighlight(g_app.hEdit, buf, len, &opts);
         View_ApplySearchResult(g_app.hEdit, &res);
     } else {
         g_findState.hasLast = FALSE;
-        ShowSearchStatusMessage(hDlg, res.status);
+        ShowSearchStatusMessage(hDlg, res.status, inSelection);
     }
 }
 
+static void RunReplace(HWND hDlg, BOOL replaceAll) {
+    WCHAR buf[256] = {0};
+    WCHAR rep[256] = {0};
+    GetDlgItemTextW(hDlg, IDC_FIND_TEXT, buf, _countof(buf));
+    GetDlgItemTextW(hDlg, IDC_REPLACE_TEXT, rep, _countof(rep));
+    size_t len = wcslen(buf);
+    size_t repLen = wcslen(rep);
+    if (len == 0) {
+        ShowSearchStatusMessage(hDlg, DOC_SEARCH_NO_PATTERN, FALSE);
+        return;
+    }
+
+    if (!g_app.pDoc) {
+        MessageBoxW(hDlg, L"No document is open.", L"Replace", MB_OK | MB_ICONINFORMATION);
+        return;
+    }
+
+    wcsncpy(g_findState.replacement, rep, _countof(g_findState.replacement) - 1);
+    g_findState.replacement[_countof(g_findState.replacement) - 1] = L'\0';
+
+    DocSearchOptions opts = {0};
+    opts.caseSensitive = (IsDlgButtonChecked(hDlg, IDC_FIND_MATCHCASE) == BST_CHECKED);
+    opts.wholeWord = (IsDlgButtonChecked(hDlg, IDC_FIND_WHOLEWORD) == BST_CHECKED);
+    BOOL inSelection = (IsDlgButtonChecked(hDlg, IDC_FIND_INSELECTION) == BST_CHECKED);
+
+    if (replaceAll) {
+        if (inSelection) {
+            opts.hasRange = View_GetSelectionRange(g_app.hEdit, &opts.rangeStart, &opts.rangeEnd);
+            if (!opts.hasRange) {
+                MessageBoxW(hDlg, L"Select the text to replace in first.", L"Replace", MB_OK | MB_ICONINFORMATION);
+                return;
+            }
+        }
+
+        size_t count = 0;
+        if (View_ReplaceAll(g_app.hEdit, buf, len, rep, repLen, &opts, &count)) {
+            WCHAR msg[96];
+            swprintf(msg, _countof(msg), L"Replaced %Iu occurrence%s.", count, (count == 1) ? L"" : L"s");
+            MessageBoxW(hDlg, msg, L"Replace", MB_OK | MB_ICONINFORMATION);
+        } else {
+            ShowSearchStatusMessage(hDlg, DOC_SEARCH_REACHED_EOF, inSelection);
+        }
+        g_findState.hasLast = FALSE;
+        return;
+    }
+
+    // Replace the current match if the selection holds one, then move on to the next
+    size_t selStart = 0, selEnd = 0;
+    if (View_GetSelectionRange(g_app.hEdit, &selStart, &selEnd) && selEnd - selStart == len) {
+        opts.hasRange = TRUE;
+        opts.rangeStart = selStart;
+        opts.rangeEnd = selEnd;
+        if (View_ReplaceAll(g_app.hEdit, buf, len, rep, repLen, &opts, NULL)) {
+            BOOL backwards = (IsDlgButtonChecked(hDlg, IDC_FIND_BACKWARD) == BST_CHECKED);
+            // Resume after (or before) the inserted text so it is never matched again
+            g_findState.hasLast = TRUE;
+            g_findState.lastOffset = backwards ? selStart : selStart + repLen - 1; // wraps back to selStart when repLen == 0
+            if (g_findState.inSelection && g_findState.rangeEnd >= selEnd) {
+                g_findState.rangeEnd = g_findState.rangeEnd - len + repLen;
+            }
+        }
+    }
+    RunFind(hDlg);
+}
+
 static INT_PTR CALLBACK FindDlgProc(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam) {
     UNREFERENCED_PARAMETER(lParam);
     switch (message) {
@@ -99,6 +204,11 @@ static INT_PTR CALLBACK FindDlgProc(HWND hDlg, UINT message, WPARAM wParam, LPAR
             SetDlgItemTextW(hDlg, IDC_FIND_TEXT, g_findState.pattern);
             CheckDlgButton(hDlg, g_findState.backwards ? IDC_FIND_BACKWARD : IDC_FIND_FORWARD, BST_CHECKED);
             CheckDlgButton(hDlg, IDC_FIND_MATCHCASE, g_findState.matchCase ? BST_CHECKED : BST_UNCHECKED);
+            CheckDlgButton(hDlg, IDC_FIND_WHOLEWORD, g_findState.wholeWord ? BST_CHECKED : BST_UNCHECKED);
+            CheckDlgButton(hDlg, IDC_FIND_INSELECTION, g_findState.inSelection ? BST_CHECKED : BST_UNCHECKED);
+            SetDlgItemTextW(hDlg, IDC_REPLACE_TEXT, g_findState.replacement);
+            // A new dialog session re-captures the selection for in-selection searches
+            if (g_findState.inSelection) g_findState.hasLast = FALSE;
             HWND hEdit = GetDlgItem(hDlg, IDC_FIND_TEXT);
             SendMessage(hEdit, EM_SETSEL, 0, -1);
             SetFocus(hEdit);
@@ -110,6 +220,12 @@ static INT_PTR CALLBACK FindDlgProc(HWND hDlg, UINT message, WPARAM wParam, LPAR
                 case IDOK:
                     RunFind(hDlg);
                     return TRUE;
+                case IDC_REPLACE_ONE:
+                    RunReplace(hDlg, FALSE);
+                    return TRUE;
+                case IDC_REPLACE_ALL:
+                    RunReplace(hDlg, TRUE);
+                    return TRUE;
                 case IDC_FIND_CANCEL:
                 case IDCANCEL:
                     EndDialog(hDlg, IDCANCEL);
@@ -134,6 +250,9 @@ HMENU CreateMenuBar(void) {
     AppendMenu(hFileMenu, MF_STRING, ID_FILE_SAVE, _T("&Save\tCtrl+S"));
     AppendMenu(hFileMenu, MF_STRING, ID_FILE_SAVE_AS, _T("Save &As..."));
     AppendMenu(hFileMenu, MF_SEPARATOR, 0, NULL);
+    AppendMenu(hFileMenu, MF_STRING, ID_FILE_OPEN_SESSION, _T("Open Sess&ion..."));
+    AppendMenu(hFileMenu, MF_STRING, ID_FILE_SAVE_SESSION, _T("Save Sessio&n..."));
+    AppendMenu(hFileMenu, MF_SEPARATOR, 0, NULL);
     AppendMenu(hFileMenu, MF_STRING, ID_FILE_EXIT, _T("E&xit"));
     AppendMenu(hMenuBar, MF_POPUP, (UINT_PTR)hFileMenu, _T("&File"));
     
@@ -148,6 +267,8 @@ HMENU CreateMenuBar(void) {
     AppendMenu(hEditMenu, MF_STRING, ID_EDIT_DELETE, _T("De&lete\tDel"));
     AppendMenu(hEditMenu, MF_SEPARATOR, 0, NULL);
     AppendMenu(hEditMenu, MF_STRING, ID_EDIT_FIND, _T("&Find...\tCtrl+F"));
+    AppendMenu(hEditMenu, MF_STRING, ID_EDIT_REPLACE, _T("R&eplace...\tCtrl+H"));
+    AppendMenu(hEditMenu, MF_STRING | MF_CHECKED, ID_EDIT_SEARCHINDEX, _T("&Index Large Files for Search"));
     AppendMenu(hEditMenu, MF_SEPARATOR, 0, NULL);
     AppendMenu(hEditMenu, MF_STRING, ID_EDIT_SELECT_ALL, _T("Select &All\tCtrl+A"));
     AppendMenu(hMenuBar, MF_POPUP, (UINT_PTR)hEditMenu, _T("&Edit"));
@@ -157,6 +278,8 @@ HMENU CreateMenuBar(void) {
     AppendMenu(hViewMenu, MF_STRING, ID_VIEW_WORDWRAP, _T("&Word Wrap"));
     AppendMenu(hViewMenu, MF_STRING, ID_VIEW_NONPRINTABLE, _T("&Show Whitespace"));
     AppendMenu(hViewMenu, MF_STRING, ID_VIEW_SYSTEMCOLORS, _T("&Use System Colors"));
+    AppendMenu(hViewMenu, MF_SEPARATOR, 0, NULL);
+    AppendMenu(hViewMenu, MF_STRING, ID_VIEW_FOLLOW, _T("&Follow File Growth"));
     AppendMenu(hMenuBar, MF_POPUP, (UINT_PTR)hViewMenu, _T("&View"));
 
     // Help menu
@@ -210,123 +333,439 @@ void UpdateStatusBar(SLATE_APP* app) {
 }
 
 /**
- * Memory-Mapped File Loader
+ * Offers to replay the edits a previous session journaled against this exact file before
+ * it ended without saving, then starts journaling the document.
  */
-BOOL LoadFile(SLATE_APP* app, const TCHAR* pszFileName) {
-    HANDLE hFile = CreateFile(pszFileName, GENERIC_READ, FILE_SHARE_READ, NULL, 
+static void RecoverJournal(SLATE_APP* app, const TCHAR* pszFileName) {
+    size_t edits = Journal_FindRecovery(pszFileName, app->pDoc);
+    if (edits > 0) {
+        TCHAR szMsg[MAX_FILE_PATH + 128];
+        _stprintf_s(szMsg, _countof(szMsg),
+                    _T("Slate found %zu unsaved edit(s) to %s from a session that did not close.\n\nRecover them?"),
+                    edits, pszFileName);
+        if (MessageBox(app->hwnd, szMsg, APP_NAME, MB_YESNO | MB_ICONQUESTION) == IDYES) {
+            if (Journal_Replay(pszFileName, app->pDoc) > 0) {
+                View_SetDocument(app->hEdit, app->pDoc);
+                app->bIsModified = TRUE;
+            }
+        } else {
+            Journal_Discard(pszFileName);
+        }
+    }
+    Doc_AttachJournal(app->pDoc, pszFileName);
+}
+
+/**
+ * Memory-Mapped File Loader. Returns NULL on failure; *pbEmpty tells an empty file apart,
+ * since there is nothing to map.
+ */
+// Opens a read-only mapping of a whole file, and maps it into one view when it is small
+// enough (MAP_WHOLE_MAX_BYTES) and the address space has room; otherwise *ppView is NULL and
+// the file is read through windows (see slate_map.h). Returns NULL on failure, with *pliSize
+// 0 for an empty file and -1 when the file could not be opened.
+static HANDLE MapWholeFile(const TCHAR* pszFileName, void** ppView, LARGE_INTEGER* pliSize) {
+    pliSize->QuadPart = -1;
+    *ppView = NULL;
+
+    // Shared for delete so a save can rename the file aside while it is still mapped, and
+    // for write so a log that is still being written can be opened (and followed)
+    HANDLE hFile = CreateFile(pszFileName, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
                               OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-    if (hFile == INVALID_HANDLE_VALUE) return FALSE;
+    if (hFile == INVALID_HANDLE_VALUE) return NULL;
 
-    LARGE_INTEGER liSize;
-    GetFileSizeEx(hFile, &liSize);
-    if (liSize.QuadPart == 0) { 
-        CloseHandle(hFile); 
-        return (BOOL)SendMessage(app->hwnd, WM_COMMAND, ID_FILE_NEW, 0); 
+    GetFileSizeEx(hFile, pliSize);
+    HANDLE hMap = (pliSize->QuadPart > 0) ? CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+    if (hMap && (ULONGLONG)pliSize->QuadPart <= MAP_WHOLE_MAX_BYTES) {
+        *ppView = MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0);
     }
 
-    // Detect encoding
-    BYTE bom[3] = {0};
-    DWORD dwRead;
-    ReadFile(hFile, bom, 3, &dwRead, NULL);
-    
-    BOOL isUtf8 = TRUE;
-    size_t skip = 0;
+    CloseHandle(hFile); // The mapping keeps the data accessible
+    return hMap;
+}
 
-    if (bom[0] == 0xEF && bom[1] == 0xBB && bom[2] == 0xBF) {
-        // UTF-8 with BOM
-        isUtf8 = TRUE;
-        skip = 3;
-    } else if (bom[0] == 0xFF && bom[1] == 0xFE) {
-        // UTF-16 LE
-        isUtf8 = FALSE;
-        skip = 2;
-    } else {
-        // Default to UTF-8/ANSI (No BOM)
-        isUtf8 = TRUE;
-        skip = 0;
-    }
+static SlateDoc* MapDocument(const TCHAR* pszFileName, BOOL* pbEmpty) {
+    void* pMapViewBase;
+    LARGE_INTEGER liSize;
+    HANDLE hMap = MapWholeFile(pszFileName, &pMapViewBase, &liSize);
+    *pbEmpty = (liSize.QuadPart == 0);
+    if (!hMap) return NULL;
 
-    // Map the file into memory
-    HANDLE hMap = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
-    if (!hMap) {
-        CloseHandle(hFile);
-        return FALSE;
+    // Offsets are size_t, which caps a 32-bit build at 4 GB of text even when windowed
+    if ((ULONGLONG)liSize.QuadPart > (size_t)-1) {
+        CloseHandle(hMap);
+        return NULL;
     }
 
-    void* pMapViewBase = MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0);
-    if (!pMapViewBase) {
+    // Detect the encoding from the start of the file; only the sampled pages are touched,
+    // and a windowed file maps just those for the purpose
+    size_t fileBytes = (size_t)liSize.QuadPart;
+    size_t headBytes = (fileBytes < DOC_DETECT_BYTES) ? fileBytes : DOC_DETECT_BYTES;
+    const BYTE* pHead = pMapViewBase ? (const BYTE*)pMapViewBase
+                                     : (const BYTE*)MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, headBytes);
+    if (!pHead) {
         CloseHandle(hMap);
-        CloseHandle(hFile);
-        return FALSE;
+        return NULL;
     }
+    size_t skip = 0;
+    UINT codePage = 0;
+    DocEncoding encoding = Doc_DetectEncoding(pHead, fileBytes, &skip, &codePage);
+    if (!pMapViewBase) UnmapViewOfFile(pHead);
+
+    // Units are bytes for UTF-8 and code pages, 2 bytes for UTF-16 and 4 for UTF-32
+    size_t charLen = (fileBytes - skip) / Doc_EncodingUnitSize(encoding);
 
     // Initialize document with lazy-loading pointers
-    void* pTextStart = (BYTE*)pMapViewBase + skip;
-    size_t rawLen = (size_t)(liSize.QuadPart - skip);
-    
-    // For UTF-8, char count initially equals byte count.
-    // For UTF-16, char count is half the byte count.
-    size_t charLen = isUtf8 ? rawLen : (rawLen / sizeof(WCHAR));
-    
-    // Call the updated CreateFromMap that stores the base pointer and encoding flag
-    SlateDoc* pNewDoc = Doc_CreateFromMap(pTextStart, charLen, hMap, pMapViewBase, isUtf8);
-    
+    SlateDoc* pNewDoc = pMapViewBase ? Doc_CreateFromMap((BYTE*)pMapViewBase + skip, charLen, hMap, pMapViewBase, encoding, codePage)
+                                     : Doc_CreateWindowed(hMap, skip, charLen, encoding, codePage);
     if (!pNewDoc) {
-        UnmapViewOfFile(pMapViewBase);
+        if (pMapViewBase) UnmapViewOfFile(pMapViewBase);
         CloseHandle(hMap);
-        CloseHandle(hFile);
-        return FALSE;
+        return NULL;
+    }
+
+    Doc_SetOriginalPath(pNewDoc, pszFileName);
+    return pNewDoc;
+}
+
+// Makes a freshly mapped document current, releasing the previous one
+static void InstallDocument(SLATE_APP* app, SlateDoc* pNewDoc, const TCHAR* pszFileName) {
+    if (app->bSearchIndex) {
+        Doc_AttachSearchIndex(pNewDoc, pszFileName);
     }
 
     // Update application state
+    FinishSave(app);
+    StopFollow(app);
     if (app->pDoc) Doc_Destroy(app->pDoc);
     app->pDoc = pNewDoc;
 
     View_SetDocument(app->hEdit, app->pDoc);
     _tcscpy_s(app->szFileName, _countof(app->szFileName), pszFileName);
     app->bIsModified = FALSE;
+}
+
+// "-" names standard input; pipes, consoles and devices cannot be mapped either. Returns
+// INVALID_HANDLE_VALUE for anything that should be mapped instead.
+static HANDLE OpenStreamSource(const TCHAR* pszFileName) {
+    if (_tcscmp(pszFileName, _T("-")) == 0) {
+        HANDLE hStdIn = GetStdHandle(STD_INPUT_HANDLE);
+        return hStdIn ? hStdIn : INVALID_HANDLE_VALUE;
+    }
+
+    HANDLE hFile = CreateFile(pszFileName, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile != INVALID_HANDLE_VALUE && GetFileType(hFile) == FILE_TYPE_DISK) {
+        CloseHandle(hFile);
+        return INVALID_HANDLE_VALUE;
+    }
+    return hFile;
+}
+
+// Stops reading streamed input; the document keeps what has arrived
+void CloseStream(SLATE_APP* app) {
+    if (!app->pStream) return;
+    Stream_Close(app->pStream);
+    app->pStream = NULL;
+}
+
+/**
+ * Streaming Loader: sources that cannot be mapped are read by a worker into a growing
+ * original buffer. The document replaces the current one as soon as the first chunk is
+ * in and grows as the rest arrives (see OnStreamData). It has no file name, so saving
+ * asks for one.
+ */
+static BOOL LoadStream(SLATE_APP* app, HANDLE hSource) {
+    CloseStream(app);
+    app->pStream = Stream_Open(hSource, app->hwnd, WM_APP_STREAM_DATA);
+    if (!app->pStream) {
+        MessageBox(app->hwnd, _T("Could not start reading the input."), APP_NAME, MB_OK | MB_ICONERROR);
+        return FALSE;
+    }
+    SendMessage(app->hStatus, SB_SETTEXT, STATUS_PART_PROGRESS, (LPARAM)_T("Reading..."));
+    return TRUE;
+}
+
+static void OnStreamData(SLATE_APP* app, SlateStream* stream) {
+    // Ignore stragglers from a stream that has already been closed
+    if (stream != app->pStream) return;
+
+    SlateDoc* pDoc = Stream_GetDocument(stream);
+    if (!pDoc) return;
+    if (pDoc != app->pDoc) {
+        InstallDocument(app, pDoc, _T(""));
+        UpdateTitleBar(app);
+    }
+    size_t oldLength = pDoc->total_length;
+    if (Stream_Update(stream) > 0) {
+        View_DocumentAppended(app->hEdit, oldLength);
+        UpdateStatusBar(app);
+    }
+
+    TCHAR szStatus[64];
+    unsigned long long mb = Stream_GetBytesRead(stream) >> 20;
+    if (!Stream_IsDone(stream)) {
+        _stprintf_s(szStatus, _countof(szStatus), _T("Reading %llu MB"), mb);
+    } else {
+        _stprintf_s(szStatus, _countof(szStatus), Stream_IsTruncated(stream) ? _T("Stopped at %llu MB") : _T("Read %llu MB"), mb);
+        CloseStream(app);
+    }
+    SendMessage(app->hStatus, SB_SETTEXT, STATUS_PART_PROGRESS, (LPARAM)szStatus);
+}
+
+void StopFollow(SLATE_APP* app) {
+    if (!app->pFollow) return;
+    Follow_Stop(app->pFollow);
+    app->pFollow = NULL;
+    CheckMenuItem(GetMenu(app->hwnd), ID_VIEW_FOLLOW, MF_BYCOMMAND | MF_UNCHECKED);
+}
+
+/**
+ * Follow Mode: a watcher thread reports when the open file changes size. Growth maps the
+ * file again at its new length and appends the new text to the document, so edits, undo
+ * and the line map all carry over; a caret parked at the end follows it like tail -f.
+ */
+static void ToggleFollow(SLATE_APP* app) {
+    if (app->pFollow) {
+        StopFollow(app);
+        SendMessage(app->hStatus, SB_SETTEXT, STATUS_PART_PROGRESS, (LPARAM)_T(""));
+        return;
+    }
+
+    // The saved file replaces the mapping, so let a running save land first
+    FinishSave(app);
+    SlateDoc* pDoc = app->pDoc;
+    if (app->pStream || !pDoc || !pDoc->hMapFile || _tcslen(app->szFileName) == 0) {
+        MessageBox(app->hwnd, _T("Follow works on a file opened from disk. Open the file (or save this document) first."),
+                   APP_NAME, MB_OK | MB_ICONINFORMATION);
+        return;
+    }
+
+    ULONGLONG mapped = pDoc->original_skip + (ULONGLONG)pDoc->original_len * Doc_EncodingUnitSize(pDoc->encoding);
+    app->pFollow = Follow_Start(app->szFileName, mapped, app->hwnd, WM_APP_FOLLOW_CHANGE);
+    if (!app->pFollow) {
+        MessageBox(app->hwnd, _T("Could not watch the file for changes."), APP_NAME, MB_OK | MB_ICONERROR);
+        return;
+    }
+    CheckMenuItem(GetMenu(app->hwnd), ID_VIEW_FOLLOW, MF_BYCOMMAND | MF_CHECKED);
+    SendMessage(app->hStatus, SB_SETTEXT, STATUS_PART_PROGRESS, (LPARAM)_T("Following"));
+}
+
+static void OnFollowChange(SLATE_APP* app, SlateFollow* follow) {
+    // Ignore stragglers from a watcher that has already been stopped
+    if (follow != app->pFollow) return;
+
+    SlateDoc* pDoc = app->pDoc;
+    size_t unitSize = Doc_EncodingUnitSize(pDoc->encoding);
+    size_t skip = pDoc->original_skip;
+    ULONGLONG size = Follow_GetSize(follow);
+    if (size < skip + (ULONGLONG)pDoc->original_len * unitSize) {
+        // Truncated or replaced: the mapped text no longer matches the file
+        StopFollow(app);
+        SendMessage(app->hStatus, SB_SETTEXT, STATUS_PART_PROGRESS, (LPARAM)_T("File shrank; follow stopped"));
+        return;
+    }
+
+    // A partly written trailing unit waits for the next change
+    if ((size - skip) / unitSize <= pDoc->original_len) return;
+
+    void* pView;
+    LARGE_INTEGER liSize;
+    HANDLE hMap = MapWholeFile(app->szFileName, &pView, &liSize);
+    if (!hMap) return; // Tried again on the next change
+
+    size_t oldLength = pDoc->total_length;
+    ULONGLONG textBytes = (liSize.QuadPart > (LONGLONG)skip) ? (ULONGLONG)liSize.QuadPart - skip : 0;
+    size_t units = (textBytes / unitSize > (size_t)-1) ? pDoc->original_len : (size_t)(textBytes / unitSize);
+    if (!Doc_ExtendMap(pDoc, pView ? (BYTE*)pView + skip : NULL, units, hMap, pView)) {
+        if (pView) UnmapViewOfFile(pView);
+        CloseHandle(hMap);
+        return;
+    }
+    if (pDoc->total_length != oldLength) {
+        View_DocumentAppended(app->hEdit, oldLength);
+        UpdateStatusBar(app);
+    }
+}
+
+BOOL LoadFile(SLATE_APP* app, const TCHAR* pszFileName) {
+    HANDLE hSource = OpenStreamSource(pszFileName);
+    if (hSource != INVALID_HANDLE_VALUE) return LoadStream(app, hSource);
+
+    BOOL bEmpty;
+    SlateDoc* pNewDoc = MapDocument(pszFileName, &bEmpty);
+    if (!pNewDoc) {
+        if (bEmpty) return (BOOL)SendMessage(app->hwnd, WM_COMMAND, ID_FILE_NEW, 0);
+
+        // A file that exists but cannot be mapped (say, too large for the address space) can still be read
+        hSource = CreateFile(pszFileName, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                             OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        return (hSource != INVALID_HANDLE_VALUE) ? LoadStream(app, hSource) : FALSE;
+    }
+
+    CloseStream(app);
+    InstallDocument(app, pNewDoc, pszFileName);
+
+    // The previous document discarded its journal above, so one found now is from a crash
+    RecoverJournal(app, pszFileName);
     
     UpdateTitleBar(app);
-    CloseHandle(hFile); // We can close the file handle; the mapping keeps the data accessible
-
     return TRUE;
 }
 
 /**
- * Persistence Strategy
+ * Session snapshots store only the edits (add buffer, pieces, undo history) and the
+ * identity of the original file, so checkpointing a huge file costs as much as its edits
+ * and reopening maps the original and rebuilds the document in place.
  */
-typedef struct { HANDLE hFile; BOOL bSuccess; } SAVE_CONTEXT;
+BOOL SaveSession(SLATE_APP* app, const TCHAR* pszSessionPath) {
+    if (!app->pDoc) return FALSE;
+
+    // A running save may rebase the document; let it land so the session names the file it maps
+    FinishSave(app);
 
-void SaveStreamingCallback(const WCHAR* text, size_t len, void* ctx) {
-    SAVE_CONTEXT* pCtx = (SAVE_CONTEXT*)ctx;
-    if (!pCtx->bSuccess) return;
-    DWORD dwWritten;
-    if (!WriteFile(pCtx->hFile, text, (DWORD)(len * sizeof(WCHAR)), &dwWritten, NULL)) {
-        pCtx->bSuccess = FALSE;
+    size_t cursor = View_GetCursorOffset(app->hEdit);
+    size_t selStart = cursor, selEnd = cursor;
+    View_GetSelectionRange(app->hEdit, &selStart, &selEnd);
+    size_t anchor = (cursor == selStart) ? selEnd : selStart;
+
+    if (!Doc_SaveSession(app->pDoc, pszSessionPath, cursor, anchor)) {
+        MessageBox(app->hwnd, _T("Could not save the session. Sessions record edits to a file on disk, so a new document must be saved first."),
+                   APP_NAME, MB_OK | MB_ICONERROR);
+        return FALSE;
     }
+    SendMessage(app->hStatus, SB_SETTEXT, STATUS_PART_PROGRESS, (LPARAM)_T("Session saved"));
+    return TRUE;
 }
 
+BOOL OpenSession(SLATE_APP* app, const TCHAR* pszSessionPath) {
+    TCHAR szOriginal[MAX_FILE_PATH];
+    if (!Doc_GetSessionOriginal(pszSessionPath, szOriginal, _countof(szOriginal))) {
+        MessageBox(app->hwnd, _T("This is not a Slate session file."), APP_NAME, MB_OK | MB_ICONERROR);
+        return FALSE;
+    }
+
+    BOOL bEmpty;
+    size_t cursor = 0, anchor = 0;
+    SlateDoc* pNewDoc = MapDocument(szOriginal, &bEmpty);
+    DocSessionStatus status = pNewDoc ? Doc_RestoreSession(pNewDoc, pszSessionPath, &cursor, &anchor)
+                                      : DOC_SESSION_ORIGINAL_CHANGED;
+    if (status != DOC_SESSION_OK) {
+        if (pNewDoc) Doc_Destroy(pNewDoc);
+
+        TCHAR szMsg[MAX_FILE_PATH + 128];
+        if (status == DOC_SESSION_ORIGINAL_CHANGED) {
+            _stprintf_s(szMsg, _countof(szMsg), _T("%s is missing or has changed since the session was saved."), szOriginal);
+        } else {
+            _stprintf_s(szMsg, _countof(szMsg), _T("The session file is damaged."));
+        }
+        MessageBox(app->hwnd, szMsg, APP_NAME, MB_OK | MB_ICONERROR);
+        return FALSE;
+    }
+
+    // Not journaled: a journal replays against the bare original, not the restored edits
+    CloseStream(app);
+    InstallDocument(app, pNewDoc, szOriginal);
+    View_DocumentRebased(app->hEdit, cursor, anchor);
+    app->bIsModified = (pNewDoc->undo_stack != NULL);
+    UpdateTitleBar(app);
+    return TRUE;
+}
+
+// The selection in the units of the file a save is about to write, which is what offsets
+// become once the document is rebased onto it
+static void GetSavedSelection(SLATE_APP* app, size_t* outCursor, size_t* outAnchor) {
+    size_t cursor = View_GetCursorOffset(app->hEdit);
+    size_t selStart = cursor, selEnd = cursor;
+    View_GetSelectionRange(app->hEdit, &selStart, &selEnd);
+    size_t anchor = (cursor == selStart) ? selEnd : selStart;
+    *outCursor = Doc_GetSavedOffset(app->pDoc, cursor, app->pDoc->encoding);
+    *outAnchor = Doc_GetSavedOffset(app->pDoc, anchor, app->pDoc->encoding);
+}
+
+/**
+ * Persistence Strategy: a worker writes a snapshot of the document in its original
+ * encoding to a temp file while editing continues; FinishSave renames it over the
+ * target and, if nothing changed meanwhile, remaps it as the new original buffer.
+ */
 BOOL SaveFile(SLATE_APP* app, const TCHAR* pszFileName) {
     if (!app->pDoc) return FALSE;
 
-    HANDLE hFile = CreateFile(pszFileName, GENERIC_WRITE, 0, NULL, 
-                              CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
-    if (hFile == INVALID_HANDLE_VALUE) return FALSE;
+    // Saving rebases the document off the buffer the reader is still filling
+    if (app->pStream) {
+        MessageBox(app->hwnd, _T("Slate is still reading the input. Save once it has finished."),
+                   APP_NAME, MB_OK | MB_ICONINFORMATION);
+        return FALSE;
+    }
 
-    WCHAR bom = 0xFEFF;
-    DWORD dwWritten;
-    WriteFile(hFile, &bom, sizeof(WCHAR), &dwWritten, NULL);
+    // One save at a time; the document must not change buffers under a running writer
+    FinishSave(app);
+    // The save replaces the followed file, which the writer no longer appends to
+    StopFollow(app);
 
-    SAVE_CONTEXT ctx = { hFile, TRUE };
-    Doc_StreamToBuffer(app->pDoc, SaveStreamingCallback, &ctx);
-    CloseHandle(hFile);
+    // An in-place save over original text is written and rebased before Doc_BeginSave
+    // returns, so the selection has to be carried across up front
+    size_t cursor, anchor;
+    GetSavedSelection(app, &cursor, &anchor);
+    size_t revision = app->pDoc->revision;
 
-    if (ctx.bSuccess) {
-        _tcscpy_s(app->szFileName, _countof(app->szFileName), pszFileName);
-        app->bIsModified = FALSE;
-        UpdateTitleBar(app);
+    app->pSaveJob = Doc_BeginSave(app->pDoc, pszFileName, app->pDoc->encoding, app->hwnd, WM_APP_SAVE_PROGRESS);
+    if (!app->pSaveJob) {
+        MessageBox(app->hwnd, _T("Could not save the file."), APP_NAME, MB_OK | MB_ICONERROR);
+        return FALSE;
     }
-    return ctx.bSuccess;
+
+    _tcscpy_s(app->szSavePath, _countof(app->szSavePath), pszFileName);
+    if (app->pDoc->revision != revision) {
+        View_DocumentRebased(app->hEdit, cursor, anchor);
+        Doc_AttachJournal(app->pDoc, pszFileName);
+    }
+    // Taken after any rebase, which FinishSave must not mistake for an edit
+    app->saveRevision = app->pDoc->revision;
+    SendMessage(app->hStatus, SB_SETTEXT, STATUS_PART_PROGRESS, (LPARAM)_T("Saving..."));
+    return TRUE;
+}
+
+/**
+ * Completes the background save, if any, waiting for its writer. Edits made while
+ * the snapshot was being written leave the document dirty.
+ */
+BOOL FinishSave(SLATE_APP* app) {
+    DocSaveJob* job = app->pSaveJob;
+    if (!job) return TRUE;
+    app->pSaveJob = NULL;
+
+    SlateDoc* pDoc = app->pDoc;
+    BOOL edited = (pDoc->revision != app->saveRevision);
+
+    // An unedited document is rebased onto the saved file, which moves offsets into the
+    // file's units, so carry the selection across
+    size_t cursor = 0, anchor = 0;
+    if (!edited) GetSavedSelection(app, &cursor, &anchor);
+    size_t revision = pDoc->revision;
+
+    BOOL ok = Doc_FinishSave(pDoc, job, NULL);
+    if (pDoc->revision != revision) {
+        View_DocumentRebased(app->hEdit, cursor, anchor);
+    }
+
+    SendMessage(app->hStatus, SB_SETTEXT, STATUS_PART_PROGRESS, (LPARAM)(ok ? _T("Saved") : _T("Save failed")));
+    if (!ok) {
+        MessageBox(app->hwnd, _T("Could not save the file."), APP_NAME, MB_OK | MB_ICONERROR);
+        return FALSE;
+    }
+
+    if (app->bSearchIndex) {
+        Doc_AttachSearchIndex(pDoc, app->szSavePath);
+    }
+    // A rebased document starts a fresh journal against the saved file
+    if (pDoc->revision != revision) {
+        Doc_AttachJournal(pDoc, app->szSavePath);
+    }
+
+    _tcscpy_s(app->szFileName, _countof(app->szFileName), app->szSavePath);
+    app->bIsModified = edited;
+    UpdateTitleBar(app);
+    return TRUE;
 }
 
 /**
@@ -343,9 +782,11 @@ int PromptSaveIfModified(SLATE_APP* app) {
     if (result == IDYES) {
         if (_tcslen(app->szFileName) == 0) {
             SendMessage(app->hwnd, WM_COMMAND, ID_FILE_SAVE_AS, 0);
+            FinishSave(app);
             return app->bIsModified ? IDCANCEL : IDYES; 
         } else {
             SaveFile(app, app->szFileName);
+            FinishSave(app);
         }
     }
     return result;
@@ -356,12 +797,13 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
         case WM_CREATE: {
             g_app.pDoc = Doc_CreateEmpty();
             g_app.bIsInsertMode = TRUE;
+            g_app.bSearchIndex = TRUE;
             
             // Create the Status Bar
             g_app.hStatus = CreateStatusWindow(WS_CHILD | WS_VISIBLE | SBARS_SIZEGRIP, 
                                              _T("Ready"), hwnd, IDC_STATUSBAR);
-            int parts[] = { 150, 250, 350, 380 };
-            SendMessage(g_app.hStatus, SB_SETPARTS, 4, (LPARAM)parts);
+            int parts[] = { 150, 250, 350, 380, -1 };
+            SendMessage(g_app.hStatus, SB_SETPARTS, 5, (LPARAM)parts);
 
             // Create the Virtual Viewport
             HINSTANCE hInst = ((LPCREATESTRUCT)lParam)->hInstance;
@@ -423,6 +865,8 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
                         g_app.bIsModified = TRUE;
                         UpdateTitleBar(&g_app);
                         UpdateStatusBar(&g_app);
+                        // Restarting the timer defers the journal write until typing pauses
+                        SetTimer(hwnd, IDT_JOURNAL_FLUSH, JOURNAL_IDLE_MS, NULL);
                         return 0;
                     
                     case EN_SELCHANGE:
@@ -435,6 +879,9 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
             switch (LOWORD(wParam)) {
                 case ID_FILE_NEW:
                     if (PromptSaveIfModified(&g_app) != IDCANCEL) {
+                        FinishSave(&g_app);
+                        CloseStream(&g_app);
+                        StopFollow(&g_app);
                         if (g_app.pDoc) Doc_Destroy(g_app.pDoc);
                         g_app.pDoc = Doc_CreateEmpty();
                         
@@ -488,6 +935,37 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
                     break;
                 }
 
+                case ID_FILE_OPEN_SESSION: {
+                    if (PromptSaveIfModified(&g_app) != IDCANCEL) {
+                        OPENFILENAME ofn = { sizeof(ofn) };
+                        TCHAR szFile[MAX_FILE_PATH] = { 0 };
+                        ofn.hwndOwner = hwnd;
+                        ofn.lpstrFile = szFile;
+                        ofn.nMaxFile = MAX_FILE_PATH;
+                        ofn.lpstrFilter = _T("Slate Sessions\0*.slss\0All Files\0*.*\0");
+                        ofn.Flags = OFN_FILEMUSTEXIST | OFN_PATHMUSTEXIST;
+                        if (GetOpenFileName(&ofn)) {
+                            OpenSession(&g_app, szFile);
+                        }
+                    }
+                    break;
+                }
+
+                case ID_FILE_SAVE_SESSION: {
+                    OPENFILENAME ofn = { sizeof(ofn) };
+                    TCHAR szFile[MAX_FILE_PATH] = { 0 };
+                    ofn.hwndOwner = hwnd;
+                    ofn.lpstrFile = szFile;
+                    ofn.nMaxFile = MAX_FILE_PATH;
+                    ofn.lpstrFilter = _T("Slate Sessions\0*.slss\0All Files\0*.*\0");
+                    ofn.lpstrDefExt = _T("slss");
+                    ofn.Flags = OFN_OVERWRITEPROMPT;
+                    if (GetSaveFileName(&ofn)) {
+                        SaveSession(&g_app, szFile);
+                    }
+                    break;
+                }
+
                 case ID_FILE_EXIT:
                     SendMessage(hwnd, WM_CLOSE, 0, 0);
                     break;
@@ -505,6 +983,19 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
                     DialogBox(GetModuleHandle(NULL), MAKEINTRESOURCE(IDD_FIND_DIALOG), hwnd, FindDlgProc);
                     break;
 
+                case ID_EDIT_SEARCHINDEX: {
+                    g_app.bSearchIndex = !g_app.bSearchIndex;
+                    CheckMenuItem(GetMenu(hwnd), ID_EDIT_SEARCHINDEX, MF_BYCOMMAND | (g_app.bSearchIndex ? MF_CHECKED : MF_UNCHECKED));
+                    if (g_app.bSearchIndex && g_app.pDoc && g_app.szFileName[0]) {
+                        Doc_AttachSearchIndex(g_app.pDoc, g_app.szFileName);
+                    }
+                    return 0;
+                }
+
+                case ID_EDIT_REPLACE:
+                    DialogBox(GetModuleHandle(NULL), MAKEINTRESOURCE(IDD_REPLACE_DIALOG), hwnd, FindDlgProc);
+                    break;
+
                 case ID_EDIT_CUT:
                     View_Cut(g_app.hEdit);
                     break;
@@ -562,6 +1053,10 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
                     break;
                 }
 
+                case ID_VIEW_FOLLOW:
+                    ToggleFollow(&g_app);
+                    return 0;
+
                 case ID_HELP_ABOUT:
                     MessageBox(hwnd, _T("Slate Editor v2.0\nMemory-Mapped Piece Table Edition"), 
                                _T("About Slate"), MB_OK | MB_ICONINFORMATION);
@@ -574,7 +1069,19 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
             SetFocus(g_app.hEdit);
             return 0;
 
+        case WM_TIMER:
+            if (wParam == IDT_JOURNAL_FLUSH) {
+                KillTimer(hwnd, IDT_JOURNAL_FLUSH);
+                if (g_app.pDoc) Journal_Flush(g_app.pDoc->journal);
+                return 0;
+            }
+            break;
+
         case WM_CLOSE:
+            // Let a running save land first, so :wq sees the document clean
+            FinishSave(&g_app);
+            CloseStream(&g_app);
+            StopFollow(&g_app);
             BOOL bForceClose = (BOOL)wParam;
             if(bForceClose)
             {
@@ -601,6 +1108,28 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
             }
             return 0;
         
+        case WM_APP_SAVE_PROGRESS: {
+            // Ignore stragglers from a save that has already been finished
+            if ((DocSaveJob*)lParam != g_app.pSaveJob) return 0;
+
+            if (wParam == DOC_SAVE_COMPLETE) {
+                FinishSave(&g_app);
+            } else {
+                TCHAR szProgress[32];
+                _stprintf_s(szProgress, _countof(szProgress), _T("Saving %u%%"), (unsigned)(wParam / 10));
+                SendMessage(g_app.hStatus, SB_SETTEXT, STATUS_PART_PROGRESS, (LPARAM)szProgress);
+            }
+            return 0;
+        }
+
+        case WM_APP_STREAM_DATA:
+            OnStreamData(&g_app, (SlateStream*)lParam);
+            return 0;
+
+        case WM_APP_FOLLOW_CHANGE:
+            OnFollowChange(&g_app, (SlateFollow*)lParam);
+            return 0;
+
         case WM_APP_OPEN_FILE:
             const WCHAR* openFilename = (const WCHAR*)lParam;
             if(openFilename && *openFilename)
@@ -34,6 +34,11 @@
 #define STATUS_PART_INSERT   1
 #define STATUS_PART_CAPS     2
 #define STATUS_PART_VIEWMODE 3
+#define STATUS_PART_PROGRESS 4
+
+// Edits are journaled to disk once typing pauses this long
+#define IDT_JOURNAL_FLUSH    1
+#define JOURNAL_IDLE_MS      500
 
 // Application state structure
 typedef struct {
@@ -44,6 +49,12 @@ typedef struct {
     TCHAR szFileName[MAX_FILE_PATH];
     BOOL bIsModified;
     BOOL bIsInsertMode;
+    BOOL bSearchIndex;   // Build trigram indexes for large files on open
+    DocSaveJob* pSaveJob;                // Background save in progress, if any
+    TCHAR szSavePath[MAX_FILE_PATH];     // Its target
+    size_t saveRevision;                 // Document revision its snapshot was taken at
+    struct SlateStream* pStream;         // Input still being read into the document, if any
+    struct SlateFollow* pFollow;         // Watches the open file for growth while View > Follow is on
 } SLATE_APP;
 
 // Function declarations
@@ -55,7 +66,12 @@ void CreateControls(SLATE_APP* app);
 void UpdateStatusBar(SLATE_APP* app);
 void UpdateTitleBar(SLATE_APP* app);
 BOOL LoadFile(SLATE_APP* app, const TCHAR* pszFileName);
+void CloseStream(SLATE_APP* app);
+void StopFollow(SLATE_APP* app);
 BOOL SaveFile(SLATE_APP* app, const TCHAR* pszFileName);
+BOOL FinishSave(SLATE_APP* app);
+BOOL SaveSession(SLATE_APP* app, const TCHAR* pszSessionPath);
+BOOL OpenSession(SLATE_APP* app, const TCHAR* pszSessionPath);
 void ShowAboutDialog(HWND hwndParent);
 void ShowHelpDialog(HWND hwndParent);
 
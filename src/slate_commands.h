@@ -11,6 +11,8 @@
 #define ID_FILE_SAVE         1003
 #define ID_FILE_SAVE_AS      1004
 #define ID_FILE_EXIT         1005
+#define ID_FILE_OPEN_SESSION 1006
+#define ID_FILE_SAVE_SESSION 1007
 
 #define ID_EDIT_UNDO         2001
 #define ID_EDIT_REDO         2002
@@ -20,10 +22,13 @@
 #define ID_EDIT_DELETE       2006
 #define ID_EDIT_SELECT_ALL   2007
 #define ID_EDIT_FIND         2008
+#define ID_EDIT_REPLACE      2009
+#define ID_EDIT_SEARCHINDEX  2010
 
 #define ID_VIEW_WORDWRAP     3001
 #define ID_VIEW_NONPRINTABLE 3002
 #define ID_VIEW_SYSTEMCOLORS 3003   
+#define ID_VIEW_FOLLOW       3004
 
 #define ID_HELP_HELP         4001
 #define ID_HELP_ABOUT        4002
@@ -33,6 +38,9 @@
 #define WM_APP_SAVE_FILE     8001
 #define WM_APP_OPEN_FILE     8002
 #define WM_APP_QUIT          8003
+#define WM_APP_SAVE_PROGRESS 8004
+#define WM_APP_STREAM_DATA   8005
+#define WM_APP_FOLLOW_CHANGE 8006
 
 typedef struct
 {
@@ -50,16 +58,23 @@ typedef enum
     EXCMD_WRITE_QUIT,
     EXCMD_QUIT,
     EXCMD_EDIT,
-    EXCMD_SEARCH
+    EXCMD_SEARCH,
+    EXCMD_SUBSTITUTE,
+    EXCMD_FOLLOW
 } ExCommandType;
 
 typedef struct
 {
     ExCommandType type;
     BOOL          force;
-    const WCHAR*  arg;   // filename for edit/write OR pattern for search
+    const WCHAR*  arg;   // filename for edit/write OR pattern for search/substitute
+    const WCHAR*  replacement;
     BOOL          searchBackwards;
     BOOL          searchCaseSensitive;
+    BOOL          searchWholeWord;
+    BOOL          searchInSelection;
+    BOOL          substituteAll;       // 'g' flag: every match rather than the first
+    BOOL          substituteWholeFile; // '%' range
 } ExCommand;
 
 #endif
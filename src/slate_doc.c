@@ -1,10 +1,19 @@
 #include "slate_doc.h"
+#include "slate_index.h"
+#include "slate_journal.h"
+#include "slate_map.h"
+#include "slate_utf.h"
 #include <stdlib.h>
 #include <string.h>
 
 #define LINE_MAP_GROW_STEP 1024
 #define LINE_SCAN_STEP_BYTES (64 * 1024)
 
+struct DocMatchCache;
+static void MatchCache_OnEdit(struct DocMatchCache* cache, size_t offset, size_t removed, size_t inserted);
+static void MatchCache_Clear(struct DocMatchCache* cache);
+static void MatchCache_Free(struct DocMatchCache* cache);
+
 static Piece* CreatePiece(BufferType buffer, size_t start, size_t length, BOOL isUtf8) {
     Piece* p = (Piece*)malloc(sizeof(Piece));
     if (p) {
@@ -76,31 +85,59 @@ static void Doc_EnsureLineMapUpTo(SlateDoc* doc, size_t targetOffset) {
             continue;
         }
 
+        // Original text is scanned a run at a time, since a windowed file is only
+        // contiguous a window span at a time
+        size_t run = piece->length - pieceOff;
+        if (piece->buffer == BUFFER_ORIGINAL) {
+            // A long scan reads the next stretch ahead while it works through this one
+            size_t stretch = DOC_PREFETCH_BYTES / Doc_EncodingUnitSize(doc->encoding);
+            if (run > stretch && targetOffset - logical > stretch) {
+                run = stretch;
+                Doc_PrefetchOriginal(doc, piece->start + pieceOff + run, stretch);
+            }
+        }
+        const BYTE* runStart = (piece->buffer == BUFFER_ORIGINAL) ? Doc_OriginalRun(doc, piece->start + pieceOff, &run)
+                                                                   : (const BYTE*)(doc->add_buffer + piece->start + pieceOff);
+        if (!runStart) break;
+
         if (piece->buffer == BUFFER_ORIGINAL && piece->isUtf8) {
-            const char* buf = (const char*)doc->original_buffer;
-            size_t idx = pieceOff;
-            while (idx < piece->length && logical <= targetOffset) {
-                if (buf[piece->start + idx] == '\n') {
+            const char* buf = (const char*)runStart;
+            size_t idx = 0;
+            while (idx < run && logical <= targetOffset) {
+                if (buf[idx] == '\n') {
+                    if (!Doc_GrowLineOffsets(doc, 1)) break;
+                    doc->line_offsets[doc->line_count++] = logical + 1;
+                }
+                idx++;
+                logical++;
+            }
+            pieceOff += idx;
+        } else if (piece->buffer == BUFFER_ORIGINAL && Doc_EncodingUnitSize(doc->encoding) == 4) {
+            const UINT32* buf = (const UINT32*)runStart;
+            UINT32 newline = Doc_EncodingIsBigEndian(doc->encoding) ? 0x0A000000u : 0x0Au;
+            size_t idx = 0;
+            while (idx < run && logical <= targetOffset) {
+                if (buf[idx] == newline) {
                     if (!Doc_GrowLineOffsets(doc, 1)) break;
                     doc->line_offsets[doc->line_count++] = logical + 1;
                 }
                 idx++;
                 logical++;
             }
-            pieceOff = idx;
+            pieceOff += idx;
         } else {
-            const WCHAR* buf = (piece->buffer == BUFFER_ORIGINAL) ? 
-                               (WCHAR*)doc->original_buffer : doc->add_buffer;
-            size_t idx = pieceOff;
-            while (idx < piece->length && logical <= targetOffset) {
-                if (buf && buf[piece->start + idx] == L'\n') {
+            const WCHAR* buf = (const WCHAR*)runStart;
+            WCHAR newline = (piece->buffer == BUFFER_ORIGINAL && Doc_EncodingIsBigEndian(doc->encoding)) ? 0x0A00 : L'\n';
+            size_t idx = 0;
+            while (idx < run && logical <= targetOffset) {
+                if (buf[idx] == newline) {
                     if (!Doc_GrowLineOffsets(doc, 1)) break;
                     doc->line_offsets[doc->line_count++] = logical + 1;
                 }
                 idx++;
                 logical++;
             }
-            pieceOff = idx;
+            pieceOff += idx;
         }
 
         if (pieceOff >= piece->length) {
@@ -121,15 +158,19 @@ static void Doc_EnsureLineMapUpTo(SlateDoc* doc, size_t targetOffset) {
     }
 }
 
-void Doc_RefreshMetadata(SlateDoc* pDoc) {
-    if (!pDoc) return;
-
-    // Recompute total length without scanning characters
-    size_t totalLen = 0;
-    for (Piece* curr = pDoc->head; curr; curr = curr->next) {
-        totalLen += curr->length;
+// Index of the mapped line holding offset; the map must already reach it
+static size_t Doc_LineOfOffset(const SlateDoc* doc, size_t offset) {
+    size_t lo = 0, hi = doc->line_count;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (doc->line_offsets[mid] <= offset) lo = mid;
+        else hi = mid;
     }
-    pDoc->total_length = totalLen;
+    return lo;
+}
+
+static void Doc_ResetLineMap(SlateDoc* pDoc) {
+    size_t totalLen = pDoc->total_length;
 
     // Reset line map storage
     if (pDoc->line_offsets) {
@@ -158,6 +199,91 @@ void Doc_RefreshMetadata(SlateDoc* pDoc) {
     }
 }
 
+static void Doc_RecountLength(SlateDoc* pDoc) {
+    // Recompute total length without scanning characters
+    size_t totalLen = 0;
+    for (Piece* curr = pDoc->head; curr; curr = curr->next) {
+        totalLen += curr->length;
+    }
+    pDoc->total_length = totalLen;
+}
+
+void Doc_RefreshMetadata(SlateDoc* pDoc) {
+    if (!pDoc) return;
+
+    pDoc->revision++;
+    Doc_RecountLength(pDoc);
+    Doc_ResetLineMap(pDoc);
+}
+
+/**
+ * Describes an edit at offset, removing 'removed' units and inserting 'text', before it is
+ * made. The line map is scanned as far as the edit, which also lets it be kept up to the
+ * edit afterwards instead of being rescanned from the top on every keystroke.
+ */
+static void Doc_DescribeEdit(SlateDoc* doc, size_t offset, size_t removed, const WCHAR* text, size_t inserted,
+                             DocEdit* edit) {
+    edit->line = DOC_EDIT_UNKNOWN;
+    if (!doc->line_offsets) return;
+
+    BOOL scanRemoved = (removed <= DOC_EDIT_SCAN_UNITS);
+    Doc_EnsureLineMapUpTo(doc, scanRemoved ? offset + removed : offset);
+    edit->line = Doc_LineOfOffset(doc, offset);
+    edit->column = offset - doc->line_offsets[edit->line];
+    if (!scanRemoved) {
+        edit->linesRemoved = 0;
+        edit->linesInserted = DOC_EDIT_UNKNOWN;
+        return;
+    }
+    edit->linesRemoved = (removed > 0) ? Doc_LineOfOffset(doc, offset + removed) - edit->line : 0;
+    edit->linesInserted = 0;
+    for (size_t i = 0; i < inserted; i++) {
+        if (text[i] == L'\n') edit->linesInserted++;
+    }
+}
+
+// Records a described edit under the revision it produced
+static void Doc_LogEdit(SlateDoc* doc, const DocEdit* edit) {
+    if (edit->line == DOC_EDIT_UNKNOWN) return;
+    DocEdit* slot = &doc->edits[doc->revision % DOC_EDIT_LOG];
+    *slot = *edit;
+    slot->revision = doc->revision;
+}
+
+BOOL Doc_GetEdit(const SlateDoc* doc, size_t revision, DocEdit* out) {
+    if (!doc || revision == 0) return FALSE;
+    const DocEdit* slot = &doc->edits[revision % DOC_EDIT_LOG];
+    if (slot->revision != revision) return FALSE;
+    *out = *slot;
+    return TRUE;
+}
+
+// After an edit at offset: line starts up to it still hold, so only the rest is rescanned
+static void Doc_RefreshAfterEdit(SlateDoc* doc, size_t offset, const DocEdit* edit) {
+    doc->revision++;
+    Doc_RecountLength(doc);
+    Doc_LogEdit(doc, edit);
+
+    if (!doc->line_offsets || doc->line_count == 0 || doc->total_length == 0) {
+        Doc_ResetLineMap(doc);
+        return;
+    }
+
+    size_t keep = Doc_LineOfOffset(doc, offset) + 1;
+    size_t resume = doc->line_offsets[keep - 1];
+    Piece* piece = doc->head;
+    size_t pos = 0;
+    while (piece && pos + piece->length <= resume) {
+        pos += piece->length;
+        piece = piece->next;
+    }
+    doc->line_count = keep;
+    doc->line_map_complete = FALSE;
+    doc->line_scan_offset = resume;
+    doc->line_scan_piece = piece;
+    doc->line_scan_piece_offset = piece ? resume - pos : 0;
+}
+
 Piece* ClonePieceList(Piece* head) {
     if (!head) return NULL;
 
@@ -261,7 +387,9 @@ BOOL Doc_Undo(SlateDoc* pDoc, size_t currentCursor, size_t* outCursor) {
     
     if (outCursor) *outCursor = step->cursor_hint;
 
+    MatchCache_Clear(pDoc->match_cache);
     Doc_RefreshMetadata(pDoc);
+    Journal_LogUndo(pDoc->journal);
     free(step);
     return TRUE;
 }
@@ -288,7 +416,9 @@ BOOL Doc_Redo(SlateDoc* pDoc, size_t currentCursor, size_t* outCursor) {
     }
 
     // Rebuild the line map for the restored state
+    MatchCache_Clear(pDoc->match_cache);
     Doc_RefreshMetadata(pDoc);
+    Journal_LogRedo(pDoc->journal);
 
     // Free only the container; the document now owns the pieces
     free(step);
@@ -300,7 +430,15 @@ BOOL Doc_Redo(SlateDoc* pDoc, size_t currentCursor, size_t* outCursor) {
 void Doc_EnsureLineForIndex(SlateDoc* doc, size_t lineIndex) {
     if (!doc) return;
 
+    // A scan that runs past its first step is reading through the file, so it reads ahead
+    size_t stretch = DOC_PREFETCH_BYTES / Doc_EncodingUnitSize(doc->encoding);
+    size_t prefetchAt = doc->line_scan_offset + LINE_SCAN_STEP_BYTES;
+
     while (!doc->line_map_complete && doc->line_count <= lineIndex) {
+        if (doc->line_scan_offset >= prefetchAt) {
+            Doc_Prefetch(doc, doc->line_scan_offset, stretch);
+            prefetchAt = doc->line_scan_offset + stretch / 2;
+        }
         size_t nextTarget = doc->line_scan_offset + LINE_SCAN_STEP_BYTES;
         if (nextTarget > doc->total_length) nextTarget = doc->total_length;
         Doc_EnsureLineMapUpTo(doc, nextTarget);
@@ -315,13 +453,277 @@ size_t Doc_GetLineOffset(SlateDoc* doc, size_t lineIndex) {
     return doc->line_offsets[lineIndex];
 }
 
-SlateDoc* Doc_CreateFromMap(void* pMappedText, size_t len, HANDLE hMap, void* pBase, BOOL isUtf8) {
+size_t Doc_EncodingUnitSize(DocEncoding encoding) {
+    switch (encoding) {
+        case DOC_ENCODING_UTF16LE:
+        case DOC_ENCODING_UTF16BE:
+        case DOC_ENCODING_UTF16LE_NOBOM:
+        case DOC_ENCODING_UTF16BE_NOBOM: return sizeof(WCHAR);
+        case DOC_ENCODING_UTF32LE:
+        case DOC_ENCODING_UTF32BE:       return sizeof(UINT32);
+        default:                         return 1;
+    }
+}
+
+BOOL Doc_EncodingIsBigEndian(DocEncoding encoding) {
+    return encoding == DOC_ENCODING_UTF16BE || encoding == DOC_ENCODING_UTF16BE_NOBOM ||
+           encoding == DOC_ENCODING_UTF32BE;
+}
+
+size_t Doc_EncodingBomBytes(DocEncoding encoding) {
+    switch (encoding) {
+        case DOC_ENCODING_UTF8_BOM: return 3;
+        case DOC_ENCODING_UTF16LE:
+        case DOC_ENCODING_UTF16BE:  return 2;
+        case DOC_ENCODING_UTF32LE:
+        case DOC_ENCODING_UTF32BE:  return 4;
+        default:                    return 0;
+    }
+}
+
+// TRUE if the bytes decode in the code page, allowing for a double-byte character cut
+// off at the end of a sample
+static BOOL Doc_FitsCodePage(const BYTE* data, size_t bytes, UINT codePage, BOOL truncated) {
+    int n = (int)bytes;
+    if (MultiByteToWideChar(codePage, MB_ERR_INVALID_CHARS, (LPCSTR)data, n, NULL, 0) > 0) return TRUE;
+    return truncated && n > 1 && MultiByteToWideChar(codePage, MB_ERR_INVALID_CHARS, (LPCSTR)data, n - 1, NULL, 0) > 0;
+}
+
+/**
+ * Guesses a file's encoding from its first DOC_DETECT_BYTES: a byte order mark if there
+ * is one, then the NUL-byte pattern of BOM-less UTF-16, then strict UTF-8 validation, and
+ * finally a legacy code page (the system ANSI one, else Windows-1252). *outSkip receives
+ * the BOM length and *outCodePage the code page for DOC_ENCODING_ANSI.
+ */
+DocEncoding Doc_DetectEncoding(const BYTE* data, size_t bytes, size_t* outSkip, UINT* outCodePage) {
+    *outSkip = 0;
+    *outCodePage = 0;
+
+    // The UTF-32 LE mark begins with the UTF-16 LE one, so it is tested first
+    if (bytes >= 4 && data[0] == 0xFF && data[1] == 0xFE && data[2] == 0x00 && data[3] == 0x00) {
+        *outSkip = 4;
+        return DOC_ENCODING_UTF32LE;
+    }
+    if (bytes >= 4 && data[0] == 0x00 && data[1] == 0x00 && data[2] == 0xFE && data[3] == 0xFF) {
+        *outSkip = 4;
+        return DOC_ENCODING_UTF32BE;
+    }
+    if (bytes >= 3 && data[0] == 0xEF && data[1] == 0xBB && data[2] == 0xBF) {
+        *outSkip = 3;
+        return DOC_ENCODING_UTF8_BOM;
+    }
+    if (bytes >= 2 && data[0] == 0xFF && data[1] == 0xFE) {
+        *outSkip = 2;
+        return DOC_ENCODING_UTF16LE;
+    }
+    if (bytes >= 2 && data[0] == 0xFE && data[1] == 0xFF) {
+        *outSkip = 2;
+        return DOC_ENCODING_UTF16BE;
+    }
+
+    size_t sample = (bytes < DOC_DETECT_BYTES) ? bytes : DOC_DETECT_BYTES;
+    BOOL truncated = (sample < bytes);
+
+    // ASCII and Latin text in UTF-16 has a NUL in the high byte of most units and almost
+    // never in the low byte; UTF-8 and code page text only has NULs in binary data
+    size_t zeros[2] = { 0, 0 };
+    for (size_t i = 0; i < sample; i++) {
+        if (data[i] == 0) zeros[i & 1]++;
+    }
+    size_t units = sample / 2;
+    if (units >= 2 && (bytes % 2) == 0) {
+        if (zeros[1] >= units * 2 / 5 && zeros[0] <= units / 20) return DOC_ENCODING_UTF16LE_NOBOM;
+        if (zeros[0] >= units * 2 / 5 && zeros[1] <= units / 20) return DOC_ENCODING_UTF16BE_NOBOM;
+    }
+
+    // The sample window may cut the last UTF-8 sequence short
+    size_t valid = Utf8_ValidPrefix((const char*)data, sample);
+    if (valid == sample || (truncated && sample - valid < 4)) return DOC_ENCODING_UTF8;
+
+    UINT acp = GetACP();
+    if (acp == CP_UTF8) return DOC_ENCODING_UTF8;
+    *outCodePage = (Doc_FitsCodePage(data, sample, acp, truncated) || !Doc_FitsCodePage(data, sample, 1252, truncated))
+                       ? acp : 1252;
+    return DOC_ENCODING_ANSI;
+}
+
+// Raw bytes [pos, pos + bytes) of the original text. A windowed original serves at most
+// MAP_SPAN_BYTES per call, and the pointer only lasts until other windows are mapped.
+const BYTE* Doc_OriginalBytes(const SlateDoc* doc, ULONGLONG pos, size_t bytes) {
+    if (!doc->original_map) return (const BYTE*)doc->original_buffer + pos;
+    return Map_Get(doc->original_map, pos, bytes);
+}
+
+/**
+ * Length of the code page text src[0, count) cut back so it does not end on a lead byte,
+ * where src starts on a character. Trail bytes can take lead byte values, so the last byte
+ * is a lead only if the run of lead-valued bytes ending with it is odd: the byte before that
+ * run, or the start of src, ends a character, and the run pairs off from there.
+ */
+static size_t Doc_CodePageCut(const SlateDoc* doc, const BYTE* src, size_t count) {
+    size_t leads = 0;
+    while (leads < count && IsDBCSLeadByteEx(doc->code_page, src[count - 1 - leads])) leads++;
+    return count - (leads & 1);
+}
+
+/**
+ * Original units [start, start + *ioCount). A windowed original is only contiguous a window
+ * span at a time, so *ioCount may come back smaller; a shortened run never ends inside a
+ * UTF-8 sequence, double-byte character or surrogate pair. NULL if it cannot be mapped.
+ */
+const BYTE* Doc_OriginalRun(const SlateDoc* doc, size_t start, size_t* ioCount) {
+    size_t unitSize = Doc_EncodingUnitSize(doc->encoding);
+    if (!doc->original_map) return (const BYTE*)doc->original_buffer + start * unitSize;
+
+    size_t count = *ioCount;
+    BOOL cut = (count > MAP_SPAN_BYTES / unitSize);
+    if (cut) count = MAP_SPAN_BYTES / unitSize;
+    const BYTE* src = Map_Get(doc->original_map, (ULONGLONG)start * unitSize, count * unitSize);
+    if (!src || !cut) {
+        *ioCount = count;
+        return src;
+    }
+
+    if (doc->encoding == DOC_ENCODING_ANSI) {
+        count = Doc_CodePageCut(doc, src, count);
+    } else if (unitSize == 1) {
+        // Leave the last sequence, complete or not, for the next run
+        size_t lead = count;
+        while (lead > count - 4 && (src[lead - 1] & 0xC0) == 0x80) lead--;
+        if (src[lead - 1] >= 0xC0) count = lead - 1;
+    } else if (unitSize == sizeof(WCHAR)) {
+        WCHAR last = ((const WCHAR*)src)[count - 1];
+        if (Doc_EncodingIsBigEndian(doc->encoding)) last = (WCHAR)((last >> 8) | (last << 8));
+        if (last >= 0xD800 && last <= 0xDBFF) count--;
+    }
+    *ioCount = count;
+    return src;
+}
+
+// Original units [start, start + count)
+void Doc_PrefetchOriginal(const SlateDoc* doc, size_t start, size_t count) {
+    if (!doc || !doc->hMapFile || start >= doc->original_len) return;
+    if (count > doc->original_len - start) count = doc->original_len - start;
+
+    size_t unitSize = Doc_EncodingUnitSize(doc->encoding);
+    if (doc->original_map) {
+        Map_PrefetchRange(doc->original_map, (ULONGLONG)start * unitSize, (ULONGLONG)count * unitSize);
+    } else {
+        Map_Prefetch((const BYTE*)doc->original_buffer + start * unitSize, count * unitSize);
+    }
+}
+
+// The original text behind document offsets [offset, offset + len)
+void Doc_Prefetch(SlateDoc* doc, size_t offset, size_t len) {
+    if (!doc || !doc->hMapFile || len == 0 || offset >= doc->total_length) return;
+
+    size_t end = (len > doc->total_length - offset) ? doc->total_length : offset + len;
+    size_t logical = 0;
+    for (Piece* p = doc->head; p && logical < end; logical += p->length, p = p->next) {
+        if (logical + p->length <= offset || p->buffer != BUFFER_ORIGINAL) continue;
+        size_t from = (offset > logical) ? offset - logical : 0;
+        size_t to = (end < logical + p->length) ? end - logical : p->length;
+        Doc_PrefetchOriginal(doc, p->start + from, to - from);
+    }
+}
+
+/**
+ * Reads ahead of a reader at 'offset' moving through the document in one direction. The next
+ * DOC_PREFETCH_BYTES of text are requested, and again once the reader is half way through
+ * them, so a cold file streams in ahead of scrolling instead of faulting a page at a time.
+ */
+void Doc_PrefetchAhead(SlateDoc* doc, size_t offset, BOOL backwards) {
+    if (!doc || !doc->hMapFile || offset > doc->total_length) return;
+
+    size_t units = DOC_PREFETCH_BYTES / Doc_EncodingUnitSize(doc->encoding);
+    size_t start, end;
+    if (backwards) {
+        if (offset <= doc->prefetch_end && offset >= doc->prefetch_start + units / 2) return;
+        start = (offset > units) ? offset - units : 0;
+        end = offset;
+    } else {
+        if (offset >= doc->prefetch_start && offset + units / 2 < doc->prefetch_end) return;
+        start = offset;
+        end = (units < doc->total_length - offset) ? offset + units : doc->total_length;
+    }
+    Doc_Prefetch(doc, start, end - start);
+    doc->prefetch_start = start;
+    doc->prefetch_end = end;
+}
+
+/**
+ * Decodes original units [start, start + count) to UTF-16 for writers: characters above
+ * U+FFFF become surrogate pairs. Stops before a unit that would not fit in dst; for code
+ * page text it also keeps a double-byte character that dst cuts in two for the next call.
+ * Returns the WCHARs written; *outConsumed (optional) receives the units used.
+ */
+size_t Doc_DecodeOriginal(const SlateDoc* doc, size_t start, size_t count, WCHAR* dst, size_t dstCap, size_t* outConsumed) {
+    size_t consumed = 0, written = 0;
+
+    // A windowed original decodes at most one run per call
+    const BYTE* run = Doc_OriginalRun(doc, start, &count);
+    if (!run) count = 0;
+
+    switch (Doc_EncodingUnitSize(doc->encoding)) {
+        case 1: {
+            const char* src = (const char*)run;
+            if (doc->encoding != DOC_ENCODING_ANSI) {
+                written = Utf8_ToUtf16(src, count, dst, dstCap, &consumed);
+                break;
+            }
+
+            // Code page text never decodes to more WCHARs than it has bytes
+            size_t n = (count < dstCap) ? count : dstCap;
+            if (n > (1u << 30)) n = (1u << 30);
+            if (n < count && n > 1) n = Doc_CodePageCut(doc, (const BYTE*)src, n);
+            written = n ? (size_t)MultiByteToWideChar(doc->code_page, 0, src, (int)n, dst, (int)dstCap) : 0;
+            consumed = n;
+            break;
+        }
+        case 4:
+            written = Utf32_ToUtf16((const UINT32*)run, count,
+                                    Doc_EncodingIsBigEndian(doc->encoding), TRUE, dst, dstCap, &consumed);
+            break;
+        default: {
+            const WCHAR* src = (const WCHAR*)run;
+            size_t n = (count < dstCap) ? count : dstCap;
+            if (Doc_EncodingIsBigEndian(doc->encoding)) {
+                for (size_t i = 0; i < n; i++) dst[i] = (WCHAR)((src[i] >> 8) | (src[i] << 8));
+            } else {
+                memcpy(dst, src, n * sizeof(WCHAR));
+            }
+            written = consumed = n;
+            break;
+        }
+    }
+
+    if (outConsumed) *outConsumed = consumed;
+    return written;
+}
+
+// Fills code_page_chars. Lead bytes of double-byte code pages mean nothing on their own and
+// become U+FFFD.
+static void Doc_BuildCodePageChars(SlateDoc* doc) {
+    for (int b = 0; b < 256; b++) {
+        char ch = (char)b;
+        WCHAR wc = 0;
+        doc->code_page_chars[b] = (MultiByteToWideChar(doc->code_page, 0, &ch, 1, &wc, 1) == 1) ? wc : 0xFFFD;
+    }
+}
+
+SlateDoc* Doc_CreateFromMap(void* pMappedText, size_t len, HANDLE hMap, void* pBase, DocEncoding encoding, UINT codePage) {
     SlateDoc* doc = (SlateDoc*)calloc(1, sizeof(SlateDoc));
     if (!doc) return NULL;
 
+    BOOL isUtf8 = (Doc_EncodingUnitSize(encoding) == 1);
+    doc->encoding = encoding;
+    doc->code_page = (encoding == DOC_ENCODING_ANSI) ? codePage : 0;
+    if (encoding == DOC_ENCODING_ANSI) Doc_BuildCodePageChars(doc);
+
     doc->original_buffer = pMappedText;
     doc->original_buffer_base = pBase;
     doc->hMapFile = hMap;
+    doc->original_skip = (pMappedText && pBase) ? (size_t)((BYTE*)pMappedText - (BYTE*)pBase) : 0;
     doc->original_len = len;
     doc->original_is_utf8 = isUtf8;
 
@@ -334,9 +736,185 @@ SlateDoc* Doc_CreateFromMap(void* pMappedText, size_t len, HANDLE hMap, void* pB
     return doc;
 }
 
+/**
+ * Document over a file mapping too large to map whole: its text, starting 'skip' bytes in,
+ * is read through windows (see slate_map.h). The document takes ownership of hMap.
+ */
+SlateDoc* Doc_CreateWindowed(HANDLE hMap, size_t skip, size_t len, DocEncoding encoding, UINT codePage) {
+    SlateMap* map = Map_Open(hMap, skip, (ULONGLONG)len * Doc_EncodingUnitSize(encoding));
+    SlateDoc* doc = map ? Doc_CreateFromMap(NULL, len, hMap, NULL, encoding, codePage) : NULL;
+    if (!doc) {
+        Map_Close(map);
+        return NULL;
+    }
+    doc->original_map = map;
+    doc->original_skip = skip;
+    return doc;
+}
+
+/**
+ * Starts (or loads) the trigram index for a large mapped original buffer.
+ * Small and in-memory documents are searched linearly.
+ */
+BOOL Doc_AttachSearchIndex(SlateDoc* doc, const WCHAR* filePath) {
+    if (!doc || !doc->hMapFile || doc->search_index) return FALSE;
+    // The index hashes raw byte or UTF-16 units, which would not line up with patterns for
+    // big-endian or UTF-32 text, nor for code page text, which search reads decoded
+    size_t unitSize = Doc_EncodingUnitSize(doc->encoding);
+    if (unitSize == 4 || Doc_EncodingIsBigEndian(doc->encoding) || doc->encoding == DOC_ENCODING_ANSI) return FALSE;
+
+    ULONGLONG bytes = (ULONGLONG)doc->original_len * unitSize;
+    if (bytes < INDEX_MIN_FILE_BYTES) return FALSE;
+
+    doc->search_index = Index_Open(filePath, doc->original_buffer, doc->original_map, doc->original_len, doc->original_is_utf8);
+    return doc->search_index != NULL;
+}
+
+// Records which file the original buffer maps, so saves back to it can be done in place
+void Doc_SetOriginalPath(SlateDoc* doc, const WCHAR* filePath) {
+    if (!doc) return;
+    DWORD len = filePath ? GetFullPathNameW(filePath, MAX_PATH, doc->original_path, NULL) : 0;
+    if (len == 0 || len >= MAX_PATH) doc->original_path[0] = L'\0';
+}
+
+BOOL Doc_AttachJournal(SlateDoc* doc, const WCHAR* filePath) {
+    if (!doc || !filePath || !doc->hMapFile) return FALSE;
+    Journal_Close(doc->journal, TRUE);
+    doc->journal = Journal_Open(filePath, doc);
+    return doc->journal != NULL;
+}
+
+/**
+ * Document over a streamed original (stdin, a pipe) that is still arriving: pBase is an
+ * address range of 'reserved' bytes from VirtualAlloc, committed as data comes in, and
+ * the document takes ownership of it. Doc_AppendOriginal extends it as more is received.
+ */
+SlateDoc* Doc_CreateStreaming(void* pText, size_t len, void* pBase, size_t reserved, DocEncoding encoding, UINT codePage) {
+    SlateDoc* doc = Doc_CreateFromMap(pText, len, NULL, pBase, encoding, codePage);
+    if (doc) doc->original_reserved = reserved;
+    return doc;
+}
+
+// Appends an original span to the end of a piece list, extending the last piece when it
+// already ends where the span starts
+static BOOL Doc_AppendToPieceList(Piece** head, size_t start, size_t units, BOOL isUtf8) {
+    Piece** link = head;
+    Piece* last = NULL;
+    while (*link) {
+        last = *link;
+        link = &last->next;
+    }
+    if (last && last->buffer == BUFFER_ORIGINAL && last->start + last->length == start) {
+        last->length += units;
+        return TRUE;
+    }
+    *link = CreatePiece(BUFFER_ORIGINAL, start, units, isUtf8);
+    return *link != NULL;
+}
+
+/**
+ * The original buffer grew by 'units' past its end (more streamed input arrived, or the
+ * mapped file was extended); the caller has made them readable. They are appended to the
+ * document, and to every undo and redo state so undoing an edit keeps them. The line map
+ * resumes where it stopped instead of starting over.
+ */
+BOOL Doc_AppendOriginal(SlateDoc* doc, size_t units) {
+    if (!doc || units == 0) return FALSE;
+
+    size_t start = doc->original_len;
+    if (!Doc_AppendToPieceList(&doc->head, start, units, doc->original_is_utf8)) return FALSE;
+
+    // History that cannot take the new text is dropped rather than left to lose it
+    BOOL historyOk = TRUE;
+    for (UndoStep* step = doc->undo_stack; step && historyOk; step = step->next) {
+        historyOk = Doc_AppendToPieceList(&step->pieces, start, units, doc->original_is_utf8);
+    }
+    for (UndoStep* step = doc->redo_stack; step && historyOk; step = step->next) {
+        historyOk = Doc_AppendToPieceList(&step->pieces, start, units, doc->original_is_utf8);
+    }
+    if (!historyOk) {
+        Doc_ClearUndoStack(doc);
+        Doc_ClearRedoStack(doc);
+    }
+
+    // The index only covers the text it was built over
+    Index_Close(doc->search_index);
+    doc->search_index = NULL;
+
+    size_t oldTotal = doc->total_length;
+    doc->original_len += units;
+    doc->total_length += units;
+    doc->revision++;
+    MatchCache_OnEdit(doc->match_cache, oldTotal, 0, units);
+
+    // Lines before the last one mapped are whole; it and everything after may have grown
+    DocEdit edit = { 0, doc->line_count ? doc->line_count - 1 : 0, 0, DOC_EDIT_UNKNOWN,
+                     doc->line_count ? oldTotal - doc->line_offsets[doc->line_count - 1] : oldTotal };
+    Doc_LogEdit(doc, &edit);
+
+    if (doc->line_map_complete && doc->line_offsets) {
+        Piece* tail = doc->head;
+        while (tail->next) tail = tail->next;
+        doc->line_map_complete = FALSE;
+        doc->line_scan_offset = oldTotal;
+        doc->line_scan_piece = tail;
+        doc->line_scan_piece_offset = tail->length - units;
+    }
+    return TRUE;
+}
+
+// Releases the original buffer in whichever way it was obtained
+static void Doc_ReleaseOriginal(SlateDoc* doc) {
+    if (doc->hMapFile) {
+        Map_Close(doc->original_map);
+        doc->original_map = NULL;
+        if (doc->original_buffer_base) UnmapViewOfFile(doc->original_buffer_base);
+        CloseHandle(doc->hMapFile);
+    } else if (doc->original_reserved) {
+        VirtualFree(doc->original_buffer_base, 0, MEM_RELEASE);
+    } else {
+        free(doc->original_buffer);
+    }
+}
+
+/**
+ * Follow mode: the mapped file grew and pMappedText maps it again at its new length, of
+ * which the first original_len units are the ones already mapped; it is NULL when the file
+ * has to be read through windows of hMap instead. The document moves onto the new mapping
+ * and appends the rest. Returns FALSE, leaving the mapping to the caller, when the document
+ * is not a mapped file or the new one is not longer than what it has.
+ */
+BOOL Doc_ExtendMap(SlateDoc* doc, void* pMappedText, size_t len, HANDLE hMap, void* pBase) {
+    if (!doc || !doc->hMapFile || len <= doc->original_len) return FALSE;
+
+    SlateMap* map = NULL;
+    if (!pMappedText) {
+        map = Map_Open(hMap, doc->original_skip, (ULONGLONG)len * Doc_EncodingUnitSize(doc->encoding));
+        if (!map) return FALSE;
+    }
+
+    // The index reads the old mapping, so it must stop before that goes away
+    Index_Close(doc->search_index);
+    doc->search_index = NULL;
+    Doc_ReleaseOriginal(doc);
+    doc->original_buffer = pMappedText;
+    doc->original_buffer_base = pBase;
+    doc->original_map = map;
+    doc->hMapFile = hMap;
+
+    // Out of memory leaves the new units unused; the next extension appends them
+    Doc_AppendOriginal(doc, len - doc->original_len);
+    return TRUE;
+}
+
 void Doc_Destroy(SlateDoc* doc) {
     if (!doc) return;
 
+    // Stop the index builder before the mapping it reads goes away
+    Index_Close(doc->search_index);
+    MatchCache_Free(doc->match_cache);
+    Journal_Close(doc->journal, TRUE);
+
     Doc_ClearUndoStack(doc);
     Doc_ClearRedoStack(doc);
 
@@ -346,36 +924,146 @@ void Doc_Destroy(SlateDoc* doc) {
         free(curr);
         curr = next;
     }
-    if (doc->hMapFile) {
-        UnmapViewOfFile(doc->original_buffer_base);
-        CloseHandle(doc->hMapFile);
-    } else {
-        free(doc->original_buffer);
-    }
+    Doc_ReleaseOriginal(doc);
     free(doc->add_buffer);
     free(doc->line_offsets);
     free(doc);
 }
 
-BOOL Doc_Insert(SlateDoc* doc, size_t offset, const WCHAR* text, size_t len) {
-    if (!doc || offset > doc->total_length) return FALSE;
+/**
+ * Read-only copy for background writers: its own piece list and add buffer, sharing the
+ * original buffer, which must outlive it. Release with Doc_DestroySnapshot.
+ */
+SlateDoc* Doc_CreateSnapshot(SlateDoc* doc) {
+    if (!doc) return NULL;
 
-    // Maintain undo history
-    Doc_PushUndo(doc, offset, TRUE);
+    SlateDoc* snap = (SlateDoc*)calloc(1, sizeof(SlateDoc));
+    if (!snap) return NULL;
+
+    snap->original_buffer = doc->original_buffer;
+    snap->original_skip = doc->original_skip;
+    snap->original_len = doc->original_len;
+    snap->original_is_utf8 = doc->original_is_utf8;
+    snap->encoding = doc->encoding;
+    snap->code_page = doc->code_page;
+    memcpy(snap->code_page_chars, doc->code_page_chars, sizeof(doc->code_page_chars));
+    snap->total_length = doc->total_length;
+    snap->revision = doc->revision;
+
+    // Pieces only ever reference the add buffer up to add_len
+    snap->add_len = doc->add_len;
+    snap->add_capacity = doc->add_len;
+    snap->add_buffer = (WCHAR*)malloc((doc->add_len ? doc->add_len : 1) * sizeof(WCHAR));
+    snap->head = ClonePieceList(doc->head);
+    // Views belong to one thread, so a windowed original gets its own for the writer
+    snap->original_map = Map_Clone(doc->original_map);
+    if (!snap->add_buffer || (doc->head && !snap->head) || (doc->original_map && !snap->original_map)) {
+        Doc_DestroySnapshot(snap);
+        return NULL;
+    }
+    memcpy(snap->add_buffer, doc->add_buffer, doc->add_len * sizeof(WCHAR));
+    return snap;
+}
+
+void Doc_DestroySnapshot(SlateDoc* snapshot) {
+    if (!snapshot) return;
+    Map_Close(snapshot->original_map);
+    FreePieceList(snapshot->head);
+    free(snapshot->add_buffer);
+    free(snapshot);
+}
+
+/**
+ * Makes a freshly saved file the document's new original buffer: one piece spanning the
+ * mapping, an empty add buffer and no undo history, since the old snapshots point into
+ * buffers released here. A NULL map stands for an empty file, and a NULL pMappedText with
+ * a map for a file read through windows, its text after the encoding's byte order mark.
+ * Content is unchanged, but logical offsets follow the new encoding, so callers translate
+ * them beforehand.
+ */
+BOOL Doc_RebaseOnMap(SlateDoc* doc, void* pMappedText, size_t len, HANDLE hMap, void* pBase, DocEncoding encoding) {
+    if (!doc) return FALSE;
+
+    BOOL isUtf8 = (Doc_EncodingUnitSize(encoding) == 1);
+    size_t skip = pMappedText ? (size_t)((BYTE*)pMappedText - (BYTE*)pBase) : Doc_EncodingBomBytes(encoding);
+    SlateMap* map = NULL;
+    if (!pMappedText && hMap) {
+        map = Map_Open(hMap, skip, (ULONGLONG)len * Doc_EncodingUnitSize(encoding));
+        if (!map) return FALSE;
+    }
+    Piece* head = NULL;
+    if (len > 0) {
+        head = CreatePiece(BUFFER_ORIGINAL, 0, len, isUtf8);
+    }
+    WCHAR* addBuffer = (WCHAR*)malloc(8192 * sizeof(WCHAR));
+    if (!addBuffer || (len > 0 && !head)) {
+        free(addBuffer);
+        free(head);
+        Map_Close(map);
+        return FALSE;
+    }
+
+    // The index reads the old mapping, so it must stop before that goes away
+    Index_Close(doc->search_index);
+    doc->search_index = NULL;
+    MatchCache_Clear(doc->match_cache);
+    // The journal describes edits against the old original; the saved file now contains them
+    Journal_Close(doc->journal, TRUE);
+    doc->journal = NULL;
+    Doc_ClearUndoStack(doc);
+    Doc_ClearRedoStack(doc);
+    FreePieceList(doc->head);
+    Doc_ReleaseOriginal(doc);
+    free(doc->add_buffer);
+
+    doc->original_buffer = pMappedText;
+    doc->original_buffer_base = pBase;
+    doc->hMapFile = hMap;
+    doc->original_map = map;
+    doc->original_skip = skip;
+    doc->original_reserved = 0;
+    doc->original_len = len;
+    doc->original_is_utf8 = isUtf8;
+    doc->encoding = encoding;
+    doc->original_path[0] = L'\0';
+
+    doc->add_buffer = addBuffer;
+    doc->add_len = 0;
+    doc->add_capacity = 8192;
+    doc->head = head;
 
-    // Ensure space in the ADD buffer (the buffer for new typing)
+    Doc_RefreshMetadata(doc);
+    return TRUE;
+}
+
+// Appends text to the ADD buffer, growing it as needed; returns the start index or (size_t)-1
+static size_t Doc_AppendToAddBuffer(SlateDoc* doc, const WCHAR* text, size_t len) {
     if (doc->add_len + len > doc->add_capacity) {
         size_t new_cap = (doc->add_len + len) * 2;
         WCHAR* new_buf = (WCHAR*)realloc(doc->add_buffer, new_cap * sizeof(WCHAR));
-        if (!new_buf) return FALSE;
+        if (!new_buf) return (size_t)-1;
         doc->add_buffer = new_buf;
         doc->add_capacity = new_cap;
     }
 
-    // Copy new text to the end of the ADD buffer
-    size_t add_start_index = doc->add_len;
-    memcpy(doc->add_buffer + add_start_index, text, len * sizeof(WCHAR));
+    size_t start = doc->add_len;
+    memcpy(doc->add_buffer + start, text, len * sizeof(WCHAR));
     doc->add_len += len;
+    return start;
+}
+
+BOOL Doc_Insert(SlateDoc* doc, size_t offset, const WCHAR* text, size_t len) {
+    if (!doc || offset > doc->total_length) return FALSE;
+
+    DocEdit edit;
+    Doc_DescribeEdit(doc, offset, 0, text, len, &edit);
+
+    // Maintain undo history
+    Doc_PushUndo(doc, offset, TRUE);
+
+    // Copy new text to the end of the ADD buffer (the buffer for new typing)
+    size_t add_start_index = Doc_AppendToAddBuffer(doc, text, len);
+    if (add_start_index == (size_t)-1) return FALSE;
 
     // Insert a new piece into the table
     if (offset == 0) {
@@ -425,14 +1113,19 @@ BOOL Doc_Insert(SlateDoc* doc, size_t offset, const WCHAR* text, size_t len) {
     }
 
     // Update metadata and line map
-    Doc_RefreshMetadata(doc);
+    MatchCache_OnEdit(doc->match_cache, offset, 0, len);
+    Doc_RefreshAfterEdit(doc, offset, &edit);
+    Journal_LogInsert(doc->journal, offset, text, len);
 
     return TRUE;
 }
 
 BOOL Doc_Delete(SlateDoc* doc, size_t offset, size_t len) {
     if (!doc || len == 0 || offset + len > doc->total_length) return FALSE;
-    
+
+    DocEdit edit;
+    Doc_DescribeEdit(doc, offset, len, NULL, 0, &edit);
+
     // Snapshot state before modification
     Doc_PushUndo(doc, offset, TRUE);
 
@@ -471,7 +1164,9 @@ BOOL Doc_Delete(SlateDoc* doc, size_t offset, size_t len) {
     }
 
     // Refresh metadata and line map
-    Doc_RefreshMetadata(doc);
+    MatchCache_OnEdit(doc->match_cache, offset, len, 0);
+    Doc_RefreshAfterEdit(doc, offset, &edit);
+    Journal_LogDelete(doc->journal, offset, len);
     
     return TRUE;
 }
@@ -495,13 +1190,40 @@ size_t Doc_GetText(SlateDoc* doc, size_t offset, size_t len, WCHAR* dest) {
             if (takeFromPiece > remaining) takeFromPiece = remaining;
 
             if (curr->buffer == BUFFER_ORIGINAL && curr->isUtf8) {
-                // Convert UTF-8 on-the-fly for the view
-                int written = MultiByteToWideChar(CP_UTF8, 0, ((char*)doc->original_buffer) + curr->start + startInPiece, 
-                                   (int)takeFromPiece, dest + destPos, (int)(len - destPos));
-                if (written > 0) destPos += written;
+                // Convert UTF-8 (or the ANSI code page) on-the-fly for the view, a run at a time
+                size_t pos = curr->start + startInPiece, left = takeFromPiece;
+                while (left > 0 && destPos < len) {
+                    size_t used = 0;
+                    destPos += Doc_DecodeOriginal(doc, pos, left, dest + destPos, len - destPos, &used);
+                    if (used == 0) break;
+                    pos += used;
+                    left -= used;
+                }
+            } else if (curr->buffer == BUFFER_ORIGINAL) {
+                size_t pos = curr->start + startInPiece, left = takeFromPiece;
+                while (left > 0) {
+                    size_t run = left;
+                    const BYTE* src = Doc_OriginalRun(doc, pos, &run);
+                    if (!src) break;
+                    if (Doc_EncodingUnitSize(doc->encoding) == 4) {
+                        // One WCHAR per unit keeps offsets aligned; characters above U+FFFF show as U+FFFD
+                        Utf32_ToUtf16((const UINT32*)src, run, Doc_EncodingIsBigEndian(doc->encoding), FALSE,
+                                      dest + destPos, run, NULL);
+                    } else {
+                        memcpy(dest + destPos, src, run * sizeof(WCHAR));
+                        if (Doc_EncodingIsBigEndian(doc->encoding)) {
+                            for (size_t i = 0; i < run; i++) {
+                                WCHAR ch = dest[destPos + i];
+                                dest[destPos + i] = (WCHAR)((ch >> 8) | (ch << 8));
+                            }
+                        }
+                    }
+                    destPos += run;
+                    pos += run;
+                    left -= run;
+                }
             } else {
-                const WCHAR* src = (curr->buffer == BUFFER_ORIGINAL) ? (WCHAR*)doc->original_buffer : doc->add_buffer;
-                memcpy(dest + destPos, src + curr->start + startInPiece, takeFromPiece * sizeof(WCHAR));
+                memcpy(dest + destPos, doc->add_buffer + curr->start + startInPiece, takeFromPiece * sizeof(WCHAR));
                 destPos += takeFromPiece;
             }
             unitsConsumed += takeFromPiece;
@@ -530,6 +1252,7 @@ SlateDoc* Doc_CreateEmpty() {
     SlateDoc* doc = (SlateDoc*)calloc(1, sizeof(SlateDoc));
     if (!doc) return NULL;
     doc->original_is_utf8 = TRUE;
+    doc->encoding = DOC_ENCODING_UTF8;
     doc->add_capacity = 8192;
     doc->add_buffer = (WCHAR*)malloc(doc->add_capacity * sizeof(WCHAR));
     Doc_RefreshMetadata(doc);
@@ -547,16 +1270,8 @@ void Doc_GetOffsetInfo(SlateDoc* doc, size_t offset, int* out_line, int* out_col
 
     Doc_EnsureLineMapUpTo(doc, offset);
 
-    // Binary search or linear scan through the line map
-    int line = 1;
-    for (size_t i = 0; i < doc->line_count; i++) {
-        if (doc->line_offsets[i] <= offset) {
-            line = (int)i + 1;
-        } else {
-            break;
-        }
-    }
-    
+    int line = (int)Doc_LineOfOffset(doc, offset) + 1;
+
     *out_line = line;
     *out_col = (int)(offset - doc->line_offsets[line - 1]) + 1;
 }
@@ -596,13 +1311,29 @@ static BOOL DocIter_Seek(SlateDoc* doc, size_t targetOffset, DocCharIterator* it
 static WCHAR Doc_ReadChar(const SlateDoc* doc, const Piece* piece, size_t pieceOffset) {
     if (!doc || !piece) return 0;
 
-    if (piece->buffer == BUFFER_ORIGINAL && piece->isUtf8) {
-        const unsigned char* buf = (const unsigned char*)doc->original_buffer;
-        return (WCHAR)buf[piece->start + pieceOffset];
+    if (piece->buffer == BUFFER_ADD) {
+        return doc->add_buffer ? doc->add_buffer[piece->start + pieceOffset] : 0;
     }
 
-    const WCHAR* buf = (piece->buffer == BUFFER_ORIGINAL) ? (WCHAR*)doc->original_buffer : doc->add_buffer;
-    return buf ? buf[piece->start + pieceOffset] : 0;
+    size_t one = 1;
+    const BYTE* src = Doc_OriginalRun(doc, piece->start + pieceOffset, &one);
+    if (!src) return 0;
+
+    if (piece->isUtf8) {
+        return (doc->encoding == DOC_ENCODING_ANSI) ? doc->code_page_chars[*src] : (WCHAR)*src;
+    }
+
+    if (Doc_EncodingUnitSize(doc->encoding) == 4) {
+        WCHAR ch = 0;
+        Utf32_ToUtf16((const UINT32*)src, 1, Doc_EncodingIsBigEndian(doc->encoding), FALSE, &ch, 1, NULL);
+        return ch;
+    }
+
+    WCHAR ch = *(const WCHAR*)src;
+    if (piece->buffer == BUFFER_ORIGINAL && Doc_EncodingIsBigEndian(doc->encoding)) {
+        ch = (WCHAR)((ch >> 8) | (ch << 8));
+    }
+    return ch;
 }
 
 static BOOL DocIter_Next(SlateDoc* doc, DocCharIterator* it, WCHAR* outChar) {
@@ -620,6 +1351,12 @@ static BOOL DocIter_Next(SlateDoc* doc, DocCharIterator* it, WCHAR* outChar) {
     return TRUE;
 }
 
+// Returns the character under the iterator without advancing (0 at EOF)
+static WCHAR DocIter_Peek(SlateDoc* doc, const DocCharIterator* it) {
+    if (!doc || !it || !it->piece) return 0;
+    return Doc_ReadChar(doc, it->piece, it->pieceOffset);
+}
+
 static BOOL WindowEquals(const WCHAR* windowBuf, size_t startIdx, const WCHAR* pattern, size_t len) {
     for (size_t i = 0; i < len; i++) {
         if (windowBuf[(startIdx + i) % len] != pattern[i]) return FALSE;
@@ -627,173 +1364,766 @@ static BOOL WindowEquals(const WCHAR* windowBuf, size_t startIdx, const WCHAR* p
     return TRUE;
 }
 
-DocSearchResult Doc_Search(SlateDoc* doc, const WCHAR* pattern, size_t patternLen, size_t cursorOffset, BOOL searchBackwards, BOOL caseSensitive) {
-    DocSearchResult result = {0};
-    result.status = DOC_SEARCH_NO_PATTERN;
-    result.match_length = patternLen;
-    result.line = 1;
-    result.column = 1;
+// Word-character table for whole-word matching: one bit per BMP code unit,
+// classified once via GetStringTypeW so the kernel never calls iswalnum per hit.
+static BYTE s_wordChars[65536 / 8];
+static BOOL s_wordCharsReady = FALSE;
 
-    if (!doc || !pattern || patternLen == 0) {
-        return result; // No-op for empty pattern or null inputs
+static void Doc_InitWordChars(void) {
+    if (s_wordCharsReady) return;
+
+    WCHAR chars[4096];
+    WORD types[4096];
+    for (DWORD base = 0; base < 65536; base += 4096) {
+        for (DWORD i = 0; i < 4096; i++) chars[i] = (WCHAR)(base + i);
+        if (!GetStringTypeW(CT_CTYPE1, chars, 4096, types)) {
+            ZeroMemory(types, sizeof(types));
+        }
+        for (DWORD i = 0; i < 4096; i++) {
+            DWORD ch = base + i;
+            // Surrogate halves belong to supplementary letters; treat them as word characters
+            BOOL isWord = (types[i] & (C1_ALPHA | C1_DIGIT)) != 0 || ch == L'_' ||
+                          (ch >= 0xD800 && ch <= 0xDFFF);
+            if (isWord) s_wordChars[ch >> 3] |= (BYTE)(1u << (ch & 7));
+        }
     }
+    s_wordCharsReady = TRUE;
+}
 
-    size_t docLen = doc->total_length;
-    if (docLen == 0 || patternLen > docLen) {
-        result.status = searchBackwards ? DOC_SEARCH_REACHED_BOF : DOC_SEARCH_REACHED_EOF;
-        return result;
+static BOOL IsWordCharFast(WCHAR ch) {
+    return (s_wordChars[ch >> 3] >> (ch & 7)) & 1;
+}
+
+// Rolling-hash matching state shared by search and the match scanners
+typedef struct {
+    SlateDoc* doc;
+    WCHAR* pattern;          // Case-folded copy of the pattern
+    size_t len;
+    BOOL caseSensitive;
+    BOOL wholeWord;
+    unsigned long long patternHash;
+    unsigned long long windowHash;
+    unsigned long long highestPow; // base^(len-1)
+    WCHAR* window;           // Ring buffer of the folded window contents
+    size_t windowStartIdx;
+    DocCharIterator it;      // Positioned just past the window
+    size_t start;            // Logical offset of the window start
+    size_t prefetchAt;       // Window start at which the scan reads ahead again
+    WCHAR before;            // Character preceding the window (0 at BOF)
+} SearchKernel;
+
+#define KERNEL_HASH_BASE 257ULL
+#define KERNEL_HASH_MOD  1000000007ULL
+
+static void Kernel_Free(SearchKernel* k) {
+    free(k->pattern);
+    free(k->window);
+    k->pattern = NULL;
+    k->window = NULL;
+}
+
+static BOOL Kernel_Init(SearchKernel* k, SlateDoc* doc, const WCHAR* pattern, size_t len, BOOL caseSensitive, BOOL wholeWord) {
+    ZeroMemory(k, sizeof(*k));
+    if (!doc || !pattern || len == 0) return FALSE;
+
+    k->doc = doc;
+    k->len = len;
+    k->caseSensitive = caseSensitive;
+    k->wholeWord = wholeWord;
+    k->pattern = (WCHAR*)malloc(len * sizeof(WCHAR));
+    k->window = (WCHAR*)malloc(len * sizeof(WCHAR));
+    if (!k->pattern || !k->window) {
+        Kernel_Free(k);
+        return FALSE;
     }
 
-    if (cursorOffset > docLen) cursorOffset = docLen;
+    k->highestPow = 1;
+    for (size_t i = 0; i < len; i++) {
+        k->pattern[i] = FoldAscii(pattern[i], caseSensitive);
+        k->patternHash = (k->patternHash * KERNEL_HASH_BASE + k->pattern[i]) % KERNEL_HASH_MOD;
+        if (i < len - 1) {
+            k->highestPow = (k->highestPow * KERNEL_HASH_BASE) % KERNEL_HASH_MOD;
+        }
+    }
 
-    WCHAR* patternNorm = (WCHAR*)malloc(patternLen * sizeof(WCHAR));
-    if (!patternNorm) {
-        result.status = searchBackwards ? DOC_SEARCH_REACHED_BOF : DOC_SEARCH_REACHED_EOF;
-        return result;
+    if (wholeWord) Doc_InitWordChars();
+    return TRUE;
+}
+
+// Fills the window with the characters at [offset, offset + len)
+static BOOL Kernel_Prime(SearchKernel* k, size_t offset) {
+    if (offset + k->len > k->doc->total_length) return FALSE;
+
+    k->before = 0;
+    if (offset > 0) {
+        DocIter_Seek(k->doc, offset - 1, &k->it);
+        if (!DocIter_Next(k->doc, &k->it, &k->before)) return FALSE;
+    } else {
+        DocIter_Seek(k->doc, 0, &k->it);
+    }
+
+    k->windowHash = 0;
+    for (size_t i = 0; i < k->len; i++) {
+        WCHAR ch;
+        if (!DocIter_Next(k->doc, &k->it, &ch)) return FALSE;
+        k->window[i] = FoldAscii(ch, k->caseSensitive);
+        k->windowHash = (k->windowHash * KERNEL_HASH_BASE + k->window[i]) % KERNEL_HASH_MOD;
     }
+    k->windowStartIdx = 0;
+    k->start = offset;
+    k->prefetchAt = offset;
+    return TRUE;
+}
+
+// Reads the next stretch of a scan whose last window starts at lastStart ahead of the iterator
+static void Kernel_Prefetch(SearchKernel* k, size_t lastStart) {
+    size_t stretch = DOC_PREFETCH_BYTES / Doc_EncodingUnitSize(k->doc->encoding);
+    size_t end = lastStart + k->len;
+    if (end - k->start > stretch) end = k->start + stretch;
+    Doc_Prefetch(k->doc, k->start, end - k->start);
+    k->prefetchAt = k->start + stretch / 2;
+}
+
+// Slides the window one character to the right
+static BOOL Kernel_Advance(SearchKernel* k) {
+    WCHAR nextChar;
+    if (!DocIter_Next(k->doc, &k->it, &nextChar)) return FALSE;
+    WCHAR foldedNext = FoldAscii(nextChar, k->caseSensitive);
+
+    WCHAR outgoing = k->window[k->windowStartIdx];
+    k->windowStartIdx = (k->windowStartIdx + 1) % k->len;
+    size_t insertIdx = (k->windowStartIdx + k->len - 1) % k->len;
+    k->window[insertIdx] = foldedNext;
+
+    // Rolling hash: remove outgoing, add incoming
+    unsigned long long temp = (k->windowHash + KERNEL_HASH_MOD - (outgoing * k->highestPow) % KERNEL_HASH_MOD) % KERNEL_HASH_MOD;
+    k->windowHash = (temp * KERNEL_HASH_BASE + foldedNext) % KERNEL_HASH_MOD;
+
+    k->before = outgoing;
+    k->start++;
+    return TRUE;
+}
+
+static BOOL Kernel_IsMatch(SearchKernel* k) {
+    if (k->windowHash != k->patternHash) return FALSE;
+    if (!WindowEquals(k->window, k->windowStartIdx, k->pattern, k->len)) return FALSE;
+
+    if (k->wholeWord) {
+        // Boundaries are only required where the pattern itself starts/ends with a word character
+        if (IsWordCharFast(k->pattern[0]) && k->before && IsWordCharFast(k->before)) return FALSE;
+        WCHAR after = DocIter_Peek(k->doc, &k->it);
+        if (IsWordCharFast(k->pattern[k->len - 1]) && after && IsWordCharFast(after)) return FALSE;
+    }
+    return TRUE;
+}
+
+// Finds the first match starting in [from, lastStart]; returns (size_t)-1 when none
+static size_t Kernel_FindFirst(SearchKernel* k, size_t from, size_t lastStart) {
+    if (from > lastStart || !Kernel_Prime(k, from)) return (size_t)-1;
+
+    while (1) {
+        if (k->start >= k->prefetchAt) Kernel_Prefetch(k, lastStart);
+        if (Kernel_IsMatch(k)) return k->start;
+        if (k->start >= lastStart) break;
+        if (!Kernel_Advance(k)) break;
+    }
+    return (size_t)-1;
+}
 
-    const unsigned int base = 257;
-    const unsigned int mod  = 1000000007;
-    unsigned long long patternHash = 0;
-    unsigned long long windowHash = 0;
-    unsigned long long highestPow = 1; // base^(patternLen-1)
+// Finds the last match starting in [from, lastStart]; returns (size_t)-1 when none
+static size_t Kernel_FindLast(SearchKernel* k, size_t from, size_t lastStart) {
+    size_t best = (size_t)-1;
+    if (from > lastStart || !Kernel_Prime(k, from)) return best;
 
-    for (size_t i = 0; i < patternLen; i++) {
-        patternNorm[i] = FoldAscii(pattern[i], caseSensitive);
-        patternHash = (patternHash * base + patternNorm[i]) % mod;
-        if (i < patternLen - 1) {
-            highestPow = (highestPow * base) % mod;
+    while (1) {
+        if (k->start >= k->prefetchAt) Kernel_Prefetch(k, lastStart);
+        if (Kernel_IsMatch(k)) best = k->start;
+        if (k->start >= lastStart) break;
+        if (!Kernel_Advance(k)) break;
+    }
+    return best;
+}
+
+// Collects every non-overlapping match starting in [from, lastStart] in a single pass.
+// Caller frees *pMatches.
+static BOOL Kernel_FindAll(SearchKernel* k, size_t from, size_t lastStart, size_t** pMatches, size_t* pCount) {
+    *pMatches = NULL;
+    *pCount = 0;
+    if (from > lastStart || !Kernel_Prime(k, from)) return TRUE;
+
+    size_t* matches = NULL;
+    size_t count = 0, capacity = 0;
+    size_t nextAllowed = from;
+
+    while (1) {
+        if (k->start >= k->prefetchAt) Kernel_Prefetch(k, lastStart);
+        if (k->start >= nextAllowed && Kernel_IsMatch(k)) {
+            if (count == capacity) {
+                size_t newCap = capacity ? capacity * 2 : 256;
+                size_t* grown = (size_t*)realloc(matches, newCap * sizeof(size_t));
+                if (!grown) {
+                    free(matches);
+                    return FALSE;
+                }
+                matches = grown;
+                capacity = newCap;
+            }
+            matches[count++] = k->start;
+            nextAllowed = k->start + k->len;
         }
+        if (k->start >= lastStart) break;
+        if (!Kernel_Advance(k)) break;
     }
 
-    if (!searchBackwards) {
-        // Forward search from cursorOffset to EOF
-        if (cursorOffset + patternLen > docLen) {
-            free(patternNorm);
-            result.status = DOC_SEARCH_REACHED_EOF;
-            return result;
-        }
-
-        DocCharIterator it;
-        DocIter_Seek(doc, cursorOffset, &it);
-
-        WCHAR* window = (WCHAR*)malloc(patternLen * sizeof(WCHAR));
-        if (!window) {
-            free(patternNorm);
-            result.status = DOC_SEARCH_REACHED_EOF;
-            return result;
-        }
-
-        // Prime the first window
-        for (size_t i = 0; i < patternLen; i++) {
-            WCHAR ch;
-            if (!DocIter_Next(doc, &it, &ch)) {
-                free(window);
-                free(patternNorm);
-                result.status = DOC_SEARCH_REACHED_EOF;
-                return result;
+    *pMatches = matches;
+    *pCount = count;
+    return TRUE;
+}
+
+// Resolves the effective [start, end) search range for the given options
+static void Doc_GetSearchRange(const SlateDoc* doc, const DocSearchOptions* options, size_t* pStart, size_t* pEnd) {
+    size_t rangeStart = 0;
+    size_t rangeEnd = doc->total_length;
+    if (options && options->hasRange) {
+        rangeStart = (options->rangeStart < rangeEnd) ? options->rangeStart : rangeEnd;
+        if (options->rangeEnd < rangeEnd) rangeEnd = options->rangeEnd;
+        if (rangeEnd < rangeStart) rangeEnd = rangeStart;
+    }
+    *pStart = rangeStart;
+    *pEnd = rangeEnd;
+}
+
+// A run of candidate match starts [start, end) that still has to be scanned
+typedef struct {
+    size_t start;
+    size_t end;
+} DocSpan;
+
+static BOOL Doc_AddSpan(DocSpan** pSpans, size_t* pCount, size_t* pCapacity, size_t start, size_t end) {
+    if (start >= end) return TRUE;
+
+    DocSpan* spans = *pSpans;
+    if (*pCount > 0 && spans[*pCount - 1].end >= start) {
+        if (spans[*pCount - 1].end < end) spans[*pCount - 1].end = end;
+        return TRUE;
+    }
+    if (*pCount == *pCapacity) {
+        size_t newCap = *pCapacity ? *pCapacity * 2 : 64;
+        DocSpan* grown = (DocSpan*)realloc(spans, newCap * sizeof(DocSpan));
+        if (!grown) return FALSE;
+        *pSpans = spans = grown;
+        *pCapacity = newCap;
+    }
+    spans[*pCount].start = start;
+    spans[*pCount].end = end;
+    (*pCount)++;
+    return TRUE;
+}
+
+/**
+ * Narrows the match starts in [from, lastStart] to the spans that can hold a match.
+ * Original-buffer pieces contribute only the blocks the trigram index cannot rule out;
+ * ADD pieces, and the tail of every piece where a match could run into the next piece,
+ * are always scanned.
+ */
+static BOOL Doc_CollectSearchSpans(SlateDoc* doc, const UINT32* hashes, size_t hashCount, size_t patternLen,
+                                   size_t from, size_t lastStart, DocSpan** pSpans, size_t* pCount) {
+    *pSpans = NULL;
+    *pCount = 0;
+    size_t capacity = 0;
+    size_t limit = lastStart + 1;
+    BOOL ok = TRUE;
+
+    size_t logical = 0;
+    for (Piece* p = doc->head; ok && p && logical < limit; logical += p->length, p = p->next) {
+        size_t pieceEnd = logical + p->length;
+        if (pieceEnd <= from) continue;
+
+        size_t innerEnd = logical;
+        if (p->buffer == BUFFER_ORIGINAL && p->length >= patternLen) {
+            innerEnd = pieceEnd - (patternLen - 1);
+            for (size_t lo = logical; ok && lo < innerEnd && lo < limit; ) {
+                size_t block = (p->start + (lo - logical)) >> INDEX_BLOCK_SHIFT;
+                size_t hi = logical + (((block + 1) << INDEX_BLOCK_SHIFT) - p->start);
+                if (hi > innerEnd) hi = innerEnd;
+                if (Index_BlockMayMatch(doc->search_index, block, hashes, hashCount)) {
+                    ok = Doc_AddSpan(pSpans, pCount, &capacity, (lo > from) ? lo : from, (hi < limit) ? hi : limit);
+                }
+                lo = hi;
             }
-            window[i] = FoldAscii(ch, caseSensitive);
-            windowHash = (windowHash * base + window[i]) % mod;
-        }
-
-        size_t windowStartIdx = 0;
-        size_t currentStart = cursorOffset;
-        size_t lastStart = docLen - patternLen;
-
-        while (1) {
-            if (windowHash == patternHash && WindowEquals(window, windowStartIdx, patternNorm, patternLen)) {
-                result.status = DOC_SEARCH_MATCH;
-                result.match_offset = currentStart;
-                Doc_GetOffsetInfo(doc, currentStart, &result.line, &result.column);
-                free(window);
-                free(patternNorm);
-                return result;
+        }
+        if (ok) {
+            ok = Doc_AddSpan(pSpans, pCount, &capacity, (innerEnd > from) ? innerEnd : from, (pieceEnd < limit) ? pieceEnd : limit);
+        }
+    }
+
+    if (!ok) {
+        free(*pSpans);
+        *pSpans = NULL;
+        *pCount = 0;
+    }
+    return ok;
+}
+
+// Finds the first (or last) match starting in [from, lastStart], consulting the trigram
+// index when one is ready so ruled-out blocks of the original buffer are never read.
+static size_t Doc_FindMatch(SlateDoc* doc, SearchKernel* k, size_t from, size_t lastStart, BOOL backwards) {
+    UINT32 hashes[INDEX_MAX_PATTERN];
+    size_t hashCount = Index_IsReady(doc->search_index) ? Index_HashPattern(k->pattern, k->len, hashes) : 0;
+
+    DocSpan* spans = NULL;
+    size_t spanCount = 0;
+    if (hashCount == 0 || from > lastStart ||
+        !Doc_CollectSearchSpans(doc, hashes, hashCount, k->len, from, lastStart, &spans, &spanCount)) {
+        return backwards ? Kernel_FindLast(k, from, lastStart) : Kernel_FindFirst(k, from, lastStart);
+    }
+
+    size_t match = (size_t)-1;
+    for (size_t i = 0; i < spanCount && match == (size_t)-1; i++) {
+        if (backwards) {
+            const DocSpan* span = &spans[spanCount - 1 - i];
+            match = Kernel_FindLast(k, span->start, span->end - 1);
+        } else {
+            match = Kernel_FindFirst(k, spans[i].start, spans[i].end - 1);
+        }
+    }
+    free(spans);
+    return match;
+}
+
+/**
+ * Match cache for repeated Find Next/Previous with one pattern. 'scanned' holds sorted,
+ * disjoint ranges of match starts that have already been searched and 'hits' every match
+ * found inside them, so cycling through a scanned region is a binary search instead of
+ * a rescan. Edits only drop the starts whose match window they touch and shift the rest.
+ */
+typedef struct DocMatchCache {
+    WCHAR* pattern;          // Key: the pattern as given, plus the options below
+    size_t len;
+    BOOL caseSensitive;
+    BOOL wholeWord;
+    DocSpan* scanned;
+    size_t scannedCount;
+    size_t scannedCapacity;
+    size_t* hits;
+    size_t hitCount;
+    size_t hitCapacity;
+    SearchKernel kernel;     // Kept primed for this pattern so repeat searches skip the setup
+} DocMatchCache;
+
+static void MatchCache_Clear(DocMatchCache* cache) {
+    if (!cache) return;
+    cache->scannedCount = 0;
+    cache->hitCount = 0;
+}
+
+static void MatchCache_Free(DocMatchCache* cache) {
+    if (!cache) return;
+    Kernel_Free(&cache->kernel);
+    free(cache->pattern);
+    free(cache->scanned);
+    free(cache->hits);
+    free(cache);
+}
+
+// Returns the document's cache keyed to this pattern, resetting it if the key changed
+static DocMatchCache* MatchCache_Acquire(SlateDoc* doc, const WCHAR* pattern, size_t len, BOOL caseSensitive, BOOL wholeWord) {
+    DocMatchCache* cache = doc->match_cache;
+    if (cache && cache->len == len && cache->caseSensitive == caseSensitive && cache->wholeWord == wholeWord &&
+        memcmp(cache->pattern, pattern, len * sizeof(WCHAR)) == 0) {
+        return cache;
+    }
+
+    if (!cache) {
+        cache = (DocMatchCache*)calloc(1, sizeof(DocMatchCache));
+        if (!cache) return NULL;
+        doc->match_cache = cache;
+    }
+    Kernel_Free(&cache->kernel);
+    WCHAR* copy = (WCHAR*)realloc(cache->pattern, len * sizeof(WCHAR));
+    if (copy) cache->pattern = copy;
+    if (!copy || !Kernel_Init(&cache->kernel, doc, pattern, len, caseSensitive, wholeWord)) {
+        doc->match_cache = NULL;
+        MatchCache_Free(cache);
+        return NULL;
+    }
+    memcpy(copy, pattern, len * sizeof(WCHAR));
+    cache->len = len;
+    cache->caseSensitive = caseSensitive;
+    cache->wholeWord = wholeWord;
+    MatchCache_Clear(cache);
+    return cache;
+}
+
+// Index of the first scanned range whose end is beyond pos
+static size_t MatchCache_LowerRange(const DocMatchCache* cache, size_t pos) {
+    size_t lo = 0, hi = cache->scannedCount;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (cache->scanned[mid].end <= pos) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Index of the first hit at or after pos
+static size_t MatchCache_LowerHit(const DocMatchCache* cache, size_t pos) {
+    size_t lo = 0, hi = cache->hitCount;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (cache->hits[mid] < pos) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Records that [start, end) has been searched and, optionally, a hit inside it
+static void MatchCache_AddScanned(DocMatchCache* cache, size_t start, size_t end, size_t hit) {
+    if (start >= end) return;
+
+    if (hit != (size_t)-1) {
+        size_t at = MatchCache_LowerHit(cache, hit);
+        if (at == cache->hitCount || cache->hits[at] != hit) {
+            if (cache->hitCount == cache->hitCapacity) {
+                size_t newCap = cache->hitCapacity ? cache->hitCapacity * 2 : 64;
+                size_t* grown = (size_t*)realloc(cache->hits, newCap * sizeof(size_t));
+                if (!grown) return; // Not recording the range keeps the cache truthful
+                cache->hits = grown;
+                cache->hitCapacity = newCap;
             }
+            memmove(&cache->hits[at + 1], &cache->hits[at], (cache->hitCount - at) * sizeof(size_t));
+            cache->hits[at] = hit;
+            cache->hitCount++;
+        }
+    }
 
-            if (currentStart >= lastStart) break;
+    // Merge with every range that overlaps or touches [start, end)
+    size_t first = MatchCache_LowerRange(cache, start > 0 ? start - 1 : 0);
+    size_t last = first;
+    while (last < cache->scannedCount && cache->scanned[last].start <= end) {
+        if (cache->scanned[last].start < start) start = cache->scanned[last].start;
+        if (cache->scanned[last].end > end) end = cache->scanned[last].end;
+        last++;
+    }
 
-            WCHAR nextChar;
-            if (!DocIter_Next(doc, &it, &nextChar)) break;
-            WCHAR foldedNext = FoldAscii(nextChar, caseSensitive);
+    if (first == last) {
+        if (cache->scannedCount == cache->scannedCapacity) {
+            size_t newCap = cache->scannedCapacity ? cache->scannedCapacity * 2 : 16;
+            DocSpan* grown = (DocSpan*)realloc(cache->scanned, newCap * sizeof(DocSpan));
+            if (!grown) return;
+            cache->scanned = grown;
+            cache->scannedCapacity = newCap;
+        }
+        memmove(&cache->scanned[first + 1], &cache->scanned[first], (cache->scannedCount - first) * sizeof(DocSpan));
+        cache->scannedCount++;
+    } else if (last - first > 1) {
+        memmove(&cache->scanned[first + 1], &cache->scanned[last], (cache->scannedCount - last) * sizeof(DocSpan));
+        cache->scannedCount -= (last - first - 1);
+    }
+    cache->scanned[first].start = start;
+    cache->scanned[first].end = end;
+}
 
-            WCHAR outgoing = window[windowStartIdx];
-            windowStartIdx = (windowStartIdx + 1) % patternLen;
-            size_t insertIdx = (windowStartIdx + patternLen - 1) % patternLen;
-            window[insertIdx] = foldedNext;
+/**
+ * Adjusts the cache for 'removed' characters at offset being replaced by 'inserted' ones.
+ * A match starting at s reads [s - 1, s + len] (the extra characters are its word
+ * boundaries), so only starts in [offset - len, offset + removed] can change; everything
+ * after them just shifts.
+ */
+static void MatchCache_OnEdit(DocMatchCache* cache, size_t offset, size_t removed, size_t inserted) {
+    if (!cache || (cache->scannedCount == 0 && cache->hitCount == 0)) return;
 
-            // Rolling hash: remove outgoing, add incoming
-            unsigned long long temp = (windowHash + mod - (outgoing * highestPow) % mod) % mod;
-            windowHash = (temp * base + foldedNext) % mod;
+    size_t cutStart = (offset > cache->len) ? offset - cache->len : 0;
+    size_t cutEnd = offset + removed + 1;
 
-            currentStart++;
+    size_t out = 0;
+    for (size_t i = 0; i < cache->hitCount; i++) {
+        size_t h = cache->hits[i];
+        if (h >= cutStart && h < cutEnd) continue;
+        cache->hits[out++] = (h >= cutEnd) ? h - removed + inserted : h;
+    }
+    cache->hitCount = out;
+
+    // Compact in place; only the range that contains the cut splits in two, and its upper
+    // half is re-added once the pass is done
+    size_t kept = 0;
+    DocSpan tail = {0, 0};
+    for (size_t i = 0; i < cache->scannedCount; i++) {
+        DocSpan r = cache->scanned[i];
+        DocSpan lo = { r.start, (r.end < cutStart) ? r.end : cutStart };
+        DocSpan hi = { (r.start > cutEnd) ? r.start : cutEnd, r.end };
+        if (hi.start < hi.end) {
+            hi.start = hi.start - removed + inserted;
+            hi.end = hi.end - removed + inserted;
         }
 
-        free(window);
-        result.status = DOC_SEARCH_REACHED_EOF;
-    } else {
-        // Backward search: scan from start, keep the last match <= cursorOffset
-        size_t lastAllowedStart = (cursorOffset + patternLen > docLen) ? (docLen - patternLen) : cursorOffset;
-
-        DocCharIterator it;
-        DocIter_Seek(doc, 0, &it);
-
-        WCHAR* window = (WCHAR*)malloc(patternLen * sizeof(WCHAR));
-        if (!window) {
-            free(patternNorm);
-            result.status = DOC_SEARCH_REACHED_BOF;
-            return result;
-        }
-
-        for (size_t i = 0; i < patternLen; i++) {
-            WCHAR ch;
-            if (!DocIter_Next(doc, &it, &ch)) {
-                free(window);
-                free(patternNorm);
-                result.status = DOC_SEARCH_REACHED_BOF;
-                return result;
+        if (lo.start < lo.end && hi.start < hi.end) {
+            cache->scanned[kept++] = lo;
+            tail = hi;
+        } else if (lo.start < lo.end) {
+            cache->scanned[kept++] = lo;
+        } else if (hi.start < hi.end) {
+            cache->scanned[kept++] = hi;
+        }
+    }
+    cache->scannedCount = kept;
+    if (tail.start < tail.end) MatchCache_AddScanned(cache, tail.start, tail.end, (size_t)-1);
+}
+
+// Finds the first match starting in [from, lastStart], answering from the scanned ranges
+// where possible and searching (then recording) only the gaps between them
+static size_t MatchCache_FindNext(SlateDoc* doc, DocMatchCache* cache, size_t from, size_t lastStart) {
+    size_t pos = from;
+    while (pos <= lastStart) {
+        size_t r = MatchCache_LowerRange(cache, pos);
+        if (r < cache->scannedCount && cache->scanned[r].start <= pos) {
+            size_t h = MatchCache_LowerHit(cache, pos);
+            if (h < cache->hitCount && cache->hits[h] < cache->scanned[r].end) {
+                return (cache->hits[h] <= lastStart) ? cache->hits[h] : (size_t)-1;
             }
-            window[i] = FoldAscii(ch, caseSensitive);
-            windowHash = (windowHash * base + window[i]) % mod;
+            pos = cache->scanned[r].end;
+            continue;
         }
 
-        size_t windowStartIdx = 0;
-        size_t currentStart = 0;
-        size_t bestMatch = (size_t)-1;
+        size_t gapLast = lastStart;
+        if (r < cache->scannedCount && cache->scanned[r].start <= lastStart) gapLast = cache->scanned[r].start - 1;
 
-        while (currentStart <= lastAllowedStart) {
-            if (windowHash == patternHash && WindowEquals(window, windowStartIdx, patternNorm, patternLen)) {
-                bestMatch = currentStart;
+        size_t hit = Doc_FindMatch(doc, &cache->kernel, pos, gapLast, FALSE);
+        if (hit != (size_t)-1) {
+            MatchCache_AddScanned(cache, pos, hit + 1, hit);
+            return hit;
+        }
+        MatchCache_AddScanned(cache, pos, gapLast + 1, (size_t)-1);
+        pos = gapLast + 1;
+    }
+    return (size_t)-1;
+}
+
+// Backward counterpart of MatchCache_FindNext: the last match starting in [firstStart, pos]
+static size_t MatchCache_FindPrev(SlateDoc* doc, DocMatchCache* cache, size_t firstStart, size_t pos) {
+    while (pos >= firstStart) {
+        size_t r = MatchCache_LowerRange(cache, pos);
+        if (r < cache->scannedCount && cache->scanned[r].start <= pos) {
+            size_t h = MatchCache_LowerHit(cache, pos + 1);
+            if (h > 0 && cache->hits[h - 1] >= cache->scanned[r].start) {
+                return (cache->hits[h - 1] >= firstStart) ? cache->hits[h - 1] : (size_t)-1;
             }
+            if (cache->scanned[r].start <= firstStart) break;
+            pos = cache->scanned[r].start - 1;
+            continue;
+        }
+
+        size_t gapStart = firstStart;
+        if (r > 0 && cache->scanned[r - 1].end > firstStart) gapStart = cache->scanned[r - 1].end;
+
+        size_t hit = Doc_FindMatch(doc, &cache->kernel, gapStart, pos, TRUE);
+        if (hit != (size_t)-1) {
+            MatchCache_AddScanned(cache, hit, pos + 1, hit);
+            return hit;
+        }
+        MatchCache_AddScanned(cache, gapStart, pos + 1, (size_t)-1);
+        if (gapStart <= firstStart) break;
+        pos = gapStart - 1;
+    }
+    return (size_t)-1;
+}
 
-            if (currentStart == lastAllowedStart) break;
+DocSearchResult Doc_Search(SlateDoc* doc, const WCHAR* pattern, size_t patternLen, size_t cursorOffset, const DocSearchOptions* options) {
+    DocSearchResult result = {0};
+    result.status = DOC_SEARCH_NO_PATTERN;
+    result.match_length = patternLen;
+    result.line = 1;
+    result.column = 1;
+
+    if (!doc || !pattern || patternLen == 0) {
+        return result; // No-op for empty pattern or null inputs
+    }
 
-            WCHAR nextChar;
-            if (!DocIter_Next(doc, &it, &nextChar)) break;
-            WCHAR foldedNext = FoldAscii(nextChar, caseSensitive);
+    BOOL searchBackwards = options ? options->searchBackwards : FALSE;
+    BOOL caseSensitive = options ? options->caseSensitive : FALSE;
+    BOOL wholeWord = options ? options->wholeWord : FALSE;
+    DocSearchStatus notFound = searchBackwards ? DOC_SEARCH_REACHED_BOF : DOC_SEARCH_REACHED_EOF;
 
-            WCHAR outgoing = window[windowStartIdx];
-            windowStartIdx = (windowStartIdx + 1) % patternLen;
-            size_t insertIdx = (windowStartIdx + patternLen - 1) % patternLen;
-            window[insertIdx] = foldedNext;
+    size_t rangeStart, rangeEnd;
+    Doc_GetSearchRange(doc, options, &rangeStart, &rangeEnd);
+    if (rangeEnd - rangeStart < patternLen) {
+        result.status = notFound;
+        return result;
+    }
+    size_t lastStart = rangeEnd - patternLen;
+
+    if (cursorOffset > doc->total_length) cursorOffset = doc->total_length;
+
+    DocMatchCache* cache = MatchCache_Acquire(doc, pattern, patternLen, caseSensitive, wholeWord);
+    if (!cache) {
+        result.status = notFound;
+        return result;
+    }
+
+    size_t match = (size_t)-1;
+    if (!searchBackwards) {
+        // Forward search from cursorOffset to the end of the range
+        size_t from = (cursorOffset > rangeStart) ? cursorOffset : rangeStart;
+        match = MatchCache_FindNext(doc, cache, from, lastStart);
+    } else if (cursorOffset >= rangeStart) {
+        // Backward search: the last match starting at or before cursorOffset
+        size_t lastAllowedStart = (cursorOffset < lastStart) ? cursorOffset : lastStart;
+        match = MatchCache_FindPrev(doc, cache, rangeStart, lastAllowedStart);
+    }
+
+    if (match != (size_t)-1) {
+        result.status = DOC_SEARCH_MATCH;
+        result.match_offset = match;
+        Doc_GetOffsetInfo(doc, match, &result.line, &result.column);
+    } else {
+        result.status = notFound;
+    }
+    return result;
+}
+
+/**
+ * Replaces every match in one batch: a single streaming search pass, one copy of the
+ * replacement text in the ADD buffer shared by all replacement pieces, one rebuild of
+ * the piece list, one undo step and one metadata refresh.
+ */
+BOOL Doc_ReplaceAll(SlateDoc* doc, const WCHAR* pattern, size_t patternLen, const WCHAR* replacement, size_t replacementLen,
+                    const DocSearchOptions* options, size_t* ioCursor, size_t* outCount) {
+    if (outCount) *outCount = 0;
+    if (!doc || !pattern || patternLen == 0 || (!replacement && replacementLen > 0)) return FALSE;
+
+    size_t rangeStart, rangeEnd;
+    Doc_GetSearchRange(doc, options, &rangeStart, &rangeEnd);
+    if (rangeEnd - rangeStart < patternLen) return FALSE;
+
+    SearchKernel kernel;
+    if (!Kernel_Init(&kernel, doc, pattern, patternLen, options ? options->caseSensitive : FALSE,
+                     options ? options->wholeWord : FALSE)) {
+        return FALSE;
+    }
 
-            unsigned long long temp = (windowHash + mod - (outgoing * highestPow) % mod) % mod;
-            windowHash = (temp * base + foldedNext) % mod;
+    size_t* matches = NULL;
+    size_t count = 0;
+    BOOL ok = Kernel_FindAll(&kernel, rangeStart, rangeEnd - patternLen, &matches, &count);
+    Kernel_Free(&kernel);
+    if (!ok || count == 0) {
+        free(matches);
+        return FALSE;
+    }
 
-            currentStart++;
+    size_t cursor = ioCursor ? *ioCursor : rangeStart;
+    size_t addStart = 0;
+    if (replacementLen > 0) {
+        addStart = Doc_AppendToAddBuffer(doc, replacement, replacementLen);
+        if (addStart == (size_t)-1) {
+            free(matches);
+            return FALSE;
         }
+    }
 
-        free(window);
+    // Build the new piece list beside the old one, so running out of memory part way leaves
+    // the document as it was
+    Piece* newHead = NULL;
+    Piece** tail = &newHead;
+    size_t matchIdx = 0;
+    size_t skipUntil = 0;      // Old text before this offset belongs to a replaced match
+    size_t cumulative = 0;
+    BOOL built = TRUE;
 
-        if (bestMatch != (size_t)-1) {
-            result.status = DOC_SEARCH_MATCH;
-            result.match_offset = bestMatch;
-            Doc_GetOffsetInfo(doc, bestMatch, &result.line, &result.column);
-        } else {
-            result.status = DOC_SEARCH_REACHED_BOF;
+    for (Piece* curr = doc->head; curr && built; curr = curr->next) {
+        size_t pieceEnd = cumulative + curr->length;
+        size_t pos = cumulative;
+
+        while (pos < pieceEnd) {
+            if (pos < skipUntil) {
+                pos = (skipUntil < pieceEnd) ? skipUntil : pieceEnd;
+                continue;
+            }
+            if (matchIdx < count && matches[matchIdx] == pos) {
+                if (replacementLen > 0) {
+                    Piece* rep = CreatePiece(BUFFER_ADD, addStart, replacementLen, FALSE);
+                    if (!rep) {
+                        built = FALSE;
+                        break;
+                    }
+                    *tail = rep;
+                    tail = &rep->next;
+                }
+                skipUntil = pos + patternLen;
+                matchIdx++;
+                continue;
+            }
+
+            size_t segEnd = pieceEnd;
+            if (matchIdx < count && matches[matchIdx] < segEnd) segEnd = matches[matchIdx];
+            Piece* seg = CreatePiece(curr->buffer, curr->start + (pos - cumulative), segEnd - pos, curr->isUtf8);
+            if (!seg) {
+                built = FALSE;
+                break;
+            }
+            *tail = seg;
+            tail = &seg->next;
+            pos = segEnd;
         }
+        cumulative = pieceEnd;
+    }
+    *tail = NULL;
+    if (!built) {
+        FreePieceList(newHead);
+        free(matches);
+        return FALSE;
     }
 
-    free(patternNorm);
-    return result;
+    // Snapshot state before modification
+    Doc_PushUndo(doc, cursor, TRUE);
+    FreePieceList(doc->head);
+    doc->head = newHead;
+
+    // Shift the cursor by the growth of every replacement that precedes it
+    if (ioCursor) {
+        size_t newCursor = cursor;
+        for (size_t i = 0; i < count && matches[i] < cursor; i++) {
+            if (cursor < matches[i] + patternLen) {
+                // Cursor sat inside this match: park it at the end of the replacement
+                newCursor = newCursor - (cursor - matches[i]) + replacementLen;
+                break;
+            }
+            newCursor = newCursor - patternLen + replacementLen;
+        }
+        *ioCursor = newCursor;
+    }
+
+    free(matches);
+    if (outCount) *outCount = count;
+
+    // Update metadata and line map
+    MatchCache_Clear(doc->match_cache);
+    Doc_RefreshMetadata(doc);
+    Journal_LogReplaceAll(doc->journal, pattern, patternLen, replacement, replacementLen, options);
+    return TRUE;
+}
+
+// Finds the next match within an already-decoded run of text, using the same folding and
+// word-boundary rules as Doc_Search. The text edges count as boundaries. Returns
+// (size_t)-1 if there is no match at or after 'from'.
+size_t Doc_FindInText(const WCHAR* text, size_t textLen, size_t from, const WCHAR* pattern, size_t patternLen,
+                      BOOL caseSensitive, BOOL wholeWord) {
+    if (!text || !pattern || patternLen == 0 || textLen < patternLen) return (size_t)-1;
+    if (wholeWord) Doc_InitWordChars();
+
+    WCHAR first = FoldAscii(pattern[0], caseSensitive);
+    for (size_t i = from; i + patternLen <= textLen; i++) {
+        if (FoldAscii(text[i], caseSensitive) != first) continue;
+
+        size_t k = 1;
+        while (k < patternLen && FoldAscii(text[i + k], caseSensitive) == FoldAscii(pattern[k], caseSensitive)) k++;
+        if (k < patternLen) continue;
+
+        if (wholeWord) {
+            if (IsWordCharFast(pattern[0]) && i > 0 && IsWordCharFast(text[i - 1])) continue;
+            if (IsWordCharFast(pattern[patternLen - 1]) && i + patternLen < textLen &&
+                IsWordCharFast(text[i + patternLen])) continue;
+        }
+        return i;
+    }
+    return (size_t)-1;
 }
@@ -5,14 +5,51 @@
 
 typedef enum { BUFFER_ORIGINAL, BUFFER_ADD } BufferType;
 
+// On-disk encoding of the original buffer; saves write the document back in it
+typedef enum {
+    DOC_ENCODING_UTF8,
+    DOC_ENCODING_UTF8_BOM,
+    DOC_ENCODING_UTF16LE,
+    DOC_ENCODING_UTF16BE,
+    DOC_ENCODING_UTF16LE_NOBOM,
+    DOC_ENCODING_UTF16BE_NOBOM,
+    DOC_ENCODING_UTF32LE,
+    DOC_ENCODING_UTF32BE,
+    DOC_ENCODING_ANSI            // Single or double byte text in the document's code_page
+} DocEncoding;
+
+#define DOC_DETECT_BYTES (1024 * 1024) // Bytes of a file inspected to guess its encoding
+#define DOC_PREFETCH_BYTES (8 * 1024 * 1024) // Read ahead of scrolling, searches and full scans
+
+struct SlateIndex;
+struct SlateJournal;
+struct SlateMap;
+struct DocMatchCache;
+
 typedef struct Piece {
     BufferType buffer;
     size_t start;
     size_t length;
-    BOOL isUtf8;       // TRUE for original UTF-8 pieces, FALSE for ADD buffer text (always UTF-16)
+    BOOL isUtf8;       // TRUE for original pieces with byte units (UTF-8 or ANSI), FALSE for 16/32-bit units and ADD text
     struct Piece* next;
 } Piece;
 
+// One edit as views see it: the lines it replaced, from the line holding its offset on.
+// Views that keep per-line layout replay the edits since they last looked instead of
+// starting over; an edit that has dropped out of the log means starting over. The text of
+// 'line' before 'column' is untouched, so layout of that part can be kept too.
+#define DOC_EDIT_LOG        16
+#define DOC_EDIT_UNKNOWN    ((size_t)-1)
+#define DOC_EDIT_SCAN_UNITS (4 * 1024 * 1024) // Larger deletions are not scanned for line breaks
+
+typedef struct DocEdit {
+    size_t revision;        // Revision the edit produced
+    size_t line;            // Line holding the edit's offset
+    size_t linesRemoved;    // Line breaks the edit removed
+    size_t linesInserted;   // Line breaks it inserted, or DOC_EDIT_UNKNOWN: every line from 'line' on is new
+    size_t column;          // The edit's offset from the start of 'line'
+} DocEdit;
+
 typedef struct UndoStep {
     Piece* pieces;
     size_t piece_count;
@@ -21,11 +58,20 @@ typedef struct UndoStep {
 } UndoStep;
 
 typedef struct {
-    void* original_buffer;      // void* handles char* or WCHAR*
+    void* original_buffer;      // void* handles char* or WCHAR*; NULL when windowed
     void* original_buffer_base;
     HANDLE hMapFile;
+    struct SlateMap* original_map; // Windows onto hMapFile for a file too large to map whole, NULL otherwise
+    size_t original_skip;        // Bytes before the text in the file (its byte order mark)
+    size_t original_reserved;    // Address space reserved for a streamed original (VirtualAlloc), 0 otherwise
     size_t original_len;
-    BOOL   original_is_utf8;     // Flag for the mapped file encoding
+    BOOL   original_is_utf8;     // Original units are bytes (UTF-8 or ANSI)
+    DocEncoding encoding;        // Full encoding of the mapped file, including BOM and byte order
+    UINT   code_page;            // For DOC_ENCODING_ANSI
+    WCHAR  code_page_chars[256]; // What each byte decodes to in code_page on its own, for DOC_ENCODING_ANSI
+    WCHAR  original_path[MAX_PATH]; // Full path of the mapped file, empty when unknown
+    struct SlateIndex* search_index; // Optional trigram index over the original buffer
+    struct SlateJournal* journal;    // Crash-recovery log of edits since open or save, if any
     
     WCHAR* add_buffer;
     size_t add_len;
@@ -33,6 +79,8 @@ typedef struct {
 
     Piece* head;
     size_t total_length;
+    size_t revision;            // Bumped on every edit so views can drop derived caches
+    DocEdit edits[DOC_EDIT_LOG]; // The latest edits, at revision % DOC_EDIT_LOG
 
     // Lazy line-map state
     BOOL    line_map_complete;      // TRUE once we've scanned to EOF
@@ -43,25 +91,84 @@ typedef struct {
     UndoStep* undo_stack;
     UndoStep* redo_stack;
 
+    struct DocMatchCache* match_cache; // Scanned ranges and hits of the last searched pattern
+
+    size_t  prefetch_start;         // Document range last read ahead for scrolling
+    size_t  prefetch_end;
+
     size_t* line_offsets;
     size_t  line_count;
     size_t  line_capacity;
 } SlateDoc;
 
+// Layout of an encoding in the original buffer and on disk
+size_t      Doc_EncodingUnitSize(DocEncoding encoding);  // 1, 2 or 4 bytes per unit
+BOOL        Doc_EncodingIsBigEndian(DocEncoding encoding);
+size_t      Doc_EncodingBomBytes(DocEncoding encoding);
+DocEncoding Doc_DetectEncoding(const BYTE* data, size_t bytes, size_t* outSkip, UINT* outCodePage);
+
 // Function declarations
 SlateDoc* Doc_CreateEmpty();
-SlateDoc* Doc_CreateFromMap(void* pMappedText, size_t len, HANDLE hMap, void* pBase, BOOL isUtf8);
+SlateDoc* Doc_CreateFromMap(void* pMappedText, size_t len, HANDLE hMap, void* pBase, DocEncoding encoding, UINT codePage);
+SlateDoc* Doc_CreateWindowed(HANDLE hMap, size_t skip, size_t len, DocEncoding encoding, UINT codePage);
+SlateDoc* Doc_CreateStreaming(void* pText, size_t len, void* pBase, size_t reserved, DocEncoding encoding, UINT codePage);
+BOOL      Doc_AppendOriginal(SlateDoc* doc, size_t units);
+BOOL      Doc_ExtendMap(SlateDoc* doc, void* pMappedText, size_t len, HANDLE hMap, void* pBase);
 void      Doc_Destroy(SlateDoc* doc);
+SlateDoc* Doc_CreateSnapshot(SlateDoc* doc);
+void      Doc_DestroySnapshot(SlateDoc* snapshot);
+BOOL      Doc_RebaseOnMap(SlateDoc* doc, void* pMappedText, size_t len, HANDLE hMap, void* pBase, DocEncoding encoding);
+BOOL      Doc_AttachSearchIndex(SlateDoc* doc, const WCHAR* filePath);
+void      Doc_SetOriginalPath(SlateDoc* doc, const WCHAR* filePath);
+// Starts journaling edits to a mapped document (recover or discard an old journal first)
+BOOL      Doc_AttachJournal(SlateDoc* doc, const WCHAR* filePath);
 void      Doc_RefreshMetadata(SlateDoc* pDoc);
 void      Doc_StreamToBuffer(SlateDoc* doc, void (*callback)(const WCHAR*, size_t, void*), void* ctx);
 size_t    Doc_GetText(SlateDoc* doc, size_t offset, size_t len, WCHAR* dest);
+const BYTE* Doc_OriginalBytes(const SlateDoc* doc, ULONGLONG pos, size_t bytes);
+const BYTE* Doc_OriginalRun(const SlateDoc* doc, size_t start, size_t* ioCount);
+size_t    Doc_DecodeOriginal(const SlateDoc* doc, size_t start, size_t count, WCHAR* dst, size_t dstCap, size_t* outConsumed);
+// Read-ahead hints for a mapped original; no-ops for text already in memory
+void      Doc_PrefetchOriginal(const SlateDoc* doc, size_t start, size_t count);
+void      Doc_Prefetch(SlateDoc* doc, size_t offset, size_t len);
+void      Doc_PrefetchAhead(SlateDoc* doc, size_t offset, BOOL backwards);
 void      Doc_GetOffsetInfo(SlateDoc* doc, size_t offset, int* out_line, int* out_col);
 size_t    Doc_GetLineOffset(SlateDoc* doc, size_t lineIndex);
 BOOL      Doc_Insert(SlateDoc* doc, size_t offset, const WCHAR* text, size_t len);
 BOOL      Doc_Delete(SlateDoc* doc, size_t offset, size_t len);
 void      Doc_EnsureLineForIndex(SlateDoc* doc, size_t lineIndex);
+BOOL      Doc_GetEdit(const SlateDoc* doc, size_t revision, DocEdit* out);
 BOOL      Doc_Undo(SlateDoc* pDoc, size_t currentCursor, size_t* outCursor);
 BOOL      Doc_Redo(SlateDoc* pDoc, size_t currentCursor, size_t* outCursor);
+void      Doc_ClearUndoStack(SlateDoc* pDoc);
+
+typedef struct {
+    ULONGLONG bytesWritten;
+    ULONGLONG bytesPassedThrough; // Original-buffer bytes copied straight from the mapping
+} DocSaveStats;
+
+typedef struct DocSaveJob DocSaveJob;
+
+#define DOC_SAVE_COMPLETE 1001 // wParam of the last message a background save posts
+
+// slate_save.c
+BOOL        Doc_WriteToHandle(SlateDoc* doc, HANDLE hFile, DocEncoding encoding, DocSaveStats* outStats,
+                              void (*progress)(size_t unitsDone, size_t unitsTotal, void* ctx), void* ctx);
+BOOL        Doc_SaveToFile(SlateDoc* doc, const WCHAR* path, DocEncoding encoding, DocSaveStats* outStats);
+DocSaveJob* Doc_BeginSave(SlateDoc* doc, const WCHAR* path, DocEncoding encoding, HWND hwndNotify, UINT msg);
+BOOL        Doc_FinishSave(SlateDoc* doc, DocSaveJob* job, DocSaveStats* outStats);
+size_t      Doc_GetSavedOffset(SlateDoc* doc, size_t offset, DocEncoding encoding);
+
+typedef enum {
+    DOC_SESSION_OK,
+    DOC_SESSION_UNREADABLE,        // Not a session file, or damaged
+    DOC_SESSION_ORIGINAL_CHANGED   // The original file is gone or differs from when the session was saved
+} DocSessionStatus;
+
+// slate_session.c
+BOOL             Doc_SaveSession(SlateDoc* doc, const WCHAR* sessionPath, size_t cursor, size_t anchor);
+BOOL             Doc_GetSessionOriginal(const WCHAR* sessionPath, WCHAR* outPath, size_t outCount);
+DocSessionStatus Doc_RestoreSession(SlateDoc* doc, const WCHAR* sessionPath, size_t* outCursor, size_t* outAnchor);
 
 typedef enum {
     DOC_SEARCH_NO_PATTERN,
@@ -70,6 +177,15 @@ typedef enum {
     DOC_SEARCH_REACHED_BOF
 } DocSearchStatus;
 
+typedef struct {
+    BOOL   searchBackwards;
+    BOOL   caseSensitive;
+    BOOL   wholeWord;       // Require word boundaries around the match
+    BOOL   hasRange;        // Confine matches to [rangeStart, rangeEnd)
+    size_t rangeStart;
+    size_t rangeEnd;
+} DocSearchOptions;
+
 typedef struct {
     DocSearchStatus status;
     size_t match_offset;
@@ -78,6 +194,10 @@ typedef struct {
     int column;
 } DocSearchResult;
 
-DocSearchResult Doc_Search(SlateDoc* doc, const WCHAR* pattern, size_t patternLen, size_t cursorOffset, BOOL searchBackwards, BOOL caseSensitive);
+DocSearchResult Doc_Search(SlateDoc* doc, const WCHAR* pattern, size_t patternLen, size_t cursorOffset, const DocSearchOptions* options);
+BOOL            Doc_ReplaceAll(SlateDoc* doc, const WCHAR* pattern, size_t patternLen, const WCHAR* replacement, size_t replacementLen,
+                               const DocSearchOptions* options, size_t* ioCursor, size_t* outCount);
+size_t          Doc_FindInText(const WCHAR* text, size_t textLen, size_t from, const WCHAR* pattern, size_t patternLen,
+                               BOOL caseSensitive, BOOL wholeWord);
 
 #endif
@@ -0,0 +1,88 @@
+#include "slate_follow.h"
+#include <stdlib.h>
+
+struct SlateFollow {
+    HANDLE hFile;
+    HANDLE hChange;              // Folder change notification, or INVALID_HANDLE_VALUE
+    HANDLE hStop;
+    HANDLE hThread;
+    HWND hwndNotify;
+    UINT msg;
+
+    volatile LONGLONG size;      // Latest size seen by the watcher
+    volatile LONGLONG reported;  // Size last handed out by Follow_GetSize
+    volatile LONG notifyPending;
+};
+
+static DWORD WINAPI Follow_WatchThread(LPVOID param) {
+    SlateFollow* follow = (SlateFollow*)param;
+    HANDLE waits[2] = { follow->hStop, follow->hChange };
+    DWORD waitCount = (follow->hChange != INVALID_HANDLE_VALUE) ? 2 : 1;
+
+    for (;;) {
+        DWORD wait = WaitForMultipleObjects(waitCount, waits, FALSE, FOLLOW_POLL_MS);
+        if (wait == WAIT_OBJECT_0 || wait == WAIT_FAILED) break;
+        if (wait == WAIT_OBJECT_0 + 1) FindNextChangeNotification(follow->hChange);
+
+        // Querying the open handle sees a writer's appends even before the folder entry does
+        LARGE_INTEGER liSize;
+        if (!GetFileSizeEx(follow->hFile, &liSize)) continue;
+        InterlockedExchange64(&follow->size, liSize.QuadPart);
+
+        // One message in flight at a time; a burst of appends is picked up by one update
+        if (liSize.QuadPart != follow->reported && InterlockedExchange(&follow->notifyPending, 1) == 0) {
+            PostMessageW(follow->hwndNotify, follow->msg, 0, (LPARAM)follow);
+        }
+    }
+    return 0;
+}
+
+SlateFollow* Follow_Start(const WCHAR* filePath, ULONGLONG knownSize, HWND hwndNotify, UINT msg) {
+    WCHAR folder[MAX_PATH];
+    WCHAR* filePart = NULL;
+    DWORD fullLen = GetFullPathNameW(filePath, MAX_PATH, folder, &filePart);
+    if (fullLen == 0 || fullLen >= MAX_PATH || !filePart) return NULL;
+    *filePart = L'\0';
+
+    SlateFollow* follow = (SlateFollow*)calloc(1, sizeof(SlateFollow));
+    if (!follow) return NULL;
+    follow->hwndNotify = hwndNotify;
+    follow->msg = msg;
+    follow->size = follow->reported = (LONGLONG)knownSize;
+
+    // Shared with everything so the writer, renames and deletes carry on undisturbed
+    follow->hFile = CreateFileW(filePath, FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    follow->hChange = FindFirstChangeNotificationW(folder, FALSE, FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE);
+    follow->hStop = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (follow->hFile != INVALID_HANDLE_VALUE && follow->hStop) {
+        follow->hThread = CreateThread(NULL, 0, Follow_WatchThread, follow, 0, NULL);
+    }
+    if (!follow->hThread) {
+        Follow_Stop(follow);
+        return NULL;
+    }
+    return follow;
+}
+
+ULONGLONG Follow_GetSize(SlateFollow* follow) {
+    if (!follow) return 0;
+    InterlockedExchange(&follow->notifyPending, 0);
+    LONGLONG size = InterlockedCompareExchange64(&follow->size, 0, 0);
+    InterlockedExchange64(&follow->reported, size);
+    return (ULONGLONG)size;
+}
+
+void Follow_Stop(SlateFollow* follow) {
+    if (!follow) return;
+
+    if (follow->hThread) {
+        SetEvent(follow->hStop);
+        WaitForSingleObject(follow->hThread, INFINITE);
+        CloseHandle(follow->hThread);
+    }
+    if (follow->hStop) CloseHandle(follow->hStop);
+    if (follow->hChange != INVALID_HANDLE_VALUE && follow->hChange) FindCloseChangeNotification(follow->hChange);
+    if (follow->hFile != INVALID_HANDLE_VALUE && follow->hFile) CloseHandle(follow->hFile);
+    free(follow);
+}
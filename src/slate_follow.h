@@ -0,0 +1,22 @@
+#ifndef SLATE_FOLLOW_H
+#define SLATE_FOLLOW_H
+
+#include <windows.h>
+
+// Watches a file for growth on a background thread (View > Follow). The thread sleeps on a
+// change notification for the file's folder, so an idle log costs nothing; writers whose
+// size changes NTFS only reports lazily are caught by a slow poll instead.
+#define FOLLOW_POLL_MS 1000
+
+typedef struct SlateFollow SlateFollow;
+
+// Starts watching; posts 'msg' to hwndNotify with the watcher as lParam whenever the size
+// differs from knownSize or the last size handed out (one message in flight at a time)
+SlateFollow* Follow_Start(const WCHAR* filePath, ULONGLONG knownSize, HWND hwndNotify, UINT msg);
+
+// The latest size seen; re-arms the notification
+ULONGLONG    Follow_GetSize(SlateFollow* follow);
+
+void         Follow_Stop(SlateFollow* follow);
+
+#endif
@@ -0,0 +1,288 @@
+#include "slate_index.h"
+#include "slate_map.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define INDEX_MAGIC          0x58494C53 // "SLIX"
+#define INDEX_VERSION        1
+#define INDEX_BLOCK_UNITS    ((size_t)1 << INDEX_BLOCK_SHIFT)
+#define INDEX_BUCKET_MASK    ((1u << INDEX_BUCKET_BITS) - 1)
+#define INDEX_BITMAP_BYTES   ((size_t)1 << (INDEX_BUCKET_BITS - 3))
+
+typedef struct {
+    DWORD     magic;
+    DWORD     version;
+    ULONGLONG fileSize;      // Identity of the indexed file: size and last write time
+    FILETIME  lastWrite;
+    ULONGLONG unitCount;     // Length of the original buffer in units (bytes or UTF-16 code units)
+    DWORD     unitSize;
+    DWORD     blockShift;
+    DWORD     bucketBits;
+    DWORD     reserved;
+    ULONGLONG blockCount;
+} IndexHeader;
+
+struct SlateIndex {
+    const void* data;
+    SlateMap* window;        // The builder's own views of a windowed original, in place of data
+    size_t len;
+    BOOL isUtf8;
+    ULONGLONG fileSize;
+    FILETIME lastWrite;
+    WCHAR sidecarPath[MAX_PATH];
+
+    HANDLE hThread;
+    volatile LONG cancel;
+    volatile LONG ready;
+
+    HANDLE hFile;
+    HANDLE hMap;
+    const BYTE* view;
+    const BYTE* bitmaps;
+    size_t blockCount;
+};
+
+static UINT32 FoldUnit(UINT32 u) {
+    return (u >= 'A' && u <= 'Z') ? u + 32 : u;
+}
+
+static UINT32 HashTrigram(UINT32 a, UINT32 b, UINT32 c) {
+    UINT32 h = a * 0x9E3779B1u + b * 0x85EBCA77u + c * 0xC2B2AE3Du;
+    h ^= h >> 15;
+    h *= 0x2C1B3C6Du;
+    h ^= h >> 12;
+    return h & INDEX_BUCKET_MASK;
+}
+
+static UINT32 ReadUnit(const BYTE* units, BOOL isUtf8, size_t i) {
+    return isUtf8 ? units[i] : ((const WCHAR*)units)[i];
+}
+
+static size_t GetBlockCount(size_t len) {
+    return (len + INDEX_BLOCK_UNITS - 1) >> INDEX_BLOCK_SHIFT;
+}
+
+// Cache files live in %LOCALAPPDATA%\Slate\<subdir>, named by a hash of the full path, so
+// read-only archive folders can still be indexed or journaled.
+BOOL Slate_BuildCachePath(const WCHAR* subdir, const WCHAR* filePath, const WCHAR* ext, WCHAR* out, size_t outCount) {
+    WCHAR fullPath[MAX_PATH];
+    DWORD fullLen = GetFullPathNameW(filePath, MAX_PATH, fullPath, NULL);
+    if (fullLen == 0 || fullLen >= MAX_PATH) return FALSE;
+    CharLowerBuffW(fullPath, fullLen);
+
+    unsigned long long hash = 14695981039346656037ULL; // FNV-1a
+    for (DWORD i = 0; i < fullLen; i++) {
+        hash ^= fullPath[i];
+        hash *= 1099511628211ULL;
+    }
+
+    WCHAR dir[MAX_PATH];
+    DWORD dirLen = GetEnvironmentVariableW(L"LOCALAPPDATA", dir, MAX_PATH);
+    if (dirLen == 0 || dirLen >= MAX_PATH - 32) return FALSE;
+
+    wcscat_s(dir, MAX_PATH, L"\\Slate");
+    CreateDirectoryW(dir, NULL);
+    wcscat_s(dir, MAX_PATH, L"\\");
+    wcscat_s(dir, MAX_PATH, subdir);
+    CreateDirectoryW(dir, NULL);
+    if (GetFileAttributesW(dir) == INVALID_FILE_ATTRIBUTES) return FALSE;
+
+    swprintf(out, outCount, L"%s\\%016llX.%s", dir, hash, ext);
+    return TRUE;
+}
+
+static BOOL HeaderMatches(const SlateIndex* index, const IndexHeader* h) {
+    return h->magic == INDEX_MAGIC && h->version == INDEX_VERSION &&
+           h->fileSize == index->fileSize &&
+           CompareFileTime(&h->lastWrite, &index->lastWrite) == 0 &&
+           h->unitCount == index->len &&
+           h->unitSize == (index->isUtf8 ? 1u : (DWORD)sizeof(WCHAR)) &&
+           h->blockShift == INDEX_BLOCK_SHIFT && h->bucketBits == INDEX_BUCKET_BITS &&
+           h->blockCount == GetBlockCount(index->len);
+}
+
+// Maps an existing sidecar and marks the index ready if it describes this exact file
+static BOOL Index_MapSidecar(SlateIndex* index) {
+    HANDLE hFile = CreateFileW(index->sidecarPath, GENERIC_READ, FILE_SHARE_READ, NULL,
+                               OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) return FALSE;
+
+    size_t blockCount = GetBlockCount(index->len);
+    LARGE_INTEGER liSize;
+    if (!GetFileSizeEx(hFile, &liSize) ||
+        (ULONGLONG)liSize.QuadPart != sizeof(IndexHeader) + (ULONGLONG)blockCount * INDEX_BITMAP_BYTES) {
+        CloseHandle(hFile);
+        return FALSE;
+    }
+
+    HANDLE hMap = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    const BYTE* view = hMap ? (const BYTE*)MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0) : NULL;
+    if (!view || !HeaderMatches(index, (const IndexHeader*)view)) {
+        if (view) UnmapViewOfFile(view);
+        if (hMap) CloseHandle(hMap);
+        CloseHandle(hFile);
+        return FALSE;
+    }
+
+    index->hFile = hFile;
+    index->hMap = hMap;
+    index->view = view;
+    index->bitmaps = view + sizeof(IndexHeader);
+    index->blockCount = blockCount;
+    InterlockedExchange(&index->ready, 1);
+    return TRUE;
+}
+
+/**
+ * Builds the sidecar block by block at low priority. A block's bitmap also covers trigrams
+ * starting up to INDEX_MAX_PATTERN units past its end, so every trigram of a match that
+ * starts in the block is found in that block's bitmap alone.
+ */
+static DWORD WINAPI Index_BuildThread(LPVOID param) {
+    SlateIndex* index = (SlateIndex*)param;
+    SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_BELOW_NORMAL);
+
+    WCHAR tempPath[MAX_PATH + 8];
+    swprintf(tempPath, _countof(tempPath), L"%s.tmp", index->sidecarPath);
+    HANDLE hOut = CreateFileW(tempPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                              FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hOut == INVALID_HANDLE_VALUE) return 1;
+
+    IndexHeader header = {0};
+    header.magic = INDEX_MAGIC;
+    header.version = INDEX_VERSION;
+    header.fileSize = index->fileSize;
+    header.lastWrite = index->lastWrite;
+    header.unitCount = index->len;
+    header.unitSize = index->isUtf8 ? 1u : (DWORD)sizeof(WCHAR);
+    header.blockShift = INDEX_BLOCK_SHIFT;
+    header.bucketBits = INDEX_BUCKET_BITS;
+    header.blockCount = GetBlockCount(index->len);
+
+    BYTE* bitmap = (BYTE*)malloc(INDEX_BITMAP_BYTES);
+    DWORD written;
+    BOOL ok = bitmap && WriteFile(hOut, &header, sizeof(header), &written, NULL);
+
+    for (size_t block = 0; ok && block < header.blockCount; block++) {
+        if (index->cancel) {
+            ok = FALSE;
+            break;
+        }
+
+        ZeroMemory(bitmap, INDEX_BITMAP_BYTES);
+        size_t start = block << INDEX_BLOCK_SHIFT;
+        size_t end = start + INDEX_BLOCK_UNITS + INDEX_MAX_PATTERN;
+        if (end > index->len) end = index->len;
+
+        // A block and its overlap fit in one window span. The next block is read ahead
+        // while this one is hashed.
+        size_t unitSize = index->isUtf8 ? 1 : sizeof(WCHAR);
+        if (end < index->len) {
+            size_t next = start + INDEX_BLOCK_UNITS;
+            size_t nextEnd = (index->len - next > INDEX_BLOCK_UNITS) ? next + INDEX_BLOCK_UNITS : index->len;
+            if (index->window) {
+                Map_PrefetchRange(index->window, (ULONGLONG)next * unitSize, (ULONGLONG)(nextEnd - next) * unitSize);
+            } else {
+                Map_Prefetch((const BYTE*)index->data + next * unitSize, (nextEnd - next) * unitSize);
+            }
+        }
+        const BYTE* units = index->window ? Map_Get(index->window, (ULONGLONG)start * unitSize, (end - start) * unitSize)
+                                          : (const BYTE*)index->data + start * unitSize;
+        if (!units) {
+            ok = FALSE;
+            break;
+        }
+
+        if (end - start >= 3) {
+            UINT32 a = FoldUnit(ReadUnit(units, index->isUtf8, 0));
+            UINT32 b = FoldUnit(ReadUnit(units, index->isUtf8, 1));
+            for (size_t i = 2; i < end - start; i++) {
+                UINT32 c = FoldUnit(ReadUnit(units, index->isUtf8, i));
+                UINT32 h = HashTrigram(a, b, c);
+                bitmap[h >> 3] |= (BYTE)(1u << (h & 7));
+                a = b;
+                b = c;
+            }
+        }
+        ok = WriteFile(hOut, bitmap, (DWORD)INDEX_BITMAP_BYTES, &written, NULL);
+    }
+
+    free(bitmap);
+    CloseHandle(hOut);
+
+    if (!ok || !MoveFileExW(tempPath, index->sidecarPath, MOVEFILE_REPLACE_EXISTING)) {
+        DeleteFileW(tempPath);
+        return 1;
+    }
+    return Index_MapSidecar(index) ? 0 : 1;
+}
+
+SlateIndex* Index_Open(const WCHAR* filePath, const void* data, const struct SlateMap* window, size_t len, BOOL isUtf8) {
+    if (!filePath || (!data && !window) || len == 0) return NULL;
+
+    WIN32_FILE_ATTRIBUTE_DATA attrs;
+    if (!GetFileAttributesExW(filePath, GetFileExInfoStandard, &attrs)) return NULL;
+
+    SlateIndex* index = (SlateIndex*)calloc(1, sizeof(SlateIndex));
+    if (!index) return NULL;
+
+    index->data = data;
+    index->len = len;
+    index->isUtf8 = isUtf8;
+    index->fileSize = ((ULONGLONG)attrs.nFileSizeHigh << 32) | attrs.nFileSizeLow;
+    index->lastWrite = attrs.ftLastWriteTime;
+
+    if (!Slate_BuildCachePath(L"Index", filePath, L"idx", index->sidecarPath, _countof(index->sidecarPath))) {
+        free(index);
+        return NULL;
+    }
+
+    if (!Index_MapSidecar(index)) {
+        index->window = data ? NULL : Map_Clone(window);
+        index->hThread = (data || index->window) ? CreateThread(NULL, 0, Index_BuildThread, index, 0, NULL) : NULL;
+        if (!index->hThread) {
+            Map_Close(index->window);
+            free(index);
+            return NULL;
+        }
+    }
+    return index;
+}
+
+void Index_Close(SlateIndex* index) {
+    if (!index) return;
+
+    if (index->hThread) {
+        InterlockedExchange(&index->cancel, 1);
+        WaitForSingleObject(index->hThread, INFINITE);
+        CloseHandle(index->hThread);
+    }
+    Map_Close(index->window);
+    if (index->view) UnmapViewOfFile(index->view);
+    if (index->hMap) CloseHandle(index->hMap);
+    if (index->hFile) CloseHandle(index->hFile);
+    free(index);
+}
+
+BOOL Index_IsReady(SlateIndex* index) {
+    return index && index->ready;
+}
+
+size_t Index_HashPattern(const WCHAR* pattern, size_t len, UINT32* outHashes) {
+    if (!pattern || len < 3 || len > INDEX_MAX_PATTERN) return 0;
+
+    for (size_t i = 0; i + 2 < len; i++) {
+        outHashes[i] = HashTrigram(FoldUnit(pattern[i]), FoldUnit(pattern[i + 1]), FoldUnit(pattern[i + 2]));
+    }
+    return len - 2;
+}
+
+BOOL Index_BlockMayMatch(SlateIndex* index, size_t block, const UINT32* hashes, size_t hashCount) {
+    if (!Index_IsReady(index) || block >= index->blockCount) return TRUE;
+
+    const BYTE* bitmap = index->bitmaps + block * INDEX_BITMAP_BYTES;
+    for (size_t i = 0; i < hashCount; i++) {
+        if (!(bitmap[hashes[i] >> 3] & (1u << (hashes[i] & 7)))) return FALSE;
+    }
+    return TRUE;
+}
@@ -0,0 +1,36 @@
+#ifndef SLATE_INDEX_H
+#define SLATE_INDEX_H
+
+#include <windows.h>
+
+// Trigram block index over the read-only original buffer. Each block of the buffer gets a
+// bitmap of the (hashed, case-folded) trigrams that start in it, so a search only scans the
+// blocks whose bitmaps contain every trigram of the pattern.
+#define INDEX_MIN_FILE_BYTES (64ULL * 1024 * 1024) // Smaller files scan fast enough linearly
+#define INDEX_BLOCK_SHIFT    22                    // 4M units per block
+#define INDEX_BUCKET_BITS    17                    // 128 Kbit trigram bitmap per block
+#define INDEX_MAX_PATTERN    256                   // Longest pattern the index can answer for
+
+typedef struct SlateIndex SlateIndex;
+
+// Builds %LOCALAPPDATA%\Slate\<subdir>\<hash of the full path>.<ext>, creating the folders.
+// Shared by the index sidecars and the edit journals.
+BOOL Slate_BuildCachePath(const WCHAR* subdir, const WCHAR* filePath, const WCHAR* ext, WCHAR* out, size_t outCount);
+
+struct SlateMap;
+
+// Opens the cached sidecar for the file, or starts building it on a background thread.
+// 'data' must stay mapped until Index_Close; a windowed original passes NULL and its
+// window, of which the builder takes its own views.
+SlateIndex* Index_Open(const WCHAR* filePath, const void* data, const struct SlateMap* window, size_t len, BOOL isUtf8);
+void        Index_Close(SlateIndex* index);
+BOOL        Index_IsReady(SlateIndex* index);
+
+// Hashes the pattern's trigrams into outHashes (room for INDEX_MAX_PATTERN entries).
+// Returns 0 when the pattern is too short or too long for the index to help.
+size_t      Index_HashPattern(const WCHAR* pattern, size_t len, UINT32* outHashes);
+
+// FALSE only when no match of the hashed pattern can start inside the block
+BOOL        Index_BlockMayMatch(SlateIndex* index, size_t block, const UINT32* hashes, size_t hashCount);
+
+#endif
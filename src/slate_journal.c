@@ -0,0 +1,370 @@
+#include "slate_journal.h"
+#include "slate_index.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define JOURNAL_MAGIC       0x4E4A4C53 // "SLJN"
+#define JOURNAL_VERSION     1
+#define JOURNAL_MAX_PAYLOAD 0x7FFFFFFEu
+
+enum {
+    JOURNAL_OP_INSERT = 1,
+    JOURNAL_OP_DELETE,
+    JOURNAL_OP_UNDO,
+    JOURNAL_OP_REDO,
+    JOURNAL_OP_REPLACE_ALL
+};
+
+#define JOURNAL_FLAG_CASE  1
+#define JOURNAL_FLAG_WORD  2
+#define JOURNAL_FLAG_RANGE 4
+
+typedef struct {
+    DWORD     magic;
+    DWORD     version;
+    ULONGLONG fileSize;      // Identity of the original: size, last write time and decoded length
+    FILETIME  lastWrite;
+    ULONGLONG originalLen;
+    DWORD     encoding;
+    DWORD     reserved;
+} JournalHeader;
+
+typedef struct {
+    DWORD     op;
+    DWORD     flags;         // Search options for Replace All
+    ULONGLONG offset;        // Edit position, or range start for Replace All
+    ULONGLONG length;        // Units inserted or deleted, or range end for Replace All
+    DWORD     payloadBytes;  // Inserted text, or pattern length + pattern + replacement
+    DWORD     checksum;      // FNV-1a over the record (this field zeroed) and its payload
+} JournalRecord;
+
+struct SlateJournal {
+    WCHAR path[MAX_PATH];
+    HANDLE hFile;
+    BYTE* buf;               // Records not yet written
+    size_t used;
+    size_t capacity;
+};
+
+static DWORD Journal_Hash(DWORD hash, const void* data, size_t bytes) {
+    const BYTE* p = (const BYTE*)data;
+    for (size_t i = 0; i < bytes; i++) {
+        hash ^= p[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static BOOL Journal_GetIdentity(const WCHAR* filePath, const SlateDoc* doc, JournalHeader* out) {
+    WIN32_FILE_ATTRIBUTE_DATA attrs;
+    if (!filePath || !doc || !GetFileAttributesExW(filePath, GetFileExInfoStandard, &attrs)) return FALSE;
+
+    ZeroMemory(out, sizeof(*out));
+    out->magic = JOURNAL_MAGIC;
+    out->version = JOURNAL_VERSION;
+    out->fileSize = ((ULONGLONG)attrs.nFileSizeHigh << 32) | attrs.nFileSizeLow;
+    out->lastWrite = attrs.ftLastWriteTime;
+    out->originalLen = doc->original_len;
+    out->encoding = (DWORD)doc->encoding;
+    return TRUE;
+}
+
+static BOOL Journal_HeaderMatches(const JournalHeader* a, const JournalHeader* b) {
+    return a->magic == b->magic && a->version == b->version && a->fileSize == b->fileSize &&
+           CompareFileTime(&a->lastWrite, &b->lastWrite) == 0 &&
+           a->originalLen == b->originalLen && a->encoding == b->encoding;
+}
+
+static BOOL Journal_ApplyRecord(SlateDoc* doc, const JournalRecord* rec, const BYTE* payload) {
+    switch (rec->op) {
+        case JOURNAL_OP_INSERT:
+            if (rec->payloadBytes != rec->length * sizeof(WCHAR)) return FALSE;
+            return Doc_Insert(doc, (size_t)rec->offset, (const WCHAR*)payload, (size_t)rec->length);
+        case JOURNAL_OP_DELETE:
+            return Doc_Delete(doc, (size_t)rec->offset, (size_t)rec->length);
+        case JOURNAL_OP_UNDO:
+            return Doc_Undo(doc, 0, NULL);
+        case JOURNAL_OP_REDO:
+            return Doc_Redo(doc, 0, NULL);
+        case JOURNAL_OP_REPLACE_ALL: {
+            DWORD patternLen;
+            if (rec->payloadBytes < sizeof(DWORD)) return FALSE;
+            memcpy(&patternLen, payload, sizeof(DWORD));
+            size_t textBytes = rec->payloadBytes - sizeof(DWORD);
+            if ((textBytes % sizeof(WCHAR)) != 0 || patternLen > textBytes / sizeof(WCHAR)) return FALSE;
+
+            const WCHAR* pattern = (const WCHAR*)(payload + sizeof(DWORD));
+            DocSearchOptions options = {0};
+            options.caseSensitive = (rec->flags & JOURNAL_FLAG_CASE) != 0;
+            options.wholeWord = (rec->flags & JOURNAL_FLAG_WORD) != 0;
+            options.hasRange = (rec->flags & JOURNAL_FLAG_RANGE) != 0;
+            options.rangeStart = (size_t)rec->offset;
+            options.rangeEnd = (size_t)rec->length;
+            return Doc_ReplaceAll(doc, pattern, patternLen, pattern + patternLen,
+                                  textBytes / sizeof(WCHAR) - patternLen, &options, NULL, NULL);
+        }
+        default:
+            return FALSE;
+    }
+}
+
+/**
+ * Walks the intact records after the header, applying them to 'doc' when one is given.
+ * A torn or corrupt record (the crash hit mid-write) ends the walk. Returns the record
+ * count; *outEnd receives the file offset just past the last intact record.
+ */
+static size_t Journal_Scan(HANDLE hFile, SlateDoc* doc, ULONGLONG* outEnd) {
+    LARGE_INTEGER liPos;
+    liPos.QuadPart = sizeof(JournalHeader);
+    ULONGLONG end = sizeof(JournalHeader);
+    size_t count = 0;
+    BYTE* payload = NULL;
+    size_t payloadCap = 0;
+
+    if (SetFilePointerEx(hFile, liPos, NULL, FILE_BEGIN)) {
+        while (1) {
+            JournalRecord rec;
+            DWORD read = 0;
+            if (!ReadFile(hFile, &rec, sizeof(rec), &read, NULL) || read != sizeof(rec)) break;
+            if (rec.op < JOURNAL_OP_INSERT || rec.op > JOURNAL_OP_REPLACE_ALL || rec.payloadBytes > JOURNAL_MAX_PAYLOAD) break;
+
+            if (rec.payloadBytes > payloadCap) {
+                BYTE* grown = (BYTE*)realloc(payload, rec.payloadBytes);
+                if (!grown) break;
+                payload = grown;
+                payloadCap = rec.payloadBytes;
+            }
+            if (rec.payloadBytes > 0 &&
+                (!ReadFile(hFile, payload, rec.payloadBytes, &read, NULL) || read != rec.payloadBytes)) {
+                break;
+            }
+
+            DWORD checksum = rec.checksum;
+            rec.checksum = 0;
+            DWORD hash = Journal_Hash(2166136261u, &rec, sizeof(rec));
+            if (Journal_Hash(hash, payload, rec.payloadBytes) != checksum) break;
+            if (doc && !Journal_ApplyRecord(doc, &rec, payload)) break;
+
+            end += sizeof(rec) + rec.payloadBytes;
+            count++;
+        }
+    }
+
+    free(payload);
+    if (outEnd) *outEnd = end;
+    return count;
+}
+
+// Opens the journal of an unchanged original; NULL when there is none or it is stale
+static HANDLE Journal_OpenExisting(const WCHAR* filePath, const SlateDoc* doc) {
+    JournalHeader expected, header;
+    WCHAR path[MAX_PATH];
+    if (!Journal_GetIdentity(filePath, doc, &expected) ||
+        !Slate_BuildCachePath(L"Journal", filePath, L"jnl", path, _countof(path))) {
+        return INVALID_HANDLE_VALUE;
+    }
+
+    HANDLE hFile = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                               FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) return INVALID_HANDLE_VALUE;
+
+    DWORD read = 0;
+    if (!ReadFile(hFile, &header, sizeof(header), &read, NULL) || read != sizeof(header) ||
+        !Journal_HeaderMatches(&header, &expected)) {
+        CloseHandle(hFile);
+        return INVALID_HANDLE_VALUE;
+    }
+    return hFile;
+}
+
+size_t Journal_FindRecovery(const WCHAR* filePath, const SlateDoc* doc) {
+    HANDLE hFile = Journal_OpenExisting(filePath, doc);
+    if (hFile == INVALID_HANDLE_VALUE) return 0;
+    size_t count = Journal_Scan(hFile, NULL, NULL);
+    CloseHandle(hFile);
+    return count;
+}
+
+size_t Journal_Replay(const WCHAR* filePath, SlateDoc* doc) {
+    if (!doc || doc->journal) return 0; // Replaying into a journaled document would log everything twice
+
+    HANDLE hFile = Journal_OpenExisting(filePath, doc);
+    if (hFile == INVALID_HANDLE_VALUE) return 0;
+    size_t count = Journal_Scan(hFile, doc, NULL);
+    CloseHandle(hFile);
+    return count;
+}
+
+void Journal_Discard(const WCHAR* filePath) {
+    WCHAR path[MAX_PATH];
+    if (filePath && Slate_BuildCachePath(L"Journal", filePath, L"jnl", path, _countof(path))) {
+        DeleteFileW(path);
+    }
+}
+
+SlateJournal* Journal_Open(const WCHAR* filePath, const SlateDoc* doc) {
+    JournalHeader header;
+    if (!doc || !doc->hMapFile || !Journal_GetIdentity(filePath, doc, &header)) return NULL;
+
+    SlateJournal* journal = (SlateJournal*)calloc(1, sizeof(SlateJournal));
+    if (!journal) return NULL;
+    if (!Slate_BuildCachePath(L"Journal", filePath, L"jnl", journal->path, _countof(journal->path))) {
+        free(journal);
+        return NULL;
+    }
+
+    journal->hFile = CreateFileW(journal->path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+                                 OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (journal->hFile == INVALID_HANDLE_VALUE) {
+        free(journal);
+        return NULL;
+    }
+
+    // Keep the intact records of a journal for this same original (a recovered session);
+    // anything else is overwritten
+    JournalHeader existing;
+    DWORD io = 0;
+    ULONGLONG end = 0;
+    if (ReadFile(journal->hFile, &existing, sizeof(existing), &io, NULL) && io == sizeof(existing) &&
+        Journal_HeaderMatches(&existing, &header)) {
+        Journal_Scan(journal->hFile, NULL, &end);
+    }
+
+    LARGE_INTEGER liPos;
+    liPos.QuadPart = 0;
+    if (end == 0) {
+        if (!SetFilePointerEx(journal->hFile, liPos, NULL, FILE_BEGIN) ||
+            !WriteFile(journal->hFile, &header, sizeof(header), &io, NULL) || io != sizeof(header)) {
+            Journal_Close(journal, TRUE);
+            return NULL;
+        }
+        end = sizeof(header);
+    }
+
+    // Drop a torn tail so new records follow the last intact one
+    liPos.QuadPart = (LONGLONG)end;
+    SetFilePointerEx(journal->hFile, liPos, NULL, FILE_BEGIN);
+    SetEndOfFile(journal->hFile);
+    return journal;
+}
+
+// A journal with a gap would replay wrongly; stop journaling this document
+static void Journal_Abandon(SlateJournal* journal) {
+    journal->used = 0;
+    CloseHandle(journal->hFile);
+    journal->hFile = INVALID_HANDLE_VALUE;
+    DeleteFileW(journal->path);
+}
+
+static void Journal_Write(SlateJournal* journal) {
+    if (journal->used == 0 || journal->hFile == INVALID_HANDLE_VALUE) return;
+
+    DWORD written = 0;
+    if (!WriteFile(journal->hFile, journal->buf, (DWORD)journal->used, &written, NULL) || written != journal->used) {
+        Journal_Abandon(journal);
+    }
+    journal->used = 0;
+}
+
+void Journal_Flush(SlateJournal* journal) {
+    if (!journal) return;
+    Journal_Write(journal);
+    if (journal->hFile != INVALID_HANDLE_VALUE) FlushFileBuffers(journal->hFile);
+}
+
+void Journal_Close(SlateJournal* journal, BOOL discard) {
+    if (!journal) return;
+    if (!discard) Journal_Write(journal);
+    if (journal->hFile != INVALID_HANDLE_VALUE) CloseHandle(journal->hFile);
+    if (discard) DeleteFileW(journal->path);
+    free(journal->buf);
+    free(journal);
+}
+
+// Buffers one record; the payload is up to three pieces laid end to end
+static void Journal_Append(SlateJournal* journal, DWORD op, DWORD flags, ULONGLONG offset, ULONGLONG length,
+                           const void* p1, size_t n1, const void* p2, size_t n2, const void* p3, size_t n3) {
+    if (!journal || journal->hFile == INVALID_HANDLE_VALUE) return;
+
+    size_t payloadBytes = n1 + n2 + n3;
+    if (payloadBytes > JOURNAL_MAX_PAYLOAD) {
+        // Too large to record; without it the journal could not be replayed faithfully
+        Journal_Abandon(journal);
+        return;
+    }
+
+    size_t need = journal->used + sizeof(JournalRecord) + payloadBytes;
+    if (need > journal->capacity) {
+        size_t newCap = journal->capacity ? journal->capacity * 2 : 64 * 1024;
+        while (newCap < need) newCap *= 2;
+        BYTE* grown = (BYTE*)realloc(journal->buf, newCap);
+        if (!grown) {
+            // Write what we have and buffer the record in the space that frees; a record that
+            // does not fit even then cannot be logged
+            Journal_Write(journal);
+            if (journal->hFile == INVALID_HANDLE_VALUE) return;
+            if (sizeof(JournalRecord) + payloadBytes > journal->capacity) {
+                Journal_Abandon(journal);
+                return;
+            }
+        } else {
+            journal->buf = grown;
+            journal->capacity = newCap;
+        }
+    }
+
+    JournalRecord rec = {0};
+    rec.op = op;
+    rec.flags = flags;
+    rec.offset = offset;
+    rec.length = length;
+    rec.payloadBytes = (DWORD)payloadBytes;
+    DWORD hash = Journal_Hash(2166136261u, &rec, sizeof(rec));
+    hash = Journal_Hash(hash, p1, n1);
+    hash = Journal_Hash(hash, p2, n2);
+    rec.checksum = Journal_Hash(hash, p3, n3);
+
+    BYTE* dst = journal->buf + journal->used;
+    memcpy(dst, &rec, sizeof(rec));
+    dst += sizeof(rec);
+    if (n1) memcpy(dst, p1, n1);
+    if (n2) memcpy(dst + n1, p2, n2);
+    if (n3) memcpy(dst + n1 + n2, p3, n3);
+    journal->used += sizeof(rec) + payloadBytes;
+
+    if (journal->used >= JOURNAL_WRITE_BYTES) Journal_Write(journal);
+}
+
+void Journal_LogInsert(SlateJournal* journal, size_t offset, const WCHAR* text, size_t len) {
+    Journal_Append(journal, JOURNAL_OP_INSERT, 0, offset, len, text, len * sizeof(WCHAR), NULL, 0, NULL, 0);
+}
+
+void Journal_LogDelete(SlateJournal* journal, size_t offset, size_t len) {
+    Journal_Append(journal, JOURNAL_OP_DELETE, 0, offset, len, NULL, 0, NULL, 0, NULL, 0);
+}
+
+void Journal_LogUndo(SlateJournal* journal) {
+    Journal_Append(journal, JOURNAL_OP_UNDO, 0, 0, 0, NULL, 0, NULL, 0, NULL, 0);
+}
+
+void Journal_LogRedo(SlateJournal* journal) {
+    Journal_Append(journal, JOURNAL_OP_REDO, 0, 0, 0, NULL, 0, NULL, 0, NULL, 0);
+}
+
+void Journal_LogReplaceAll(SlateJournal* journal, const WCHAR* pattern, size_t patternLen,
+                           const WCHAR* replacement, size_t replacementLen, const DocSearchOptions* options) {
+    DWORD flags = 0;
+    ULONGLONG rangeStart = 0, rangeEnd = 0;
+    if (options) {
+        if (options->caseSensitive) flags |= JOURNAL_FLAG_CASE;
+        if (options->wholeWord) flags |= JOURNAL_FLAG_WORD;
+        if (options->hasRange) {
+            flags |= JOURNAL_FLAG_RANGE;
+            rangeStart = options->rangeStart;
+            rangeEnd = options->rangeEnd;
+        }
+    }
+    DWORD len32 = (DWORD)patternLen;
+    Journal_Append(journal, JOURNAL_OP_REPLACE_ALL, flags, rangeStart, rangeEnd, &len32, sizeof(len32),
+                   pattern, patternLen * sizeof(WCHAR), replacement, replacementLen * sizeof(WCHAR));
+}
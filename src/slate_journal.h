@@ -0,0 +1,33 @@
+#ifndef SLATE_JOURNAL_H
+#define SLATE_JOURNAL_H
+
+#include "slate_doc.h"
+
+// Append-only journal of the edits made to a mapped document since it was opened or saved.
+// Records are buffered in memory and written at idle, so logging a keystroke is a memcpy;
+// after a crash the journal is replayed against the same, unchanged original file.
+#define JOURNAL_WRITE_BYTES (4 * 1024 * 1024) // Buffered records are written early past this
+
+typedef struct SlateJournal SlateJournal;
+
+// Continues the file's journal if it belongs to this exact original, otherwise starts a new one
+SlateJournal* Journal_Open(const WCHAR* filePath, const SlateDoc* doc);
+// Writes out buffered records; 'discard' deletes the journal file (the edits were saved or abandoned)
+void          Journal_Close(SlateJournal* journal, BOOL discard);
+// Writes buffered records and flushes them to disk; call when the editor goes idle
+void          Journal_Flush(SlateJournal* journal);
+
+void          Journal_LogInsert(SlateJournal* journal, size_t offset, const WCHAR* text, size_t len);
+void          Journal_LogDelete(SlateJournal* journal, size_t offset, size_t len);
+void          Journal_LogUndo(SlateJournal* journal);
+void          Journal_LogRedo(SlateJournal* journal);
+void          Journal_LogReplaceAll(SlateJournal* journal, const WCHAR* pattern, size_t patternLen,
+                                    const WCHAR* replacement, size_t replacementLen, const DocSearchOptions* options);
+
+// Number of intact records a previous session left for this exact original (0 if none)
+size_t        Journal_FindRecovery(const WCHAR* filePath, const SlateDoc* doc);
+// Applies those records to a freshly opened document; returns how many were replayed
+size_t        Journal_Replay(const WCHAR* filePath, SlateDoc* doc);
+void          Journal_Discard(const WCHAR* filePath);
+
+#endif
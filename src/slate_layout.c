@@ -0,0 +1,929 @@
+#include "slate_layout.h"
+#include <stdlib.h>
+#include <string.h>
+
+static long long Layout_TabStop(const LayoutMeasure* m, long long x) {
+    return (m->tabWidth > 0) ? (x / m->tabWidth + 1) * m->tabWidth : x;
+}
+
+// Advance of the character at text[*i], stepping *i past the second half of a surrogate pair
+static int Layout_Advance(const LayoutMeasure* m, const WCHAR* text, size_t len, size_t* i) {
+    if (m->fixedWidth) return m->fixedWidth;
+    uint32_t cp = text[*i];
+    if (cp >= 0xD800 && cp <= 0xDBFF && *i + 1 < len && text[*i + 1] >= 0xDC00 && text[*i + 1] <= 0xDFFF) {
+        cp = 0x10000 + ((cp - 0xD800) << 10) + (text[*i + 1] - 0xDC00);
+        (*i)++;
+    }
+    return m->advance(m->context, cp);
+}
+
+long long Layout_MeasureRun(const LayoutMeasure* m, const WCHAR* text, size_t len, long long x0, long long* outX) {
+    long long x = x0;
+    if (outX) outX[0] = x0;
+
+    // Fixed metrics: runs between tabs are counted, not measured
+    if (m->fixedWidth && !outX) {
+        size_t i = 0;
+        while (i < len) {
+            size_t segEnd = i;
+            while (segEnd < len && text[segEnd] != L'\t') segEnd++;
+            x += (long long)(segEnd - i) * m->fixedWidth;
+            if (segEnd < len) x = Layout_TabStop(m, x);
+            i = segEnd + 1;
+        }
+        return x;
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        if (text[i] == L'\t') {
+            x = Layout_TabStop(m, x);
+        } else {
+            size_t first = i;
+            int advance = Layout_Advance(m, text, len, &i);
+            if (outX && i > first) outX[i] = x;
+            x += advance;
+        }
+        if (outX) outX[i + 1] = x;
+    }
+    return x;
+}
+
+size_t Layout_ColumnAtX(const LayoutMeasure* m, const WCHAR* text, size_t len, long long x0, long long targetX) {
+    long long x = x0;
+    size_t i = 0;
+    while (i < len && x < targetX) {
+        size_t next = i;
+        long long nextX = (text[i] == L'\t') ? Layout_TabStop(m, x) : x + Layout_Advance(m, text, len, &next);
+        next++;
+        // Boundaries only get further right, so the first one past targetX ends the search
+        if (nextX >= targetX) return (nextX - targetX < targetX - x) ? next : i;
+        x = nextX;
+        i = next;
+    }
+    return i;
+}
+
+size_t Layout_BreakLine(const LayoutMeasure* m, const WCHAR* text, size_t len, int width,
+                        WrapRow** rows, size_t* capacity) {
+    size_t used = 0;
+    return Layout_BreakRows(m, text, len, 0, TRUE, width, rows, capacity, &used);
+}
+
+size_t Layout_BreakRows(const LayoutMeasure* m, const WCHAR* text, size_t len, size_t origin,
+                        BOOL lineEnds, int width, WrapRow** rows, size_t* capacity, size_t* outUsed) {
+    // A surrogate pair cut by the end of the text is measured whole by the next call
+    if (!lineEnds && len > 0 && text[len - 1] >= 0xD800 && text[len - 1] <= 0xDBFF) len--;
+
+    size_t count = 0;
+    size_t pos = 0;
+    *outUsed = 0;
+    for (;;) {
+        size_t start = pos;
+        if (origin + pos > 0) {
+            while (start < len && (text[start] == L' ' || text[start] == L'\t')) start++;
+        }
+
+        // Walk forward until a character no longer fits, remembering the last place to break
+        long long x = 0;
+        size_t i = start, next = start, breakAt = 0;
+        while (i < len) {
+            next = i;
+            long long nextX = (text[i] == L'\t') ? Layout_TabStop(m, x) : x + Layout_Advance(m, text, len, &next);
+            next++;
+            if (nextX > width) break;
+            if (text[i] == L' ' || text[i] == L'\t' || text[i] == L'-') breakAt = next;
+            x = nextX;
+            i = next;
+        }
+
+        size_t end;
+        if (i < len) {
+            // Break after the last space, tab or hyphen that fits, or force one at the limit
+            end = breakAt ? breakAt : (i > start) ? i : next;
+        } else if (lineEnds) {
+            end = len;
+        } else {
+            break;
+        }
+
+        if (count >= *capacity) {
+            size_t newCap = *capacity ? *capacity * 2 : 64;
+            WrapRow* grown = (WrapRow*)realloc(*rows, newCap * sizeof(WrapRow));
+            if (!grown) return 0;
+            *rows = grown;
+            *capacity = newCap;
+        }
+        WrapRow* row = &(*rows)[count++];
+        row->start = origin + start;
+        row->length = end - start;
+        pos = end;
+        *outUsed = pos;
+        if (pos >= len) break;
+    }
+    return count;
+}
+
+// Fenwick trees here are 1-based arrays over n values. Adds newValue - oldValue to value i.
+static void Fenwick_Add(size_t* tree, size_t n, size_t i, size_t oldValue, size_t newValue) {
+    for (i++; i <= n; i += i & (0 - i)) tree[i] = tree[i] - oldValue + newValue;
+}
+
+// Sum of the first i values
+static size_t Fenwick_Prefix(const size_t* tree, size_t i) {
+    size_t sum = 0;
+    for (; i > 0; i -= i & (0 - i)) sum += tree[i];
+    return sum;
+}
+
+// Extends a tree over n values by one more, 'value'. Node n + 1 covers the values after
+// n + 1 - lowbit, which all precede it.
+static void Fenwick_Push(size_t* tree, size_t n, size_t value) {
+    size_t node = n + 1;
+    size_t sum = 0;
+    for (size_t i = n; i > node - (node & (0 - node)); i -= i & (0 - i)) sum += tree[i];
+    tree[node] = sum + value;
+}
+
+// Builds a tree in place over the n values already in tree[1..n], in linear time
+static void Fenwick_Build(size_t* tree, size_t n) {
+    for (size_t i = 1; i <= n; i++) {
+        size_t parent = i + (i & (0 - i));
+        if (parent <= n) tree[parent] += tree[i];
+    }
+}
+
+// How many leading values sum to at most 'target', by descending the tree, and their sum
+static size_t Fenwick_Descend(const size_t* tree, size_t n, size_t target, size_t* outSum) {
+    size_t step = 1;
+    while (step * 2 <= n) step *= 2;
+    size_t i = 0, sum = 0;
+    for (; step > 0; step /= 2) {
+        if (i + step <= n && sum + tree[i + step] <= target) {
+            i += step;
+            sum += tree[i];
+        }
+    }
+    *outSum = sum;
+    return i;
+}
+
+void Layout_WidthsClear(LineWidths* w) {
+    for (size_t b = 0; b < w->blockCount; b++) free(w->blocks[b]);
+    free(w->blocks);
+    free(w->blockLines);
+    free(w->blockMax);
+    memset(w, 0, sizeof(LineWidths));
+}
+
+// The block holding 'line', which must be below count, and the line's index in it
+static WidthBlock* Layout_WidthsFind(const LineWidths* w, size_t line, size_t* outBlock, size_t* outIndex) {
+    size_t before = 0;
+    size_t b = Fenwick_Descend(w->blockLines, w->blockCount, line, &before);
+    *outBlock = b;
+    *outIndex = line - before;
+    return w->blocks[b];
+}
+
+int Layout_WidthsGet(const LineWidths* w, size_t line) {
+    if (line >= w->count) return LAYOUT_UNMEASURED;
+    size_t b, index;
+    return Layout_WidthsFind(w, line, &b, &index)->widths[index];
+}
+
+int Layout_WidthsMax(const LineWidths* w) {
+    return (w->blockCount && w->blockMax[1] > 0) ? w->blockMax[1] : 0;
+}
+
+// Finds a block's widest line again once lines in it have changed
+static void Layout_WidthsBlockMax(WidthBlock* block) {
+    int widest = LAYOUT_UNMEASURED;
+    for (size_t i = 0; i < block->count; i++) {
+        if (block->widths[i] > widest) widest = block->widths[i];
+    }
+    block->widest = widest;
+}
+
+// Rebuilds the max tree over the blocks; leaves past the last block stay unmeasured
+static void Layout_WidthsBuildMax(LineWidths* w) {
+    for (size_t b = 0; b < w->maxLeaves; b++) {
+        w->blockMax[w->maxLeaves + b] = (b < w->blockCount) ? w->blocks[b]->widest : LAYOUT_UNMEASURED;
+    }
+    for (size_t node = w->maxLeaves - 1; node >= 1; node--) {
+        int a = w->blockMax[2 * node], b = w->blockMax[2 * node + 1];
+        w->blockMax[node] = (a > b) ? a : b;
+    }
+}
+
+// Rebuilds both trees over the blocks once blocks have come or gone
+static void Layout_WidthsBuildTop(LineWidths* w) {
+    for (size_t b = 1; b <= w->blockCount; b++) w->blockLines[b] = w->blocks[b - 1]->count;
+    Fenwick_Build(w->blockLines, w->blockCount);
+    Layout_WidthsBuildMax(w);
+}
+
+// Brings the max tree up to date with block b's widest line
+static void Layout_WidthsUpdateMax(LineWidths* w, size_t b) {
+    size_t node = w->maxLeaves + b;
+    w->blockMax[node] = w->blocks[b]->widest;
+    for (node /= 2; node >= 1; node /= 2) {
+        int a = w->blockMax[2 * node], c = w->blockMax[2 * node + 1];
+        int best = (a > c) ? a : c;
+        if (w->blockMax[node] == best) break;
+        w->blockMax[node] = best;
+    }
+}
+
+// Brings both trees up to date with block b's line count and widest line
+static void Layout_WidthsUpdateTop(LineWidths* w, size_t b) {
+    size_t oldLines = Fenwick_Prefix(w->blockLines, b + 1) - Fenwick_Prefix(w->blockLines, b);
+    Fenwick_Add(w->blockLines, w->blockCount, b, oldLines, w->blocks[b]->count);
+    Layout_WidthsUpdateMax(w, b);
+}
+
+static BOOL Layout_WidthsReserveBlocks(LineWidths* w, size_t blocks) {
+    if (blocks <= w->blockCapacity) return TRUE;
+
+    size_t capacity = w->blockCapacity ? w->blockCapacity : 16;
+    while (capacity < blocks) capacity *= 2;
+    WidthBlock** grownBlocks = (WidthBlock**)realloc(w->blocks, capacity * sizeof(WidthBlock*));
+    if (!grownBlocks) return FALSE;
+    w->blocks = grownBlocks;
+    size_t* grownLines = (size_t*)realloc(w->blockLines, (capacity + 1) * sizeof(size_t));
+    if (!grownLines) return FALSE;
+    w->blockLines = grownLines;
+    int* grownMax = (int*)realloc(w->blockMax, 2 * capacity * sizeof(int));
+    if (!grownMax) return FALSE;
+    w->blockMax = grownMax;
+    w->blockCapacity = capacity;
+
+    // The capacity is a power of two, so it is also the max tree's leaf count
+    w->maxLeaves = capacity;
+    Layout_WidthsBuildMax(w);
+    return TRUE;
+}
+
+// Covers lines up to 'lines' with unmeasured ones, filling each block before the next
+static BOOL Layout_WidthsExtend(LineWidths* w, size_t lines) {
+    while (w->count < lines) {
+        size_t b = w->blockCount;
+        if (b == 0 || w->blocks[b - 1]->count == WIDTH_BLOCK_LINES) {
+            if (!Layout_WidthsReserveBlocks(w, b + 1)) return FALSE;
+            WidthBlock* block = (WidthBlock*)malloc(sizeof(WidthBlock));
+            if (!block) return FALSE;
+            block->count = 0;
+            block->widest = LAYOUT_UNMEASURED;
+            w->blocks[b] = block;
+            Fenwick_Push(w->blockLines, b, 0);
+            w->blockCount++;
+        } else {
+            b--;
+        }
+
+        WidthBlock* block = w->blocks[b];
+        size_t n = WIDTH_BLOCK_LINES - block->count;
+        if (n > lines - w->count) n = lines - w->count;
+        for (size_t i = 0; i < n; i++) block->widths[block->count + i] = LAYOUT_UNMEASURED;
+        Fenwick_Add(w->blockLines, w->blockCount, b, block->count, block->count + n);
+        block->count += n;
+        w->count += n;
+    }
+    return TRUE;
+}
+
+BOOL Layout_WidthsSet(LineWidths* w, size_t line, int width) {
+    if (line >= w->count && !Layout_WidthsExtend(w, line + 1)) return FALSE;
+
+    size_t b, index;
+    WidthBlock* block = Layout_WidthsFind(w, line, &b, &index);
+    int old = block->widths[index];
+    if (old == LAYOUT_UNMEASURED && width != LAYOUT_UNMEASURED) w->measured++;
+    else if (old != LAYOUT_UNMEASURED && width == LAYOUT_UNMEASURED) w->measured--;
+    block->widths[index] = width;
+
+    // Only narrowing the widest line of a block needs the block looked over again
+    int widest = block->widest;
+    if (width > widest) block->widest = width;
+    else if (old == widest && width < old) Layout_WidthsBlockMax(block);
+    if (block->widest != widest) Layout_WidthsUpdateMax(w, b);
+    return TRUE;
+}
+
+// Merges block b + 1 into block b if either is under a quarter full and both fit in one,
+// so deletions do not leave a trail of near-empty blocks. Returns TRUE if it did.
+static BOOL Layout_WidthsMergeBlocks(LineWidths* w, size_t b) {
+    if (b + 1 >= w->blockCount) return FALSE;
+    WidthBlock* left = w->blocks[b];
+    WidthBlock* right = w->blocks[b + 1];
+    if (left->count + right->count > WIDTH_BLOCK_LINES ||
+        (left->count >= WIDTH_BLOCK_LINES / 4 && right->count >= WIDTH_BLOCK_LINES / 4)) {
+        return FALSE;
+    }
+    memcpy(left->widths + left->count, right->widths, right->count * sizeof(int));
+    left->count += right->count;
+    if (right->widest > left->widest) left->widest = right->widest;
+    free(right);
+    memmove(w->blocks + b + 1, w->blocks + b + 2, (w->blockCount - b - 2) * sizeof(WidthBlock*));
+    w->blockCount--;
+    return TRUE;
+}
+
+/**
+ * Lines [line, line + removed) become 'inserted' unmeasured lines, with line below count.
+ * As for the wrap layout, only the blocks the splice touches are rewritten, their kept lines
+ * and the new ones spread evenly over as few blocks as hold them, and the trees over the
+ * blocks are rebuilt only when blocks come or go. Returns FALSE, with nothing changed, when
+ * out of memory.
+ */
+static BOOL Layout_WidthsSpliceBlocks(LineWidths* w, size_t line, size_t removed, size_t inserted) {
+    // The kept lines after the splice are the tail of block e; when they start a block, that
+    // block is left alone
+    size_t b, j, e, je;
+    Layout_WidthsFind(w, line, &b, &j);
+    if (line + removed < w->count) {
+        Layout_WidthsFind(w, line + removed, &e, &je);
+    } else {
+        e = w->blockCount - 1;
+        je = w->blocks[e]->count;
+    }
+    if (je == 0 && e > b) je = w->blocks[--e]->count;
+    size_t span = e - b + 1;
+    size_t tailLen = w->blocks[e]->count - je;
+
+    size_t total = j + inserted + tailLen;
+    size_t blocks = (total + WIDTH_BLOCK_LINES - 1) / WIDTH_BLOCK_LINES;
+    size_t per = blocks ? (total + blocks - 1) / blocks : 0;
+
+    // Everything that can fail comes first
+    int* tail = tailLen ? (int*)malloc(tailLen * sizeof(int)) : NULL;
+    WidthBlock** dest = blocks ? (WidthBlock**)malloc(blocks * sizeof(WidthBlock*)) : NULL;
+    BOOL ok = (!tailLen || tail) && (!blocks || dest) && Layout_WidthsReserveBlocks(w, w->blockCount - span + blocks);
+    size_t fresh = 0;
+    for (size_t d = 0; ok && d < blocks; d++) {
+        if (d < span) {
+            dest[d] = w->blocks[b + d];
+        } else if ((dest[d] = (WidthBlock*)malloc(sizeof(WidthBlock))) != NULL) {
+            fresh++;
+        } else {
+            ok = FALSE;
+        }
+    }
+    if (!ok) {
+        for (size_t d = span; d < span + fresh; d++) free(dest[d]);
+        free(dest);
+        free(tail);
+        return FALSE;
+    }
+
+    // Set the tail aside and forget the removed lines
+    if (tailLen) memcpy(tail, w->blocks[e]->widths + je, tailLen * sizeof(int));
+    for (size_t k = b; k < b + span; k++) {
+        const WidthBlock* block = w->blocks[k];
+        size_t from = (k == b) ? j : 0;
+        size_t to = (k == e) ? je : block->count;
+        for (size_t i = from; i < to; i++) {
+            if (block->widths[i] != LAYOUT_UNMEASURED) w->measured--;
+        }
+    }
+
+    // Lay the kept and new lines out again; the head of block b is already in place as far
+    // as it stays in its block
+    for (size_t i = 0; i < total; i++) {
+        int* to = &dest[i / per]->widths[i % per];
+        if (i < j) {
+            if (i >= per) *to = w->blocks[b]->widths[i];
+        } else if (i < j + inserted) {
+            *to = LAYOUT_UNMEASURED;
+        } else {
+            *to = tail[i - j - inserted];
+        }
+    }
+    for (size_t d = 0; d < blocks; d++) {
+        dest[d]->count = (d + 1 < blocks) ? per : total - per * (blocks - 1);
+        Layout_WidthsBlockMax(dest[d]);
+    }
+    for (size_t d = blocks; d < span; d++) free(w->blocks[b + d]);
+
+    BOOL moved = (blocks != span);
+    if (moved) {
+        memmove(w->blocks + b + blocks, w->blocks + b + span, (w->blockCount - b - span) * sizeof(WidthBlock*));
+        w->blockCount = w->blockCount - span + blocks;
+    }
+    if (blocks) memcpy(w->blocks + b, dest, blocks * sizeof(WidthBlock*));
+    free(dest);
+    free(tail);
+
+    if (blocks) moved |= Layout_WidthsMergeBlocks(w, b + blocks - 1);
+    if (b > 0) moved |= Layout_WidthsMergeBlocks(w, b - 1);
+    if (moved) {
+        Layout_WidthsBuildTop(w);
+    } else {
+        for (size_t d = 0; d < blocks; d++) Layout_WidthsUpdateTop(w, b + d);
+    }
+    w->count = w->count - removed + inserted;
+    return TRUE;
+}
+
+void Layout_WidthsSplice(LineWidths* w, size_t line, size_t removed, size_t inserted) {
+    if (line < w->scanNext) w->scanNext = line;
+    if (line >= w->count) return;
+    if (removed > w->count - line) removed = w->count - line;
+
+    if (removed == inserted) {
+        // Same line count: nothing moves
+        size_t b, index;
+        Layout_WidthsFind(w, line, &b, &index);
+        for (size_t i = 0; i < removed; b++, index = 0) {
+            WidthBlock* block = w->blocks[b];
+            for (; index < block->count && i < removed; index++, i++) {
+                if (block->widths[index] == LAYOUT_UNMEASURED) continue;
+                block->widths[index] = LAYOUT_UNMEASURED;
+                w->measured--;
+            }
+            int widest = block->widest;
+            Layout_WidthsBlockMax(block);
+            if (block->widest != widest) Layout_WidthsUpdateMax(w, b);
+        }
+        return;
+    }
+    if (!Layout_WidthsSpliceBlocks(w, line, removed, inserted)) {
+        // Without room for the new lines, everything from the edit on is measured again
+        Layout_WidthsTruncate(w, line);
+    }
+}
+
+void Layout_WidthsTruncate(LineWidths* w, size_t line) {
+    if (line < w->scanNext) w->scanNext = line;
+    w->complete = FALSE;
+    if (line >= w->count) return;
+
+    size_t b, index;
+    Layout_WidthsFind(w, line, &b, &index);
+    for (size_t k = b; k < w->blockCount; k++) {
+        WidthBlock* block = w->blocks[k];
+        for (size_t i = (k == b) ? index : 0; i < block->count; i++) {
+            if (block->widths[i] != LAYOUT_UNMEASURED) w->measured--;
+        }
+        if (k > b || index == 0) free(block);
+    }
+    w->blockCount = index ? b + 1 : b;
+    if (index) {
+        w->blocks[b]->count = index;
+        Layout_WidthsBlockMax(w->blocks[b]);
+    }
+    Layout_WidthsBuildTop(w);
+    w->count = line;
+}
+
+static size_t Layout_WrapWeight(const WrapLine* line) {
+    if (line->rowCount == 0) return line->estimate;
+    return line->rows ? line->rowCount + line->estimate : line->rowCount;
+}
+
+// Makes a line pending, counted as 'estimate' rows
+static void Layout_WrapFreeLine(WrapLine* line, size_t estimate) {
+    free(line->rows);
+    memset(line, 0, sizeof(WrapLine));
+    line->estimate = (estimate > 0) ? estimate : 1;
+}
+
+// Rebuilds a block's tree and row total once lines have moved in it
+static void Layout_WrapBuildBlock(WrapBlock* block) {
+    block->rows = 0;
+    for (size_t i = 1; i <= block->count; i++) {
+        block->tree[i] = Layout_WrapWeight(&block->lines[i - 1]);
+        block->rows += block->tree[i];
+    }
+    Fenwick_Build(block->tree, block->count);
+}
+
+// Rebuilds the trees over the blocks once blocks have come or gone
+static void Layout_WrapBuildTop(WrapLayout* layout) {
+    for (size_t b = 1; b <= layout->blockCount; b++) {
+        layout->blockRows[b] = layout->blocks[b - 1]->rows;
+        layout->blockLines[b] = layout->blocks[b - 1]->count;
+    }
+    Fenwick_Build(layout->blockRows, layout->blockCount);
+    Fenwick_Build(layout->blockLines, layout->blockCount);
+}
+
+// Brings the trees over the blocks up to date with block b's totals
+static void Layout_WrapUpdateTop(WrapLayout* layout, size_t b) {
+    const WrapBlock* block = layout->blocks[b];
+    size_t oldRows = Fenwick_Prefix(layout->blockRows, b + 1) - Fenwick_Prefix(layout->blockRows, b);
+    size_t oldLines = Fenwick_Prefix(layout->blockLines, b + 1) - Fenwick_Prefix(layout->blockLines, b);
+    Fenwick_Add(layout->blockRows, layout->blockCount, b, oldRows, block->rows);
+    Fenwick_Add(layout->blockLines, layout->blockCount, b, oldLines, block->count);
+}
+
+// The block holding 'line' and the line's index in it; for line == count, the block count
+// and 0, and NULL
+static WrapLine* Layout_WrapFind(const WrapLayout* layout, size_t line, size_t* outBlock, size_t* outIndex) {
+    size_t before = 0;
+    size_t b = Fenwick_Descend(layout->blockLines, layout->blockCount, line, &before);
+    *outBlock = b;
+    *outIndex = (b < layout->blockCount) ? line - before : 0;
+    return (b < layout->blockCount) ? &layout->blocks[b]->lines[line - before] : NULL;
+}
+
+// Line 'index' of block b, which counted as oldWeight rows, has changed
+static void Layout_WrapReweigh(WrapLayout* layout, size_t b, size_t index, size_t oldWeight) {
+    WrapBlock* block = layout->blocks[b];
+    size_t newWeight = Layout_WrapWeight(&block->lines[index]);
+    Fenwick_Add(block->tree, block->count, index, oldWeight, newWeight);
+    Fenwick_Add(layout->blockRows, layout->blockCount, b, block->rows, block->rows - oldWeight + newWeight);
+    block->rows = block->rows - oldWeight + newWeight;
+}
+
+static BOOL Layout_WrapReserveBlocks(WrapLayout* layout, size_t blocks) {
+    if (blocks <= layout->blockCapacity) return TRUE;
+
+    size_t capacity = layout->blockCapacity ? layout->blockCapacity : 16;
+    while (capacity < blocks) capacity *= 2;
+    WrapBlock** grownBlocks = (WrapBlock**)realloc(layout->blocks, capacity * sizeof(WrapBlock*));
+    if (!grownBlocks) return FALSE;
+    layout->blocks = grownBlocks;
+    size_t* grownRows = (size_t*)realloc(layout->blockRows, (capacity + 1) * sizeof(size_t));
+    if (!grownRows) return FALSE;
+    layout->blockRows = grownRows;
+    size_t* grownLines = (size_t*)realloc(layout->blockLines, (capacity + 1) * sizeof(size_t));
+    if (!grownLines) return FALSE;
+    layout->blockLines = grownLines;
+    layout->blockCapacity = capacity;
+    return TRUE;
+}
+
+void Layout_WrapClear(WrapLayout* layout) {
+    for (size_t b = 0; b < layout->blockCount; b++) {
+        WrapBlock* block = layout->blocks[b];
+        for (size_t i = 0; i < block->count; i++) free(block->lines[i].rows);
+        free(block);
+    }
+    free(layout->blocks);
+    free(layout->blockRows);
+    free(layout->blockLines);
+    memset(layout, 0, sizeof(WrapLayout));
+}
+
+const WrapRow* Layout_WrapRows(const WrapLayout* layout, size_t line, size_t* outCount) {
+    size_t b, index;
+    const WrapLine* wl = (line < layout->count) ? Layout_WrapFind(layout, line, &b, &index) : NULL;
+    if (!wl || wl->rowCount == 0) return NULL;
+    *outCount = wl->rowCount;
+    return wl->rows ? wl->rows : &wl->single;
+}
+
+BOOL Layout_WrapLineDone(const WrapLayout* layout, size_t line) {
+    size_t b, index;
+    const WrapLine* wl = (line < layout->count) ? Layout_WrapFind(layout, line, &b, &index) : NULL;
+    if (!wl || wl->rowCount == 0) return FALSE;
+    return !wl->rows || wl->estimate == 0;
+}
+
+size_t Layout_WrapLineRows(const WrapLayout* layout, size_t line) {
+    size_t b, index;
+    const WrapLine* wl = (line < layout->count) ? Layout_WrapFind(layout, line, &b, &index) : NULL;
+    return wl ? Layout_WrapWeight(wl) : 0;
+}
+
+BOOL Layout_WrapAppend(WrapLayout* layout, size_t estimate) {
+    // Appending fills each block before starting the next
+    size_t b = layout->blockCount;
+    if (b == 0 || layout->blocks[b - 1]->count == WRAP_BLOCK_LINES) {
+        if (!Layout_WrapReserveBlocks(layout, b + 1)) return FALSE;
+        WrapBlock* block = (WrapBlock*)malloc(sizeof(WrapBlock));
+        if (!block) return FALSE;
+        block->count = 0;
+        block->rows = 0;
+        layout->blocks[b] = block;
+        Fenwick_Push(layout->blockRows, b, 0);
+        Fenwick_Push(layout->blockLines, b, 0);
+        layout->blockCount++;
+    } else {
+        b--;
+    }
+
+    WrapBlock* block = layout->blocks[b];
+    WrapLine* wl = &block->lines[block->count];
+    memset(wl, 0, sizeof(WrapLine));
+    Layout_WrapFreeLine(wl, estimate);
+    Fenwick_Push(block->tree, block->count, wl->estimate);
+    block->count++;
+    block->rows += wl->estimate;
+    Layout_WrapUpdateTop(layout, b);
+    layout->count++;
+    layout->pendingEnd = layout->count;
+    return TRUE;
+}
+
+BOOL Layout_WrapSetLine(WrapLayout* layout, size_t line, const WrapRow* rows, size_t rowCount) {
+    if (line > layout->count || rowCount == 0) return FALSE;
+
+    WrapRow* copy = NULL;
+    if (rowCount > 1) {
+        copy = (WrapRow*)malloc(rowCount * sizeof(WrapRow));
+        if (!copy) return FALSE;
+        memcpy(copy, rows, rowCount * sizeof(WrapRow));
+    }
+
+    if (line == layout->count && !Layout_WrapAppend(layout, 1)) {
+        free(copy);
+        return FALSE;
+    }
+
+    size_t b, index;
+    WrapLine* wl = Layout_WrapFind(layout, line, &b, &index);
+    size_t oldWeight = Layout_WrapWeight(wl);
+    free(wl->rows);
+    wl->rows = copy;
+    if (copy) wl->estimate = 0;
+    else wl->single = rows[0];
+    wl->rowCount = rowCount;
+    Layout_WrapReweigh(layout, b, index, oldWeight);
+    return TRUE;
+}
+
+BOOL Layout_WrapAddRows(WrapLayout* layout, size_t line, const WrapRow* rows, size_t rowCount, size_t tail) {
+    if (line >= layout->count || Layout_WrapLineDone(layout, line)) return FALSE;
+
+    size_t b, index;
+    WrapLine* wl = Layout_WrapFind(layout, line, &b, &index);
+    size_t have = wl->rowCount;
+    size_t total = have + rowCount;
+    if (total == 0) return FALSE;
+    if (have == 0 && tail == 0 && rowCount == 1) return Layout_WrapSetLine(layout, line, rows, 1);
+
+    // A line laid out in part holds its rows in a power-of-two array, so adding rows a chunk
+    // at a time copies them only as often as the array doubles
+    size_t capacity = 1;
+    while (capacity < total) capacity *= 2;
+    size_t oldCapacity = 1;
+    while (have && oldCapacity < have) oldCapacity *= 2;
+    if (!wl->rows || capacity != oldCapacity || tail == 0) {
+        WrapRow* grown = (WrapRow*)realloc(wl->rows, ((tail == 0) ? total : capacity) * sizeof(WrapRow));
+        if (!grown) return FALSE;
+        wl->rows = grown;
+    }
+    memcpy(wl->rows + have, rows, rowCount * sizeof(WrapRow));
+
+    size_t oldWeight = Layout_WrapWeight(wl);
+    wl->rowCount = total;
+    wl->estimate = tail;
+    Layout_WrapReweigh(layout, b, index, oldWeight);
+    return TRUE;
+}
+
+void Layout_WrapTrimLine(WrapLayout* layout, size_t line, size_t offset) {
+    if (line < layout->scanNext) layout->scanNext = line;
+    if (line >= layout->count) return;
+    if (layout->pendingEnd <= line) layout->pendingEnd = line + 1;
+
+    // A row's break depends on the text up to the first character that did not fit on it,
+    // which lies in the row after; so a row is kept only if the next one ends by 'offset'
+    size_t b, index;
+    WrapLine* wl = Layout_WrapFind(layout, line, &b, &index);
+    size_t oldWeight = Layout_WrapWeight(wl);
+    size_t keep = 0;
+    if (wl->rows) {
+        while (keep + 1 < wl->rowCount && wl->rows[keep + 1].start + wl->rows[keep + 1].length <= offset) keep++;
+    }
+    if (keep == 0) {
+        if (wl->rowCount == 0) return;
+        Layout_WrapFreeLine(wl, oldWeight);
+        return;
+    }
+
+    // Back to the power-of-two array Layout_WrapAddRows expects of a line laid out in part
+    size_t capacity = 1;
+    while (capacity < keep) capacity *= 2;
+    WrapRow* rows = (WrapRow*)realloc(wl->rows, capacity * sizeof(WrapRow));
+    if (!rows) {
+        Layout_WrapFreeLine(wl, oldWeight);
+        return;
+    }
+    wl->rows = rows;
+    wl->rowCount = keep;
+    wl->estimate = (oldWeight > keep) ? oldWeight - keep : 1;
+    Layout_WrapReweigh(layout, b, index, oldWeight);
+}
+
+// Merges block b + 1 into block b if either is under a quarter full and both fit in one,
+// so deletions do not leave a trail of near-empty blocks. Returns TRUE if it did.
+static BOOL Layout_WrapMergeBlocks(WrapLayout* layout, size_t b) {
+    if (b + 1 >= layout->blockCount) return FALSE;
+    WrapBlock* left = layout->blocks[b];
+    WrapBlock* right = layout->blocks[b + 1];
+    if (left->count + right->count > WRAP_BLOCK_LINES ||
+        (left->count >= WRAP_BLOCK_LINES / 4 && right->count >= WRAP_BLOCK_LINES / 4)) {
+        return FALSE;
+    }
+    memcpy(left->lines + left->count, right->lines, right->count * sizeof(WrapLine));
+    left->count += right->count;
+    Layout_WrapBuildBlock(left);
+    free(right);
+    memmove(layout->blocks + b + 1, layout->blocks + b + 2, (layout->blockCount - b - 2) * sizeof(WrapBlock*));
+    layout->blockCount--;
+    return TRUE;
+}
+
+/**
+ * Lines [line, line + removed) become 'inserted' pending lines, the first counted as 'first'
+ * rows and the rest as 'share'. Only the blocks the splice touches are rewritten: the lines
+ * kept before and after it in them, and the new ones, are spread evenly over as few blocks
+ * as hold them, so a block that overflows splits in two rather than spilling a line at a
+ * time. The trees over the blocks are rebuilt only when blocks come or go. Returns FALSE,
+ * with nothing changed, when out of memory.
+ */
+static BOOL Layout_WrapSpliceBlocks(WrapLayout* layout, size_t line, size_t removed, size_t inserted,
+                                    size_t first, size_t share) {
+    // The kept lines before the splice are the head of block b; at a block boundary, the
+    // previous block's lines, so an insertion there goes at the end of the previous block
+    size_t b, j, e, je;
+    Layout_WrapFind(layout, line, &b, &j);
+    if (j == 0 && b > 0) j = layout->blocks[--b]->count;
+    Layout_WrapFind(layout, line + removed, &e, &je);
+    if (je == 0 && e > b) je = layout->blocks[--e]->count;
+    size_t span = layout->blockCount ? e - b + 1 : 0;
+    size_t tailLen = span ? layout->blocks[e]->count - je : 0;
+
+    size_t total = j + inserted + tailLen;
+    size_t blocks = (total + WRAP_BLOCK_LINES - 1) / WRAP_BLOCK_LINES;
+    size_t per = blocks ? (total + blocks - 1) / blocks : 0;
+
+    // Everything that can fail comes first
+    WrapLine* tail = tailLen ? (WrapLine*)malloc(tailLen * sizeof(WrapLine)) : NULL;
+    WrapBlock** dest = blocks ? (WrapBlock**)malloc(blocks * sizeof(WrapBlock*)) : NULL;
+    BOOL ok = (!tailLen || tail) && (!blocks || dest) && Layout_WrapReserveBlocks(layout, layout->blockCount - span + blocks);
+    size_t fresh = 0;
+    for (size_t d = 0; ok && d < blocks; d++) {
+        if (d < span) {
+            dest[d] = layout->blocks[b + d];
+        } else if ((dest[d] = (WrapBlock*)malloc(sizeof(WrapBlock))) != NULL) {
+            fresh++;
+        } else {
+            ok = FALSE;
+        }
+    }
+    if (!ok) {
+        for (size_t d = span; d < span + fresh; d++) free(dest[d]);
+        free(dest);
+        free(tail);
+        return FALSE;
+    }
+
+    // Set the tail aside and drop the removed lines
+    if (tailLen) memcpy(tail, layout->blocks[e]->lines + je, tailLen * sizeof(WrapLine));
+    for (size_t k = b; k < b + span; k++) {
+        WrapBlock* block = layout->blocks[k];
+        size_t from = (k == b) ? j : 0;
+        size_t to = (k == e) ? je : block->count;
+        for (size_t i = from; i < to; i++) free(block->lines[i].rows);
+    }
+
+    // Lay the kept and new lines out again; the head of block b is already in place as far
+    // as it stays in its block. Blocks after it held only removed lines and the tail.
+    for (size_t i = 0; i < total; i++) {
+        WrapLine* to = &dest[i / per]->lines[i % per];
+        if (i < j) {
+            if (i >= per) *to = layout->blocks[b]->lines[i];
+        } else if (i < j + inserted) {
+            memset(to, 0, sizeof(WrapLine));
+            Layout_WrapFreeLine(to, (i == j) ? first : share);
+        } else {
+            *to = tail[i - j - inserted];
+        }
+    }
+    for (size_t d = 0; d < blocks; d++) {
+        dest[d]->count = (d + 1 < blocks) ? per : total - per * (blocks - 1);
+        Layout_WrapBuildBlock(dest[d]);
+    }
+    for (size_t d = blocks; d < span; d++) free(layout->blocks[b + d]);
+
+    BOOL moved = (blocks != span);
+    if (moved) {
+        memmove(layout->blocks + b + blocks, layout->blocks + b + span,
+                (layout->blockCount - b - span) * sizeof(WrapBlock*));
+        layout->blockCount = layout->blockCount - span + blocks;
+    }
+    if (blocks) memcpy(layout->blocks + b, dest, blocks * sizeof(WrapBlock*));
+    free(dest);
+    free(tail);
+
+    if (blocks) moved |= Layout_WrapMergeBlocks(layout, b + blocks - 1);
+    if (b > 0) moved |= Layout_WrapMergeBlocks(layout, b - 1);
+    if (moved) {
+        Layout_WrapBuildTop(layout);
+    } else {
+        for (size_t d = 0; d < blocks; d++) Layout_WrapUpdateTop(layout, b + d);
+    }
+    layout->count = layout->count - removed + inserted;
+    return TRUE;
+}
+
+void Layout_WrapSplice(WrapLayout* layout, size_t line, size_t removed, size_t inserted) {
+    if (line < layout->scanNext) layout->scanNext = line;
+    if (line > layout->count) return;
+    if (removed > layout->count - line) removed = layout->count - line;
+
+    // Pending lines after the splice move with it
+    if (layout->pendingEnd > line + removed) {
+        layout->pendingEnd = layout->pendingEnd - removed + inserted;
+    } else if (layout->pendingEnd < line + inserted) {
+        layout->pendingEnd = line + inserted;
+    }
+
+    // The new lines share out the rows of the old ones until they are laid out, so the rows
+    // below stay put in the meantime
+    size_t oldRows = Layout_WrapRowOfLine(layout, line + removed) - Layout_WrapRowOfLine(layout, line);
+    size_t share = inserted ? oldRows / inserted : 0;
+    size_t first = inserted ? oldRows - share * (inserted - 1) : 0;
+
+    if (removed == inserted) {
+        // Same line count: nothing moves
+        for (size_t i = 0; i < removed; i++) {
+            size_t b, index;
+            WrapLine* wl = Layout_WrapFind(layout, line + i, &b, &index);
+            size_t oldWeight = Layout_WrapWeight(wl);
+            Layout_WrapFreeLine(wl, (i == 0) ? first : share);
+            Layout_WrapReweigh(layout, b, index, oldWeight);
+        }
+        return;
+    }
+    if (!Layout_WrapSpliceBlocks(layout, line, removed, inserted, first, share)) {
+        Layout_WrapTruncate(layout, line);
+    }
+}
+
+void Layout_WrapTruncate(WrapLayout* layout, size_t line) {
+    if (line < layout->scanNext) layout->scanNext = line;
+    layout->complete = FALSE;
+    if (line >= layout->count) return;
+
+    size_t b, index;
+    Layout_WrapFind(layout, line, &b, &index);
+    for (size_t k = b; k < layout->blockCount; k++) {
+        WrapBlock* block = layout->blocks[k];
+        for (size_t i = (k == b) ? index : 0; i < block->count; i++) free(block->lines[i].rows);
+        if (k > b || index == 0) free(block);
+    }
+
+    // Tree nodes up to a value only cover values before it, so those over what is left stand
+    layout->blockCount = index ? b + 1 : b;
+    if (index) {
+        WrapBlock* block = layout->blocks[b];
+        block->count = index;
+        block->rows = Fenwick_Prefix(block->tree, index);
+        Layout_WrapUpdateTop(layout, b);
+    }
+    layout->count = line;
+}
+
+size_t Layout_WrapRowOfLine(const WrapLayout* layout, size_t line) {
+    if (line > layout->count) line = layout->count;
+    size_t b, index;
+    Layout_WrapFind(layout, line, &b, &index);
+    size_t rows = Fenwick_Prefix(layout->blockRows, b);
+    if (b < layout->blockCount) rows += Fenwick_Prefix(layout->blocks[b]->tree, index);
+    return rows;
+}
+
+size_t Layout_WrapLineAtRow(const WrapLayout* layout, size_t row, size_t* outLineRow) {
+    if (layout->count == 0) {
+        *outLineRow = 0;
+        return 0;
+    }
+
+    // Descend the trees, taking every block and then every line whose rows still end at or
+    // before 'row'
+    size_t blockRow = 0;
+    size_t b = Fenwick_Descend(layout->blockRows, layout->blockCount, row, &blockRow);
+
+    // Past the last row: the last line
+    if (b == layout->blockCount) {
+        const WrapBlock* last = layout->blocks[b - 1];
+        *outLineRow = blockRow - Layout_WrapWeight(&last->lines[last->count - 1]);
+        return layout->count - 1;
+    }
+    size_t lineRow = 0;
+    size_t index = Fenwick_Descend(layout->blocks[b]->tree, layout->blocks[b]->count, row - blockRow, &lineRow);
+    *outLineRow = blockRow + lineRow;
+    return Fenwick_Prefix(layout->blockLines, b) + index;
+}
+
+size_t Layout_WrapRowInLine(const WrapLayout* layout, size_t line, size_t offset) {
+    size_t rowCount = 0;
+    const WrapRow* rows = Layout_WrapRows(layout, line, &rowCount);
+    if (!rows) return 0;
+
+    // First row whose end is at or past offset; at a row boundary the earlier row wins
+    size_t low = 0, high = rowCount - 1;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (offset > rows[mid].start + rows[mid].length) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+size_t Layout_WrapTotalRows(const WrapLayout* layout) {
+    return Layout_WrapRowOfLine(layout, layout->count);
+}
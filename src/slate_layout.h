@@ -0,0 +1,162 @@
+#ifndef SLATE_LAYOUT_H
+#define SLATE_LAYOUT_H
+
+// The layout code has no GDI in it, so it also builds headless (bench/bench_layout.c)
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <wchar.h>
+typedef int BOOL;
+typedef unsigned short WCHAR;   // UTF-16 code units, as on Windows
+#define TRUE  1
+#define FALSE 0
+#endif
+#include <stddef.h>
+#include <stdint.h>
+
+// How text is measured. A character is as wide as advance() says, or fixedWidth when that
+// is nonzero (advance is then never called, and a run is measured by counting); a surrogate
+// pair is passed as one code point. A tab moves to the next multiple of tabWidth from the
+// line origin, as TabbedTextOutW does.
+typedef struct LayoutMeasure {
+    int (*advance)(void* context, uint32_t codePoint);
+    void* context;
+    int fixedWidth;
+    int tabWidth;
+} LayoutMeasure;
+
+// x after text that starts at x0 on its line. outX (optional, len + 1 entries) receives the
+// x of every character boundary; the second half of a surrogate pair shares the first's.
+long long Layout_MeasureRun(const LayoutMeasure* m, const WCHAR* text, size_t len, long long x0, long long* outX);
+// Character boundary nearest targetX in text that starts at x0 on its line
+size_t    Layout_ColumnAtX(const LayoutMeasure* m, const WCHAR* text, size_t len, long long x0, long long targetX);
+
+// Pixel width of every logical line of an unwrapped document, measured lazily. Widths are
+// held in blocks of up to WIDTH_BLOCK_LINES, each knowing its widest line, under a Fenwick
+// tree over their line counts and a max tree over their widest lines, so the widest line is
+// known without rescanning and an edit rewrites only the blocks it touches. Lines not
+// measured yet count as zero, so the maximum is a lower bound until every line has been
+// measured.
+#define LAYOUT_UNMEASURED (-1)
+#define WIDTH_BLOCK_LINES 1024
+
+typedef struct WidthBlock {
+    size_t count;           // Lines held, at least one
+    int widest;             // Widest of them, or LAYOUT_UNMEASURED
+    int widths[WIDTH_BLOCK_LINES];
+} WidthBlock;
+
+typedef struct LineWidths {
+    WidthBlock** blocks;
+    size_t blockCount;
+    size_t blockCapacity;
+    size_t* blockLines;     // 1-based Fenwick tree over the line counts of blocks[0..blockCount)
+    int* blockMax;          // blockMax[1] is the root; block b is leaf blockMax[maxLeaves + b]
+    size_t maxLeaves;       // blockCapacity, a power of two
+    size_t count;           // Lines covered; lines past it are unmeasured
+    size_t measured;        // Lines below count with a width
+    size_t scanNext;        // No unmeasured line lies before it
+    BOOL complete;          // count is every line of the document
+} LineWidths;
+
+void   Layout_WidthsClear(LineWidths* w);
+int    Layout_WidthsGet(const LineWidths* w, size_t line);
+BOOL   Layout_WidthsSet(LineWidths* w, size_t line, int width);
+// Lines [line, line + removed) become 'inserted' unmeasured lines
+void   Layout_WidthsSplice(LineWidths* w, size_t line, size_t removed, size_t inserted);
+// Lines from 'line' on are dropped, and the document may have more lines than count
+void   Layout_WidthsTruncate(LineWidths* w, size_t line);
+// Widest measured line, 0 when none is
+int    Layout_WidthsMax(const LineWidths* w);
+
+// Word-wrapped layout: the visual rows of each logical line, with a Fenwick tree over row
+// counts so the row a line starts on is a prefix sum. Lines not laid out yet are pending and
+// count as an estimated number of rows; a very long line may be laid out in part, its first
+// rows known and the rest estimated. Edits splice lines in and out and leave them pending,
+// the edited line keeping its rows ahead of the edit; only pending lines are broken into
+// rows again.
+typedef struct WrapRow {
+    size_t start;           // Offset within the logical line
+    size_t length;
+} WrapRow;
+
+typedef struct WrapLine {
+    size_t rowCount;        // Rows laid out, 0 while the line is pending
+    union {
+        WrapRow single;     // The only row, when rows is NULL
+        size_t estimate;    // Rows a pending line counts as, at least one; when rows is set,
+                            // rows still expected after them, 0 once the line is laid out whole
+    };
+    WrapRow* rows;          // The rows, unless the line is laid out whole on one row
+} WrapLine;
+
+// Lines are held in blocks of up to WRAP_BLOCK_LINES, each with a Fenwick tree over its
+// lines' row counts, under two more over the blocks' row and line totals. A splice moves
+// lines within the blocks it touches, and blocks only come or go once one fills or empties.
+#define WRAP_BLOCK_LINES 1024
+
+typedef struct WrapBlock {
+    size_t count;                       // Lines held, at least one
+    size_t rows;                        // Rows they count as
+    size_t tree[WRAP_BLOCK_LINES + 1];  // 1-based over the row counts of lines[0..count)
+    WrapLine lines[WRAP_BLOCK_LINES];
+} WrapBlock;
+
+typedef struct WrapLayout {
+    WrapBlock** blocks;
+    size_t blockCount;
+    size_t blockCapacity;
+    size_t* blockRows;      // 1-based over the rows of blocks[0..blockCount)
+    size_t* blockLines;     // 1-based over their line counts
+    size_t count;           // Lines covered; the document may have more
+    size_t scanNext;        // No pending line lies before it
+    size_t pendingEnd;      // Nor from it up to count
+    BOOL complete;          // count is every line of the document
+    int width;              // Wrap width the rows were made for
+} WrapLayout;
+
+// Breaks a line into rows no wider than width, preferring to break after a space, tab or
+// hyphen; rows after the first skip their leading blanks, and an empty line is one row. The
+// rows go to *rows, grown as needed. Returns the row count, 0 when out of memory.
+size_t         Layout_BreakLine(const LayoutMeasure* m, const WCHAR* text, size_t len, int width,
+                                WrapRow** rows, size_t* capacity);
+// The same in one forward pass over part of a line: text starts at line offset 'origin', 0 or
+// where the line's rows so far end. Unless lineEnds, text stops short of the line's end and
+// the row running into its end is left for the next call, which starts at origin + *outUsed.
+// Returns 0 when out of memory, or when no row ends within text.
+size_t         Layout_BreakRows(const LayoutMeasure* m, const WCHAR* text, size_t len, size_t origin,
+                                BOOL lineEnds, int width, WrapRow** rows, size_t* capacity, size_t* outUsed);
+
+void           Layout_WrapClear(WrapLayout* layout);
+// Rows of a line laid out whole or in part, or NULL
+const WrapRow* Layout_WrapRows(const WrapLayout* layout, size_t line, size_t* outCount);
+// TRUE when every row of the line is laid out
+BOOL           Layout_WrapLineDone(const WrapLayout* layout, size_t line);
+// Rows the line counts as, laid out or estimated
+size_t         Layout_WrapLineRows(const WrapLayout* layout, size_t line);
+// Covers one more line, pending
+BOOL           Layout_WrapAppend(WrapLayout* layout, size_t estimate);
+// Replaces a line's rows (copied); line may be count, which appends it
+BOOL           Layout_WrapSetLine(WrapLayout* layout, size_t line, const WrapRow* rows, size_t rowCount);
+// Adds rows after those a line not yet laid out whole has; 'tail' is the rows still expected
+// after them, 0 when these finish the line
+BOOL           Layout_WrapAddRows(WrapLayout* layout, size_t line, const WrapRow* rows, size_t rowCount, size_t tail);
+// An edit at 'offset' within a line: the rows that cannot depend on text from there on are
+// kept, and the line is laid out again after them
+void           Layout_WrapTrimLine(WrapLayout* layout, size_t line, size_t offset);
+// Lines [line, line + removed) become 'inserted' pending lines, sharing the rows of the old;
+// line may be count, which appends them
+void           Layout_WrapSplice(WrapLayout* layout, size_t line, size_t removed, size_t inserted);
+// Lines from 'line' on are dropped, and the document may have more lines than count
+void           Layout_WrapTruncate(WrapLayout* layout, size_t line);
+// Visual row that line starts on, counting every line before it; line is at most count
+size_t         Layout_WrapRowOfLine(const WrapLayout* layout, size_t line);
+size_t         Layout_WrapTotalRows(const WrapLayout* layout);
+// Line holding visual row 'row' and the row it starts on, by descending the tree; past the
+// last row, the last line
+size_t         Layout_WrapLineAtRow(const WrapLayout* layout, size_t row, size_t* outLineRow);
+// Row of a laid-out line holding 'offset' within the line, by binary search over its breaks;
+// at a row boundary the earlier row wins, and past the rows laid out so far, the last one
+size_t         Layout_WrapRowInLine(const WrapLayout* layout, size_t line, size_t offset);
+
+#endif
@@ -0,0 +1,130 @@
+#include "slate_map.h"
+#include <stdlib.h>
+
+typedef struct {
+    const BYTE* base;            // NULL while the slot is free
+    ULONGLONG start;             // File offset of base, a multiple of MAP_VIEW_BYTES
+    size_t size;
+    ULONGLONG lastUse;
+} MapView;
+
+struct SlateMap {
+    HANDLE hMap;
+    ULONGLONG offset;            // File offset of position 0
+    ULONGLONG length;
+    MapView views[MAP_MAX_VIEWS];
+    size_t recent;               // Slot of the last hit, checked first
+    ULONGLONG clock;
+};
+
+SlateMap* Map_Open(HANDLE hMap, ULONGLONG offset, ULONGLONG length) {
+    if (!hMap) return NULL;
+
+    SlateMap* map = (SlateMap*)calloc(1, sizeof(SlateMap));
+    if (!map) return NULL;
+    HANDLE hProcess = GetCurrentProcess();
+    if (!DuplicateHandle(hProcess, hMap, hProcess, &map->hMap, 0, FALSE, DUPLICATE_SAME_ACCESS)) {
+        free(map);
+        return NULL;
+    }
+    map->offset = offset;
+    map->length = length;
+    return map;
+}
+
+SlateMap* Map_Clone(const SlateMap* map) {
+    return map ? Map_Open(map->hMap, map->offset, map->length) : NULL;
+}
+
+const BYTE* Map_Get(SlateMap* map, ULONGLONG pos, size_t bytes) {
+    if (!map || bytes > MAP_SPAN_BYTES || pos + bytes > map->length) return NULL;
+    ULONGLONG at = map->offset + pos;
+
+    // Scans and decoders mostly stay inside the view they used last
+    MapView* view = &map->views[map->recent];
+    if (view->base && at >= view->start && at + bytes <= view->start + view->size) {
+        view->lastUse = ++map->clock;
+        return view->base + (at - view->start);
+    }
+
+    size_t victim = 0;
+    for (size_t i = 0; i < MAP_MAX_VIEWS; i++) {
+        view = &map->views[i];
+        if (view->base && at >= view->start && at + bytes <= view->start + view->size) {
+            view->lastUse = ++map->clock;
+            map->recent = i;
+            return view->base + (at - view->start);
+        }
+        if (!view->base || (map->views[victim].base && view->lastUse < map->views[victim].lastUse)) victim = i;
+    }
+
+    // Views start on a view boundary and run a span past it, so the run fits in this one
+    view = &map->views[victim];
+    if (view->base) UnmapViewOfFile(view->base);
+    view->base = NULL;
+
+    ULONGLONG start = at - (at % MAP_VIEW_BYTES);
+    ULONGLONG end = start + MAP_VIEW_BYTES + MAP_SPAN_BYTES;
+    if (end > map->offset + map->length) end = map->offset + map->length;
+    const BYTE* base = (const BYTE*)MapViewOfFile(map->hMap, FILE_MAP_READ, (DWORD)(start >> 32), (DWORD)start,
+                                                  (SIZE_T)(end - start));
+    if (!base) return NULL;
+
+    view->base = base;
+    view->start = start;
+    view->size = (size_t)(end - start);
+    view->lastUse = ++map->clock;
+    map->recent = victim;
+    return base + (at - start);
+}
+
+typedef BOOL (WINAPI *PrefetchVirtualMemoryFn)(HANDLE, ULONG_PTR, PWIN32_MEMORY_RANGE_ENTRY, ULONG);
+
+static volatile LONG s_prefetchOff;
+
+// NULL when read-ahead is unavailable (before Windows 8) or switched off
+static PrefetchVirtualMemoryFn Map_GetPrefetch(void) {
+    // Resolved once; threads racing here store the same pointer
+    static PrefetchVirtualMemoryFn prefetch;
+    static volatile LONG resolved;
+    if (!resolved) {
+        prefetch = (PrefetchVirtualMemoryFn)GetProcAddress(GetModuleHandleW(L"kernel32.dll"), "PrefetchVirtualMemory");
+        InterlockedExchange(&resolved, 1);
+    }
+    return s_prefetchOff ? NULL : prefetch;
+}
+
+void Map_Prefetch(const void* address, size_t bytes) {
+    PrefetchVirtualMemoryFn prefetch = Map_GetPrefetch();
+    if (!prefetch || !address || bytes == 0) return;
+
+    WIN32_MEMORY_RANGE_ENTRY range = { (PVOID)address, bytes };
+    prefetch(GetCurrentProcess(), 1, &range, 0);
+}
+
+void Map_PrefetchRange(SlateMap* map, ULONGLONG pos, ULONGLONG bytes) {
+    // Mapping windows just to hint them is only worth it when the hint can be given
+    if (!map || !Map_GetPrefetch()) return;
+    if (pos >= map->length) return;
+    if (bytes > map->length - pos) bytes = map->length - pos;
+
+    while (bytes > 0) {
+        size_t run = (bytes > MAP_SPAN_BYTES) ? MAP_SPAN_BYTES : (size_t)bytes;
+        Map_Prefetch(Map_Get(map, pos, run), run);
+        pos += run;
+        bytes -= run;
+    }
+}
+
+void Map_SetPrefetch(BOOL enabled) {
+    InterlockedExchange(&s_prefetchOff, enabled ? 0 : 1);
+}
+
+void Map_Close(SlateMap* map) {
+    if (!map) return;
+    for (size_t i = 0; i < MAP_MAX_VIEWS; i++) {
+        if (map->views[i].base) UnmapViewOfFile(map->views[i].base);
+    }
+    CloseHandle(map->hMap);
+    free(map);
+}
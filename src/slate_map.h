@@ -0,0 +1,42 @@
+#ifndef SLATE_MAP_H
+#define SLATE_MAP_H
+
+#include <windows.h>
+
+// Windowed access to a file mapping that is too large to map in one view, or too large to
+// be worth holding in the address space whole. Views of MAP_VIEW_BYTES are mapped on demand,
+// each running MAP_SPAN_BYTES into the next, so any run of up to MAP_SPAN_BYTES is contiguous
+// in a single view. The MAP_MAX_VIEWS most recently used views stay mapped.
+#ifdef _WIN64
+#define MAP_VIEW_BYTES      (64 * 1024 * 1024)
+#define MAP_WHOLE_MAX_BYTES (1024ULL * 1024 * 1024)  // Larger files are windowed
+#else
+#define MAP_VIEW_BYTES      (16 * 1024 * 1024)
+#define MAP_WHOLE_MAX_BYTES (256ULL * 1024 * 1024)
+#endif
+#define MAP_SPAN_BYTES      (16 * 1024 * 1024)       // Covers an index block of UTF-16 text
+#define MAP_MAX_VIEWS       4
+
+typedef struct SlateMap SlateMap;
+
+// Windows onto bytes [offset, offset + length) of a file mapping. The mapping handle is
+// duplicated, so the caller keeps its own. A SlateMap serves one thread; Map_Clone gives
+// another thread its own views of the same file.
+SlateMap*   Map_Open(HANDLE hMap, ULONGLONG offset, ULONGLONG length);
+SlateMap*   Map_Clone(const SlateMap* map);
+
+// Bytes [pos, pos + bytes) with bytes <= MAP_SPAN_BYTES, or NULL if they cannot be mapped.
+// The pointer stays valid until views for MAP_MAX_VIEWS other ranges have been mapped.
+const BYTE* Map_Get(SlateMap* map, ULONGLONG pos, size_t bytes);
+
+void        Map_Close(SlateMap* map);
+
+// Asks the memory manager to start reading [address, address + bytes) of a mapped view in
+// the background (PrefetchVirtualMemory, Windows 8 and later; a no-op before that)
+void        Map_Prefetch(const void* address, size_t bytes);
+// The same for bytes [pos, pos + bytes) of a windowed file, mapping the windows they lie in
+void        Map_PrefetchRange(SlateMap* map, ULONGLONG pos, ULONGLONG bytes);
+// Read-ahead is on by default; benchmarks switch it off to measure what it saves
+void        Map_SetPrefetch(BOOL enabled);
+
+#endif
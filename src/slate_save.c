@@ -0,0 +1,940 @@
+#include "slate_doc.h"
+#include "slate_map.h"
+#include "slate_utf.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define SAVE_BUFFER_BYTES (4 * 1024 * 1024)  // Staging buffer, page-aligned via VirtualAlloc
+#define SAVE_MAX_WRITE    (64 * 1024 * 1024) // Largest single WriteFile for pass-through spans
+#define SAVE_CHUNK_UNITS  (256 * 1024)       // Code units transcoded per step
+#define SAVE_IN_PLACE_MAX (4 * SAVE_BUFFER_BYTES) // Most an in-place save may rewrite on the UI thread
+
+typedef struct {
+    HANDLE hFile;
+    BYTE* buf;
+    size_t used;
+    WCHAR* scratch;          // SAVE_CHUNK_UNITS, for byte-swapping and decoding to UTF-16
+    BOOL ok;
+    DocSaveStats stats;
+    BOOL staged;             // Copy every span through buf, even large ones (in-place saves)
+    size_t unitsDone;        // Document units consumed so far, for progress reporting
+    size_t unitsTotal;
+    size_t nextReport;
+    void (*progress)(size_t unitsDone, size_t unitsTotal, void* ctx);
+    void* progressCtx;
+    DocEncoding encoding;    // Target encoding
+    UINT codePage;           // The document's, for a DOC_ENCODING_ANSI target
+    WCHAR pendingHigh;       // High surrogate that ended the last run, held for its low half
+} DocWriter;
+
+struct DocSaveJob {
+    SlateDoc* snapshot;
+    size_t revision;         // Document revision the snapshot was taken at
+    DocEncoding encoding;
+    WCHAR dir[MAX_PATH];
+    WCHAR targetPath[MAX_PATH];
+    WCHAR tempPath[MAX_PATH];
+    HANDLE hFile;            // The temp file, or the target itself for in-place saves
+    HANDLE hBackup;          // In-place saves over original text: the overwritten bytes, at tempPath
+    HANDLE hThread;
+    HWND hwndNotify;
+    UINT msg;
+    LONG lastPermille;
+    BOOL ok;
+    BOOL committed;          // Already renamed into place / rebased
+    DocSaveStats stats;
+
+    // In-place saves rewrite only the target's suffix from the first changed piece
+    BOOL inPlace;
+    BOOL appendOnly;         // Nothing before the end of the original text changed
+    const Piece* firstChanged; // In the snapshot; NULL when nothing changed
+    ULONGLONG writeOffset;   // File offset the suffix starts at
+};
+
+static BOOL Writer_WriteDirect(DocWriter* w, const void* data, size_t bytes) {
+    const BYTE* p = (const BYTE*)data;
+    while (w->ok && bytes > 0) {
+        DWORD chunk = (DWORD)((bytes > SAVE_MAX_WRITE) ? SAVE_MAX_WRITE : bytes);
+        DWORD written = 0;
+        if (!WriteFile(w->hFile, p, chunk, &written, NULL) || written != chunk) {
+            w->ok = FALSE;
+            break;
+        }
+        w->stats.bytesWritten += written;
+        p += chunk;
+        bytes -= chunk;
+    }
+    return w->ok;
+}
+
+static BOOL Writer_Flush(DocWriter* w) {
+    if (w->used > 0) {
+        Writer_WriteDirect(w, w->buf, w->used);
+        w->used = 0;
+    }
+    return w->ok;
+}
+
+// Copies bytes out as-is; spans larger than the staging buffer skip it entirely unless
+// the writer is staged, where the source may be the very file being overwritten
+static BOOL Writer_Put(DocWriter* w, const void* data, size_t bytes) {
+    if (!w->ok) return FALSE;
+    if (bytes >= SAVE_BUFFER_BYTES && !w->staged) {
+        return Writer_Flush(w) && Writer_WriteDirect(w, data, bytes);
+    }
+    const BYTE* p = (const BYTE*)data;
+    while (bytes > 0) {
+        if (w->used == SAVE_BUFFER_BYTES && !Writer_Flush(w)) return FALSE;
+        size_t n = SAVE_BUFFER_BYTES - w->used;
+        if (n > bytes) n = bytes;
+        memcpy(w->buf + w->used, p, n);
+        w->used += n;
+        p += n;
+        bytes -= n;
+    }
+    return TRUE;
+}
+
+// Returns room for 'bytes' (at most SAVE_BUFFER_BYTES) to transcode into directly
+static BYTE* Writer_Reserve(DocWriter* w, size_t bytes) {
+    if (!w->ok) return NULL;
+    if (w->used + bytes > SAVE_BUFFER_BYTES && !Writer_Flush(w)) return NULL;
+    return w->buf + w->used;
+}
+
+// Reports progress about every 0.1% of the document
+static void Writer_Advance(DocWriter* w, size_t units) {
+    w->unitsDone += units;
+    if (w->progress && w->unitsDone >= w->nextReport) {
+        w->progress(w->unitsDone, w->unitsTotal, w->progressCtx);
+        w->nextReport = w->unitsDone + w->unitsTotal / 1000 + 1;
+    }
+}
+
+// Copies units out unchanged, in slices small enough to report progress between them
+static BOOL Writer_PutUnits(DocWriter* w, const void* data, size_t units, size_t unitSize) {
+    const BYTE* p = (const BYTE*)data;
+    size_t slice = SAVE_MAX_WRITE / unitSize;
+    while (w->ok && units > 0) {
+        size_t n = (units > slice) ? slice : units;
+        if (!Writer_Put(w, p, n * unitSize)) return FALSE;
+        Writer_Advance(w, n);
+        p += n * unitSize;
+        units -= n;
+    }
+    return w->ok;
+}
+
+static void SwapBytes16(WCHAR* dst, const WCHAR* src, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        WCHAR ch = src[i];
+        dst[i] = (WCHAR)((ch >> 8) | (ch << 8));
+    }
+}
+
+static BOOL Writer_PutUtf16AsUtf8(DocWriter* w, const WCHAR* src, size_t count, BOOL srcBigEndian) {
+    while (w->ok && count > 0) {
+        size_t n = (count > SAVE_CHUNK_UNITS) ? SAVE_CHUNK_UNITS : count;
+        // Keep surrogate pairs together so each half converts as one code point
+        WCHAR last = srcBigEndian ? (WCHAR)((src[n - 1] >> 8) | (src[n - 1] << 8)) : src[n - 1];
+        if (n < count && n > 1 && last >= 0xD800 && last <= 0xDBFF) n--;
+
+        const WCHAR* chunk = src;
+        if (srcBigEndian) {
+            SwapBytes16(w->scratch, src, n);
+            chunk = w->scratch;
+        }
+
+        BYTE* dst = Writer_Reserve(w, n * 3);
+        if (!dst) return FALSE;
+        w->used += Utf16_ToUtf8(chunk, n, (char*)dst, n * 3, NULL);
+        Writer_Advance(w, n);
+        src += n;
+        count -= n;
+    }
+    return w->ok;
+}
+
+static BOOL Writer_PutUtf8AsUtf16(DocWriter* w, const char* src, size_t bytes, BOOL bigEndian) {
+    while (w->ok && bytes > 0) {
+        size_t n = (bytes > SAVE_CHUNK_UNITS) ? SAVE_CHUNK_UNITS : bytes;
+        // Back up to a lead byte so no sequence is split across chunks
+        size_t back = 0;
+        while (n < bytes && back < 3 && n > 1 && ((unsigned char)src[n] & 0xC0) == 0x80) {
+            n--;
+            back++;
+        }
+
+        BYTE* dst = Writer_Reserve(w, n * sizeof(WCHAR));
+        if (!dst) return FALSE;
+        size_t written = Utf8_ToUtf16(src, n, (WCHAR*)dst, n, NULL);
+        if (bigEndian) SwapBytes16((WCHAR*)dst, (const WCHAR*)dst, written);
+        w->used += written * sizeof(WCHAR);
+        Writer_Advance(w, n);
+        src += n;
+        bytes -= n;
+    }
+    return w->ok;
+}
+
+static BOOL Writer_PutUtf16Swapped(DocWriter* w, const WCHAR* src, size_t count) {
+    while (w->ok && count > 0) {
+        size_t n = (count > SAVE_CHUNK_UNITS) ? SAVE_CHUNK_UNITS : count;
+        BYTE* dst = Writer_Reserve(w, n * sizeof(WCHAR));
+        if (!dst) return FALSE;
+        SwapBytes16((WCHAR*)dst, src, n);
+        w->used += n * sizeof(WCHAR);
+        Writer_Advance(w, n);
+        src += n;
+        count -= n;
+    }
+    return w->ok;
+}
+
+// Original and target store text in the same units byte for byte, so original spans copy as-is
+static BOOL Save_SameUnits(DocEncoding source, DocEncoding target) {
+    size_t unitSize = Doc_EncodingUnitSize(source);
+    if (unitSize != Doc_EncodingUnitSize(target)) return FALSE;
+    if (unitSize == 1) return (source == DOC_ENCODING_ANSI) == (target == DOC_ENCODING_ANSI);
+    return Doc_EncodingIsBigEndian(source) == Doc_EncodingIsBigEndian(target);
+}
+
+static BOOL Save_IsUtf8(DocEncoding encoding) {
+    return encoding == DOC_ENCODING_UTF8 || encoding == DOC_ENCODING_UTF8_BOM;
+}
+
+/**
+ * Decodes up to 'count' units of a piece, starting at unit 'pos', to UTF-16 for the
+ * transcoders without a direct path. Characters are never split across calls: a UTF-8
+ * sequence or surrogate pair cut off by dst is left for the next one. Returns the WCHARs
+ * written; *outConsumed receives the piece units used.
+ */
+static size_t Doc_DecodePieceChunk(const SlateDoc* doc, const Piece* p, size_t pos, size_t count,
+                                   WCHAR* dst, size_t dstCap, size_t* outConsumed) {
+    size_t written = 0, consumed = 0;
+    if (p->buffer == BUFFER_ADD) {
+        written = consumed = (count < dstCap) ? count : dstCap;
+        memcpy(dst, doc->add_buffer + p->start + pos, written * sizeof(WCHAR));
+    } else {
+        // A UTF-32 unit may become a surrogate pair
+        size_t take = (Doc_EncodingUnitSize(doc->encoding) == 4) ? dstCap / 2 : dstCap;
+        if (take > count) take = count;
+        // One unit past 'take' shows whether it splits a UTF-8 sequence; a run cut short by
+        // a window already ends on a character boundary
+        size_t run = (take < count) ? take + 1 : take;
+        const unsigned char* src = Doc_OriginalRun(doc, p->start + pos, &run);
+        if (src && run <= take) take = run;
+        else if (src && Save_IsUtf8(doc->encoding)) {
+            size_t back = 0;
+            while (take < count && back < 3 && take > 1 && (src[take] & 0xC0) == 0x80) {
+                take--;
+                back++;
+            }
+        }
+        written = Doc_DecodeOriginal(doc, p->start + pos, take, dst, dstCap, &consumed);
+    }
+
+    // Only 16-bit sources can end a chunk on a high surrogate, one unit per WCHAR
+    if (consumed < count && written > 1 && dst[written - 1] >= 0xD800 && dst[written - 1] <= 0xDBFF) {
+        written--;
+        consumed--;
+    }
+    *outConsumed = consumed;
+    return written;
+}
+
+// Encodes a UTF-16 chunk of at most SAVE_CHUNK_UNITS in the target encoding
+static BOOL Writer_PutWide(DocWriter* w, const WCHAR* src, size_t n, DocEncoding encoding, UINT codePage) {
+    if (n == 0) return w->ok;
+
+    if (encoding == DOC_ENCODING_ANSI) {
+        BYTE* dst = Writer_Reserve(w, n * 4);
+        if (!dst) return FALSE;
+        // Characters the code page lacks become its default character
+        int bytes = WideCharToMultiByte(codePage, 0, src, (int)n, (LPSTR)dst, (int)(n * 4), NULL, NULL);
+        if (bytes <= 0) w->ok = FALSE;
+        else w->used += (size_t)bytes;
+    } else if (Doc_EncodingUnitSize(encoding) == 4) {
+        BYTE* dst = Writer_Reserve(w, n * sizeof(UINT32));
+        if (!dst) return FALSE;
+        w->used += Utf16_ToUtf32(src, n, Doc_EncodingIsBigEndian(encoding), (UINT32*)dst, n, NULL) * sizeof(UINT32);
+    } else if (Doc_EncodingUnitSize(encoding) == sizeof(WCHAR)) {
+        BYTE* dst = Writer_Reserve(w, n * sizeof(WCHAR));
+        if (!dst) return FALSE;
+        if (Doc_EncodingIsBigEndian(encoding)) SwapBytes16((WCHAR*)dst, src, n);
+        else memcpy(dst, src, n * sizeof(WCHAR));
+        w->used += n * sizeof(WCHAR);
+    } else {
+        BYTE* dst = Writer_Reserve(w, n * 3);
+        if (!dst) return FALSE;
+        w->used += Utf16_ToUtf8(src, n, (char*)dst, n * 3, NULL);
+    }
+    return w->ok;
+}
+
+// UTF-16 unit i of a piece whose text is in UTF-16, 0 for pieces in other units
+static WCHAR Save_Utf16Unit(const SlateDoc* doc, const Piece* p, size_t i) {
+    if (p->buffer == BUFFER_ADD) return doc->add_buffer[p->start + i];
+    if (Doc_EncodingUnitSize(doc->encoding) != sizeof(WCHAR)) return 0;
+    size_t run = 1;
+    const WCHAR* src = (const WCHAR*)Doc_OriginalRun(doc, p->start + i, &run);
+    if (!src || run == 0) return 0;
+    return Doc_EncodingIsBigEndian(doc->encoding) ? (WCHAR)((*src >> 8) | (*src << 8)) : *src;
+}
+
+static BOOL Save_IsHighSurrogate(WCHAR ch) { return ch >= 0xD800 && ch <= 0xDBFF; }
+static BOOL Save_IsLowSurrogate(WCHAR ch) { return ch >= 0xDC00 && ch <= 0xDFFF; }
+
+// Writes the held high surrogate, as a pair with 'low' when that is its other half (returns
+// TRUE then), otherwise alone as whatever an unpaired surrogate becomes
+static BOOL Writer_PutPending(DocWriter* w, WCHAR low) {
+    if (!w->pendingHigh) return FALSE;
+    WCHAR pair[2] = { w->pendingHigh, low };
+    BOOL paired = Save_IsLowSurrogate(low);
+    w->pendingHigh = 0;
+    Writer_PutWide(w, pair, paired ? 2 : 1, w->encoding, w->codePage);
+    return paired;
+}
+
+// Pairings without a direct path (code pages, UTF-32) go through UTF-16 a chunk at a time
+static BOOL Writer_PutTranscoded(SlateDoc* doc, DocWriter* w, const Piece* p, DocEncoding encoding) {
+    size_t pos = 0;
+    while (w->ok && pos < p->length) {
+        size_t consumed = 0;
+        size_t n = Doc_DecodePieceChunk(doc, p, pos, p->length - pos, w->scratch, SAVE_CHUNK_UNITS, &consumed);
+        if (consumed == 0) {
+            w->ok = FALSE;
+            break;
+        }
+        Writer_PutWide(w, w->scratch, n, encoding, doc->code_page);
+        Writer_Advance(w, consumed);
+        pos += consumed;
+    }
+    return w->ok;
+}
+
+// Writes a piece whose original text, if any, is contiguous at 'original'
+static BOOL Doc_WriteRun(SlateDoc* doc, DocWriter* w, const Piece* p, const BYTE* original, DocEncoding encoding) {
+    BOOL isOriginal = (p->buffer == BUFFER_ORIGINAL);
+    size_t sourceUnit = isOriginal ? Doc_EncodingUnitSize(doc->encoding) : sizeof(WCHAR);
+    size_t targetUnit = Doc_EncodingUnitSize(encoding);
+    BOOL targetBigEndian = Doc_EncodingIsBigEndian(encoding);
+
+    if (isOriginal && Save_SameUnits(doc->encoding, encoding)) {
+        Writer_PutPending(w, 0);
+        w->stats.bytesPassedThrough += p->length * sourceUnit;
+        return Writer_PutUnits(w, original, p->length, sourceUnit);
+    }
+
+    if (isOriginal && Save_IsUtf8(doc->encoding) && targetUnit == sizeof(WCHAR)) {
+        Writer_PutPending(w, 0);
+        return Writer_PutUtf8AsUtf16(w, (const char*)original, p->length, targetBigEndian);
+    }
+
+    if (sourceUnit == sizeof(WCHAR) && targetUnit == sizeof(WCHAR)) {
+        const WCHAR* src = isOriginal ? (const WCHAR*)original : doc->add_buffer + p->start;
+        BOOL srcBigEndian = isOriginal && Doc_EncodingIsBigEndian(doc->encoding);
+        if (srcBigEndian != targetBigEndian) return Writer_PutUtf16Swapped(w, src, p->length);
+        return Writer_PutUnits(w, src, p->length, sizeof(WCHAR));
+    }
+    if (sourceUnit != sizeof(WCHAR)) {
+        Writer_PutPending(w, 0);
+        return Writer_PutTranscoded(doc, w, p, encoding);
+    }
+
+    // UTF-16 into other units: a surrogate pair that pieces or stretches split between them
+    // is encoded whole, the high half held back until the next run shows the low one
+    Piece rest = *p;
+    if (Writer_PutPending(w, Save_Utf16Unit(doc, p, 0))) {
+        rest.start++;
+        rest.length--;
+        Writer_Advance(w, 1);
+    }
+    if (rest.length > 0 && Save_IsHighSurrogate(Save_Utf16Unit(doc, &rest, rest.length - 1))) {
+        w->pendingHigh = Save_Utf16Unit(doc, &rest, rest.length - 1);
+        rest.length--;
+        Writer_Advance(w, 1);
+    }
+    if (Save_IsUtf8(encoding)) {
+        const WCHAR* src = isOriginal ? (const WCHAR*)original + (rest.start - p->start) : doc->add_buffer + rest.start;
+        return Writer_PutUtf16AsUtf8(w, src, rest.length, isOriginal && Doc_EncodingIsBigEndian(doc->encoding));
+    }
+    return Writer_PutTranscoded(doc, w, &rest, encoding);
+}
+
+static BOOL Doc_WritePiece(SlateDoc* doc, DocWriter* w, const Piece* p, DocEncoding encoding) {
+    if (p->length == 0) return TRUE;
+    if (p->buffer != BUFFER_ORIGINAL) return Doc_WriteRun(doc, w, p, NULL, encoding);
+
+    // Written a stretch at a time with the next one read ahead; a windowed original may cut
+    // a stretch shorter still, to a window span
+    size_t stretch = DOC_PREFETCH_BYTES / Doc_EncodingUnitSize(doc->encoding);
+    Piece run = *p;
+    for (size_t done = 0; done < p->length && w->ok; done += run.length) {
+        run.start = p->start + done;
+        run.length = p->length - done;
+        if (run.length > stretch) {
+            run.length = stretch;
+            Doc_PrefetchOriginal(doc, run.start + stretch, stretch);
+        }
+        const BYTE* src = Doc_OriginalRun(doc, run.start, &run.length);
+        if (!src || run.length == 0 || !Doc_WriteRun(doc, w, &run, src, encoding)) {
+            w->ok = FALSE;
+            break;
+        }
+    }
+    return w->ok;
+}
+
+// Writes the pieces from 'first' onward, preceded by the encoding's BOM if asked
+static BOOL Doc_WritePieces(SlateDoc* doc, HANDLE hFile, const Piece* first, DocEncoding encoding, BOOL withBom,
+                            BOOL staged, DocSaveStats* outStats,
+                            void (*progress)(size_t unitsDone, size_t unitsTotal, void* ctx), void* ctx) {
+    DocWriter w = {0};
+    w.hFile = hFile;
+    w.ok = TRUE;
+    w.staged = staged;
+    w.progress = progress;
+    w.progressCtx = ctx;
+    w.encoding = encoding;
+    w.codePage = doc->code_page;
+    for (const Piece* p = first; p; p = p->next) w.unitsTotal += p->length;
+    w.buf = (BYTE*)VirtualAlloc(NULL, SAVE_BUFFER_BYTES, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    w.scratch = (WCHAR*)malloc(SAVE_CHUNK_UNITS * sizeof(WCHAR));
+    if (!w.buf || !w.scratch) w.ok = FALSE;
+
+    static const BYTE bomUtf8[] = { 0xEF, 0xBB, 0xBF };
+    static const BYTE bomUtf16LE[] = { 0xFF, 0xFE };
+    static const BYTE bomUtf16BE[] = { 0xFE, 0xFF };
+    static const BYTE bomUtf32LE[] = { 0xFF, 0xFE, 0x00, 0x00 };
+    static const BYTE bomUtf32BE[] = { 0x00, 0x00, 0xFE, 0xFF };
+    switch (withBom ? encoding : DOC_ENCODING_UTF8) {
+        case DOC_ENCODING_UTF8_BOM: Writer_Put(&w, bomUtf8, sizeof(bomUtf8)); break;
+        case DOC_ENCODING_UTF16LE:  Writer_Put(&w, bomUtf16LE, sizeof(bomUtf16LE)); break;
+        case DOC_ENCODING_UTF16BE:  Writer_Put(&w, bomUtf16BE, sizeof(bomUtf16BE)); break;
+        case DOC_ENCODING_UTF32LE:  Writer_Put(&w, bomUtf32LE, sizeof(bomUtf32LE)); break;
+        case DOC_ENCODING_UTF32BE:  Writer_Put(&w, bomUtf32BE, sizeof(bomUtf32BE)); break;
+        default: break;
+    }
+
+    for (const Piece* p = first; p && w.ok; p = p->next) {
+        Doc_WritePiece(doc, &w, p, encoding);
+    }
+    Writer_PutPending(&w, 0);
+    Writer_Flush(&w);
+
+    if (w.buf) VirtualFree(w.buf, 0, MEM_RELEASE);
+    free(w.scratch);
+    if (outStats) *outStats = w.stats;
+    return w.ok;
+}
+
+/**
+ * Writes the whole document to an open file in the given encoding. Untouched original
+ * spans already in that encoding go straight from the mapping to WriteFile; everything
+ * else is transcoded into a multi-megabyte staging buffer. 'progress' (optional) is called
+ * with document units written so far, from the calling thread.
+ */
+BOOL Doc_WriteToHandle(SlateDoc* doc, HANDLE hFile, DocEncoding encoding, DocSaveStats* outStats,
+                       void (*progress)(size_t unitsDone, size_t unitsTotal, void* ctx), void* ctx) {
+    if (!doc || hFile == INVALID_HANDLE_VALUE) return FALSE;
+    return Doc_WritePieces(doc, hFile, doc->head, encoding, TRUE, FALSE, outStats, progress, ctx);
+}
+
+// UTF-8 bytes of UTF-16 text, counting unpaired surrogates as the replacement they become
+static size_t Save_Utf8Length(const WCHAR* src, size_t count, BOOL bigEndian) {
+    size_t bytes = 0;
+    for (size_t i = 0; i < count; i++) {
+        WCHAR c = bigEndian ? (WCHAR)((src[i] >> 8) | (src[i] << 8)) : src[i];
+        if (c < 0x80) {
+            bytes += 1;
+        } else if (c < 0x800) {
+            bytes += 2;
+        } else if (c >= 0xD800 && c <= 0xDBFF && i + 1 < count) {
+            WCHAR lo = bigEndian ? (WCHAR)((src[i + 1] >> 8) | (src[i + 1] << 8)) : src[i + 1];
+            if (lo >= 0xDC00 && lo <= 0xDFFF) {
+                bytes += 4;
+                i++;
+            } else {
+                bytes += 3;
+            }
+        } else {
+            bytes += 3;
+        }
+    }
+    return bytes;
+}
+
+// Units a native UTF-16 chunk takes up once encoded
+static size_t Save_EncodedUnits(const WCHAR* src, size_t n, DocEncoding encoding, UINT codePage) {
+    if (n == 0) return 0;
+    if (encoding == DOC_ENCODING_ANSI) {
+        return (size_t)WideCharToMultiByte(codePage, 0, src, (int)n, NULL, 0, NULL, NULL);
+    }
+    if (Save_IsUtf8(encoding)) return Save_Utf8Length(src, n, FALSE);
+
+    size_t units = n;
+    if (Doc_EncodingUnitSize(encoding) == 4) {
+        for (size_t i = 0; i + 1 < n; i++) {
+            if (src[i] >= 0xD800 && src[i] <= 0xDBFF && src[i + 1] >= 0xDC00 && src[i + 1] <= 0xDFFF) {
+                units--;
+                i++;
+            }
+        }
+    }
+    return units;
+}
+
+// Units (bytes, UTF-16 or UTF-32 units) that the first 'count' units of a piece occupy
+// once saved in 'encoding'
+static size_t Doc_SavedUnits(SlateDoc* doc, const Piece* p, size_t count, DocEncoding encoding) {
+    BOOL isOriginal = (p->buffer == BUFFER_ORIGINAL);
+    size_t sourceUnit = isOriginal ? Doc_EncodingUnitSize(doc->encoding) : sizeof(WCHAR);
+    size_t targetUnit = Doc_EncodingUnitSize(encoding);
+    if (isOriginal && Save_SameUnits(doc->encoding, encoding)) return count;
+    if (sourceUnit == sizeof(WCHAR) && targetUnit == sizeof(WCHAR)) return count;
+
+    if (isOriginal && Save_IsUtf8(doc->encoding) && targetUnit == sizeof(WCHAR)) {
+        WCHAR scratch[1024];
+        size_t units = 0, pos = p->start;
+        while (count > 0) {
+            size_t run = count;
+            const char* src = (const char*)Doc_OriginalRun(doc, pos, &run);
+            size_t consumed = 0;
+            if (src) units += Utf8_ToUtf16(src, run, scratch, _countof(scratch), &consumed);
+            if (consumed == 0) break;
+            pos += consumed;
+            count -= consumed;
+        }
+        return units;
+    }
+
+    if (sourceUnit == sizeof(WCHAR) && Save_IsUtf8(encoding)) {
+        BOOL bigEndian = isOriginal && Doc_EncodingIsBigEndian(doc->encoding);
+        if (!isOriginal) return Save_Utf8Length(doc->add_buffer + p->start, count, bigEndian);
+
+        size_t units = 0, pos = p->start;
+        while (count > 0) {
+            size_t run = count;
+            const WCHAR* src = (const WCHAR*)Doc_OriginalRun(doc, pos, &run);
+            if (!src || run == 0) break;
+            units += Save_Utf8Length(src, run, bigEndian);
+            pos += run;
+            count -= run;
+        }
+        return units;
+    }
+
+    WCHAR scratch[1024];
+    size_t units = 0, pos = 0;
+    while (pos < count) {
+        size_t consumed = 0;
+        size_t n = Doc_DecodePieceChunk(doc, p, pos, count - pos, scratch, _countof(scratch), &consumed);
+        if (consumed == 0) break;
+        units += Save_EncodedUnits(scratch, n, encoding, doc->code_page);
+        pos += consumed;
+    }
+    return units;
+}
+
+/**
+ * Translates a logical offset into the offset of the same position after the document is
+ * saved in 'encoding' and rebased onto the result (UTF-8 and code page documents count
+ * bytes, UTF-32 documents code points).
+ */
+size_t Doc_GetSavedOffset(SlateDoc* doc, size_t offset, DocEncoding encoding) {
+    if (!doc) return 0;
+
+    // A surrogate pair split between pieces is saved whole (Doc_WriteRun), not as the two
+    // unpaired halves the pieces count on their own
+    BOOL widens = (Doc_EncodingUnitSize(encoding) != sizeof(WCHAR));
+    WCHAR high = 0;
+    size_t pos = 0, saved = 0;
+    for (const Piece* p = doc->head; p && pos < offset; p = p->next) {
+        size_t take = (p->length < offset - pos) ? p->length : offset - pos;
+        saved += Doc_SavedUnits(doc, p, take, encoding);
+        if (widens && take > 0) {
+            WCHAR low = Save_Utf16Unit(doc, p, 0);
+            if (high && Save_IsLowSurrogate(low)) {
+                WCHAR pair[2] = { high, low };
+                size_t apart = Save_EncodedUnits(pair, 1, encoding, doc->code_page) +
+                               Save_EncodedUnits(pair + 1, 1, encoding, doc->code_page);
+                saved -= apart - Save_EncodedUnits(pair, 2, encoding, doc->code_page);
+            }
+            WCHAR last = (take == p->length) ? Save_Utf16Unit(doc, p, p->length - 1) : 0;
+            high = Save_IsHighSurrogate(last) ? last : 0;
+        }
+        pos += take;
+    }
+    return saved;
+}
+
+// Maps the just-written file and makes it the document's original buffer
+static BOOL Doc_MapSavedFile(SlateDoc* doc, HANDLE hFile, DocEncoding encoding) {
+    LARGE_INTEGER liSize;
+    if (!GetFileSizeEx(hFile, &liSize)) return FALSE;
+
+    size_t skip = Doc_EncodingBomBytes(encoding);
+    size_t rawLen = (size_t)liSize.QuadPart;
+
+    // Empty files cannot be mapped; the document simply becomes empty
+    if (rawLen <= skip) return Doc_RebaseOnMap(doc, NULL, 0, NULL, NULL, encoding);
+
+    HANDLE hMap = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!hMap) return FALSE;
+
+    // Large files are read through windows, like MapDocument does
+    void* base = ((ULONGLONG)rawLen <= MAP_WHOLE_MAX_BYTES) ? MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0) : NULL;
+    size_t len = (rawLen - skip) / Doc_EncodingUnitSize(encoding);
+    if (!Doc_RebaseOnMap(doc, base ? (BYTE*)base + skip : NULL, len, hMap, base, encoding)) {
+        if (base) UnmapViewOfFile(base);
+        CloseHandle(hMap);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void SaveJob_Free(DocSaveJob* job) {
+    if (job->hThread) CloseHandle(job->hThread);
+    if (job->hFile != INVALID_HANDLE_VALUE) CloseHandle(job->hFile);
+    if (job->hBackup != INVALID_HANDLE_VALUE) CloseHandle(job->hBackup);
+    Doc_DestroySnapshot(job->snapshot);
+    free(job);
+}
+
+/**
+ * Checks whether a save over the document's own file can rewrite just the suffix after the
+ * first change. The pieces must open with the original text in place, and no original text
+ * after that may have to move towards the end of the file: the suffix is written front to
+ * back over the same mapping it reads from, so a piece is only safe to copy while its source
+ * has not been overwritten yet. Shrinking files are left to the full save, since the file
+ * cannot be truncated below a view that is still mapped. *outEnd receives the saved length
+ * in units.
+ */
+static BOOL Doc_PlanInPlaceSave(SlateDoc* doc, const Piece** outFirst, size_t* outOffset, size_t* outEnd,
+                                BOOL* outAppendOnly) {
+    size_t pos = 0;
+    const Piece* p = doc->head;
+    while (p && p->buffer == BUFFER_ORIGINAL && p->start == pos) {
+        pos += p->length;
+        p = p->next;
+    }
+
+    // Same encoding as the mapping, so saved units line up with original offsets
+    size_t out = pos;
+    for (const Piece* q = p; q; q = q->next) {
+        if (q->buffer == BUFFER_ORIGINAL && q->start < out) return FALSE;
+        out += Doc_SavedUnits(doc, q, q->length, doc->encoding);
+    }
+    if (out < doc->original_len) return FALSE;
+
+    *outFirst = p;
+    *outOffset = pos;
+    *outEnd = out;
+    *outAppendOnly = (pos == doc->original_len);
+    return TRUE;
+}
+
+// Copies hFrom from 'fromOffset' to its end into hTo at 'toOffset', and ends hTo there
+static BOOL Save_CopyTail(HANDLE hFrom, ULONGLONG fromOffset, HANDLE hTo, ULONGLONG toOffset) {
+    BYTE* buf = (BYTE*)malloc(SAVE_BUFFER_BYTES);
+    LARGE_INTEGER liFrom, liTo;
+    liFrom.QuadPart = (LONGLONG)fromOffset;
+    liTo.QuadPart = (LONGLONG)toOffset;
+    BOOL ok = buf && SetFilePointerEx(hFrom, liFrom, NULL, FILE_BEGIN) && SetFilePointerEx(hTo, liTo, NULL, FILE_BEGIN);
+    DWORD got = 0;
+    while (ok && (ok = ReadFile(hFrom, buf, SAVE_BUFFER_BYTES, &got, NULL)) && got > 0) {
+        DWORD written = 0;
+        ok = WriteFile(hTo, buf, got, &written, NULL) && written == got;
+    }
+    free(buf);
+    return ok && SetEndOfFile(hTo) && FlushFileBuffers(hTo);
+}
+
+// Saves the bytes an in-place save will overwrite, so a failed write or rebase can put
+// them back: the document reads them through its mapping until it is rebased
+static BOOL SaveJob_BackUpTail(DocSaveJob* job) {
+    if (!GetTempFileNameW(job->dir, L"slb", 0, job->tempPath)) return FALSE;
+    job->hBackup = CreateFileW(job->tempPath, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                               FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (job->hBackup != INVALID_HANDLE_VALUE && Save_CopyTail(job->hFile, job->writeOffset, job->hBackup, 0)) {
+        return TRUE;
+    }
+    if (job->hBackup != INVALID_HANDLE_VALUE) CloseHandle(job->hBackup);
+    job->hBackup = INVALID_HANDLE_VALUE;
+    DeleteFileW(job->tempPath);
+    return FALSE;
+}
+
+// Opens the document's own file for an in-place save if the plan allows one
+static BOOL SaveJob_TryInPlace(DocSaveJob* job, SlateDoc* doc) {
+    if (!doc->hMapFile || job->encoding != doc->encoding || !doc->original_path[0] ||
+        _wcsicmp(job->targetPath, doc->original_path) != 0) {
+        return FALSE;
+    }
+
+    size_t offset = 0, end = 0;
+    if (!Doc_PlanInPlaceSave(job->snapshot, &job->firstChanged, &offset, &end, &job->appendOnly)) return FALSE;
+
+    HANDLE hFile = CreateFileW(job->targetPath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+                               OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) return FALSE;
+
+    // The file must still hold at least the text the mapping was made from
+    size_t unitSize = Doc_EncodingUnitSize(doc->encoding);
+    ULONGLONG originalBytes = Doc_EncodingBomBytes(doc->encoding) + (ULONGLONG)doc->original_len * unitSize;
+    LARGE_INTEGER liSize;
+    if (!GetFileSizeEx(hFile, &liSize) || (ULONGLONG)liSize.QuadPart < originalBytes) {
+        CloseHandle(hFile);
+        return FALSE;
+    }
+
+    // Saves over original text run on the UI thread and back up what they overwrite, so
+    // only a short suffix is rewritten that way; longer ones go through a temp file
+    job->writeOffset = Doc_EncodingBomBytes(doc->encoding) + (ULONGLONG)offset * unitSize;
+    if (!job->appendOnly && ((ULONGLONG)liSize.QuadPart - job->writeOffset > SAVE_IN_PLACE_MAX ||
+                             (ULONGLONG)(end - offset) * unitSize > SAVE_IN_PLACE_MAX)) {
+        CloseHandle(hFile);
+        return FALSE;
+    }
+
+    job->hFile = hFile;
+    if (!job->appendOnly && !SaveJob_BackUpTail(job)) {
+        CloseHandle(hFile);
+        job->hFile = INVALID_HANDLE_VALUE;
+        return FALSE;
+    }
+    job->inPlace = TRUE;
+    return TRUE;
+}
+
+// Takes the snapshot the writer will read and opens its output: the target itself for
+// in-place saves, otherwise a temp file beside it
+static DocSaveJob* SaveJob_Create(SlateDoc* doc, const WCHAR* path, DocEncoding encoding) {
+    DocSaveJob* job = (DocSaveJob*)calloc(1, sizeof(DocSaveJob));
+    if (!job) return NULL;
+    job->hFile = INVALID_HANDLE_VALUE;
+    job->hBackup = INVALID_HANDLE_VALUE;
+    job->encoding = encoding;
+    job->revision = doc->revision;
+    job->lastPermille = -1;
+
+    WCHAR* filePart = NULL;
+    DWORD fullLen = GetFullPathNameW(path, MAX_PATH, job->targetPath, &filePart);
+    job->snapshot = (fullLen > 0 && fullLen < MAX_PATH && filePart) ? Doc_CreateSnapshot(doc) : NULL;
+    if (!job->snapshot) {
+        SaveJob_Free(job);
+        return NULL;
+    }
+
+    // Same directory, so the rename never has to copy across volumes
+    wcsncpy_s(job->dir, MAX_PATH, job->targetPath, (size_t)(filePart - job->targetPath));
+    if (SaveJob_TryInPlace(job, doc)) return job;
+    if (!GetTempFileNameW(job->dir, L"slt", 0, job->tempPath)) {
+        SaveJob_Free(job);
+        return NULL;
+    }
+
+    // Shared for delete so the file can still be renamed while the document maps it
+    job->hFile = CreateFileW(job->tempPath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+                             CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (job->hFile == INVALID_HANDLE_VALUE) {
+        DeleteFileW(job->tempPath);
+        SaveJob_Free(job);
+        return NULL;
+    }
+    return job;
+}
+
+static void SaveJob_Progress(size_t unitsDone, size_t unitsTotal, void* ctx) {
+    DocSaveJob* job = (DocSaveJob*)ctx;
+    LONG permille = unitsTotal ? (LONG)((ULONGLONG)unitsDone * 1000 / unitsTotal) : 1000;
+    if (permille != job->lastPermille) {
+        job->lastPermille = permille;
+        PostMessageW(job->hwndNotify, job->msg, (WPARAM)permille, (LPARAM)job);
+    }
+}
+
+static DWORD WINAPI SaveJob_Run(LPVOID param) {
+    DocSaveJob* job = (DocSaveJob*)param;
+    void (*progress)(size_t, size_t, void*) = job->hwndNotify ? SaveJob_Progress : NULL;
+
+    if (job->inPlace) {
+        LARGE_INTEGER liOffset;
+        liOffset.QuadPart = (LONGLONG)job->writeOffset;
+        job->ok = SetFilePointerEx(job->hFile, liOffset, NULL, FILE_BEGIN) &&
+                  Doc_WritePieces(job->snapshot, job->hFile, job->firstChanged, job->encoding, FALSE,
+                                  !job->appendOnly, &job->stats, progress, job) &&
+                  SetEndOfFile(job->hFile) && FlushFileBuffers(job->hFile);
+    } else {
+        job->ok = Doc_WriteToHandle(job->snapshot, job->hFile, job->encoding, &job->stats, progress, job) &&
+                  FlushFileBuffers(job->hFile);
+    }
+    if (job->hwndNotify) PostMessageW(job->hwndNotify, job->msg, DOC_SAVE_COMPLETE, (LPARAM)job);
+    return job->ok ? 0 : 1;
+}
+
+// Deletes a file the document may still map. Opening it for delete-on-close marks it for
+// deletion once the last handle, the mapping's included, is closed; failing that it goes at
+// the next reboot.
+static void Save_DeleteWhenUnmapped(const WCHAR* path) {
+    HANDLE hFile = CreateFileW(path, DELETE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                               OPEN_EXISTING, FILE_FLAG_DELETE_ON_CLOSE, NULL);
+    if (hFile != INVALID_HANDLE_VALUE) {
+        CloseHandle(hFile);
+    } else {
+        MoveFileExW(path, NULL, MOVEFILE_DELAY_UNTIL_REBOOT);
+    }
+}
+
+// The document still maps the target, so it cannot be replaced in place. Rename it aside
+// (the mapping keeps reading it there) and delete it once the document lets go.
+static BOOL SaveJob_ReplaceMapped(DocSaveJob* job) {
+    WCHAR asidePath[MAX_PATH];
+    if (!GetTempFileNameW(job->dir, L"slo", 0, asidePath)) return FALSE;
+    if (!MoveFileExW(job->targetPath, asidePath, MOVEFILE_REPLACE_EXISTING)) {
+        DeleteFileW(asidePath);
+        return FALSE;
+    }
+    if (!MoveFileExW(job->tempPath, job->targetPath, MOVEFILE_WRITE_THROUGH)) {
+        MoveFileExW(asidePath, job->targetPath, 0);
+        return FALSE;
+    }
+    // Only marked once the new file is in place, since a file pending deletion cannot be
+    // renamed back
+    Save_DeleteWhenUnmapped(asidePath);
+    return TRUE;
+}
+
+// Moves the written temp file over the target. An existing target is replaced rather than
+// renamed over, which keeps its ACLs, attributes and alternate streams.
+static BOOL SaveJob_Rename(DocSaveJob* job) {
+    if (GetFileAttributesW(job->targetPath) == INVALID_FILE_ATTRIBUTES) {
+        return MoveFileExW(job->tempPath, job->targetPath, MOVEFILE_WRITE_THROUGH);
+    }
+    if (ReplaceFileW(job->targetPath, job->tempPath, NULL, REPLACEFILE_IGNORE_MERGE_ERRORS, NULL, NULL)) return TRUE;
+    // The target is already gone if only the final rename failed
+    return GetLastError() == ERROR_UNABLE_TO_MOVE_REPLACEMENT_2 &&
+           MoveFileExW(job->tempPath, job->targetPath, MOVEFILE_WRITE_THROUGH);
+}
+
+// Puts the written file in place and rebases the document onto it if it was not edited
+// since the snapshot
+static void SaveJob_Commit(SlateDoc* doc, DocSaveJob* job) {
+    job->committed = TRUE;
+    BOOL unedited = doc && doc->revision == job->revision;
+
+    if (job->inPlace) {
+        BOOL rebased = job->ok && unedited && Doc_MapSavedFile(doc, job->hFile, job->encoding);
+        if (job->appendOnly) {
+            // A failed append leaves the original text intact; drop the partial tail
+            if (!job->ok) {
+                LARGE_INTEGER liOffset;
+                liOffset.QuadPart = (LONGLONG)job->writeOffset;
+                if (SetFilePointerEx(job->hFile, liOffset, NULL, FILE_BEGIN)) SetEndOfFile(job->hFile);
+            }
+        } else if (!rebased) {
+            // The document still maps the file, so its text has to be put back. The backup is
+            // kept if even that fails, as the only copy of it.
+            job->ok = FALSE;
+            if (!Save_CopyTail(job->hBackup, 0, job->hFile, job->writeOffset)) return;
+        }
+        if (job->hBackup != INVALID_HANDLE_VALUE) {
+            CloseHandle(job->hBackup);
+            job->hBackup = INVALID_HANDLE_VALUE;
+            DeleteFileW(job->tempPath);
+        }
+        if (rebased) wcscpy_s(doc->original_path, MAX_PATH, job->targetPath);
+        return;
+    }
+
+    CloseHandle(job->hFile);
+    job->hFile = INVALID_HANDLE_VALUE;
+
+    // The document may still map the target, which then has to be moved aside first
+    if (job->ok) job->ok = SaveJob_Rename(job) || SaveJob_ReplaceMapped(job);
+    if (!job->ok) {
+        DeleteFileW(job->tempPath);
+        return;
+    }
+
+    // Only rebased once the file is in place, so a failed rename leaves the document on
+    // the buffers it had
+    BOOL rebased = FALSE;
+    if (unedited) {
+        HANDLE hFile = CreateFileW(job->targetPath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                   NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (hFile != INVALID_HANDLE_VALUE) {
+            rebased = Doc_MapSavedFile(doc, hFile, job->encoding);
+            CloseHandle(hFile); // The new mapping, if any, keeps the file open
+        }
+    }
+    if (rebased) {
+        wcscpy_s(doc->original_path, MAX_PATH, job->targetPath);
+    } else if (doc && _wcsicmp(doc->original_path, job->targetPath) == 0) {
+        // The document still maps the file that was replaced
+        doc->original_path[0] = L'\0';
+    }
+}
+
+/**
+ * Starts writing a snapshot of the document on a worker thread. The worker posts 'msg' to
+ * hwndNotify with the progress in permille as wParam and the job as lParam, and a final
+ * DOC_SAVE_COMPLETE; the UI thread then calls Doc_FinishSave. The document may be edited
+ * meanwhile, but must not be destroyed or saved again until then.
+ *
+ * In-place saves that overwrite original text run to completion before returning, since
+ * the document reads that text through its mapping, and are only made when what they
+ * rewrite is short; appends never touch it and run in the background like full saves.
+ */
+DocSaveJob* Doc_BeginSave(SlateDoc* doc, const WCHAR* path, DocEncoding encoding, HWND hwndNotify, UINT msg) {
+    if (!doc || !path) return NULL;
+
+    DocSaveJob* job = SaveJob_Create(doc, path, encoding);
+    if (!job) return NULL;
+    job->hwndNotify = hwndNotify;
+    job->msg = msg;
+
+    if (job->inPlace && !job->appendOnly) {
+        SaveJob_Run(job);
+        SaveJob_Commit(doc, job);
+        return job;
+    }
+
+    job->hThread = CreateThread(NULL, 0, SaveJob_Run, job, 0, NULL);
+    if (!job->hThread) {
+        if (!job->inPlace) DeleteFileW(job->tempPath);
+        SaveJob_Free(job);
+        return NULL;
+    }
+    return job;
+}
+
+/**
+ * Waits for the writer and commits its output. A full save renames the temp file over the
+ * target, so a crash leaves either the old file or the new one; an in-place save has already
+ * written the target, and puts back the text it overwrote if the write or the rebase failed.
+ * If the document was not edited since the snapshot, it is rebased onto the saved file, which
+ * releases the memory held by edits and the old mapping (which may be the target itself).
+ * Frees the job.
+ */
+BOOL Doc_FinishSave(SlateDoc* doc, DocSaveJob* job, DocSaveStats* outStats) {
+    if (!job) return FALSE;
+
+    if (job->hThread) WaitForSingleObject(job->hThread, INFINITE);
+    if (!job->committed) SaveJob_Commit(doc, job);
+    if (outStats) *outStats = job->stats;
+
+    BOOL ok = job->ok;
+    SaveJob_Free(job);
+    return ok;
+}
+
+BOOL Doc_SaveToFile(SlateDoc* doc, const WCHAR* path, DocEncoding encoding, DocSaveStats* outStats) {
+    if (!doc || !path) return FALSE;
+
+    DocSaveJob* job = SaveJob_Create(doc, path, encoding);
+    if (!job) return FALSE;
+    SaveJob_Run(job);
+    return Doc_FinishSave(doc, job, outStats);
+}
@@ -0,0 +1,338 @@
+#include "slate_doc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SESSION_MAGIC        0x53534C53 // "SLSS"
+#define SESSION_VERSION      1
+#define SESSION_SAMPLE_BYTES (64 * 1024)       // Hashed at the start, middle and end of the original
+#define SESSION_MAX_IO       (64 * 1024 * 1024) // Largest single ReadFile/WriteFile
+
+typedef struct {
+    DWORD     magic;
+    DWORD     version;
+    WCHAR     originalPath[MAX_PATH];
+    ULONGLONG fileSize;      // Identity of the original: size, last write time and a content sample
+    FILETIME  lastWrite;
+    ULONGLONG sampleHash;
+    ULONGLONG originalLen;
+    DWORD     encoding;
+    DWORD     codePage;      // Only for code page text; zero otherwise
+    ULONGLONG addLen;        // Add buffer units that follow the header
+    ULONGLONG undoCount;     // Piece lists after the current one, top of each stack first
+    ULONGLONG redoCount;
+    ULONGLONG cursor;
+    ULONGLONG anchor;
+} SessionHeader;
+
+typedef struct {
+    ULONGLONG pieceCount;
+    ULONGLONG cursorHint;
+} SessionList;
+
+typedef struct {
+    ULONGLONG start;
+    ULONGLONG length;
+    DWORD     buffer;
+    DWORD     isUtf8;
+} SessionPiece;
+
+static ULONGLONG Session_HashBytes(ULONGLONG hash, const BYTE* p, size_t bytes) {
+    for (size_t i = 0; i < bytes; i++) {
+        hash ^= p[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Hashes original bytes [pos, pos + bytes); a few samples fit in one window span
+static ULONGLONG Session_HashOriginal(ULONGLONG hash, const SlateDoc* doc, size_t pos, size_t bytes) {
+    const BYTE* data = Doc_OriginalBytes(doc, pos, bytes);
+    return data ? Session_HashBytes(hash, data, bytes) : hash;
+}
+
+// Hashes a few windows of the original so a same-size, same-mtime replacement is still caught
+static ULONGLONG Session_SampleOriginal(const SlateDoc* doc) {
+    size_t bytes = doc->original_len * Doc_EncodingUnitSize(doc->encoding);
+    ULONGLONG hash = 14695981039346656037ULL; // FNV-1a
+    if ((!doc->original_buffer && !doc->original_map) || bytes == 0) return hash;
+
+    if (bytes <= 3 * SESSION_SAMPLE_BYTES) return Session_HashOriginal(hash, doc, 0, bytes);
+    hash = Session_HashOriginal(hash, doc, 0, SESSION_SAMPLE_BYTES);
+    hash = Session_HashOriginal(hash, doc, bytes / 2 - SESSION_SAMPLE_BYTES / 2, SESSION_SAMPLE_BYTES);
+    return Session_HashOriginal(hash, doc, bytes - SESSION_SAMPLE_BYTES, SESSION_SAMPLE_BYTES);
+}
+
+static BOOL Session_GetIdentity(const WCHAR* path, ULONGLONG* outSize, FILETIME* outWrite) {
+    WIN32_FILE_ATTRIBUTE_DATA attrs;
+    if (!GetFileAttributesExW(path, GetFileExInfoStandard, &attrs)) return FALSE;
+    *outSize = ((ULONGLONG)attrs.nFileSizeHigh << 32) | attrs.nFileSizeLow;
+    *outWrite = attrs.ftLastWriteTime;
+    return TRUE;
+}
+
+static BOOL Session_Write(HANDLE hFile, const void* data, size_t bytes) {
+    const BYTE* p = (const BYTE*)data;
+    while (bytes > 0) {
+        DWORD chunk = (DWORD)((bytes > SESSION_MAX_IO) ? SESSION_MAX_IO : bytes);
+        DWORD written = 0;
+        if (!WriteFile(hFile, p, chunk, &written, NULL) || written != chunk) return FALSE;
+        p += chunk;
+        bytes -= chunk;
+    }
+    return TRUE;
+}
+
+static BOOL Session_Read(HANDLE hFile, void* data, size_t bytes) {
+    BYTE* p = (BYTE*)data;
+    while (bytes > 0) {
+        DWORD chunk = (DWORD)((bytes > SESSION_MAX_IO) ? SESSION_MAX_IO : bytes);
+        DWORD read = 0;
+        if (!ReadFile(hFile, p, chunk, &read, NULL) || read != chunk) return FALSE;
+        p += chunk;
+        bytes -= chunk;
+    }
+    return TRUE;
+}
+
+static BOOL Session_WriteList(HANDLE hFile, const Piece* head, size_t cursorHint) {
+    SessionList list = {0};
+    list.cursorHint = cursorHint;
+    for (const Piece* p = head; p; p = p->next) list.pieceCount++;
+
+    SessionPiece* pieces = (SessionPiece*)malloc((size_t)(list.pieceCount ? list.pieceCount : 1) * sizeof(SessionPiece));
+    if (!pieces) return FALSE;
+
+    size_t i = 0;
+    for (const Piece* p = head; p; p = p->next, i++) {
+        pieces[i].start = p->start;
+        pieces[i].length = p->length;
+        pieces[i].buffer = (DWORD)p->buffer;
+        pieces[i].isUtf8 = p->isUtf8 ? 1u : 0u;
+    }
+
+    BOOL ok = Session_Write(hFile, &list, sizeof(list)) &&
+              Session_Write(hFile, pieces, (size_t)list.pieceCount * sizeof(SessionPiece));
+    free(pieces);
+    return ok;
+}
+
+static BOOL Session_WriteSteps(HANDLE hFile, const UndoStep* step) {
+    for (; step; step = step->next) {
+        if (!Session_WriteList(hFile, step->pieces, step->cursor_hint)) return FALSE;
+    }
+    return TRUE;
+}
+
+static ULONGLONG Session_CountSteps(const UndoStep* step) {
+    ULONGLONG count = 0;
+    for (; step; step = step->next) count++;
+    return count;
+}
+
+/**
+ * Writes a snapshot of the document's edit state: the original file's identity, the add
+ * buffer, the piece list and the undo/redo history. The original's text is not copied,
+ * so the cost is proportional to the edits, not the file. The document must map a file
+ * it knows the path of.
+ */
+BOOL Doc_SaveSession(SlateDoc* doc, const WCHAR* sessionPath, size_t cursor, size_t anchor) {
+    if (!doc || !sessionPath || !doc->hMapFile || !doc->original_path[0]) return FALSE;
+
+    SessionHeader header = {0};
+    header.magic = SESSION_MAGIC;
+    header.version = SESSION_VERSION;
+    wcscpy_s(header.originalPath, MAX_PATH, doc->original_path);
+    if (!Session_GetIdentity(doc->original_path, &header.fileSize, &header.lastWrite)) return FALSE;
+    header.sampleHash = Session_SampleOriginal(doc);
+    header.originalLen = doc->original_len;
+    header.encoding = (DWORD)doc->encoding;
+    header.codePage = doc->code_page;
+    header.addLen = doc->add_len;
+    header.undoCount = Session_CountSteps(doc->undo_stack);
+    header.redoCount = Session_CountSteps(doc->redo_stack);
+    header.cursor = cursor;
+    header.anchor = anchor;
+
+    // Written beside the target and renamed over it, so an older session survives a failure
+    WCHAR tempPath[MAX_PATH + 8];
+    swprintf(tempPath, _countof(tempPath), L"%s.tmp", sessionPath);
+    HANDLE hFile = CreateFileW(tempPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                               FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) return FALSE;
+
+    BOOL ok = Session_Write(hFile, &header, sizeof(header)) &&
+              Session_Write(hFile, doc->add_buffer, doc->add_len * sizeof(WCHAR)) &&
+              Session_WriteList(hFile, doc->head, cursor) &&
+              Session_WriteSteps(hFile, doc->undo_stack) &&
+              Session_WriteSteps(hFile, doc->redo_stack);
+    CloseHandle(hFile);
+
+    if (!ok || !MoveFileExW(tempPath, sessionPath, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+        DeleteFileW(tempPath);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static HANDLE Session_OpenHeader(const WCHAR* sessionPath, SessionHeader* outHeader) {
+    HANDLE hFile = CreateFileW(sessionPath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                               FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) return INVALID_HANDLE_VALUE;
+
+    if (!Session_Read(hFile, outHeader, sizeof(*outHeader)) || outHeader->magic != SESSION_MAGIC ||
+        outHeader->version != SESSION_VERSION) {
+        CloseHandle(hFile);
+        return INVALID_HANDLE_VALUE;
+    }
+    outHeader->originalPath[MAX_PATH - 1] = L'\0';
+    return hFile;
+}
+
+BOOL Doc_GetSessionOriginal(const WCHAR* sessionPath, WCHAR* outPath, size_t outCount) {
+    SessionHeader header;
+    HANDLE hFile = Session_OpenHeader(sessionPath, &header);
+    if (hFile == INVALID_HANDLE_VALUE) return FALSE;
+    CloseHandle(hFile);
+    return wcscpy_s(outPath, outCount, header.originalPath) == 0;
+}
+
+static void Session_FreePieces(Piece* head) {
+    while (head) {
+        Piece* next = head->next;
+        free(head);
+        head = next;
+    }
+}
+
+static void Session_FreeSteps(UndoStep* step) {
+    while (step) {
+        UndoStep* next = step->next;
+        Session_FreePieces(step->pieces);
+        free(step);
+        step = next;
+    }
+}
+
+// Reads one piece list, rejecting pieces that reach outside either buffer
+static BOOL Session_ReadList(HANDLE hFile, const SessionHeader* header, Piece** outHead, size_t* outCursorHint) {
+    SessionList list;
+    *outHead = NULL;
+    if (!Session_Read(hFile, &list, sizeof(list))) return FALSE;
+    if (list.pieceCount > ((ULONGLONG)SIZE_MAX / sizeof(SessionPiece))) return FALSE;
+
+    SessionPiece* pieces = (SessionPiece*)malloc((size_t)(list.pieceCount ? list.pieceCount : 1) * sizeof(SessionPiece));
+    if (!pieces) return FALSE;
+    if (!Session_Read(hFile, pieces, (size_t)list.pieceCount * sizeof(SessionPiece))) {
+        free(pieces);
+        return FALSE;
+    }
+
+    Piece** tail = outHead;
+    BOOL ok = TRUE;
+    for (size_t i = 0; ok && i < list.pieceCount; i++) {
+        const SessionPiece* sp = &pieces[i];
+        ULONGLONG limit = (sp->buffer == BUFFER_ORIGINAL) ? header->originalLen : header->addLen;
+        BOOL isUtf8 = (sp->buffer == BUFFER_ORIGINAL) && Doc_EncodingUnitSize((DocEncoding)header->encoding) == 1;
+        if ((sp->buffer != BUFFER_ORIGINAL && sp->buffer != BUFFER_ADD) ||
+            sp->start > limit || sp->length > limit - sp->start || (sp->isUtf8 != 0) != isUtf8) {
+            ok = FALSE;
+            break;
+        }
+
+        Piece* p = (Piece*)malloc(sizeof(Piece));
+        if (!p) {
+            ok = FALSE;
+            break;
+        }
+        p->buffer = (BufferType)sp->buffer;
+        p->start = (size_t)sp->start;
+        p->length = (size_t)sp->length;
+        p->isUtf8 = isUtf8;
+        p->next = NULL;
+        *tail = p;
+        tail = &p->next;
+    }
+    free(pieces);
+
+    if (!ok) {
+        Session_FreePieces(*outHead);
+        *outHead = NULL;
+        return FALSE;
+    }
+    if (outCursorHint) *outCursorHint = (size_t)list.cursorHint;
+    return TRUE;
+}
+
+static BOOL Session_ReadSteps(HANDLE hFile, const SessionHeader* header, ULONGLONG count, UndoStep** outStack) {
+    UndoStep** tail = outStack;
+    *outStack = NULL;
+    for (ULONGLONG i = 0; i < count; i++) {
+        UndoStep* step = (UndoStep*)calloc(1, sizeof(UndoStep));
+        if (!step) return FALSE;
+        *tail = step;
+        tail = &step->next;
+        if (!Session_ReadList(hFile, header, &step->pieces, &step->cursor_hint)) return FALSE;
+    }
+    return TRUE;
+}
+
+/**
+ * Rebuilds a saved session on 'doc', a freshly opened, unedited mapping of the session's
+ * original file. Only the add buffer and piece lists are read, so this takes milliseconds
+ * however large the original is. The document is left untouched unless this succeeds.
+ */
+DocSessionStatus Doc_RestoreSession(SlateDoc* doc, const WCHAR* sessionPath, size_t* outCursor, size_t* outAnchor) {
+    if (!doc) return DOC_SESSION_UNREADABLE;
+
+    SessionHeader header;
+    HANDLE hFile = Session_OpenHeader(sessionPath, &header);
+    if (hFile == INVALID_HANDLE_VALUE) return DOC_SESSION_UNREADABLE;
+
+    ULONGLONG fileSize;
+    FILETIME lastWrite;
+    if (!Session_GetIdentity(header.originalPath, &fileSize, &lastWrite) || fileSize != header.fileSize ||
+        CompareFileTime(&lastWrite, &header.lastWrite) != 0 || header.originalLen != doc->original_len ||
+        header.encoding != (DWORD)doc->encoding || header.codePage != doc->code_page ||
+        header.sampleHash != Session_SampleOriginal(doc)) {
+        CloseHandle(hFile);
+        return DOC_SESSION_ORIGINAL_CHANGED;
+    }
+
+    size_t addCapacity = (header.addLen > 8192) ? (size_t)header.addLen : 8192;
+    WCHAR* addBuffer = (header.addLen <= (ULONGLONG)SIZE_MAX / sizeof(WCHAR))
+                           ? (WCHAR*)malloc(addCapacity * sizeof(WCHAR)) : NULL;
+    Piece* head = NULL;
+    UndoStep* undo = NULL;
+    UndoStep* redo = NULL;
+    BOOL ok = addBuffer && Session_Read(hFile, addBuffer, (size_t)header.addLen * sizeof(WCHAR)) &&
+              Session_ReadList(hFile, &header, &head, NULL) &&
+              Session_ReadSteps(hFile, &header, header.undoCount, &undo) &&
+              Session_ReadSteps(hFile, &header, header.redoCount, &redo);
+    CloseHandle(hFile);
+
+    if (!ok) {
+        free(addBuffer);
+        Session_FreePieces(head);
+        Session_FreeSteps(undo);
+        Session_FreeSteps(redo);
+        return DOC_SESSION_UNREADABLE;
+    }
+
+    Session_FreePieces(doc->head);
+    Session_FreeSteps(doc->undo_stack);
+    Session_FreeSteps(doc->redo_stack);
+    free(doc->add_buffer);
+
+    doc->add_buffer = addBuffer;
+    doc->add_len = (size_t)header.addLen;
+    doc->add_capacity = addCapacity;
+    doc->head = head;
+    doc->undo_stack = undo;
+    doc->redo_stack = redo;
+    Doc_RefreshMetadata(doc);
+
+    if (outCursor) *outCursor = (size_t)header.cursor;
+    if (outAnchor) *outAnchor = (size_t)header.anchor;
+    return DOC_SESSION_OK;
+}
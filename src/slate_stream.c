@@ -0,0 +1,174 @@
+#include "slate_stream.h"
+#include <stdlib.h>
+
+#define STREAM_MIN_RESERVE (64 * 1024 * 1024)
+
+struct SlateStream {
+    HANDLE hSource;
+    HANDLE hThread;
+    HWND hwndNotify;
+    UINT msg;
+
+    BYTE* base;                  // Reserved range; the document owns it once adopted
+    size_t reserved;
+    size_t committed;            // Reader thread only
+
+    // Written by the reader, read by the UI thread. Aligned volatile stores are published
+    // in order on the targets Slate builds for, and 'done' is always set after 'received'.
+    volatile size_t received;
+    volatile LONG done;
+    volatile LONG truncated;     // The reserved range filled up before the source ended
+    volatile LONG cancel;
+    volatile LONG notifyPending;
+
+    SlateDoc* doc;
+    BOOL adopted;                // The document reads (and will free) the reserved range
+    BOOL finished;               // The reader had ended as of the last update
+    size_t skip;                 // BOM bytes before the text
+    size_t unitSize;
+    size_t units;                // Units handed to the document so far
+};
+
+static void Stream_Notify(SlateStream* stream) {
+    // One message in flight at a time keeps a fast source from flooding the queue
+    if (InterlockedExchange(&stream->notifyPending, 1) == 0) {
+        PostMessageW(stream->hwndNotify, stream->msg, 0, (LPARAM)stream);
+    }
+}
+
+static DWORD WINAPI Stream_ReadThread(LPVOID param) {
+    SlateStream* stream = (SlateStream*)param;
+
+    while (!stream->cancel) {
+        size_t have = stream->received;
+        if (have == stream->reserved) {
+            InterlockedExchange(&stream->truncated, 1);
+            break;
+        }
+        size_t want = stream->reserved - have;
+        if (want > STREAM_READ_BYTES) want = STREAM_READ_BYTES;
+
+        if (have + want > stream->committed) {
+            size_t target = stream->committed + STREAM_COMMIT_BYTES;
+            if (target > stream->reserved) target = stream->reserved;
+            if (!VirtualAlloc(stream->base + stream->committed, target - stream->committed, MEM_COMMIT, PAGE_READWRITE)) {
+                InterlockedExchange(&stream->truncated, 1);
+                break;
+            }
+            stream->committed = target;
+        }
+
+        // Pipes return whatever is available, so the first screen shows up without waiting
+        // for a full read; a broken pipe is the normal end of a producer's output
+        DWORD got = 0;
+        if (!ReadFile(stream->hSource, stream->base + have, (DWORD)want, &got, NULL) || got == 0) break;
+        stream->received = have + got;
+        Stream_Notify(stream);
+    }
+
+    InterlockedExchange(&stream->done, 1);
+    PostMessageW(stream->hwndNotify, stream->msg, 0, (LPARAM)stream);
+    return 0;
+}
+
+SlateStream* Stream_Open(HANDLE hSource, HWND hwndNotify, UINT msg) {
+    if (!hSource || hSource == INVALID_HANDLE_VALUE) return NULL;
+
+    SlateStream* stream = (SlateStream*)calloc(1, sizeof(SlateStream));
+    if (!stream) {
+        CloseHandle(hSource);
+        return NULL;
+    }
+    stream->hSource = hSource;
+    stream->hwndNotify = hwndNotify;
+    stream->msg = msg;
+
+    // Fragmented address spaces may not have the full range free in one piece
+    for (size_t size = (size_t)STREAM_RESERVE_BYTES; size >= STREAM_MIN_RESERVE && !stream->base; size /= 2) {
+        stream->base = (BYTE*)VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_READWRITE);
+        stream->reserved = size;
+    }
+
+    stream->hThread = stream->base ? CreateThread(NULL, 0, Stream_ReadThread, stream, 0, NULL) : NULL;
+    if (!stream->hThread) {
+        if (stream->base) VirtualFree(stream->base, 0, MEM_RELEASE);
+        CloseHandle(hSource);
+        free(stream);
+        return NULL;
+    }
+    return stream;
+}
+
+SlateDoc* Stream_GetDocument(SlateStream* stream) {
+    if (!stream) return NULL;
+    if (stream->doc) return stream->doc;
+    InterlockedExchange(&stream->notifyPending, 0);
+
+    BOOL done = (stream->done != 0);
+    size_t received = stream->received;
+    if (received == 0 && !done) return NULL;
+
+    // Guessed from the first chunk, since the document is shown before the rest arrives
+    UINT codePage = 0;
+    DocEncoding encoding = Doc_DetectEncoding(stream->base, received, &stream->skip, &codePage);
+    stream->unitSize = Doc_EncodingUnitSize(encoding);
+    size_t units = (received > stream->skip) ? (received - stream->skip) / stream->unitSize : 0;
+
+    if (units == 0) {
+        if (!done) return NULL; // Only a byte order mark so far
+        stream->doc = Doc_CreateEmpty();
+    } else {
+        stream->doc = Doc_CreateStreaming(stream->base + stream->skip, units, stream->base, stream->reserved,
+                                          encoding, codePage);
+        stream->adopted = (stream->doc != NULL);
+        stream->units = units;
+    }
+    stream->finished = done;
+    return stream->doc;
+}
+
+size_t Stream_Update(SlateStream* stream) {
+    if (!stream) return 0;
+    InterlockedExchange(&stream->notifyPending, 0);
+
+    // Read the end flag first, so the length read after it includes everything
+    BOOL done = (stream->done != 0);
+    size_t received = stream->received;
+    if (stream->doc) stream->finished = done;
+    if (!stream->adopted) return 0;
+
+    size_t units = (received - stream->skip) / stream->unitSize;
+    if (units <= stream->units) return 0;
+
+    size_t added = units - stream->units;
+    if (!Doc_AppendOriginal(stream->doc, added)) return 0;
+    stream->units = units;
+    return added;
+}
+
+BOOL Stream_IsDone(SlateStream* stream) {
+    return stream && stream->finished;
+}
+
+BOOL Stream_IsTruncated(SlateStream* stream) {
+    return stream && stream->truncated;
+}
+
+ULONGLONG Stream_GetBytesRead(SlateStream* stream) {
+    return stream ? (ULONGLONG)stream->received : 0;
+}
+
+void Stream_Close(SlateStream* stream) {
+    if (!stream) return;
+
+    // A read blocked on an idle pipe or console only returns once cancelled
+    InterlockedExchange(&stream->cancel, 1);
+    while (WaitForSingleObject(stream->hThread, 50) == WAIT_TIMEOUT) {
+        CancelSynchronousIo(stream->hThread);
+    }
+    CloseHandle(stream->hThread);
+    CloseHandle(stream->hSource);
+
+    if (!stream->adopted) VirtualFree(stream->base, 0, MEM_RELEASE);
+    free(stream);
+}
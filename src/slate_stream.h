@@ -0,0 +1,40 @@
+#ifndef SLATE_STREAM_H
+#define SLATE_STREAM_H
+
+#include "slate_doc.h"
+
+// Reads a source that cannot be mapped (stdin, a pipe, a device) on a background thread into
+// one reserved address range, committed as data arrives. The range becomes the document's
+// original buffer, so it never moves and the document can be shown while the rest streams in.
+#ifdef _WIN64
+#define STREAM_RESERVE_BYTES (64ULL * 1024 * 1024 * 1024)
+#else
+#define STREAM_RESERVE_BYTES (1024u * 1024 * 1024)
+#endif
+#define STREAM_READ_BYTES    (1024 * 1024)      // Largest single read from the source
+#define STREAM_COMMIT_BYTES  (16 * 1024 * 1024) // Pages are committed ahead in steps this big
+
+typedef struct SlateStream SlateStream;
+
+// Starts reading; takes ownership of hSource. The reader posts 'msg' to hwndNotify with the
+// stream as lParam whenever data arrives (one message in flight at a time) and once at the end.
+SlateStream* Stream_Open(HANDLE hSource, HWND hwndNotify, UINT msg);
+
+// The document over the data received so far, created on the first call that has data (or
+// finds the source ended). Returns NULL until then. The caller owns the document but must
+// call Stream_Close before destroying it.
+SlateDoc*    Stream_GetDocument(SlateStream* stream);
+
+// Appends what arrived since the last call to the document; returns the units added
+size_t       Stream_Update(SlateStream* stream);
+
+// TRUE once the source reached its end (or failed) and everything read was handed over
+BOOL         Stream_IsDone(SlateStream* stream);
+// TRUE if the source outgrew the reserved range and the rest of it was not read
+BOOL         Stream_IsTruncated(SlateStream* stream);
+ULONGLONG    Stream_GetBytesRead(SlateStream* stream);
+
+// Stops the reader; a document already created keeps the text received so far
+void         Stream_Close(SlateStream* stream);
+
+#endif
@@ -0,0 +1,258 @@
+#include "slate_utf.h"
+
+// SLATE_UTF_SCALAR builds the plain loops alone, for comparing against the SSE2 paths
+#if (defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)) && !defined(SLATE_UTF_SCALAR)
+#define SLATE_UTF_SSE2 1
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#else
+#define SLATE_UTF_SSE2 0
+#endif
+
+#define UTF_REPLACEMENT 0xFFFD
+
+#if SLATE_UTF_SSE2
+// Index of the lowest set bit of a nonzero mask
+static unsigned LowestBit(unsigned mask) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (unsigned)index;
+#else
+    return (unsigned)__builtin_ctz(mask);
+#endif
+}
+#endif
+
+size_t Utf8_ToUtf16(const char* src, size_t srcLen, WCHAR* dst, size_t dstCap, size_t* outConsumed) {
+    const unsigned char* s = (const unsigned char*)src;
+    size_t i = 0, o = 0;
+
+    while (i < srcLen) {
+#if SLATE_UTF_SSE2
+        // ASCII fast path: widen 16 bytes at a time, keeping those before the first with its
+        // top bit set. Entered only at an ASCII byte, so in mixed text every pass gains some.
+        const __m128i zero = _mm_setzero_si128();
+        while (s[i] < 0x80 && i + 16 <= srcLen && o + 16 <= dstCap) {
+            __m128i bytes = _mm_loadu_si128((const __m128i*)(s + i));
+            _mm_storeu_si128((__m128i*)(dst + o), _mm_unpacklo_epi8(bytes, zero));
+            _mm_storeu_si128((__m128i*)(dst + o + 8), _mm_unpackhi_epi8(bytes, zero));
+            unsigned high = (unsigned)_mm_movemask_epi8(bytes);
+            size_t ascii = high ? LowestBit(high) : 16;
+            i += ascii;
+            o += ascii;
+            if (i >= srcLen) break;
+        }
+        if (i >= srcLen) break;
+#endif
+        unsigned c = s[i];
+        if (c < 0x80) {
+            if (o >= dstCap) break;
+            dst[o++] = (WCHAR)c;
+            i++;
+            continue;
+        }
+
+        // Multi-byte sequence; ill-formed input yields one U+FFFD per maximal subpart
+        size_t need = 0;
+        unsigned cp = 0;
+        unsigned lo = 0x80, hi = 0xBF;
+        if (c >= 0xC2 && c <= 0xDF) {
+            need = 1;
+            cp = c & 0x1F;
+        } else if (c >= 0xE0 && c <= 0xEF) {
+            need = 2;
+            cp = c & 0x0F;
+            if (c == 0xE0) lo = 0xA0;       // Overlong
+            else if (c == 0xED) hi = 0x9F;  // Surrogates
+        } else if (c >= 0xF0 && c <= 0xF4) {
+            need = 3;
+            cp = c & 0x07;
+            if (c == 0xF0) lo = 0x90;       // Overlong
+            else if (c == 0xF4) hi = 0x8F;  // Above U+10FFFF
+        }
+
+        size_t len = 1;
+        BOOL valid = (need > 0);
+        for (size_t k = 1; valid && k <= need; k++) {
+            if (i + k >= srcLen) {
+                valid = FALSE;
+                break;
+            }
+            unsigned b = s[i + k];
+            if (b < lo || b > hi) {
+                valid = FALSE;
+                break;
+            }
+            lo = 0x80;
+            hi = 0xBF;
+            cp = (cp << 6) | (b & 0x3F);
+            len++;
+        }
+
+        if (!valid) {
+            if (o >= dstCap) break;
+            dst[o++] = UTF_REPLACEMENT;
+        } else if (cp >= 0x10000) {
+            if (o + 2 > dstCap) break;
+            cp -= 0x10000;
+            dst[o++] = (WCHAR)(0xD800 + (cp >> 10));
+            dst[o++] = (WCHAR)(0xDC00 + (cp & 0x3FF));
+        } else {
+            if (o >= dstCap) break;
+            dst[o++] = (WCHAR)cp;
+        }
+        i += len;
+    }
+
+    if (outConsumed) *outConsumed = i;
+    return o;
+}
+
+size_t Utf16_ToUtf8(const WCHAR* src, size_t srcLen, char* dst, size_t dstCap, size_t* outConsumed) {
+    unsigned char* d = (unsigned char*)dst;
+    size_t i = 0, o = 0;
+
+    while (i < srcLen) {
+#if SLATE_UTF_SSE2
+        // ASCII fast path: narrow 8 units at a time, keeping those before the first at or
+        // above 0x80. Entered only at an ASCII unit, as above.
+        const __m128i highMask = _mm_set1_epi16((short)0xFF80);
+        const __m128i zero = _mm_setzero_si128();
+        while (src[i] < 0x80 && i + 8 <= srcLen && o + 8 <= dstCap) {
+            __m128i units = _mm_loadu_si128((const __m128i*)(src + i));
+            _mm_storel_epi64((__m128i*)(d + o), _mm_packus_epi16(units, units));
+            unsigned high = ~(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(units, highMask), zero)) & 0xFFFF;
+            size_t ascii = high ? LowestBit(high) / 2 : 8;
+            i += ascii;
+            o += ascii;
+            if (i >= srcLen) break;
+        }
+        if (i >= srcLen) break;
+#endif
+        unsigned c = src[i];
+        size_t used = 1;
+        if (c < 0x80) {
+            if (o >= dstCap) break;
+            d[o++] = (unsigned char)c;
+        } else if (c < 0x800) {
+            if (o + 2 > dstCap) break;
+            d[o++] = (unsigned char)(0xC0 | (c >> 6));
+            d[o++] = (unsigned char)(0x80 | (c & 0x3F));
+        } else if (c >= 0xD800 && c <= 0xDBFF && i + 1 < srcLen && src[i + 1] >= 0xDC00 && src[i + 1] <= 0xDFFF) {
+            if (o + 4 > dstCap) break;
+            unsigned cp = 0x10000 + ((c - 0xD800) << 10) + (src[i + 1] - 0xDC00);
+            d[o++] = (unsigned char)(0xF0 | (cp >> 18));
+            d[o++] = (unsigned char)(0x80 | ((cp >> 12) & 0x3F));
+            d[o++] = (unsigned char)(0x80 | ((cp >> 6) & 0x3F));
+            d[o++] = (unsigned char)(0x80 | (cp & 0x3F));
+            used = 2;
+        } else {
+            // Unpaired surrogates are replaced, like WideCharToMultiByte does
+            if (c >= 0xD800 && c <= 0xDFFF) c = UTF_REPLACEMENT;
+            if (o + 3 > dstCap) break;
+            d[o++] = (unsigned char)(0xE0 | (c >> 12));
+            d[o++] = (unsigned char)(0x80 | ((c >> 6) & 0x3F));
+            d[o++] = (unsigned char)(0x80 | (c & 0x3F));
+        }
+        i += used;
+    }
+
+    if (outConsumed) *outConsumed = i;
+    return o;
+}
+
+static UINT32 SwapBytes32(UINT32 v) {
+    return (v >> 24) | ((v >> 8) & 0xFF00) | ((v << 8) & 0xFF0000) | (v << 24);
+}
+
+size_t Utf32_ToUtf16(const UINT32* src, size_t srcLen, BOOL bigEndian, BOOL pairs,
+                     WCHAR* dst, size_t dstCap, size_t* outConsumed) {
+    size_t i = 0, o = 0;
+    for (; i < srcLen; i++) {
+        UINT32 cp = bigEndian ? SwapBytes32(src[i]) : src[i];
+        if (cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF)) cp = UTF_REPLACEMENT;
+
+        if (cp >= 0x10000 && pairs) {
+            if (o + 2 > dstCap) break;
+            cp -= 0x10000;
+            dst[o++] = (WCHAR)(0xD800 + (cp >> 10));
+            dst[o++] = (WCHAR)(0xDC00 + (cp & 0x3FF));
+        } else {
+            if (o >= dstCap) break;
+            dst[o++] = (cp >= 0x10000) ? (WCHAR)UTF_REPLACEMENT : (WCHAR)cp;
+        }
+    }
+
+    if (outConsumed) *outConsumed = i;
+    return o;
+}
+
+size_t Utf16_ToUtf32(const WCHAR* src, size_t srcLen, BOOL bigEndian, UINT32* dst, size_t dstCap, size_t* outConsumed) {
+    size_t i = 0, o = 0;
+    while (i < srcLen && o < dstCap) {
+        UINT32 cp = src[i];
+        size_t used = 1;
+        if (cp >= 0xD800 && cp <= 0xDBFF && i + 1 < srcLen && src[i + 1] >= 0xDC00 && src[i + 1] <= 0xDFFF) {
+            cp = 0x10000 + ((cp - 0xD800) << 10) + (src[i + 1] - 0xDC00);
+            used = 2;
+        } else if (cp >= 0xD800 && cp <= 0xDFFF) {
+            cp = UTF_REPLACEMENT;
+        }
+        dst[o++] = bigEndian ? SwapBytes32(cp) : cp;
+        i += used;
+    }
+
+    if (outConsumed) *outConsumed = i;
+    return o;
+}
+
+size_t Utf8_ValidPrefix(const char* src, size_t srcLen) {
+    const unsigned char* s = (const unsigned char*)src;
+    size_t i = 0;
+
+    while (i < srcLen) {
+#if SLATE_UTF_SSE2
+        while (i + 16 <= srcLen && _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(s + i))) == 0) {
+            i += 16;
+        }
+        if (i >= srcLen) break;
+#endif
+        unsigned c = s[i];
+        if (c < 0x80) {
+            i++;
+            continue;
+        }
+
+        // Same well-formedness rules as Utf8_ToUtf16
+        size_t need;
+        unsigned lo = 0x80, hi = 0xBF;
+        if (c >= 0xC2 && c <= 0xDF) {
+            need = 1;
+        } else if (c >= 0xE0 && c <= 0xEF) {
+            need = 2;
+            if (c == 0xE0) lo = 0xA0;
+            else if (c == 0xED) hi = 0x9F;
+        } else if (c >= 0xF0 && c <= 0xF4) {
+            need = 3;
+            if (c == 0xF0) lo = 0x90;
+            else if (c == 0xF4) hi = 0x8F;
+        } else {
+            break;
+        }
+
+        if (i + need >= srcLen) break;
+        size_t k = 1;
+        for (; k <= need; k++) {
+            unsigned b = s[i + k];
+            if (b < lo || b > hi) break;
+            lo = 0x80;
+            hi = 0xBF;
+        }
+        if (k <= need) break;
+        i += need + 1;
+    }
+    return i;
+}
@@ -0,0 +1,34 @@
+#ifndef SLATE_UTF_H
+#define SLATE_UTF_H
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <stddef.h>
+#include <stdint.h>
+typedef int BOOL;
+typedef unsigned short WCHAR;   // UTF-16 code units, as on Windows
+typedef uint32_t UINT32;
+#define TRUE  1
+#define FALSE 0
+#endif
+
+// UTF-8 <-> UTF-16 transcoding with an SSE2 ASCII fast path. Invalid input becomes U+FFFD,
+// matching MultiByteToWideChar/WideCharToMultiByte on CP_UTF8. Conversion stops before a
+// code point that would not fit in dst; *outConsumed (optional) reports how much of src
+// was used. Both return the number of units written; dst past them, up to dstCap, may have
+// been written as scratch.
+size_t Utf8_ToUtf16(const char* src, size_t srcLen, WCHAR* dst, size_t dstCap, size_t* outConsumed);
+size_t Utf16_ToUtf8(const WCHAR* src, size_t srcLen, char* dst, size_t dstCap, size_t* outConsumed);
+
+// UTF-32 <-> UTF-16 in either byte order of the UTF-32 side. Code points above U+FFFF
+// become surrogate pairs, or U+FFFD when 'pairs' is FALSE so each unit yields one WCHAR.
+size_t Utf32_ToUtf16(const UINT32* src, size_t srcLen, BOOL bigEndian, BOOL pairs,
+                     WCHAR* dst, size_t dstCap, size_t* outConsumed);
+size_t Utf16_ToUtf32(const WCHAR* src, size_t srcLen, BOOL bigEndian, UINT32* dst, size_t dstCap, size_t* outConsumed);
+
+// Length of the well-formed UTF-8 prefix of src, skipping ASCII 16 bytes at a time.
+// A sequence cut off by srcLen counts as ill-formed.
+size_t Utf8_ValidPrefix(const char* src, size_t srcLen);
+
+#endif
@@ -42,161 +42,599 @@ static BOOL View_LoadLine(ViewState* pState, size_t lineIdx, size_t* pLineStart,
     return TRUE;
 }
 
-// Rebuild the visual line cache for wrapped display
-static void RebuildWrapCache(HWND hwnd, ViewState* pState) {
-    if (!pState || !pState->pDoc || !pState->bWordWrap) {
-        pState->wrapCacheValid = FALSE;
-        pState->visualLineCount = 0;
-        return;
+// Length of a line without its line break, reading only the break itself
+static size_t View_LineLength(SlateDoc* pDoc, size_t lineIdx, size_t* pLineStart, size_t* pLineEnd) {
+    size_t lineStart = Doc_GetLineOffset(pDoc, lineIdx);
+    size_t lineEnd = (lineIdx + 1 < pDoc->line_count) ? Doc_GetLineOffset(pDoc, lineIdx + 1) : pDoc->total_length;
+    size_t len = lineEnd - lineStart;
+
+    WCHAR tail[2];
+    size_t n = (len < 2) ? len : 2;
+    if (n > 0 && Doc_GetText(pDoc, lineEnd - n, n, tail) == n) {
+        while (n > 0 && (tail[n - 1] == L'\n' || tail[n - 1] == L'\r')) {
+            n--;
+            len--;
+        }
     }
+    if (pLineStart) *pLineStart = lineStart;
+    if (pLineEnd) *pLineEnd = lineEnd;
+    return len;
+}
 
-    if (pState->pDoc->line_count == 0) {
-        pState->wrapCacheValid = FALSE;
-        pState->visualLineCount = 0;
-        return;
+static void ResetAdvances(CharAdvances* adv) {
+    for (size_t i = 0; i < 65536 / ADVANCE_BLOCK_CHARS; i++) free(adv->blocks[i]);
+    ZeroMemory(adv, sizeof(CharAdvances));
+}
+
+// The advance table for the view font, started over if the font has changed
+static CharAdvances* GetAdvances(ViewState* pState, HDC hdc) {
+    CharAdvances* adv = &pState->advances;
+    if (adv->font == pState->hFont) return adv;
+
+    ResetAdvances(adv);
+    TEXTMETRIC tm;
+    GetTextMetrics(hdc, &tm);
+    adv->font = pState->hFont;
+    // TMPF_FIXED_PITCH is set for variable pitch fonts; a fixed-pitch font with some wider
+    // glyphs is measured per character like any other
+    adv->fixedPitch = !(tm.tmPitchAndFamily & TMPF_FIXED_PITCH) && tm.tmAveCharWidth == tm.tmMaxCharWidth;
+    adv->fixedWidth = tm.tmAveCharWidth;
+    return adv;
+}
+
+static int* FillAdvanceBlock(CharAdvances* adv, HDC hdc, WCHAR ch) {
+    size_t block = ch / ADVANCE_BLOCK_CHARS;
+    int* widths = (int*)malloc(ADVANCE_BLOCK_CHARS * sizeof(int));
+    if (!widths) return NULL;
+    UINT first = (UINT)(block * ADVANCE_BLOCK_CHARS);
+    if (!GetCharWidth32W(hdc, first, first + ADVANCE_BLOCK_CHARS - 1, widths)) {
+        for (size_t i = 0; i < ADVANCE_BLOCK_CHARS; i++) widths[i] = adv->fixedWidth;
     }
+    adv->blocks[block] = widths;
+    return widths;
+}
 
-    RECT clientRect;
-    GetClientRect(hwnd, &clientRect);
-    int wrapWidth = clientRect.right - 10;
+typedef struct {
+    CharAdvances* adv;
+    HDC hdc;
+} ViewMeasure;
+
+// LayoutMeasure advance callback: BMP characters from the table, others measured by GDI
+static int View_Advance(void* context, uint32_t codePoint) {
+    ViewMeasure* vm = (ViewMeasure*)context;
+    if (codePoint > 0xFFFF) {
+        WCHAR pair[2] = { (WCHAR)(0xD800 + ((codePoint - 0x10000) >> 10)), (WCHAR)(0xDC00 + ((codePoint - 0x10000) & 0x3FF)) };
+        SIZE sz = {0};
+        GetTextExtentPoint32W(vm->hdc, pair, 2, &sz);
+        return sz.cx;
+    }
+    int* widths = vm->adv->blocks[codePoint / ADVANCE_BLOCK_CHARS];
+    if (!widths && !(widths = FillAdvanceBlock(vm->adv, vm->hdc, (WCHAR)codePoint))) return vm->adv->fixedWidth;
+    return widths[codePoint % ADVANCE_BLOCK_CHARS];
+}
+
+// The layout code's view of the font selected into hdc; vm must outlive the measure
+static void View_GetMeasure(ViewState* pState, HDC hdc, int tabStops, LayoutMeasure* m, ViewMeasure* vm) {
+    vm->adv = GetAdvances(pState, hdc);
+    vm->hdc = hdc;
+    m->advance = View_Advance;
+    m->context = vm;
+    m->fixedWidth = vm->adv->fixedPitch ? vm->adv->fixedWidth : 0;
+    m->tabWidth = tabStops;
+}
+
+// Layout_MeasureRun with the view font
+static long long MeasureRun(ViewState* pState, HDC hdc, const WCHAR* text, size_t len, long long x0, int tabStops,
+                            long long* outX) {
+    LayoutMeasure m;
+    ViewMeasure vm;
+    View_GetMeasure(pState, hdc, tabStops, &m, &vm);
+    return Layout_MeasureRun(&m, text, len, x0, outX);
+}
+
+static void ClearColumnSlot(LineColumns* cols) {
+    free(cols->xs);
+    ZeroMemory(cols, sizeof(LineColumns));
+    cols->line = (size_t)-1;
+}
+
+static void ResetColumnCache(ViewState* pState) {
+    if (!pState->columnCache) return;
+    for (size_t i = 0; i < COLUMN_CACHE_SLOTS; i++) {
+        ClearColumnSlot(&pState->columnCache[i]);
+    }
+}
+
+// Carries the cache across one edit. Lines before it are untouched; the edited line keeps
+// the checkpoints before the edit's column and takes its new length on its next lookup;
+// lines after it move to their new index unless the edit merged them away.
+static void ColumnCache_ApplyEdit(ViewState* pState, const DocEdit* edit) {
+    BOOL unknown = (edit->linesInserted == DOC_EDIT_UNKNOWN);
+    LineColumns moved[COLUMN_CACHE_SLOTS];
+    size_t movedCount = 0;
+
+    for (size_t i = 0; i < COLUMN_CACHE_SLOTS; i++) {
+        LineColumns* cols = &pState->columnCache[i];
+        if (cols->line == (size_t)-1 || cols->line < edit->line) continue;
+
+        if (cols->line == edit->line) {
+            size_t keep = edit->column / COLUMN_CHECKPOINT_CHARS + 1;
+            if (cols->count > keep) cols->count = keep;
+            cols->length = COLUMN_LENGTH_PENDING;
+        } else if (unknown || cols->line <= edit->line + edit->linesRemoved) {
+            ClearColumnSlot(cols);
+        } else if (edit->linesInserted != edit->linesRemoved) {
+            moved[movedCount] = *cols;
+            moved[movedCount].line = cols->line - edit->linesRemoved + edit->linesInserted;
+            movedCount++;
+            ZeroMemory(cols, sizeof(LineColumns));
+            cols->line = (size_t)-1;
+        }
+    }
+    for (size_t i = 0; i < movedCount; i++) {
+        LineColumns* cols = &pState->columnCache[moved[i].line % COLUMN_CACHE_SLOTS];
+        ClearColumnSlot(cols);
+        *cols = moved[i];
+    }
+}
+
+// The checkpoints of a long unwrapped line, or NULL for a line short enough to measure whole.
+// Edits since the cache was last used are replayed from the document's log, so typing into
+// a long line only remeasures it from the edit on; a new document starts over.
+static LineColumns* GetLineColumns(ViewState* pState, size_t lineIdx, size_t lineLen) {
+    if (lineLen <= COLUMN_CHECKPOINT_CHARS) return NULL;
+
+    SlateDoc* pDoc = pState->pDoc;
+    if (!pState->columnCache) {
+        pState->columnCache = calloc(COLUMN_CACHE_SLOTS, sizeof(LineColumns));
+        if (!pState->columnCache) return NULL;
+        ResetColumnCache(pState);
+        pState->columnCacheRevision = pDoc->revision;
+        pState->columnCacheGeneration = pState->docGeneration;
+    }
+    if (pState->columnCacheGeneration != pState->docGeneration) {
+        ResetColumnCache(pState);
+        pState->columnCacheRevision = pDoc->revision;
+        pState->columnCacheGeneration = pState->docGeneration;
+    }
+    while (pState->columnCacheRevision != pDoc->revision) {
+        DocEdit edit;
+        if (!Doc_GetEdit(pDoc, pState->columnCacheRevision + 1, &edit)) {
+            ResetColumnCache(pState);
+            pState->columnCacheRevision = pDoc->revision;
+            break;
+        }
+        ColumnCache_ApplyEdit(pState, &edit);
+        pState->columnCacheRevision++;
+    }
+
+    LineColumns* cols = &pState->columnCache[lineIdx % COLUMN_CACHE_SLOTS];
+    if (cols->line == lineIdx && cols->length == COLUMN_LENGTH_PENDING) cols->length = lineLen;
+    if (cols->line == lineIdx && cols->length == lineLen) return cols;
+
+    ClearColumnSlot(cols);
+    cols->xs = (long long*)malloc(16 * sizeof(long long));
+    if (!cols->xs) return NULL;
+    cols->capacity = 16;
+    cols->xs[0] = 0;
+    cols->count = 1;
+    cols->line = lineIdx;
+    cols->length = lineLen;
+    return cols;
+}
+
+// Measures checkpoints until the last one lies past untilX or at or beyond untilCol, or the line ends
+static void LineColumns_Extend(ViewState* pState, HDC hdc, int tabStops, LineColumns* cols, size_t lineStart,
+                               long long untilX, size_t untilCol) {
+    WCHAR chunk[COLUMN_CHECKPOINT_CHARS];
+    while (cols->xs[cols->count - 1] <= untilX && (cols->count - 1) * COLUMN_CHECKPOINT_CHARS < untilCol &&
+           cols->count * COLUMN_CHECKPOINT_CHARS <= cols->length) {
+        if (cols->count == cols->capacity) {
+            long long* grown = (long long*)realloc(cols->xs, cols->capacity * 2 * sizeof(long long));
+            if (!grown) return;
+            cols->xs = grown;
+            cols->capacity *= 2;
+        }
+        size_t from = (cols->count - 1) * COLUMN_CHECKPOINT_CHARS;
+        if (Doc_GetText(pState->pDoc, lineStart + from, COLUMN_CHECKPOINT_CHARS, chunk) != COLUMN_CHECKPOINT_CHARS) return;
+        cols->xs[cols->count] = MeasureRun(pState, hdc, chunk, COLUMN_CHECKPOINT_CHARS, cols->xs[cols->count - 1], tabStops, NULL);
+        cols->count++;
+    }
+}
 
-    // Check if we need to rebuild - MUST check document generation!
-    if (pState->wrapCacheValid && 
-        pState->cachedWrapWidth == wrapWidth &&
-        pState->cachedDocGeneration == pState->docGeneration) {
-        
-        // Lazy line map check: if the document has discovered more lines since we cached,
-        // our "last line" (which previously contained the rest of the file) is now invalid.
-        if (pState->visualLineCount > 0) {
-            size_t lastCachedLogLine = pState->visualLines[pState->visualLineCount - 1].logicalLine;
-            if (lastCachedLogLine == pState->pDoc->line_count - 1) {
-                return;  // Cache is still valid
-            }
+// Columns [from, to) of a line, starting at x from the line origin
+typedef struct {
+    size_t from;
+    size_t to;
+    long long x;
+} LineSlice;
+
+// The part of an unwrapped line covering x range [leftX, rightX]: from the last checkpoint
+// at or before leftX to the first one past rightX. A short line is one slice.
+static void View_SliceForX(ViewState* pState, HDC hdc, int tabStops, size_t lineIdx, size_t lineStart, size_t lineLen,
+                           long long leftX, long long rightX, LineSlice* out) {
+    out->from = 0;
+    out->to = lineLen;
+    out->x = 0;
+
+    LineColumns* cols = GetLineColumns(pState, lineIdx, lineLen);
+    if (!cols) return;
+    LineColumns_Extend(pState, hdc, tabStops, cols, lineStart, rightX, (size_t)-1);
+
+    size_t lo = 0, hi = cols->count;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (cols->xs[mid] <= leftX) lo = mid;
+        else hi = mid;
+    }
+    out->from = lo * COLUMN_CHECKPOINT_CHARS;
+    out->x = cols->xs[lo];
+
+    for (size_t k = lo + 1; k < cols->count; k++) {
+        if (cols->xs[k] > rightX) {
+            out->to = k * COLUMN_CHECKPOINT_CHARS;
+            break;
         }
     }
+}
+
+// x of column 'col' of an unwrapped line, from the line origin
+static long long View_ColumnToX(ViewState* pState, HDC hdc, int tabStops, size_t lineIdx, size_t lineStart,
+                                size_t lineLen, size_t col) {
+    size_t from = 0;
+    long long x = 0;
+    LineColumns* cols = (col > COLUMN_CHECKPOINT_CHARS) ? GetLineColumns(pState, lineIdx, lineLen) : NULL;
+    if (cols) {
+        LineColumns_Extend(pState, hdc, tabStops, cols, lineStart, LLONG_MAX, col);
+        size_t k = col / COLUMN_CHECKPOINT_CHARS;
+        if (k >= cols->count) k = cols->count - 1;
+        from = k * COLUMN_CHECKPOINT_CHARS;
+        x = cols->xs[k];
+    }
+    if (col <= from) return x;
+
+    WCHAR* buf = (WCHAR*)malloc((col - from) * sizeof(WCHAR));
+    if (!buf) return x;
+    size_t n = Doc_GetText(pState->pDoc, lineStart + from, col - from, buf);
+    x = MeasureRun(pState, hdc, buf, n, x, tabStops, NULL);
+    free(buf);
+    return x;
+}
+
+// Column of the character boundary nearest targetX on an unwrapped line
+static size_t View_XToColumn(ViewState* pState, HDC hdc, int tabStops, size_t lineIdx, size_t lineStart,
+                             size_t lineLen, long long targetX) {
+    LineSlice slice;
+    View_SliceForX(pState, hdc, tabStops, lineIdx, lineStart, lineLen, targetX, targetX, &slice);
+
+    size_t n = slice.to - slice.from;
+    WCHAR* buf = (WCHAR*)malloc((n + 1) * sizeof(WCHAR));
+    size_t best = slice.from;
+    if (buf) {
+        n = Doc_GetText(pState->pDoc, lineStart + slice.from, n, buf);
+        LayoutMeasure m;
+        ViewMeasure vm;
+        View_GetMeasure(pState, hdc, tabStops, &m, &vm);
+        best = slice.from + Layout_ColumnAtX(&m, buf, n, slice.x, targetX);
+    }
+    free(buf);
+    return best;
+}
+
+// Caret x of an offset on its unwrapped line, from the line origin; *pLine receives the line index
+static long long View_OffsetToLineX(ViewState* pState, HDC hdc, int tabStops, size_t offset, size_t* pLine) {
+    int line, col;
+    Doc_GetOffsetInfo(pState->pDoc, offset, &line, &col);
+    size_t lineIdx = (line > 0) ? (size_t)(line - 1) : 0;
+    size_t lineStart = 0;
+    size_t lineLen = View_LineLength(pState->pDoc, lineIdx, &lineStart, NULL);
+    if (pLine) *pLine = lineIdx;
+    return View_ColumnToX(pState, hdc, tabStops, lineIdx, lineStart, lineLen, offset - lineStart);
+}
+
+// Offset under client point (x, y) in unwrapped mode; y must already exclude the command prompt
+static size_t View_UnwrappedOffsetAt(HWND hwnd, ViewState* pState, int x, int y) {
+    long long lineIndex = ((long long)y + pState->scrollY) / pState->lineHeight;
+    if (lineIndex >= (long long)pState->pDoc->line_count) lineIndex = (long long)pState->pDoc->line_count - 1;
+    if (lineIndex < 0) lineIndex = 0;
+
+    size_t lineStart = 0;
+    size_t lineLen = View_LineLength(pState->pDoc, (size_t)lineIndex, &lineStart, NULL);
 
-    // Cache is invalid, rebuild it
     HDC hdc = GetDC(hwnd);
     SelectObject(hdc, pState->hFont);
-
     TEXTMETRIC tm;
     GetTextMetrics(hdc, &tm);
     int tabStops = tm.tmAveCharWidth * 4;
+    size_t col = View_XToColumn(pState, hdc, tabStops, (size_t)lineIndex, lineStart, lineLen,
+                                (long long)x + pState->scrollX - 5);
+    ReleaseDC(hwnd, hdc);
+    return lineStart + col;
+}
+
+static void StartLayoutTimer(HWND hwnd, ViewState* pState) {
+    if (!pState->layoutTimer) pState->layoutTimer = (SetTimer(hwnd, IDT_LAYOUT, LAYOUT_IDLE_MS, NULL) != 0);
+}
+
+// Rows a line of 'units' characters is estimated to wrap to, at the average character width
+static size_t View_WrapEstimate(const ViewState* pState, size_t units) {
+    int rowChars = pState->wrap.width / ((pState->wrapCharWidth > 0) ? pState->wrapCharWidth : 1);
+    if (rowChars < 1) rowChars = 1;
+    return (units > 0) ? (units + (size_t)rowChars - 1) / (size_t)rowChars : 1;
+}
+
+// Covers lines up to 'lines' that the line map has found and whose end is known, each
+// pending with an estimate. Nothing is scanned or measured.
+static void View_WrapExtend(ViewState* pState, size_t lines) {
+    SlateDoc* pDoc = pState->pDoc;
+    WrapLayout* layout = &pState->wrap;
+    size_t known = pDoc->line_map_complete ? pDoc->line_count : (pDoc->line_count ? pDoc->line_count - 1 : 0);
+    if (known > lines) known = lines;
 
-    // Allocate initial capacity
-    if (!pState->visualLines) {
-        pState->visualLineCapacity = 1024;
-        pState->visualLines = (VisualLineInfo*)malloc(pState->visualLineCapacity * sizeof(VisualLineInfo));
+    while (layout->count < known) {
+        size_t line = layout->count;
+        size_t units = Doc_GetLineOffset(pDoc, line + 1) - Doc_GetLineOffset(pDoc, line);
+        if (!Layout_WrapAppend(layout, View_WrapEstimate(pState, units))) break;
     }
-    pState->visualLineCount = 0;
+    layout->complete = pDoc->line_map_complete && layout->count >= pDoc->line_count;
+}
 
-    int currentY = 0;
+// Document offset where the lines the layout covers end
+static size_t View_WrapCoveredUnits(ViewState* pState) {
+    SlateDoc* pDoc = pState->pDoc;
+    if (pState->wrap.complete) return pDoc->total_length;
+    return (pState->wrap.count < pDoc->line_count) ? Doc_GetLineOffset(pDoc, pState->wrap.count) : pDoc->line_scan_offset;
+}
 
-    // Process each logical line
-    for (size_t logLine = 0; logLine < pState->pDoc->line_count; logLine++) {
-        size_t lineStart = 0, lineEnd = 0;
-        WCHAR* buf = NULL;
-        size_t dLen = 0;
-        
-        if (!View_LoadLine(pState, logLine, &lineStart, &lineEnd, &buf, &dLen)) continue;
-
-        size_t pos = 0;
-
-        while (pos < dLen) {
-            // Grow array if needed
-            if (pState->visualLineCount >= pState->visualLineCapacity) {
-                pState->visualLineCapacity *= 2;
-                VisualLineInfo* newArray = (VisualLineInfo*)realloc(
-                    pState->visualLines, 
-                    pState->visualLineCapacity * sizeof(VisualLineInfo)
-                );
-                if (!newArray) {
-                    free(buf);
-                    ReleaseDC(hwnd, hdc);
-                    pState->wrapCacheValid = FALSE;
-                    return;
-                }
-                pState->visualLines = newArray;
-            }
+// Rows expected past the covered lines: the rest of the document at the rows per unit seen so far
+static size_t View_WrapTailRows(ViewState* pState) {
+    size_t covered = View_WrapCoveredUnits(pState);
+    size_t tail = pState->pDoc->total_length - covered;
+    if (tail == 0) return 0;
+    size_t rows = Layout_WrapTotalRows(&pState->wrap);
+    if (covered == 0 || rows == 0) return View_WrapEstimate(pState, tail);
 
-            // Find how much text fits on this visual line
-            size_t fitLen = 0;
-            size_t remaining = dLen - pos;
-            size_t low = 1;
-            size_t high = remaining;
-            size_t bestFit = 0;
-
-            // Binary search for the longest string that fits
-            while (low <= high) {
-                size_t mid = low + (high - low) / 2;
-                DWORD extent = GetTabbedTextExtentW(hdc, buf + pos, (int)mid, 1, &tabStops);
-                int width = LOWORD(extent);
-
-                if (width <= wrapWidth) {
-                    bestFit = mid;
-                    low = mid + 1;
-                } else {
-                    high = mid - 1;
-                }
-            }
+    double estimate = (double)tail * (double)rows / (double)covered;
+    return (estimate < 1.0) ? 1 : (estimate > (double)(SIZE_MAX / 2)) ? SIZE_MAX / 2 : (size_t)estimate;
+}
 
-            fitLen = bestFit;
-
-            // If we can't fit the rest of the line, we need to wrap
-            if (fitLen < remaining) {
-                // Scan backwards for a word boundary
-                BOOL foundBreak = FALSE;
-                for (size_t i = fitLen; i > 0; i--) {
-                    WCHAR ch = buf[pos + i - 1];
-                    if (ch == L' ' || ch == L'\t' || ch == L'-') {
-                        fitLen = i;
-                        foundBreak = TRUE;
-                        break;
-                    }
-                }
-                // If no boundary found, force break at the limit
-                if (!foundBreak && fitLen == 0) fitLen = 1;
-            } else {
-                fitLen = remaining;
-            }
+/**
+ * The logical line holding visual row 'row', and the row it starts on. Rows past the covered
+ * lines are estimated: the line map is scanned ahead to where the estimate puts the row and
+ * the lines found are covered, until the row is reached or the document ends. Past the last
+ * line, the last line is returned.
+ */
+static size_t View_WrapLineAtRow(ViewState* pState, size_t row, size_t* outLineRow) {
+    SlateDoc* pDoc = pState->pDoc;
+    WrapLayout* layout = &pState->wrap;
 
-            // Skip leading spaces on wrapped lines
-            size_t skipLeading = 0;
-            if (pos > 0) {
-                while (skipLeading < fitLen && 
-                       (buf[pos + skipLeading] == L' ' || buf[pos + skipLeading] == L'\t')) {
-                    skipLeading++;
-                }
+    size_t total = Layout_WrapTotalRows(layout);
+    while (row >= total && !layout->complete) {
+        size_t covered = View_WrapCoveredUnits(pState);
+        double unitsPerRow = (total > 0 && covered > 0) ? (double)covered / (double)total
+                                                        : (double)layout->width / (pState->wrapCharWidth > 0 ? pState->wrapCharWidth : 1);
+        double target = (double)covered + (double)(row - total + 1) * unitsPerRow;
+        size_t targetOffset = (target >= (double)pDoc->total_length) ? pDoc->total_length : (size_t)target;
+
+        // Scan to the end of the line holding the target offset, so that line is covered too
+        size_t countBefore = layout->count;
+        int line, col;
+        Doc_GetOffsetInfo(pDoc, targetOffset, &line, &col);
+        Doc_EnsureLineForIndex(pDoc, (size_t)line);
+        View_WrapExtend(pState, (size_t)line);
+        if (layout->count == countBefore && !layout->complete) break;
+        total = Layout_WrapTotalRows(layout);
+    }
+
+    return Layout_WrapLineAtRow(layout, row, outLineRow);
+}
+
+/**
+ * Breaks a line into rows until it has at least 'rows' of them reaching 'offset' within the
+ * line, or it is laid out whole. The line is read WRAP_CHUNK_UNITS at a time from where its
+ * rows so far end, so the first screen of a huge line costs a chunk, not the line; the rows
+ * left are estimated from those made. FALSE if it cannot be read or stored.
+ */
+static BOOL View_WrapLayOutLine(ViewState* pState, HDC hdc, int tabStops, size_t line, size_t rows, size_t offset) {
+    WrapLayout* layout = &pState->wrap;
+    if (line >= layout->count || Layout_WrapLineDone(layout, line)) return TRUE;
+
+    size_t have = 0;
+    const WrapRow* laid = Layout_WrapRows(layout, line, &have);
+    size_t done = laid ? laid[have - 1].start + laid[have - 1].length : 0;
+    size_t lineStart = 0;
+    size_t lineLen = View_LineLength(pState->pDoc, line, &lineStart, NULL);
+
+    LayoutMeasure m;
+    ViewMeasure vm;
+    View_GetMeasure(pState, hdc, tabStops, &m, &vm);
+    WCHAR* buf = NULL;
+    size_t chunk = WRAP_CHUNK_UNITS;
+    BOOL ok = TRUE;
+    while (ok && (have < rows || done < offset)) {
+        BOOL lineEnds = (lineLen - done <= chunk);
+        size_t n = lineEnds ? lineLen - done : chunk;
+        WCHAR* grown = (WCHAR*)realloc(buf, (n + 1) * sizeof(WCHAR));
+        if (!grown || Doc_GetText(pState->pDoc, lineStart + done, n, grown) != n) {
+            buf = grown ? grown : buf;
+            ok = FALSE;
+            break;
+        }
+        buf = grown;
+
+        size_t used = 0;
+        size_t count = Layout_BreakRows(&m, buf, n, done, lineEnds, pState->wrap.width, &pState->wrapScratch,
+                                        &pState->wrapScratchCapacity, &used);
+        if (count == 0) {
+            // Out of memory, or a row longer than the chunk (zero-width characters): read more
+            if (lineEnds) ok = FALSE;
+            else chunk *= 2;
+            continue;
+        }
+        done += used;
+        have += count;
+        size_t tail = 0;
+        if (!lineEnds) {
+            double estimate = (double)(lineLen - done) * (double)have / (double)done;
+            tail = (estimate < 1.0) ? 1 : (estimate > (double)(SIZE_MAX / 2)) ? SIZE_MAX / 2 : (size_t)estimate;
+        }
+        ok = Layout_WrapAddRows(layout, line, pState->wrapScratch, count, tail);
+        if (lineEnds) break;
+    }
+    free(buf);
+    return ok;
+}
+
+/**
+ * Lays out pending lines from the first that may be pending for about LAYOUT_IDLE_SLICE_MS,
+ * covering lines past the line map's scan as it goes. Returns TRUE once every line of the
+ * document is laid out.
+ */
+static BOOL View_WrapLayOutIdle(ViewState* pState, HDC hdc, int tabStops) {
+    SlateDoc* pDoc = pState->pDoc;
+    WrapLayout* layout = &pState->wrap;
+
+    DWORD start = GetTickCount();
+    for (size_t steps = 1;; steps++) {
+        size_t line = layout->scanNext;
+        if (line >= layout->count) {
+            // Every covered line is laid out; carry on into lines the layout has not seen
+            layout->pendingEnd = 0;
+            if (!layout->complete) {
+                Doc_EnsureLineForIndex(pDoc, line + 1);
+                View_WrapExtend(pState, line + 1);
             }
+            if (line >= layout->count) return layout->complete;
+        } else if (line >= layout->pendingEnd) {
+            layout->scanNext = layout->count;
+            continue;
+        }
 
-            // Record this visual line
-            VisualLineInfo* vLine = &pState->visualLines[pState->visualLineCount++];
-            vLine->logicalLine = logLine;
-            vLine->startOffset = pos + skipLeading;
-            vLine->length = (fitLen > skipLeading) ? (fitLen - skipLeading) : 0;
-            vLine->yPosition = currentY;
+        // A chunk at a time, so a huge line is laid out over many slices; out of memory or
+        // unreadable, the rest stays estimated
+        size_t have = 0;
+        Layout_WrapRows(layout, line, &have);
+        if (!View_WrapLayOutLine(pState, hdc, tabStops, line, have + 1, 0)) return TRUE;
+        BOOL lineDone = Layout_WrapLineDone(layout, line);
+        if (lineDone) layout->scanNext = line + 1;
+        if ((steps % 16 == 0 || !lineDone) && GetTickCount() - start >= LAYOUT_IDLE_SLICE_MS) return FALSE;
+    }
+}
+
+/**
+ * Brings the wrap layout in step with the document and the window width, laying out only
+ * what is on screen, WRAP_NEAR_LINES either side of it and the caret's line; the rest keeps
+ * estimated heights until idle time reaches it (with 'idle', a slice of it is done here).
+ * Edits made since the last call are replayed from the document's log, leaving the lines
+ * they touched pending; a new document or a new width starts over. The line at the top of
+ * the window stays there while the heights above it are refined. Returns TRUE once the
+ * whole document is laid out.
+ */
+static BOOL View_WrapLayOut(HWND hwnd, ViewState* pState, BOOL idle) {
+    if (!pState || !pState->pDoc || !pState->bWordWrap) return TRUE;
+
+    SlateDoc* pDoc = pState->pDoc;
+    WrapLayout* layout = &pState->wrap;
+    RECT clientRect;
+    GetClientRect(hwnd, &clientRect);
+    int wrapWidth = clientRect.right - 10;
 
-            pos += fitLen;
-            currentY += pState->lineHeight;
+    if (pState->wrapGeneration != pState->docGeneration || layout->width != wrapWidth) {
+        Layout_WrapClear(layout);
+        layout->width = wrapWidth;
+        pState->wrapGeneration = pState->docGeneration;
+        pState->wrapRevision = pDoc->revision;
+    }
+    while (pState->wrapRevision != pDoc->revision) {
+        DocEdit edit;
+        if (!Doc_GetEdit(pDoc, pState->wrapRevision + 1, &edit)) {
+            Layout_WrapClear(layout);
+            layout->width = wrapWidth;
+            pState->wrapRevision = pDoc->revision;
+            break;
         }
-
-        // Handle empty lines
-        if (dLen == 0) {
-            VisualLineInfo* vLine = &pState->visualLines[pState->visualLineCount++];
-            vLine->logicalLine = logLine;
-            vLine->startOffset = 0;
-            vLine->length = 0;
-            vLine->yPosition = currentY;
-            currentY += pState->lineHeight;
+        // The edited line keeps its rows ahead of the edit, so typing into a huge line
+        // rewraps it from there rather than from its start
+        Layout_WrapTrimLine(layout, edit.line, edit.column);
+        if (edit.linesInserted == DOC_EDIT_UNKNOWN) {
+            Layout_WrapTruncate(layout, edit.line + 1);
+        } else {
+            Layout_WrapSplice(layout, edit.line + 1, edit.linesRemoved, edit.linesInserted);
         }
+        pState->wrapRevision++;
+    }
 
-        free(buf);
+    HDC hdc = GetDC(hwnd);
+    SelectObject(hdc, pState->hFont);
+
+    TEXTMETRIC tm;
+    GetTextMetrics(hdc, &tm);
+    int tabStops = tm.tmAveCharWidth * 4;
+    pState->wrapCharWidth = tm.tmAveCharWidth;
+
+    // The line at the top of the window, and how far into it the window starts
+    size_t topLineRow = 0;
+    size_t topRow = (size_t)pState->scrollY / pState->lineHeight;
+    size_t topLine = View_WrapLineAtRow(pState, topRow, &topLineRow);
+    long long intoTop = (long long)pState->scrollY - (long long)topLineRow * pState->lineHeight;
+
+    // Lines are at least a row high, so a screenful of lines covers the screen; of a long line
+    // only the rows that can show are broken, down to the bottom of the window for the top line
+    size_t screenLines = (size_t)(clientRect.bottom / pState->lineHeight) + 1;
+    size_t from = (topLine > WRAP_NEAR_LINES) ? topLine - WRAP_NEAR_LINES : 0;
+    size_t to = topLine + screenLines + WRAP_NEAR_LINES;
+    Doc_EnsureLineForIndex(pDoc, to);
+    int cursorLine, cursorCol;
+    Doc_GetOffsetInfo(pDoc, pState->cursorOffset, &cursorLine, &cursorCol);
+    Doc_EnsureLineForIndex(pDoc, (size_t)cursorLine);
+    View_WrapExtend(pState, ((size_t)cursorLine > to) ? (size_t)cursorLine : to);
+
+    for (size_t line = from; line < to && line < layout->count; line++) {
+        size_t rows = (line == topLine) ? topRow - topLineRow + screenLines : screenLines;
+        View_WrapLayOutLine(pState, hdc, tabStops, line, rows, 0);
     }
+    size_t cursorLineIdx = (cursorLine > 0) ? (size_t)(cursorLine - 1) : 0;
+    View_WrapLayOutLine(pState, hdc, tabStops, cursorLineIdx, 1,
+                        pState->cursorOffset - Doc_GetLineOffset(pDoc, cursorLineIdx));
+    BOOL done = idle ? View_WrapLayOutIdle(pState, hdc, tabStops) : (layout->complete && layout->scanNext >= layout->count);
 
     ReleaseDC(hwnd, hdc);
-    pState->cachedWrapWidth = wrapWidth;
-    pState->cachedDocGeneration = pState->docGeneration;  // Mark which document this cache is for
-    pState->wrapCacheValid = TRUE;
+
+    // Keep the top line in place now that the lines above it may have changed height
+    if (topLine < layout->count) {
+        long long lineHeight = (long long)Layout_WrapLineRows(layout, topLine) * pState->lineHeight;
+        if (intoTop >= lineHeight) intoTop = (lineHeight > 0) ? lineHeight - 1 : 0;
+        if (intoTop < 0) intoTop = 0;
+        long long y = (long long)Layout_WrapRowOfLine(layout, topLine) * pState->lineHeight + intoTop;
+        pState->scrollY = (y > INT_MAX) ? INT_MAX : (int)y;
+    }
+    return done;
+}
+
+static void UpdateWrapLayout(HWND hwnd, ViewState* pState) {
+    if (!View_WrapLayOut(hwnd, pState, FALSE)) StartLayoutTimer(hwnd, pState);
+}
+
+// The visual row holding offset, counted from the top of the document, and its part of the
+// line; FALSE while the offset's row is not laid out. At a row boundary the earlier row wins.
+static BOOL View_WrapRowForOffset(ViewState* pState, size_t offset, size_t* pRow, size_t* pLineStart, WrapRow* pRowOut) {
+    int line, col;
+    Doc_GetOffsetInfo(pState->pDoc, offset, &line, &col);
+    size_t logLine = (line > 0) ? (size_t)(line - 1) : 0;
+
+    size_t rowCount = 0;
+    const WrapRow* rows = Layout_WrapRows(&pState->wrap, logLine, &rowCount);
+    if (!rows) return FALSE;
+
+    size_t lineStart = Doc_GetLineOffset(pState->pDoc, logLine);
+    const WrapRow* last = &rows[rowCount - 1];
+    if (!Layout_WrapLineDone(&pState->wrap, logLine) && offset - lineStart > last->start + last->length) return FALSE;
+    size_t r = Layout_WrapRowInLine(&pState->wrap, logLine, offset - lineStart);
+
+    *pRow = Layout_WrapRowOfLine(&pState->wrap, logLine) + r;
+    *pLineStart = lineStart;
+    *pRowOut = rows[r];
+    return TRUE;
 }
 
 static int GetCommandPromptTopY(ViewState* pState) {
@@ -209,27 +647,14 @@ static int GetCommandPromptTopY(ViewState* pState) {
         return ((cursorLine - 1) * pState->lineHeight) - pState->scrollY;
     }
 
-    // Wrapped mode: find the visual line containing the cursor
-    RebuildWrapCache(GetFocus(), pState);  // You may need to pass hwnd differently
-    
-    if (!pState->wrapCacheValid || pState->visualLineCount == 0) {
+    // Wrapped mode: the visual row holding the cursor, as laid out at the last update
+    size_t row = 0, lineStart = 0;
+    WrapRow wrapRow;
+    if (!View_WrapRowForOffset(pState, pState->cursorOffset, &row, &lineStart, &wrapRow)) {
         return 0;
     }
-
-    size_t lineStart = Doc_GetLineOffset(pState->pDoc, cursorLine - 1);
-    size_t relOffset = pState->cursorOffset - lineStart;
-
-    for (size_t i = 0; i < pState->visualLineCount; i++) {
-        VisualLineInfo* vLine = &pState->visualLines[i];
-        
-        if (vLine->logicalLine == (size_t)(cursorLine - 1) &&
-            relOffset >= vLine->startOffset &&
-            relOffset <= vLine->startOffset + vLine->length) {
-            return vLine->yPosition - pState->scrollY;
-        }
-    }
-
-    return 0;
+    long long y = (long long)row * pState->lineHeight - pState->scrollY;
+    return (y > INT_MAX) ? INT_MAX : (y < INT_MIN + 1) ? INT_MIN + 1 : (int)y;
 }
 
 static void ClearCommandFeedback(ViewState* pState) {
@@ -249,9 +674,49 @@ static void SetCommandFeedback(ViewState* pState, const WCHAR* text, int caretCo
     pState->commandFeedbackCaretCol = hasCaret ? caretCol : -1;
 }
 
-// Maximum pixel width of unwrapped content (includes 5px inset on each side)
-static int View_GetDocumentWidth(HWND hwnd, ViewState* pState) {
-    if (!pState || !pState->pDoc || pState->bWordWrap) return 0;
+// Brings the width index in step with the document by replaying the edits made since it
+// last looked; when they have dropped out of the document's log it starts over
+static void SyncLineWidths(ViewState* pState) {
+    SlateDoc* pDoc = pState->pDoc;
+    LineWidths* widths = &pState->lineWidths;
+    if (pState->lineWidthsGeneration != pState->docGeneration) {
+        Layout_WidthsClear(widths);
+        pState->lineWidthsGeneration = pState->docGeneration;
+        pState->lineWidthsRevision = pDoc->revision;
+    }
+
+    while (pState->lineWidthsRevision != pDoc->revision) {
+        DocEdit edit;
+        if (!Doc_GetEdit(pDoc, pState->lineWidthsRevision + 1, &edit)) {
+            Layout_WidthsClear(widths);
+            pState->lineWidthsRevision = pDoc->revision;
+            break;
+        }
+        // The edited line itself changes along with the lines it added or removed
+        if (edit.linesInserted == DOC_EDIT_UNKNOWN) {
+            Layout_WidthsTruncate(widths, edit.line);
+        } else {
+            Layout_WidthsSplice(widths, edit.line, edit.linesRemoved + 1, edit.linesInserted + 1);
+        }
+        pState->lineWidthsRevision++;
+    }
+}
+
+static int MeasureLineWidth(ViewState* pState, HDC hdc, int tabStops, size_t line) {
+    size_t lineStart = 0;
+    size_t lineLen = View_LineLength(pState->pDoc, line, &lineStart, NULL);
+    long long width = View_ColumnToX(pState, hdc, tabStops, line, lineStart, lineLen, lineLen);
+    return (width > INT_MAX - 10) ? INT_MAX - 10 : (int)width;
+}
+
+/**
+ * Measures lines without a width for about LAYOUT_IDLE_SLICE_MS, walking forward from the
+ * first that may lack one. Lines already measured are skipped without touching the
+ * document. Returns TRUE once every line of the document has a width.
+ */
+static BOOL MeasureLineWidthsIdle(HWND hwnd, ViewState* pState) {
+    SyncLineWidths(pState);
+    LineWidths* widths = &pState->lineWidths;
 
     HDC hdc = GetDC(hwnd);
     SelectObject(hdc, pState->hFont);
@@ -259,20 +724,59 @@ static int View_GetDocumentWidth(HWND hwnd, ViewState* pState) {
     GetTextMetrics(hdc, &tm);
     int tabStops = tm.tmAveCharWidth * 4;
 
-    int maxWidth = 0;
-    for (size_t i = 0; i < pState->pDoc->line_count; i++) {
-        WCHAR* buf = NULL;
-        size_t dLen = 0;
-        if (!View_LoadLine(pState, i, NULL, NULL, &buf, &dLen)) continue;
-        DWORD extent = GetTabbedTextExtentW(hdc, buf, (int)dLen, 1, &tabStops);
-        int width = (int)LOWORD(extent);
-        if (width > maxWidth) maxWidth = width;
-        free(buf);
+    DWORD start = GetTickCount();
+    BOOL done = FALSE;
+    for (size_t steps = 1;; steps++) {
+        size_t line = widths->scanNext;
+        if (line >= widths->count) {
+            if (!widths->complete) {
+                Doc_EnsureLineForIndex(pState->pDoc, line);
+                widths->complete = (line >= pState->pDoc->line_count);
+            }
+            if (widths->complete) {
+                done = TRUE;
+                break;
+            }
+        }
+        if (Layout_WidthsGet(widths, line) == LAYOUT_UNMEASURED &&
+            !Layout_WidthsSet(widths, line, MeasureLineWidth(pState, hdc, tabStops, line))) {
+            done = TRUE; // Out of memory: the range stays as wide as what was measured
+            break;
+        }
+        widths->scanNext = line + 1;
+        if (steps % 64 == 0 && GetTickCount() - start >= LAYOUT_IDLE_SLICE_MS) break;
     }
 
     ReleaseDC(hwnd, hdc);
+    return done;
+}
+
+/**
+ * Width of the widest unwrapped line, from the width index. The caret's line is measured
+ * on the spot so typing past the widest line widens the range at once; the rest are
+ * measured in idle time, and until then the width is that of the widest line measured.
+ */
+static int View_GetDocumentWidth(HWND hwnd, ViewState* pState) {
+    if (!pState || !pState->pDoc || pState->bWordWrap) return 0;
+
+    SyncLineWidths(pState);
+    LineWidths* widths = &pState->lineWidths;
+
+    int line, col;
+    Doc_GetOffsetInfo(pState->pDoc, pState->cursorOffset, &line, &col);
+    size_t cursorLine = (line > 0) ? (size_t)(line - 1) : 0;
+    if (Layout_WidthsGet(widths, cursorLine) == LAYOUT_UNMEASURED) {
+        HDC hdc = GetDC(hwnd);
+        SelectObject(hdc, pState->hFont);
+        TEXTMETRIC tm;
+        GetTextMetrics(hdc, &tm);
+        Layout_WidthsSet(widths, cursorLine, MeasureLineWidth(pState, hdc, tm.tmAveCharWidth * 4, cursorLine));
+        ReleaseDC(hwnd, hdc);
+    }
+    if (!widths->complete || widths->scanNext < widths->count) StartLayoutTimer(hwnd, pState);
+
     // 5px inset on each side to match draw origin of 5
-    return maxWidth + 10;
+    return Layout_WidthsMax(widths) + 10;
 }
 
 // Returns TRUE when a non-empty selection exists; outputs start/len
@@ -334,22 +838,13 @@ static int View_GetDocumentHeight(HWND hwnd, ViewState* pState) {
     if (!pState || !pState->pDoc) return 0;
     
     if (pState->bWordWrap) {
-        RebuildWrapCache(hwnd, pState);
-        
-        if (!pState->wrapCacheValid || pState->visualLineCount == 0) {
-            return pState->lineHeight;
-        }
-        
-        // Total height is the Y position of the last line plus one line height
-        VisualLineInfo* lastLine = &pState->visualLines[pState->visualLineCount - 1];
-        int totalHeight = lastLine->yPosition + pState->lineHeight;
-        
-        int extra = GetCommandSpaceHeight(pState);
-        if (extra > 0) {
-            if (totalHeight > INT_MAX - extra) totalHeight = INT_MAX;
-            else totalHeight += extra;
-        }
-        return (totalHeight > INT_MAX) ? INT_MAX : totalHeight;
+        UpdateWrapLayout(hwnd, pState);
+
+        size_t rows = Layout_WrapTotalRows(&pState->wrap) + View_WrapTailRows(pState);
+        if (rows > (size_t)INT_MAX / pState->lineHeight) return INT_MAX;
+        long long totalHeight = (long long)(rows ? rows : 1) * pState->lineHeight;
+        totalHeight += GetCommandSpaceHeight(pState);
+        return (totalHeight > INT_MAX) ? INT_MAX : (int)totalHeight;
     }
     
     // Unwrapped mode
@@ -367,6 +862,7 @@ void View_SetDefaultColors(HWND hwnd) {
     pState->colorBgDim = RGB(0xE6, 0xE6, 0xE6); 
     pState->colorText  = RGB(0x26, 0x25, 0x22); 
     pState->colorDim   = RGB(150, 150, 150);    
+    pState->colorMatch = RGB(0xF2, 0xD9, 0x8C);
     InvalidateRect(hwnd, NULL, TRUE);
 }
 
@@ -379,6 +875,7 @@ void View_UseSystemColors(HWND hwnd) {
     pState->colorBgDim   = GetSysColor(COLOR_WINDOW);
     pState->colorText = GetSysColor(COLOR_WINDOWTEXT);
     pState->colorDim  = RGB(180, 180, 180);
+    pState->colorMatch = RGB(0xFF, 0xE8, 0x8A);
     InvalidateRect(hwnd, NULL, TRUE);
 }
 
@@ -399,45 +896,22 @@ static void GetCursorVisualPos(HWND hwnd, ViewState* pState, size_t targetOffset
     int finalX = 5, finalYDoc = 0;
 
     if (pState->bWordWrap) {
-        RebuildWrapCache(hwnd, pState);
-
-        if (!pState->wrapCacheValid || pState->visualLineCount == 0) {
-            ReleaseDC(hwnd, hdc);
-            *outX = 5;
-            *outY = 0;
-            return;
-        }
-
-        // Find which logical line contains the target offset
-        int cursorLine, cursorCol;
-        Doc_GetOffsetInfo(pState->pDoc, targetOffset, &cursorLine, &cursorCol);
-        size_t logLine = (cursorLine > 0) ? (cursorLine - 1) : 0;
-        
-        size_t lineStart = Doc_GetLineOffset(pState->pDoc, logLine);
-        size_t relOffset = targetOffset - lineStart;
-
-        // Find which visual line contains this offset
-        for (size_t i = 0; i < pState->visualLineCount; i++) {
-            VisualLineInfo* vLine = &pState->visualLines[i];
-            
-            if (vLine->logicalLine == logLine &&
-                relOffset >= vLine->startOffset &&
-                relOffset <= vLine->startOffset + vLine->length) {
-                
-                // Load the logical line
-                WCHAR* buf = NULL;
-                size_t dLen = 0;
-                if (View_LoadLine(pState, logLine, NULL, NULL, &buf, &dLen)) {
-                    // Calculate X from visual line start
-                    size_t offsetInVisualLine = relOffset - vLine->startOffset;
-                    DWORD extent = GetTabbedTextExtentW(hdc, buf + vLine->startOffset, 
-                                                       (int)offsetInVisualLine, 1, &tabStops);
-                    finalX = 5 + LOWORD(extent);
-                    finalYDoc = vLine->yPosition;
-                    free(buf);
-                }
-                break;
+        UpdateWrapLayout(hwnd, pState);
+
+        size_t row = 0, lineStart = 0;
+        WrapRow wrapRow;
+        if (View_WrapRowForOffset(pState, targetOffset, &row, &lineStart, &wrapRow)) {
+            size_t offsetInRow = targetOffset - lineStart - wrapRow.start;
+            WCHAR* buf = (WCHAR*)malloc((offsetInRow + 1) * sizeof(WCHAR));
+            if (buf) {
+                // Calculate X from visual line start
+                size_t n = Doc_GetText(pState->pDoc, lineStart + wrapRow.start, offsetInRow, buf);
+                long long x = 5 + MeasureRun(pState, hdc, buf, n, 0, tabStops, NULL);
+                finalX = (x > INT_MAX) ? INT_MAX : (int)x;
+                free(buf);
             }
+            long long y = (long long)row * pState->lineHeight;
+            finalYDoc = (y > INT_MAX) ? INT_MAX : (int)y;
         }
     } else {
         // Unwrapped mode (existing logic)
@@ -446,16 +920,8 @@ static void GetCursorVisualPos(HWND hwnd, ViewState* pState, size_t targetOffset
 
         finalYDoc = (cursorLine - 1) * pState->lineHeight;
 
-        size_t lineStart = Doc_GetLineOffset(pState->pDoc, cursorLine - 1);
-        size_t len = targetOffset - lineStart;
-        WCHAR* lineBuf = (WCHAR*)malloc((len + 1) * sizeof(WCHAR));
-        if (lineBuf) {
-            Doc_GetText(pState->pDoc, lineStart, len, lineBuf);
-            lineBuf[len] = L'\0';
-            DWORD extent = GetTabbedTextExtentW(hdc, lineBuf, (int)len, 1, &tabStops);
-            finalX = 5 + LOWORD(extent);
-            free(lineBuf);
-        }
+        long long lineX = View_OffsetToLineX(pState, hdc, tabStops, targetOffset, NULL);
+        finalX = (lineX > INT_MAX - 5) ? INT_MAX : 5 + (int)lineX;
     }
 
     ReleaseDC(hwnd, hdc);
@@ -492,11 +958,10 @@ size_t View_XYToOffset(HWND hwnd, int targetX, int targetY) {
     ViewState* pState = (ViewState*)GetWindowLongPtr(hwnd, GWLP_USERDATA);
     
     if (pState->bWordWrap) {
-        RebuildWrapCache(hwnd, pState);
+        UpdateWrapLayout(hwnd, pState);
 
-        if (!pState->wrapCacheValid || pState->visualLineCount == 0) {
-            return 0;
-        }
+        WrapLayout* layout = &pState->wrap;
+        if (layout->count == 0) return 0;
 
         HDC hdc = GetDC(hwnd);
         SelectObject(hdc, pState->hFont);
@@ -505,108 +970,44 @@ size_t View_XYToOffset(HWND hwnd, int targetX, int targetY) {
         GetTextMetrics(hdc, &tm);
         int tabStops = tm.tmAveCharWidth * 4;
 
-        int targetYDoc = targetY + pState->scrollY;
-
-        // Find which visual line was clicked
-        VisualLineInfo* targetVLine = NULL;
-        for (size_t i = 0; i < pState->visualLineCount; i++) {
-            VisualLineInfo* vLine = &pState->visualLines[i];
-            if (targetYDoc >= vLine->yPosition && 
-                targetYDoc < vLine->yPosition + pState->lineHeight) {
-                targetVLine = vLine;
-                break;
-            }
-        }
+        long long targetYDoc = (long long)targetY + pState->scrollY;
+        size_t targetRow = (targetYDoc > 0) ? (size_t)(targetYDoc / pState->lineHeight) : 0;
 
-        if (!targetVLine) {
-            // Click below all lines - return end of document
+        // Find the logical line holding the clicked row, laying it out if it is still estimated
+        size_t row = 0;
+        size_t line = View_WrapLineAtRow(pState, targetRow, &row);
+        size_t rowCount = 0;
+        BOOL laidOut = View_WrapLayOutLine(pState, hdc, tabStops, line, targetRow - row + 1, 0);
+        const WrapRow* rows = laidOut ? Layout_WrapRows(layout, line, &rowCount) : NULL;
+        if (!rows) {
             ReleaseDC(hwnd, hdc);
-            if (pState->visualLineCount > 0) {
-                VisualLineInfo* lastVLine = &pState->visualLines[pState->visualLineCount - 1];
-                size_t lineStart = Doc_GetLineOffset(pState->pDoc, lastVLine->logicalLine);
-                return lineStart + lastVLine->startOffset + lastVLine->length;
-            }
-            return 0;
+            return Doc_GetLineOffset(pState->pDoc, line);
         }
-
-        // Load the logical line
-        size_t lineStart = 0;
-        WCHAR* buf = NULL;
-        size_t dLen = 0;
-        if (!View_LoadLine(pState, targetVLine->logicalLine, &lineStart, NULL, &buf, &dLen)) {
+        if (targetRow - row >= rowCount) {
+            // Click below all lines - return end of document
             ReleaseDC(hwnd, hdc);
-            return lineStart;
+            return Doc_GetLineOffset(pState->pDoc, line) + rows[rowCount - 1].start + rows[rowCount - 1].length;
         }
-
-        // Find closest character in this visual line
-        size_t bestOffset = targetVLine->startOffset;
-        int minDist = INT_MAX;
-
-        for (size_t i = 0; i <= targetVLine->length; i++) {
-            DWORD extent = GetTabbedTextExtentW(hdc, buf + targetVLine->startOffset, 
-                                               (int)i, 1, &tabStops);
-            int cx = 5 + LOWORD(extent);
-            int dist = abs(cx - targetX);
-
-            if (dist < minDist) {
-                minDist = dist;
-                bestOffset = targetVLine->startOffset + i;
-            }
+        const WrapRow* targetVLine = &rows[targetRow - row];
+
+        // Find the closest character in this visual row, reading only the row
+        size_t lineStart = Doc_GetLineOffset(pState->pDoc, line);
+        WCHAR* buf = (WCHAR*)malloc((targetVLine->length + 1) * sizeof(WCHAR));
+        size_t bestOffset = targetVLine->start;
+        if (buf) {
+            size_t n = Doc_GetText(pState->pDoc, lineStart + targetVLine->start, targetVLine->length, buf);
+            LayoutMeasure m;
+            ViewMeasure vm;
+            View_GetMeasure(pState, hdc, tabStops, &m, &vm);
+            bestOffset += Layout_ColumnAtX(&m, buf, n, 0, (long long)targetX - 5);
         }
 
         free(buf);
         ReleaseDC(hwnd, hdc);
         return lineStart + bestOffset;
-
-    } else {
-        // Unwrapped mode (existing logic)
-        HDC hdc = GetDC(hwnd);
-        SelectObject(hdc, pState->hFont);
-        
-        TEXTMETRIC tm;
-        GetTextMetrics(hdc, &tm);
-        int charWidth = tm.tmAveCharWidth;
-        ReleaseDC(hwnd, hdc);
-
-        int lineIndex = (targetY + pState->scrollY) / pState->lineHeight;
-        
-        if (lineIndex < 0) lineIndex = 0;
-        if (lineIndex >= (int)pState->pDoc->line_count) 
-            lineIndex = (int)pState->pDoc->line_count - 1;
-
-        int col = (targetX + pState->scrollX - 5 + (charWidth / 2)) / charWidth;
-        
-        size_t lineStart = 0, lineEnd = 0;
-        size_t lineLen = 0;
-        WCHAR* buf = NULL;
-        size_t dLen = 0;
-        if (View_LoadLine(pState, lineIndex, &lineStart, &lineEnd, &buf, &dLen)) {
-            lineLen = dLen;
-        } else {
-            lineStart = Doc_GetLineOffset(pState->pDoc, lineIndex);
-            lineEnd = Doc_GetLineOffset(pState->pDoc, lineIndex + 1);
-            lineLen = lineEnd - lineStart;
-
-            if (lineLen > 0) {
-                WCHAR last;
-                Doc_GetText(pState->pDoc, lineEnd - 1, 1, &last);
-                if (last == L'\n' || last == L'\r') {
-                    lineLen--;
-                    // Double check for \r\n pairs
-                    if (lineLen > 0) {
-                        Doc_GetText(pState->pDoc, lineEnd - 2, 1, &last);
-                        if (last == L'\r') lineLen--;
-                    }
-                }
-            }
-        }
-        if (buf) free(buf);
-
-        if (col < 0) col = 0;
-        if ((size_t)col > lineLen) col = (int)lineLen;
-
-        return lineStart + col;
     }
+
+    return View_UnwrappedOffsetAt(hwnd, pState, targetX, targetY);
 }
 
 void EnsureCursorVisible(HWND hwnd, ViewState* pState) {
@@ -650,16 +1051,8 @@ void EnsureCursorVisible(HWND hwnd, ViewState* pState) {
         GetTextMetrics(hdc, &tm);
         int tabStops = tm.tmAveCharWidth * 4;
 
-        size_t lineStart = Doc_GetLineOffset(pState->pDoc, line - 1);
-        size_t len = pState->cursorOffset - lineStart;
-        WCHAR* lineBuf = (WCHAR*)malloc((len + 1) * sizeof(WCHAR));
-        int cursorX = 5;
-        if (lineBuf) {
-            Doc_GetText(pState->pDoc, lineStart, len, lineBuf);
-            lineBuf[len] = L'\0';
-            cursorX += (int)LOWORD(GetTabbedTextExtentW(hdc, lineBuf, (int)len, 1, &tabStops));
-            free(lineBuf);
-        }
+        long long lineX = View_OffsetToLineX(pState, hdc, tabStops, pState->cursorOffset, NULL);
+        int cursorX = (lineX > INT_MAX - 5) ? INT_MAX : 5 + (int)lineX;
 
         ReleaseDC(hwnd, hdc);
 
@@ -691,6 +1084,7 @@ void UpdateScrollbars(HWND hwnd, ViewState* pState) {
     Doc_GetLineOffset(pState->pDoc, targetLine);
 
     int totalHeight = View_GetDocumentHeight(hwnd, pState);
+    pState->reportedHeight = totalHeight;
 
     SCROLLINFO si = {0};
     si.cbSize = sizeof(si);
@@ -720,6 +1114,7 @@ void UpdateScrollbars(HWND hwnd, ViewState* pState) {
     // Horizontal scroll bar only matters when not wrapping
     int clientWidth = rc.right;
     int docWidth = pState->bWordWrap ? clientWidth : View_GetDocumentWidth(hwnd, pState);
+    pState->reportedWidth = Layout_WidthsMax(&pState->lineWidths);
     SCROLLINFO siH = {0};
     siH.cbSize = sizeof(siH);
     siH.fMask = SIF_RANGE | SIF_PAGE | SIF_POS;
@@ -762,17 +1157,8 @@ void View_SetDocument(HWND hwnd, SlateDoc* pDoc) {
         pState->scrollY = 0;
         pState->scrollX = 0;
         
-        // Clear the visual lines array completely
-        if (pState->visualLines) {
-            free(pState->visualLines);
-            pState->visualLines = NULL;
-        }
-        pState->visualLineCount = 0;
-        pState->visualLineCapacity = 0;
-        
-        // Increment generation to invalidate all caches
+        // Increment generation to invalidate all caches, the wrap layout included
         pState->docGeneration++;
-        pState->wrapCacheValid = FALSE;
 
         // Ensure document's line map is initialized before wrapping
         if (pDoc && pDoc->line_count > 0) {
@@ -780,9 +1166,9 @@ void View_SetDocument(HWND hwnd, SlateDoc* pDoc) {
             Doc_GetLineOffset(pDoc, 0);  // Force initialization
         }
 
-        // If word wrap is enabled, rebuild the cache immediately
+        // If word wrap is enabled, lay the document out immediately
         if (pState->bWordWrap) {
-            RebuildWrapCache(hwnd, pState);
+            UpdateWrapLayout(hwnd, pState);
         }
         
         // Reclaim caret and focus
@@ -827,57 +1213,7 @@ size_t GetOffsetFromPoint(HWND hwnd, ViewState* pState, int x, int y) {
         return View_XYToOffset(hwnd, x, targetY);
     }
 
-    HDC hdc = GetDC(hwnd);
-    SelectObject(hdc, pState->hFont);
-    
-    TEXTMETRIC tm;
-    GetTextMetrics(hdc, &tm);
-    int charWidth = tm.tmAveCharWidth;
-    ReleaseDC(hwnd, hdc);
-
-    // Map the y coordinate to a line index
-    int lineIndex = (targetY + pState->scrollY) / pState->lineHeight;
-    
-    // Clamp to valid line range
-    if (lineIndex < 0) lineIndex = 0;
-    if (lineIndex >= (int)pState->pDoc->line_count) 
-        lineIndex = (int)pState->pDoc->line_count - 1;
-
-    // Map the x coordinate to a column, subtracting the left margin and rounding to the nearest char
-    int col = (x + pState->scrollX - 5 + (charWidth / 2)) / charWidth;
-    
-    size_t lineStart = 0, lineEnd = 0;
-    size_t lineLen = 0;
-    WCHAR* buf = NULL;
-    size_t dLen = 0;
-    if (View_LoadLine(pState, lineIndex, &lineStart, &lineEnd, &buf, &dLen)) {
-        lineLen = dLen;
-    } else {
-        lineStart = Doc_GetLineOffset(pState->pDoc, lineIndex);
-        lineEnd = Doc_GetLineOffset(pState->pDoc, lineIndex + 1);
-        lineLen = lineEnd - lineStart;
-
-        // Ignore trailing newline characters when positioning the cursor
-        if (lineLen > 0) {
-            WCHAR last;
-            Doc_GetText(pState->pDoc, lineEnd - 1, 1, &last);
-            if (last == L'\n' || last == L'\r') {
-                lineLen--;
-                // Double check for \r\n pairs
-                if (lineLen > 0) {
-                    Doc_GetText(pState->pDoc, lineEnd - 2, 1, &last);
-                    if (last == L'\r') lineLen--;
-                }
-            }
-        }
-    }
-    if (buf) free(buf);
-
-    // Clamp within the line bounds
-    if (col < 0) col = 0;
-    if ((size_t)col > lineLen) col = (int)lineLen;
-
-    return lineStart + col;
+    return View_UnwrappedOffsetAt(hwnd, pState, x, targetY);
 }
 
 void UpdateCaretPosition(HWND hwnd, ViewState* pState) {
@@ -916,15 +1252,8 @@ void UpdateCaretPosition(HWND hwnd, ViewState* pState) {
 
         y = (visualLine * pState->lineHeight) - pState->scrollY;
 
-        size_t lineStart = Doc_GetLineOffset(pState->pDoc, cursorLine - 1);
-        size_t len = pState->cursorOffset - lineStart;
-        WCHAR* lineBuf = (WCHAR*)malloc((len + 1) * sizeof(WCHAR));
-        if (lineBuf) {
-            Doc_GetText(pState->pDoc, lineStart, len, lineBuf);
-            lineBuf[len] = L'\0';
-            x += LOWORD(GetTabbedTextExtentW(hdc, lineBuf, (int)len, 1, &tabStops));
-            free(lineBuf);
-        }
+        long long caretX = (long long)x + View_OffsetToLineX(pState, hdc, tabStops, pState->cursorOffset, NULL);
+        x = (caretX > INT_MAX) ? INT_MAX : (caretX < INT_MIN) ? INT_MIN : (int)caretX;
         ReleaseDC(hwnd, hdc);
     }
     
@@ -1040,7 +1369,6 @@ void View_Cut(HWND hwnd) {
     View_Copy(hwnd);
 
     Doc_Delete(pState->pDoc, start, len);
-    pState->wrapCacheValid = FALSE;
     
     // Collapse selection and update the view
     pState->cursorOffset = pState->selectionAnchor = start;
@@ -1061,14 +1389,12 @@ void View_Paste(HWND hwnd) {
                 size_t start = 0, len = 0;
                 if (View_GetSelection(pState, &start, &len)) {
                     Doc_Delete(pState->pDoc, start, len);
-                    pState->wrapCacheValid = FALSE;
                     pState->cursorOffset = pState->selectionAnchor = start;
                 }
 
                 // Insert the clipboard text
                 size_t pasteLen = wcslen(pText);
                 Doc_Insert(pState->pDoc, pState->cursorOffset, pText, pasteLen);
-                pState->wrapCacheValid = FALSE;
                 pState->cursorOffset += pasteLen;
                 pState->selectionAnchor = pState->cursorOffset;
                 
@@ -1106,7 +1432,6 @@ static void DeleteSelection(HWND hwnd, ViewState* pState) {
     if (!View_GetSelection(pState, &start, &len)) return;
 
     Doc_Delete(pState->pDoc, start, len);
-    pState->wrapCacheValid = FALSE;
     pState->cursorOffset = pState->selectionAnchor = start;
 
     NotifyParent(hwnd, EN_CHANGE);
@@ -1126,7 +1451,6 @@ void View_SetWordWrap(HWND hwnd, BOOL bWrap) {
     ViewState* pState = GetState(hwnd);
     if (pState && pState->bWordWrap != bWrap) {
         pState->bWordWrap = bWrap;
-        pState->wrapCacheValid = FALSE;  // Invalidate cache
         pState->scrollY = 0;
         pState->scrollX = 0;
         UpdateScrollbars(hwnd, pState);
@@ -1134,6 +1458,69 @@ void View_SetWordWrap(HWND hwnd, BOOL bWrap) {
     }
 }
 
+BOOL View_GetSelectionRange(HWND hwnd, size_t* pStart, size_t* pEnd) {
+    ViewState* pState = GetState(hwnd);
+    size_t start = 0, len = 0;
+    if (!pState || !View_GetSelection(pState, &start, &len)) return FALSE;
+    if (pStart) *pStart = start;
+    if (pEnd) *pEnd = start + len;
+    return TRUE;
+}
+
+BOOL View_ReplaceAll(HWND hwnd, const WCHAR* pattern, size_t patternLen, const WCHAR* replacement, size_t replacementLen,
+                     const DocSearchOptions* options, size_t* outCount) {
+    ViewState* pState = GetState(hwnd);
+    if (outCount) *outCount = 0;
+    if (!pState || !pState->pDoc) return FALSE;
+
+    size_t cursor = pState->cursorOffset;
+    if (!Doc_ReplaceAll(pState->pDoc, pattern, patternLen, replacement, replacementLen, options, &cursor, outCount)) {
+        return FALSE;
+    }
+
+    pState->cursorOffset = pState->selectionAnchor = cursor;
+
+    NotifyParent(hwnd, EN_CHANGE);
+    UpdateScrollbars(hwnd, pState);
+    EnsureCursorVisible(hwnd, pState);
+    UpdateCaretPosition(hwnd, pState);
+    InvalidateRect(hwnd, NULL, TRUE);
+    return TRUE;
+}
+
+// The document was rebased onto a saved file: same text, but offsets and line map changed
+void View_DocumentRebased(HWND hwnd, size_t cursorOffset, size_t anchorOffset) {
+    ViewState* pState = GetState(hwnd);
+    if (!pState || !pState->pDoc) return;
+
+    size_t total = pState->pDoc->total_length;
+    pState->cursorOffset = (cursorOffset > total) ? total : cursorOffset;
+    pState->selectionAnchor = (anchorOffset > total) ? total : anchorOffset;
+    pState->docGeneration++;
+
+    UpdateScrollbars(hwnd, pState);
+    EnsureCursorVisible(hwnd, pState);
+    UpdateCaretPosition(hwnd, pState);
+    InvalidateRect(hwnd, NULL, TRUE);
+}
+
+// Text was appended to the end of the document (streamed input, a followed file growing).
+// A caret parked at the old end, with nothing selected, follows the new end like a tail;
+// otherwise caret, selection and scroll position stay put.
+void View_DocumentAppended(HWND hwnd, size_t oldLength) {
+    ViewState* pState = GetState(hwnd);
+    if (!pState || !pState->pDoc) return;
+
+    BOOL atEnd = (pState->cursorOffset == oldLength && pState->selectionAnchor == oldLength);
+    UpdateScrollbars(hwnd, pState);
+    if (atEnd) {
+        pState->cursorOffset = pState->selectionAnchor = pState->pDoc->total_length;
+        EnsureCursorVisible(hwnd, pState);
+        UpdateCaretPosition(hwnd, pState);
+    }
+    InvalidateRect(hwnd, NULL, FALSE);
+}
+
 BOOL View_ApplySearchResult(HWND hwnd, const DocSearchResult* result) {
     ViewState* pState = GetState(hwnd);
     if (!pState || !pState->pDoc || !result) return FALSE;
@@ -1155,10 +1542,142 @@ BOOL View_ApplySearchResult(HWND hwnd, const DocSearchResult* result) {
     return TRUE;
 }
 
-static void PaintWrappedContent(ViewState* pState, HDC memDC, RECT rc, int tabStops, COLORREF currentText, COLORREF currentDim, size_t selStart, size_t selEnd, BOOL hasFocus) {
-    RebuildWrapCache(GetFocus(), pState);  // Note: You'll need to pass hwnd to this function
+static void ResetMatchCache(ViewState* pState) {
+    if (!pState->matchCache) return;
+    for (size_t i = 0; i < MATCH_CACHE_SLOTS; i++) {
+        free(pState->matchCache[i].starts);
+        pState->matchCache[i].starts = NULL;
+        pState->matchCache[i].count = 0;
+        pState->matchCache[i].line = (size_t)-1;
+    }
+}
+
+void View_SetHighlight(HWND hwnd, const WCHAR* pattern, size_t patternLen, const DocSearchOptions* options) {
+    ViewState* pState = GetState(hwnd);
+    if (!pState) return;
 
-    if (!pState->wrapCacheValid || pState->visualLineCount == 0) {
+    if (!pattern || patternLen >= _countof(pState->szHighlight)) patternLen = 0;
+    BOOL caseSensitive = options ? options->caseSensitive : FALSE;
+    BOOL wholeWord = options ? options->wholeWord : FALSE;
+    if (patternLen == pState->highlightLen && caseSensitive == pState->highlightCaseSensitive &&
+        wholeWord == pState->highlightWholeWord &&
+        (patternLen == 0 || wmemcmp(pattern, pState->szHighlight, patternLen) == 0)) {
+        return;
+    }
+
+    if (patternLen > 0) wmemcpy(pState->szHighlight, pattern, patternLen);
+    pState->szHighlight[patternLen] = 0;
+    pState->highlightLen = patternLen;
+    pState->highlightCaseSensitive = caseSensitive;
+    pState->highlightWholeWord = wholeWord;
+    ResetMatchCache(pState);
+    InvalidateRect(hwnd, NULL, FALSE);
+}
+
+// Scans decoded text for the highlight pattern; *pStarts receives the match starts (caller frees)
+static size_t CollectMatches(ViewState* pState, const WCHAR* buf, size_t len, size_t** pStarts) {
+    size_t* starts = NULL;
+    size_t count = 0, capacity = 0;
+    size_t pos = 0;
+    for (;;) {
+        size_t hit = Doc_FindInText(buf, len, pos, pState->szHighlight, pState->highlightLen,
+                                    pState->highlightCaseSensitive, pState->highlightWholeWord);
+        if (hit == (size_t)-1) break;
+        if (count == capacity) {
+            size_t newCap = capacity ? capacity * 2 : 8;
+            size_t* grown = realloc(starts, newCap * sizeof(size_t));
+            if (!grown) break;
+            starts = grown;
+            capacity = newCap;
+        }
+        starts[count++] = hit;
+        pos = hit + pState->highlightLen;
+    }
+    *pStarts = starts;
+    return count;
+}
+
+// Returns the matches for a painted line, scanning its decoded text only on a cache miss.
+// The cache is dropped wholesale whenever the document or the pattern changes.
+static const LineMatchCache* GetLineMatches(ViewState* pState, size_t lineIdx, const WCHAR* buf, size_t len) {
+    if (pState->highlightLen == 0) return NULL;
+
+    if (!pState->matchCache) {
+        pState->matchCache = calloc(MATCH_CACHE_SLOTS, sizeof(LineMatchCache));
+        if (!pState->matchCache) return NULL;
+        ResetMatchCache(pState);
+        pState->matchCacheRevision = pState->pDoc->revision;
+        pState->matchCacheGeneration = pState->docGeneration;
+    }
+    if (pState->matchCacheRevision != pState->pDoc->revision || pState->matchCacheGeneration != pState->docGeneration) {
+        ResetMatchCache(pState);
+        pState->matchCacheRevision = pState->pDoc->revision;
+        pState->matchCacheGeneration = pState->docGeneration;
+    }
+
+    LineMatchCache* slot = &pState->matchCache[lineIdx % MATCH_CACHE_SLOTS];
+    if (slot->line == lineIdx) return slot;
+
+    free(slot->starts);
+    slot->line = lineIdx;
+    slot->count = CollectMatches(pState, buf, len, &slot->starts);
+    return slot;
+}
+
+// Fills the match backgrounds that fall inside one drawn run of a line
+static void PaintMatchHighlights(ViewState* pState, HDC memDC, const LineMatchCache* matches, const WCHAR* runText,
+                                 size_t runStart, size_t runLen, int x, int y, int tabStops, HBRUSH hBrush) {
+    if (!matches || matches->count == 0 || !hBrush) return;
+
+    size_t runEnd = runStart + runLen;
+    for (size_t m = 0; m < matches->count; m++) {
+        size_t mStart = matches->starts[m];
+        size_t mEnd = mStart + pState->highlightLen;
+        if (mEnd <= runStart) continue;
+        if (mStart >= runEnd) break;
+
+        size_t relStart = (mStart > runStart ? mStart : runStart) - runStart;
+        size_t relEnd = (mEnd < runEnd ? mEnd : runEnd) - runStart;
+        long long x1 = x + MeasureRun(pState, memDC, runText, relStart, 0, tabStops, NULL);
+        long long x2 = x + MeasureRun(pState, memDC, runText, relEnd, 0, tabStops, NULL);
+        RECT rcMatch = { (int)x1, y, (x2 > INT_MAX) ? INT_MAX : (int)x2, y + pState->lineHeight };
+        FillRect(memDC, &rcMatch, hBrush);
+    }
+}
+
+// Fills the match backgrounds inside a measured slice; starts are relative to column startsBase
+static void PaintSliceMatches(ViewState* pState, HDC memDC, const size_t* starts, size_t count, size_t startsBase,
+                              const LineSlice* slice, const long long* xs, int baseX, int y, HBRUSH hBrush) {
+    if (!starts || !hBrush) return;
+
+    for (size_t m = 0; m < count; m++) {
+        size_t mStart = startsBase + starts[m];
+        size_t mEnd = mStart + pState->highlightLen;
+        if (mEnd <= slice->from) continue;
+        if (mStart >= slice->to) break;
+
+        size_t relStart = (mStart > slice->from ? mStart : slice->from) - slice->from;
+        size_t relEnd = (mEnd < slice->to ? mEnd : slice->to) - slice->from;
+        RECT rcMatch = { (int)(baseX + xs[relStart]), y, (int)(baseX + xs[relEnd]), y + pState->lineHeight };
+        FillRect(memDC, &rcMatch, hBrush);
+    }
+}
+
+// Reads the file ahead of the viewport, whose first line is firstLine, in the direction it
+// last scrolled; the direction sticks while the view stands still
+static void PrefetchForScroll(ViewState* pState, size_t firstLine) {
+    if (pState->scrollY != pState->prefetchScrollY) {
+        pState->prefetchBackwards = (pState->scrollY < pState->prefetchScrollY);
+        pState->prefetchScrollY = pState->scrollY;
+    }
+    Doc_PrefetchAhead(pState->pDoc, Doc_GetLineOffset(pState->pDoc, firstLine), pState->prefetchBackwards);
+}
+
+static void PaintWrappedContent(HWND hwnd, ViewState* pState, HDC memDC, RECT rc, int tabStops, COLORREF currentText, COLORREF currentDim, size_t selStart, size_t selEnd, BOOL hasFocus) {
+    UpdateWrapLayout(hwnd, pState);
+
+    WrapLayout* layout = &pState->wrap;
+    if (layout->count == 0) {
         return;
     }
 
@@ -1169,79 +1688,128 @@ static void PaintWrappedContent(ViewState* pState, HDC memDC, RECT rc, int tabSt
     COLORREF selBg = hasFocus ? GetSysColor(COLOR_HIGHLIGHT) : GetSysColor(COLOR_3DFACE);
     COLORREF selText = hasFocus ? GetSysColor(COLOR_HIGHLIGHTTEXT) : GetSysColor(COLOR_BTNTEXT);
     HBRUSH hSelBrush = hasSelection ? CreateSolidBrush(selBg) : NULL;
+    HBRUSH hMatchBrush = (pState->highlightLen > 0) ? CreateSolidBrush(pState->colorMatch) : NULL;
+    BOOL prefetched = FALSE;
+
+    // Start from the logical line holding the first visible row
+    size_t lineRow = 0;
+    size_t logLine = View_WrapLineAtRow(pState, (size_t)(pState->scrollY / pState->lineHeight), &lineRow);
+
+    // Draw each visible line, a visual row at a time
+    for (; logLine < layout->count; logLine++) {
+        size_t rowCount = 0;
+        const WrapRow* rows = Layout_WrapRows(layout, logLine, &rowCount);
+        long long lineY = (long long)lineRow * pState->lineHeight - pState->scrollY;
+        lineRow += Layout_WrapLineRows(layout, logLine);
+        if (lineY > rc.bottom) break;
+        if (!rows) continue;
+
+        if (!prefetched) {
+            PrefetchForScroll(pState, logLine);
+            prefetched = TRUE;
+        }
 
-    // Draw each visual line
-    for (size_t i = 0; i < pState->visualLineCount; i++) {
-        VisualLineInfo* vLine = &pState->visualLines[i];
-        
-        int yPos = vLine->yPosition - pState->scrollY;
-        
-        // Skip lines outside viewport
-        if (yPos + pState->lineHeight < 0) continue;
-        if (yPos > rc.bottom) break;
+        // Only the rows in the window are read; a long line may run on for many screens. A
+        // part of a line is read a pattern's length either side, so matches crossing its edges
+        // are found.
+        size_t firstRow = (lineY < 0) ? (size_t)(-lineY / pState->lineHeight) : 0;
+        size_t endRow = (size_t)((rc.bottom - lineY) / pState->lineHeight) + 1;
+        if (endRow > rowCount) endRow = rowCount;
+        if (firstRow >= endRow) continue;
+        BOOL wholeLine = (firstRow == 0 && endRow == rowCount && Layout_WrapLineDone(layout, logLine));
 
-        // Load logical line
         size_t lineStart = 0;
-        WCHAR* buf = NULL;
-        size_t dLen = 0;
-        if (!View_LoadLine(pState, vLine->logicalLine, &lineStart, NULL, &buf, &dLen)) continue;
+        size_t lineLen = View_LineLength(pState->pDoc, logLine, &lineStart, NULL);
+        size_t spanFrom = rows[firstRow].start;
+        size_t spanTo = rows[endRow - 1].start + rows[endRow - 1].length;
+        size_t margin = wholeLine ? 0 : pState->highlightLen;
+        size_t bufFrom = wholeLine ? 0 : (spanFrom > margin) ? spanFrom - margin : 0;
+        size_t bufTo = wholeLine ? lineLen : (lineLen - spanTo > margin) ? spanTo + margin : lineLen;
+        if (spanTo > bufTo) continue;
+        WCHAR* buf = (WCHAR*)malloc((bufTo - bufFrom + 1) * sizeof(WCHAR));
+        if (!buf) continue;
+        if (Doc_GetText(pState->pDoc, lineStart + bufFrom, bufTo - bufFrom, buf) != bufTo - bufFrom) {
+            free(buf);
+            continue;
+        }
 
-        // Draw text for this visual line
-        if (vLine->length > 0) {
-            // Safety: Ensure the visual line points to valid offsets in the current buffer
-            if (vLine->startOffset + vLine->length > dLen) {
-                free(buf);
-                continue;
-            }
+        const LineMatchCache* matches = NULL;
+        LineMatchCache spanMatches = { logLine, NULL, 0 };
+        if (wholeLine) {
+            matches = GetLineMatches(pState, logLine, buf, lineLen);
+        } else if (hMatchBrush) {
+            spanMatches.count = CollectMatches(pState, buf, bufTo - bufFrom, &spanMatches.starts);
+            for (size_t k = 0; k < spanMatches.count; k++) spanMatches.starts[k] += bufFrom;
+            matches = &spanMatches;
+        }
 
-            TabbedTextOutW(memDC, 5, yPos, buf + vLine->startOffset, (int)vLine->length, 1, &tabStops, 5);
+        for (size_t r = firstRow; r < endRow; r++) {
+            const WrapRow* vLine = &rows[r];
+            const WCHAR* rowText = buf + (vLine->start - bufFrom);
+            int yPos = (int)(lineY + (long long)r * pState->lineHeight);
 
-            // Handle selection overlay
-            size_t absStart = lineStart + vLine->startOffset;
-            size_t absEnd = absStart + vLine->length;
+            // Skip rows outside viewport
+            if (yPos + pState->lineHeight < 0) continue;
+            if (yPos > rc.bottom) break;
 
-            if (hasSelection && selStart < absEnd && selEnd > absStart) {
-                size_t selStartInLine = (selStart > absStart) ? selStart : absStart;
-                size_t selEndInLine = (selEnd < absEnd) ? selEnd : absEnd;
+            // Draw text for this visual line
+            if (vLine->length > 0) {
+                PaintMatchHighlights(pState, memDC, matches, rowText, vLine->start, vLine->length,
+                                     5, yPos, tabStops, hMatchBrush);
 
-                size_t relSelStart = selStartInLine - absStart;
-                size_t relSelEnd = selEndInLine - absStart;
+                TabbedTextOutW(memDC, 5, yPos, rowText, (int)vLine->length, 1, &tabStops, 5);
 
-                DWORD ext1 = GetTabbedTextExtentW(memDC, buf + vLine->startOffset, (int)relSelStart, 1, &tabStops);
-                DWORD ext2 = GetTabbedTextExtentW(memDC, buf + vLine->startOffset, (int)relSelEnd, 1, &tabStops);
+                // Handle selection overlay
+                size_t absStart = lineStart + vLine->start;
+                size_t absEnd = absStart + vLine->length;
 
-                int x1 = 5 + LOWORD(ext1);
-                int x2 = 5 + LOWORD(ext2);
+                if (hasSelection && selStart < absEnd && selEnd > absStart) {
+                    size_t selStartInLine = (selStart > absStart) ? selStart : absStart;
+                    size_t selEndInLine = (selEnd < absEnd) ? selEnd : absEnd;
 
-                RECT selRect = { x1, yPos, x2, yPos + pState->lineHeight };
-                FillRect(memDC, &selRect, hSelBrush);
+                    size_t relSelStart = selStartInLine - absStart;
+                    size_t relSelEnd = selEndInLine - absStart;
 
-                SetTextColor(memDC, selText);
-                SetBkMode(memDC, TRANSPARENT);
-                TabbedTextOutW(memDC, x1, yPos, buf + vLine->startOffset + relSelStart, 
-                              (int)(relSelEnd - relSelStart), 1, &tabStops, x1);
-                SetTextColor(memDC, currentText);
-            }
+                    long long ext1 = MeasureRun(pState, memDC, rowText, relSelStart, 0, tabStops, NULL);
+                    long long ext2 = MeasureRun(pState, memDC, rowText, relSelEnd, 0, tabStops, NULL);
+
+                    int x1 = (int)(5 + ext1);
+                    int x2 = (5 + ext2 > INT_MAX) ? INT_MAX : (int)(5 + ext2);
+
+                    RECT selRect = { x1, yPos, x2, yPos + pState->lineHeight };
+                    FillRect(memDC, &selRect, hSelBrush);
+
+                    SetTextColor(memDC, selText);
+                    SetBkMode(memDC, TRANSPARENT);
+                    TabbedTextOutW(memDC, x1, yPos, rowText + relSelStart, 
+                                  (int)(relSelEnd - relSelStart), 1, &tabStops, x1);
+                    SetTextColor(memDC, currentText);
+                }
 
-            // Non-printable characters
-            if (pState->bShowNonPrintable) {
-                COLORREF oldClr = SetTextColor(memDC, currentDim);
-                for (size_t k = 0; k < vLine->length; k++) {
-                    WCHAR ch = buf[vLine->startOffset + k];
-                    if (ch == L' ' || ch == L'\t') {
-                        WCHAR sym = (ch == L' ') ? 0x00B7 : 0x00BB;
-                        DWORD extent = GetTabbedTextExtentW(memDC, buf + vLine->startOffset, (int)k, 1, &tabStops);
-                        TextOutW(memDC, 5 + LOWORD(extent), yPos, &sym, 1);
+                // Non-printable characters
+                long long* xs = pState->bShowNonPrintable ? (long long*)malloc((vLine->length + 1) * sizeof(long long)) : NULL;
+                if (xs) {
+                    COLORREF oldClr = SetTextColor(memDC, currentDim);
+                    MeasureRun(pState, memDC, rowText, vLine->length, 0, tabStops, xs);
+                    for (size_t k = 0; k < vLine->length; k++) {
+                        WCHAR ch = rowText[k];
+                        if ((ch == L' ' || ch == L'\t') && xs[k] < rc.right) {
+                            WCHAR sym = (ch == L' ') ? 0x00B7 : 0x00BB;
+                            TextOutW(memDC, (int)(5 + xs[k]), yPos, &sym, 1);
+                        }
                     }
+                    SetTextColor(memDC, oldClr);
+                    free(xs);
                 }
-                SetTextColor(memDC, oldClr);
             }
         }
 
+        free(spanMatches.starts);
         free(buf);
     }
 
     if (hSelBrush) DeleteObject(hSelBrush);
+    if (hMatchBrush) DeleteObject(hMatchBrush);
 }
 
 static void PaintUnwrappedContent(ViewState* pState, HDC memDC, RECT rc, int tabStops, COLORREF currentBg, COLORREF currentText, COLORREF currentDim, size_t selStart, size_t selEnd, BOOL hasFocus) {
@@ -1252,54 +1820,98 @@ static void PaintUnwrappedContent(ViewState* pState, HDC memDC, RECT rc, int tab
     
     int baseX = 5 - pState->scrollX;
     int commandSpace = GetCommandSpaceHeight(pState);
+    HBRUSH hMatchBrush = (pState->highlightLen > 0) ? CreateSolidBrush(pState->colorMatch) : NULL;
+    if (first < pState->pDoc->line_count) PrefetchForScroll(pState, first);
+    SyncLineWidths(pState);
+    // Only the part of each line between these line x positions is decoded, measured and drawn
+    long long viewLeft = (long long)pState->scrollX - 5;
+    long long viewRight = viewLeft + rc.right;
     for (size_t i = first; i <= last && i < pState->pDoc->line_count; i++) {
         size_t lineStart = 0, lineEnd = 0;
-        WCHAR* buf = NULL;
-        size_t dLen = 0;
-        if (!View_LoadLine(pState, i, &lineStart, &lineEnd, &buf, &dLen)) continue;
-        
+        size_t lineLen = View_LineLength(pState->pDoc, i, &lineStart, &lineEnd);
+        LineSlice slice;
+        View_SliceForX(pState, memDC, tabStops, i, lineStart, lineLen, viewLeft, viewRight, &slice);
+        BOOL wholeLine = (slice.from == 0 && slice.to == lineLen);
+
+        // A sliced line is read a pattern's length either side, so matches crossing the edges are found
+        size_t margin = wholeLine ? 0 : pState->highlightLen;
+        size_t bufFrom = (slice.from > margin) ? slice.from - margin : 0;
+        size_t bufTo = (lineLen - slice.to > margin) ? slice.to + margin : lineLen;
+        size_t n = slice.to - slice.from;
+        WCHAR* buf = (WCHAR*)malloc((bufTo - bufFrom + 1) * sizeof(WCHAR));
+        long long* xs = (long long*)malloc((n + 1) * sizeof(long long));
+        if (!buf || !xs || Doc_GetText(pState->pDoc, lineStart + bufFrom, bufTo - bufFrom, buf) != bufTo - bufFrom) {
+            free(buf);
+            free(xs);
+            continue;
+        }
+        WCHAR* text = buf + (slice.from - bufFrom);
+        MeasureRun(pState, memDC, text, n, slice.x, tabStops, xs);
+        int sliceX = (int)(baseX + slice.x);
+        BOOL lineTail = (slice.to == lineLen);
+        if (wholeLine && Layout_WidthsGet(&pState->lineWidths, i) == LAYOUT_UNMEASURED) {
+            Layout_WidthsSet(&pState->lineWidths, i, (xs[n] > INT_MAX - 10) ? INT_MAX - 10 : (int)xs[n]);
+        }
+
         // Calculate a stable Y coordinate based strictly on line index
         int lineY = (int)(((long long)i * pState->lineHeight) - (long long)pState->scrollY);
         if (commandSpace > 0 && (int)i >= (cursorLine - 1)) {
             lineY += commandSpace;
         }
 
-        // Pass 1: Draw the background text
+        // Pass 0: Search match backgrounds
+        if (wholeLine) {
+            const LineMatchCache* matches = GetLineMatches(pState, i, buf, lineLen);
+            if (matches) PaintSliceMatches(pState, memDC, matches->starts, matches->count, 0, &slice, xs, baseX, lineY, hMatchBrush);
+        } else if (hMatchBrush) {
+            size_t* starts = NULL;
+            size_t count = CollectMatches(pState, buf, bufTo - bufFrom, &starts);
+            PaintSliceMatches(pState, memDC, starts, count, bufFrom, &slice, xs, baseX, lineY, hMatchBrush);
+            free(starts);
+        }
+
+        // Pass 1: Draw the background text; tabs expand from the line origin, wherever the slice starts
         SetTextColor(memDC, currentText);
         SetBkColor(memDC, currentBg);
-        TabbedTextOutW(memDC, baseX, lineY, buf, (int)dLen, 1, &tabStops, baseX);
+        TabbedTextOutW(memDC, sliceX, lineY, text, (int)n, 1, &tabStops, baseX);
 
         // Pass 2: Overlay Symbols (Non-Printable)
         if (pState->bShowNonPrintable) {
             COLORREF oldClr = SetTextColor(memDC, currentDim);
             SetBkMode(memDC, TRANSPARENT);
-            for (size_t k = 0; k < dLen; k++) {
-                if (buf[k] == L' ' || buf[k] == L'\t') {
-                    WCHAR sym = (buf[k] == L' ') ? 0x00B7 : 0x00BB;
-                    DWORD extent = GetTabbedTextExtentW(memDC, buf, (int)k, 1, &tabStops);
-                    TextOutW(memDC, baseX + LOWORD(extent), lineY, &sym, 1);
+            for (size_t k = 0; k < n; k++) {
+                if (text[k] == L' ' || text[k] == L'\t') {
+                    WCHAR sym = (text[k] == L' ') ? 0x00B7 : 0x00BB;
+                    TextOutW(memDC, (int)(baseX + xs[k]), lineY, &sym, 1);
                 }
             }
-            DWORD lineExtent = GetTabbedTextExtentW(memDC, buf, (int)dLen, 1, &tabStops);
-            WCHAR pilcrow = 0x00B6;
-            TextOutW(memDC, baseX + LOWORD(lineExtent), lineY, &pilcrow, 1);
-            if (i == pState->pDoc->line_count - 1) {
-                TextOutW(memDC, baseX + 5 + LOWORD(lineExtent), lineY, L"[EOF]", 5);
+            if (lineTail) {
+                int tailX = (int)(baseX + xs[n]);
+                WCHAR pilcrow = 0x00B6;
+                TextOutW(memDC, tailX, lineY, &pilcrow, 1);
+                if (i == pState->pDoc->line_count - 1) {
+                    TextOutW(memDC, tailX + 5, lineY, L"[EOF]", 5);
+                }
             }
             SetTextColor(memDC, oldClr);
         }
 
         // Pass 3: Selection Overlay
-        if (selStart != selEnd && selStart < lineEnd && selEnd > lineStart) {
-            size_t intersectStart = (selStart > lineStart) ? selStart : lineStart;
-            size_t intersectEnd = (selEnd < lineEnd) ? selEnd : lineEnd;
-
-            if (intersectStart < intersectEnd) {
-                DWORD ext1 = GetTabbedTextExtentW(memDC, buf, (int)(intersectStart - lineStart), 1, &tabStops);
-                DWORD ext2 = GetTabbedTextExtentW(memDC, buf, (int)(intersectEnd - lineStart), 1, &tabStops);
-                
-                int x1 = baseX + LOWORD(ext1);
-                int x2 = baseX + LOWORD(ext2);
+        size_t sliceStart = lineStart + slice.from;
+        size_t sliceEnd = lineTail ? lineEnd : lineStart + slice.to;
+        if (selStart != selEnd && selStart < sliceEnd && selEnd > sliceStart) {
+            size_t relStart = ((selStart > sliceStart) ? selStart : sliceStart) - sliceStart;
+            size_t relEnd = ((selEnd < sliceEnd) ? selEnd : sliceEnd) - sliceStart;
+            BOOL coversBreak = (relEnd > n);
+            if (relStart > n) relStart = n;
+            if (relEnd > n) relEnd = n;
+
+            int x1 = (int)(baseX + xs[relStart]);
+            int x2 = (int)(baseX + xs[relEnd]);
+            // A selected line break shows as a sliver past the text
+            if (coversBreak) x2 += tabStops / 4;
+
+            if (x1 < x2) {
                 RECT selRect = { x1, lineY, x2, lineY + pState->lineHeight };
 
                 HBRUSH hSelBrush = CreateSolidBrush(hasFocus ? GetSysColor(COLOR_HIGHLIGHT) : GetSysColor(COLOR_3DFACE));
@@ -1308,17 +1920,15 @@ static void PaintUnwrappedContent(ViewState* pState, HDC memDC, RECT rc, int tab
 
                 SetTextColor(memDC, hasFocus ? GetSysColor(COLOR_HIGHLIGHTTEXT) : GetSysColor(COLOR_BTNTEXT));
                 SetBkMode(memDC, TRANSPARENT);
-                
-                int selTextLen = (int)(intersectEnd - intersectStart);
-                WCHAR* selTextPtr = buf + (intersectStart - lineStart);
-                while (selTextLen > 0 && (selTextPtr[selTextLen-1] == L'\n' || selTextPtr[selTextLen-1] == L'\r')) selTextLen--;
-                if (selTextLen > 0) {
-                    TabbedTextOutW(memDC, x1, lineY, selTextPtr, selTextLen, 1, &tabStops, x1);
+                if (relEnd > relStart) {
+                    TabbedTextOutW(memDC, x1, lineY, text + relStart, (int)(relEnd - relStart), 1, &tabStops, baseX);
                 }
             }
         }
         free(buf);
+        free(xs);
     }
+    if (hMatchBrush) DeleteObject(hMatchBrush);
 }
 
 static void PaintCommandOverlay(ViewState* pState, HDC memDC, RECT rc) {
@@ -1393,13 +2003,7 @@ static LRESULT HandleCreate(HWND hwnd) {
     pState->caretAlpha = 0.0f;     // Start transparent
     pState->caretDirection = 1;    // Prepare to fade in
     pState->scrollX = 0;
-    pState->visualLines = NULL;
-    pState->visualLineCount = 0;
-    pState->visualLineCapacity = 0;
-    pState->cachedWrapWidth = 0;
-    pState->wrapCacheValid = FALSE;
     pState->docGeneration = 0; 
-    pState->cachedDocGeneration = 0; 
     
     // 2. Create Font
     pState->hFont = CreateFont(18, 0, 0, 0, FW_NORMAL, FALSE, FALSE, FALSE, 
@@ -1447,7 +2051,26 @@ static LRESULT HandleCreate(HWND hwnd) {
     return 0;
 }
 
+static LRESULT HandleLayoutTimer(HWND hwnd, ViewState* pState) {
+    BOOL done = !pState->pDoc || (pState->bWordWrap ? View_WrapLayOut(hwnd, pState, TRUE) : MeasureLineWidthsIdle(hwnd, pState));
+    if (done) {
+        KillTimer(hwnd, IDT_LAYOUT);
+        pState->layoutTimer = FALSE;
+    }
+    if (!pState->pDoc) return 0;
+    if (pState->bWordWrap) {
+        // Refined heights move the thumb; the top line was kept where it was
+        if (View_GetDocumentHeight(hwnd, pState) != pState->reportedHeight || GetScrollPos(hwnd, SB_VERT) != pState->scrollY) {
+            UpdateScrollbars(hwnd, pState);
+        }
+    } else if (Layout_WidthsMax(&pState->lineWidths) != pState->reportedWidth) {
+        UpdateScrollbars(hwnd, pState);
+    }
+    return 0;
+}
+
 static LRESULT HandleTimer(HWND hwnd, ViewState* pState, WPARAM wParam) {
+    if (wParam == IDT_LAYOUT) return HandleLayoutTimer(hwnd, pState);
     if (wParam != IDT_CARET) return 0;
 
     DWORD now = GetTickCount();
@@ -1529,10 +2152,77 @@ static ExCommandType ResolveCommand(const WCHAR* cmd)
         _wcsicmp(cmd, L"search") == 0)
         return EXCMD_SEARCH;
 
+    if (_wcsicmp(cmd, L"follow") == 0)
+        return EXCMD_FOLLOW;
+
     return EXCMD_NONE;
 }
 
 
+// Matches a search flag token against its long or short spelling
+static BOOL IsSearchFlag(const WCHAR* token, size_t tokenLen, const WCHAR* longForm, const WCHAR* shortForm)
+{
+    return (tokenLen == wcslen(longForm) && _wcsnicmp(token, longForm, tokenLen) == 0) ||
+           (tokenLen == wcslen(shortForm) && _wcsnicmp(token, shortForm, tokenLen) == 0);
+}
+
+// Splits one '/'-delimited field in place, unescaping "\/"; returns the start of the next field
+static WCHAR* TakeSubstituteField(WCHAR* p, BOOL* pTerminated)
+{
+    WCHAR* dst = p;
+    *pTerminated = FALSE;
+    while (*p) {
+        if (p[0] == L'\\' && p[1] == L'/') {
+            *dst++ = L'/';
+            p += 2;
+            continue;
+        }
+        if (*p == L'/') {
+            *dst = L'\0';
+            *pTerminated = TRUE;
+            return p + 1;
+        }
+        *dst++ = *p++;
+    }
+    *dst = L'\0';
+    return p;
+}
+
+// Grammar: [%]s/pattern/replacement/[g][i|I][w]
+// '%' covers the whole file, otherwise the selection (or the cursor line); uppercase S matches case
+static BOOL ParseSubstitute(WCHAR* p, ExCommand* out)
+{
+    BOOL wholeFile = FALSE;
+    if (*p == L'%') {
+        wholeFile = TRUE;
+        p++;
+    }
+    if ((*p != L's' && *p != L'S') || p[1] != L'/')
+        return FALSE;
+
+    out->type = EXCMD_SUBSTITUTE;
+    out->searchCaseSensitive = (*p == L'S');
+    out->substituteWholeFile = wholeFile;
+    p += 2;
+
+    BOOL terminated = FALSE;
+    out->arg = p;
+    p = TakeSubstituteField(p, &terminated);
+    out->replacement = p;
+    p = terminated ? TakeSubstituteField(p, &terminated) : p;
+
+    for (; *p && !iswspace(*p); p++) {
+        switch (*p) {
+            case L'g': out->substituteAll = TRUE; break;
+            case L'i': out->searchCaseSensitive = FALSE; break;
+            case L'I': out->searchCaseSensitive = TRUE; break;
+            case L'w': out->searchWholeWord = TRUE; break;
+            default: break;
+        }
+    }
+    return TRUE;
+}
+
 // Ex command parser
 // Grammar: : <command> [!] [args]
 static BOOL ParseExCommand(WCHAR* text, ExCommand* out)
@@ -1545,6 +2235,10 @@ static BOOL ParseExCommand(WCHAR* text, ExCommand* out)
     while (iswspace(*p))
         p++;
 
+    // Substitute: [%]s/pattern/replacement/[flags]
+    if (ParseSubstitute(p, out))
+        return TRUE;
+
     // Parse command word
     WCHAR cmd[32] = {0};
     int len = 0;
@@ -1560,6 +2254,8 @@ static BOOL ParseExCommand(WCHAR* text, ExCommand* out)
 
     out->searchBackwards = FALSE;
     out->searchCaseSensitive = FALSE;
+    out->searchWholeWord = FALSE;
+    out->searchInSelection = FALSE;
     out->arg = NULL;
 
     // Optional force modifier
@@ -1594,16 +2290,22 @@ static BOOL ParseExCommand(WCHAR* text, ExCommand* out)
                 }
             }
 
-            // Skip whitespace before optional direction
-            while (iswspace(*p)) p++;
-            if (*p) {
-                const WCHAR* dir = p;
+            // Optional flags after the pattern: direction, whole word, in selection
+            while (*p) {
+                while (iswspace(*p)) p++;
+                if (!*p) break;
+                const WCHAR* flag = p;
                 while (*p && !iswspace(*p)) p++;
+                size_t flagLen = (size_t)(p - flag);
                 // No need to null-terminate; compare length-limited
-                if (_wcsnicmp(dir, L"backward", 8) == 0 || _wcsnicmp(dir, L"b", 1) == 0) {
+                if (IsSearchFlag(flag, flagLen, L"backward", L"b")) {
                     out->searchBackwards = TRUE;
-                } else if (_wcsnicmp(dir, L"forward", 7) == 0 || _wcsnicmp(dir, L"f", 1) == 0) {
+                } else if (IsSearchFlag(flag, flagLen, L"forward", L"f")) {
                     out->searchBackwards = FALSE;
+                } else if (IsSearchFlag(flag, flagLen, L"word", L"w")) {
+                    out->searchWholeWord = TRUE;
+                } else if (IsSearchFlag(flag, flagLen, L"selection", L"sel")) {
+                    out->searchInSelection = TRUE;
                 }
             }
 
@@ -1636,6 +2338,45 @@ static BOOL ParseExCommand(WCHAR* text, ExCommand* out)
 // Ex command execution
 static void ExecuteExCommand(HWND hwnd, const ExCommand* cmd)
 {
+    if (cmd->type == EXCMD_SUBSTITUTE) {
+        ViewState* pState = GetState(hwnd);
+        if (!pState || !pState->pDoc) return;
+
+        DocSearchOptions opts = {0};
+        opts.caseSensitive = cmd->searchCaseSensitive;
+        opts.wholeWord = cmd->searchWholeWord;
+
+        if (!cmd->substituteWholeFile) {
+            // Without '%', work on the selection or else the cursor's line
+            opts.hasRange = TRUE;
+            if (!View_GetSelectionRange(hwnd, &opts.rangeStart, &opts.rangeEnd)) {
+                int line, col;
+                Doc_GetOffsetInfo(pState->pDoc, pState->cursorOffset, &line, &col);
+                opts.rangeStart = Doc_GetLineOffset(pState->pDoc, line - 1);
+                opts.rangeEnd = Doc_GetLineOffset(pState->pDoc, line);
+            }
+        }
+
+        if (!cmd->substituteAll) {
+            // Only the first match in the range
+            DocSearchResult first = Doc_Search(pState->pDoc, cmd->arg, wcslen(cmd->arg),
+                                               opts.hasRange ? opts.rangeStart : 0, &opts);
+            if (first.status != DOC_SEARCH_MATCH) {
+                MessageBoxW(hwnd, L"Pattern not found.", L"Replace", MB_OK | MB_ICONINFORMATION);
+                return;
+            }
+            opts.hasRange = TRUE;
+            opts.rangeStart = first.match_offset;
+            opts.rangeEnd = first.match_offset + first.match_length;
+        }
+
+        size_t count = 0;
+        if (!View_ReplaceAll(hwnd, cmd->arg, wcslen(cmd->arg), cmd->replacement, wcslen(cmd->replacement), &opts, &count)) {
+            MessageBoxW(hwnd, L"Pattern not found.", L"Replace", MB_OK | MB_ICONINFORMATION);
+        }
+        return;
+    }
+
     if (cmd->type == EXCMD_SEARCH) {
         ViewState* pState = GetState(hwnd);
         if (!pState || !pState->pDoc) {
@@ -1648,14 +2389,32 @@ static void ExecuteExCommand(HWND hwnd, const ExCommand* cmd)
             return;
         }
 
+        DocSearchOptions opts = {0};
+        opts.searchBackwards = cmd->searchBackwards;
+        opts.caseSensitive = cmd->searchCaseSensitive;
+        opts.wholeWord = cmd->searchWholeWord;
+
         size_t startOffset = pState->cursorOffset;
-        DocSearchResult res = Doc_Search(pState->pDoc, cmd->arg, wcslen(cmd->arg), startOffset, cmd->searchBackwards, cmd->searchCaseSensitive);
+        if (cmd->searchInSelection) {
+            if (!View_GetSelectionRange(hwnd, &opts.rangeStart, &opts.rangeEnd)) {
+                MessageBoxW(hwnd, L"Select the text to search in first.", L"Find", MB_OK | MB_ICONINFORMATION);
+                return;
+            }
+            opts.hasRange = TRUE;
+            startOffset = cmd->searchBackwards ? opts.rangeEnd : opts.rangeStart;
+        }
+
+        DocSearchResult res = Doc_Search(pState->pDoc, cmd->arg, wcslen(cmd->arg), startOffset, &opts);
         if (res.status == DOC_SEARCH_MATCH) {
+            View_SetHighlight(hwnd, cmd->arg, wcslen(cmd->arg), &opts);
             View_ApplySearchResult(hwnd, &res);
         } else {
             const WCHAR* msg = NULL;
-            if (res.status == DOC_SEARCH_REACHED_EOF) msg = L"Reached end of file without a match.";
-            else if (res.status == DOC_SEARCH_REACHED_BOF) msg = L"Reached beginning of file without a match.";
+            if (res.status == DOC_SEARCH_REACHED_EOF) {
+                msg = cmd->searchInSelection ? L"Reached end of selection without a match." : L"Reached end of file without a match.";
+            } else if (res.status == DOC_SEARCH_REACHED_BOF) {
+                msg = cmd->searchInSelection ? L"Reached beginning of selection without a match." : L"Reached beginning of file without a match.";
+            }
             else msg = L"Pattern not found.";
             MessageBoxW(hwnd, msg, L"Find", MB_OK | MB_ICONINFORMATION);
         }
@@ -1708,6 +2467,15 @@ static void ExecuteExCommand(HWND hwnd, const ExCommand* cmd)
             break;
         }
 
+        case EXCMD_FOLLOW:
+        {
+            SendMessage(GetParent(hwnd),
+                        WM_COMMAND,
+                        ID_VIEW_FOLLOW,
+                        0);
+            break;
+        }
+
         default:
             break;
     }
@@ -1743,6 +2511,15 @@ static BOOL ProcessCommandText(HWND hwnd, WCHAR* text, CommandError* pError)
         return FALSE;
     }
 
+    if (cmd.type == EXCMD_SUBSTITUTE && (!cmd.arg || !*cmd.arg)) {
+        if (pError) {
+            pError->message = L"pattern required";
+            pError->caretCol = 1 + (int)(wordStart - pCmd) + 2 + ((*wordStart == L'%') ? 1 : 0);
+            pError->showCaret = TRUE;
+        }
+        return FALSE;
+    }
+
     if (cmd.type == EXCMD_EDIT && !cmd.arg) {
         if (pError) {
             int caretCol = 1 + (int)(wordStart - pCmd) + cmdWordLen + (cmd.force ? 1 : 0);
@@ -1837,7 +2614,6 @@ static LRESULT HandleChar(HWND hwnd, ViewState* pState, WPARAM wParam) {
             pState->commandLen++;
             pState->commandCaretPos++;
             pState->szCommandBuf[pState->commandLen] = L'\0';
-            pState->wrapCacheValid = FALSE;
             
             InvalidateRect(hwnd, NULL, TRUE);
             UpdateCaretPosition(hwnd, pState);
@@ -1849,6 +2625,12 @@ static LRESULT HandleChar(HWND hwnd, ViewState* pState, WPARAM wParam) {
     
     // Skip control characters that are processed in WM_KEYDOWN (Backspace/Delete)
     if (c == 8 || c == 127) return 0;
+
+    // Escape dismisses the search match highlights
+    if (c == 27) {
+        View_SetHighlight(hwnd, NULL, 0, NULL);
+        return 0;
+    }
     
     // Process printable characters, tabs, and newlines
     if (c == L'\r' || c == L'\n' || (c >= 32) || c == L'\t') {
@@ -1858,7 +2640,6 @@ static LRESULT HandleChar(HWND hwnd, ViewState* pState, WPARAM wParam) {
         size_t selStart = 0, selLen = 0;
         if (View_GetSelection(pState, &selStart, &selLen)) {
             Doc_Delete(pState->pDoc, selStart, selLen);
-            pState->wrapCacheValid = FALSE;
             pState->cursorOffset = pState->selectionAnchor = selStart;
         } else if (!pState->bInsertMode && c != L'\n') {
             // Overtype logic: Remove the next character if we aren't at EOF
@@ -1868,14 +2649,12 @@ static LRESULT HandleChar(HWND hwnd, ViewState* pState, WPARAM wParam) {
                 // Don't overtype the newline; it preserves the document's line structure
                 if (nextChar != L'\n') {
                     Doc_Delete(pState->pDoc, pState->cursorOffset, 1);
-                    pState->wrapCacheValid = FALSE;
                 }
             }
         }
 
         // Insert the character and collapse the selection/anchor
         Doc_Insert(pState->pDoc, pState->cursorOffset, &c, 1);
-        pState->wrapCacheValid = FALSE;
         pState->cursorOffset++;
         pState->selectionAnchor = pState->cursorOffset;
 
@@ -2102,18 +2881,15 @@ static LRESULT HandleKeyDown(HWND hwnd, ViewState* pState, WPARAM wParam, LPARAM
             size_t delStart = 0, delLen = 0;
             if (View_GetSelection(pState, &delStart, &delLen)) {
                 Doc_Delete(pState->pDoc, delStart, delLen);
-                pState->wrapCacheValid = FALSE;
                 pState->cursorOffset = pState->selectionAnchor = delStart;
                 NotifyParent(hwnd, EN_CHANGE);
             } else {
                 if (wParam == VK_BACK && pState->cursorOffset > 0) {
                     Doc_Delete(pState->pDoc, --pState->cursorOffset, 1);
-                    pState->wrapCacheValid = FALSE;
                     pState->selectionAnchor = pState->cursorOffset;
                     NotifyParent(hwnd, EN_CHANGE);
                 } else if (wParam == VK_DELETE && pState->cursorOffset < pState->pDoc->total_length) {
                     Doc_Delete(pState->pDoc, pState->cursorOffset, 1);
-                    pState->wrapCacheValid = FALSE;
                     NotifyParent(hwnd, EN_CHANGE);
                 }
             }
@@ -2171,7 +2947,7 @@ static LRESULT HandlePaint(HWND hwnd, ViewState* pState) {
 
     if (pState->pDoc && pState->pDoc->line_count > 0) {
         if (pState->bWordWrap) {
-            PaintWrappedContent(pState, memDC, rc, tabStops, currentText, currentDim, selStart, selEnd, hasFocus);
+            PaintWrappedContent(hwnd, pState, memDC, rc, tabStops, currentText, currentDim, selStart, selEnd, hasFocus);
         } else {
             PaintUnwrappedContent(pState, memDC, rc, tabStops, currentBg, currentText, currentDim, selStart, selEnd, hasFocus);
         }
@@ -2503,7 +3279,18 @@ static LRESULT HandleLButtonDblClk(HWND hwnd, ViewState* pState, WPARAM wParam,
 
 static LRESULT HandleDestroy(ViewState* pState) {
     if (pState->hCaretBm) DeleteObject(pState->hCaretBm);
-    if (pState->visualLines) free(pState->visualLines);
+    Layout_WrapClear(&pState->wrap);
+    free(pState->wrapScratch);
+    ResetAdvances(&pState->advances);
+    if (pState->matchCache) {
+        ResetMatchCache(pState);
+        free(pState->matchCache);
+    }
+    if (pState->columnCache) {
+        ResetColumnCache(pState);
+        free(pState->columnCache);
+    }
+    Layout_WidthsClear(&pState->lineWidths);
     DeleteObject(pState->hFont);
     free(pState);
     return 0;
@@ -5,6 +5,7 @@
 #include <windowsx.h>
 #include "slate_doc.h"
 #include "slate_commands.h"
+#include "slate_layout.h"
 
 #ifndef EN_SELCHANGE
 #define EN_SELCHANGE        0x8002
@@ -14,23 +15,58 @@
 #define IDT_CARET 1001
 #endif
 
+#ifndef IDT_LAYOUT
+#define IDT_LAYOUT 1002
+#endif
+
 #ifndef M_PI
     #define M_PI 3.14159265358979323846
 #endif
 
 #define CARET_IDLE_TIMEOUT 12000 // ms before switching to idle caret animation
+#define LAYOUT_IDLE_MS       10   // IDT_LAYOUT period; WM_TIMER only arrives when the queue is empty
+#define LAYOUT_IDLE_SLICE_MS 8    // Measuring done per IDT_LAYOUT tick
+#define WRAP_NEAR_LINES      64   // Lines either side of the window laid out before painting
+#define WRAP_CHUNK_UNITS     65536 // A long line is read and broken into rows this much at a time
+
+#define MATCH_CACHE_SLOTS 256  // Direct-mapped by line index; comfortably more than a screenful
+
+typedef struct LineMatchCache {
+    size_t line;            // Logical line held by this slot, or (size_t)-1 when empty
+    size_t* starts;         // Match starts relative to the line start
+    size_t count;
+} LineMatchCache;
+
+// Unwrapped lines longer than one checkpoint step are painted, hit-tested and measured a
+// slice at a time. Each keeps the tab-aware x of every COLUMN_CHECKPOINT_CHARS-th character,
+// measured lazily up to the furthest column or x anything has asked about.
+#define COLUMN_CHECKPOINT_CHARS 1024
+#define COLUMN_CACHE_SLOTS      64   // Direct-mapped by line index
+#define COLUMN_LENGTH_PENDING   ((size_t)-1)
+
+typedef struct LineColumns {
+    size_t line;            // Logical line held by this slot, or (size_t)-1 when empty
+    size_t length;          // Line length without its line break, or COLUMN_LENGTH_PENDING after an edit
+    long long* xs;          // xs[k]: x of character k * COLUMN_CHECKPOINT_CHARS from the line origin
+    size_t count;           // Checkpoints measured so far, at least 1
+    size_t capacity;
+} LineColumns;
+
+// Advance widths of the view font for the Basic Multilingual Plane, fetched from GDI a
+// 256-character block at a time on first use, so measuring text is a table lookup per
+// character. A fixed-pitch font skips the table: every character is fixedWidth wide.
+#define ADVANCE_BLOCK_CHARS 256
 
-typedef struct VisualLineInfo {
-    size_t logicalLine;      // Which logical line this belongs to
-    size_t startOffset;      // Start offset within the logical line
-    size_t length;           // Number of characters in this visual line
-    int yPosition;           // Y position in document space
-} VisualLineInfo;
+typedef struct CharAdvances {
+    HFONT font;             // Font the widths belong to; NULL until first use
+    BOOL fixedPitch;
+    int fixedWidth;
+    int* blocks[65536 / ADVANCE_BLOCK_CHARS];
+} CharAdvances;
 
 typedef struct {
     SlateDoc* pDoc;
     size_t docGeneration;  // Track when document changes
-    size_t cachedDocGeneration;  // Track which doc the cache is for
     int scrollY;
     int scrollX;
     int lineHeight;
@@ -60,12 +96,36 @@ typedef struct {
     double animationTime; // Total elapsed time in milliseconds
     DWORD lastActivity;        // Timestamp of last key press
     int   caretX, caretY;      // Current position
-    // Manual wrap cache
-    VisualLineInfo* visualLines;
-    size_t visualLineCount;
-    size_t visualLineCapacity;
-    int cachedWrapWidth;
-    BOOL wrapCacheValid;
+    // Word-wrap layout: visual rows per logical line, replayed from the document's edit log
+    WrapLayout wrap;
+    size_t wrapRevision;
+    size_t wrapGeneration;
+    WrapRow* wrapScratch;      // Rows of the line being broken
+    size_t wrapScratchCapacity;
+    int wrapCharWidth;         // Average character width behind estimated heights
+    int reportedHeight;        // Document height when the scroll bars were last set
+    // Highlight-all for the active search pattern
+    WCHAR szHighlight[256];
+    size_t highlightLen;
+    BOOL highlightCaseSensitive;
+    BOOL highlightWholeWord;
+    COLORREF colorMatch;
+    LineMatchCache* matchCache;     // MATCH_CACHE_SLOTS entries, filled only for painted lines
+    size_t matchCacheRevision;      // Doc revision the cache was built against
+    size_t matchCacheGeneration;    // docGeneration the cache was built against
+    CharAdvances advances;          // Widths behind all layout, hit-testing and caret placement
+    LineColumns* columnCache;       // COLUMN_CACHE_SLOTS entries for long unwrapped lines
+    size_t columnCacheRevision;
+    size_t columnCacheGeneration;
+    // Unwrapped line widths behind the horizontal scroll range, measured in idle time
+    LineWidths lineWidths;
+    size_t lineWidthsRevision;      // Doc revision the widths are in step with
+    size_t lineWidthsGeneration;
+    int reportedWidth;              // Widest line when the scroll bars were last set
+    BOOL layoutTimer;               // IDT_LAYOUT is running
+    // Read-ahead of a mapped file in the direction of scrolling
+    int prefetchScrollY;            // scrollY at the last paint
+    BOOL prefetchBackwards;         // Last direction the view moved in
 } ViewState;
 
 // Register the custom "SlateView" window class
@@ -75,6 +135,8 @@ size_t View_GetCursorOffset(HWND hwnd);
 
 // Viewport settings accessors
 void View_SetDocument(HWND hwnd, SlateDoc* pDoc);
+void View_DocumentRebased(HWND hwnd, size_t cursorOffset, size_t anchorOffset);
+void View_DocumentAppended(HWND hwnd, size_t oldLength);
 void View_ScrollTo(HWND hwnd, int yOffset);
 void View_UpdateMetrics(HWND hwnd);
 void View_Undo(HWND hwnd);
@@ -87,7 +149,11 @@ void View_SetShowNonPrintable(HWND hwnd, BOOL bShow);
 void View_SetDefaultColors(HWND hwnd);
 void View_UseSystemColors(HWND hwnd);
 void View_SetInsertMode(HWND hwnd, BOOL bInsert);
+BOOL View_GetSelectionRange(HWND hwnd, size_t* pStart, size_t* pEnd);
 BOOL View_ApplySearchResult(HWND hwnd, const DocSearchResult* result);
+void View_SetHighlight(HWND hwnd, const WCHAR* pattern, size_t patternLen, const DocSearchOptions* options);
+BOOL View_ReplaceAll(HWND hwnd, const WCHAR* pattern, size_t patternLen, const WCHAR* replacement, size_t replacementLen,
+                     const DocSearchOptions* options, size_t* outCount);
 
 BOOL View_GetShowNonPrintable(HWND hwnd);
 BOOL View_IsInsertMode(HWND hwnd);